@@ -0,0 +1,276 @@
+// Allocation micro-benchmarks of the slab pool behind iocp::mp::Allocator, against the system heap.
+//
+// Every case runs with mp::poolAllocate/poolDeallocate and with malloc/free (HeapAlloc/HeapFree on Windows):
+//   lifo      - allocates and frees one block at once, the best case for any allocator
+//   batch     - allocates a window of blocks, then frees them in the same order
+//   threads   - batch from N threads at once
+//   handoff   - one thread allocates, another one frees, as a buffer passed to a worker does
+//   list      - push_back/pop_front of an mp::list against a std::list
+// and then prints the stats of the pool per size class.
+//
+// usage: alloc-bench [-n millions of operations] [-T threads] [-w window]
+
+#include "iocp/ServerFramework.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+struct BenchConfig
+{
+    size_t operations = 10000000;
+    unsigned threads = 4;
+    size_t window = 1000;
+};
+
+static const size_t s_sizes[] = { 16, 64, 256, 1024, 4096 };
+
+struct SystemHeap
+{
+    static void *allocate(size_t size)
+    {
+#if PLATFORM_IS_WINDOWS
+        return ::HeapAlloc(::GetProcessHeap(), 0, size);
+#else
+        return ::malloc(size);
+#endif
+    }
+
+    static void deallocate(void *ptr, size_t)
+    {
+#if PLATFORM_IS_WINDOWS
+        ::HeapFree(::GetProcessHeap(), 0, ptr);
+#else
+        ::free(ptr);
+#endif
+    }
+};
+
+struct Pool
+{
+    static void *allocate(size_t size) { return iocp::mp::poolAllocate(size); }
+    static void deallocate(void *ptr, size_t size) { iocp::mp::poolDeallocate(ptr, size); }
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Touches the block, so a lazy allocator can't get away without mapping it.
+static inline void touch(void *ptr)
+{
+    *(volatile char *)ptr = 1;
+}
+
+template <class _Heap> static double benchLifo(size_t size, size_t operations)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < operations; ++i)
+    {
+        void *p = _Heap::allocate(size);
+        touch(p);
+        _Heap::deallocate(p, size);
+    }
+    return (double)operations / elapsedSince(start);
+}
+
+template <class _Heap> static void runBatch(size_t size, size_t operations, size_t window)
+{
+    std::vector<void *> blocks(window);
+    for (size_t done = 0; done < operations; done += window)
+    {
+        for (size_t i = 0; i < window; ++i)
+        {
+            blocks[i] = _Heap::allocate(size);
+            touch(blocks[i]);
+        }
+        for (size_t i = 0; i < window; ++i)
+        {
+            _Heap::deallocate(blocks[i], size);
+        }
+    }
+}
+
+template <class _Heap> static double benchBatch(size_t size, size_t operations, size_t window)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    runBatch<_Heap>(size, operations, window);
+    return (double)operations / elapsedSince(start);
+}
+
+template <class _Heap> static double benchThreads(size_t size, size_t operations, size_t window, unsigned threads)
+{
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.push_back(std::thread(runBatch<_Heap>, size, operations / threads, window));
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    return (double)operations / elapsedSince(start);
+}
+
+// The producer hands over windows of blocks to the consumer, which frees them.
+template <class _Heap> static double benchHandoff(size_t size, size_t operations, size_t window)
+{
+    iocp::mutex mtx;
+    std::vector<std::vector<void *> > handed;
+    volatile bool produced = false;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread consumer([&]() {
+        std::vector<std::vector<void *> > todo;
+        for (;;)
+        {
+            bool last = produced;
+            mtx.lock();
+            todo.swap(handed);
+            mtx.unlock();
+            for (size_t i = 0; i < todo.size(); ++i)
+            {
+                for (size_t k = 0; k < todo[i].size(); ++k)
+                {
+                    _Heap::deallocate(todo[i][k], size);
+                }
+            }
+            if (last && todo.empty())
+            {
+                break;
+            }
+            if (todo.empty())
+            {
+                std::this_thread::yield();
+            }
+            todo.clear();
+        }
+    });
+
+    for (size_t done = 0; done < operations; done += window)
+    {
+        std::vector<void *> blocks(window);
+        for (size_t i = 0; i < window; ++i)
+        {
+            blocks[i] = _Heap::allocate(size);
+            touch(blocks[i]);
+        }
+        mtx.lock();
+        handed.push_back(std::move(blocks));
+        size_t backlog = handed.size();
+        mtx.unlock();
+        if (backlog > 16)
+        {
+            std::this_thread::yield();  // Don't run away from the consumer.
+        }
+    }
+    produced = true;
+    consumer.join();
+    return (double)operations / elapsedSince(start);
+}
+
+template <class _List> static double benchList(size_t operations, size_t window)
+{
+    _List list;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < window; ++i)
+    {
+        list.push_back((int)i);
+    }
+    for (size_t i = 0; i < operations; ++i)
+    {
+        list.push_back((int)i);
+        list.pop_front();
+    }
+    return (double)operations / elapsedSince(start);
+}
+
+static void printRow(const char *name, size_t size, double systemRate, double poolRate)
+{
+    printf("%-8s %6lu %14.2f %14.2f %8.2fx\n", name, (unsigned long)size,
+        systemRate / 1000000, poolRate / 1000000, poolRate / systemRate);
+}
+
+static void printStats()
+{
+    std::vector<iocp::mp::PoolStats> stats(iocp::mp::getPoolStats(nullptr, 0));
+    stats.resize(iocp::mp::getPoolStats(&stats[0], stats.size()));
+
+    printf("\n%8s %14s %14s %12s %12s %12s\n", "class", "allocs", "frees", "slab KB", "depot", "cached");
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        const iocp::mp::PoolStats &st = stats[i];
+        if (st.allocs == 0 && st.frees == 0)
+        {
+            continue;
+        }
+        char name[32];
+        if (st.blockSize != 0)
+        {
+            snprintf(name, sizeof(name), "%lu", (unsigned long)st.blockSize);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "large");
+        }
+        printf("%8s %14llu %14llu %12lu %12lu %12lu\n", name,
+            (unsigned long long)st.allocs, (unsigned long long)st.frees,
+            (unsigned long)(st.slabBytes / 1024), (unsigned long)st.depotBlocks, (unsigned long)st.cachedBlocks);
+    }
+}
+
+static void usage()
+{
+    printf("usage: alloc-bench [-n millions of operations] [-T threads] [-w window]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) cfg.operations = (size_t)(atof(val) * 1000000);
+        else if (strcmp(opt, "-T") == 0) cfg.threads = (unsigned)atoi(val);
+        else if (strcmp(opt, "-w") == 0) cfg.window = (size_t)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.operations == 0 || cfg.threads == 0 || cfg.window == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    printf("%lu operations per case, window %lu, %u threads\n",
+        (unsigned long)cfg.operations, (unsigned long)cfg.window, cfg.threads);
+    printf("%-8s %6s %14s %14s %9s\n", "case", "size", "system M/s", "pool M/s", "speedup");
+
+    for (size_t i = 0; i < sizeof(s_sizes) / sizeof(s_sizes[0]); ++i)
+    {
+        size_t size = s_sizes[i];
+        printRow("lifo", size, benchLifo<SystemHeap>(size, cfg.operations), benchLifo<Pool>(size, cfg.operations));
+        printRow("batch", size, benchBatch<SystemHeap>(size, cfg.operations, cfg.window),
+            benchBatch<Pool>(size, cfg.operations, cfg.window));
+        printRow("threads", size, benchThreads<SystemHeap>(size, cfg.operations, cfg.window, cfg.threads),
+            benchThreads<Pool>(size, cfg.operations, cfg.window, cfg.threads));
+        printRow("handoff", size, benchHandoff<SystemHeap>(size, cfg.operations, cfg.window),
+            benchHandoff<Pool>(size, cfg.operations, cfg.window));
+    }
+    printRow("list", sizeof(int), benchList<std::list<int> >(cfg.operations, cfg.window),
+        benchList<iocp::mp::list<int> >(cfg.operations, cfg.window));
+
+    printStats();
+    return 0;
+}
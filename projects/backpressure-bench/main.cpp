@@ -0,0 +1,314 @@
+// Backpressure benchmark.
+//
+// Runs a server in process which publishes R messages/s of M bytes to every connection, F fast ones which read
+// everything, and S slow ones which read nothing. It runs once without limits, and once with every overflow policy
+// with a budget of Q bytes per connection, and a memory limit of L bytes over all of them if any, and reports:
+//   peak MB   - the peak of the memory held by the send buffers
+//   fast/s    - the messages the fast connections received per second each, which the slow ones must not hold up
+//   slow left - the slow connections still connected at the end
+//   full      - the onSendQueueFull calls, one per slow connection, none if COALESCE keeps them under the mark
+//
+// usage: backpressure-bench [-f fast connections] [-s slow connections] [-m message bytes] [-r messages/s]
+//                           [-q queue bytes] [-L memory limit] [-k keys] [-t seconds] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct BenchConfig
+{
+    int fast = 4;
+    int slow = 4;
+    int messageSize = 256;
+    int rate = 10000;
+    size_t queueBytes = 256 * 1024;
+    size_t memoryLimit = 0;
+    int keys = 16;
+    int seconds = 3;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+};
+
+struct BenchResult
+{
+    size_t peakBytes = 0;
+    double fastRate = 0.0;
+    int slowLeft = 0;
+    uint64_t full = 0;
+};
+
+class BackpressureBench
+{
+public:
+    explicit BackpressureBench(const BenchConfig &cfg) : _cfg(cfg), _port(cfg.port), _stop(false), _fastBytes(0), _full(0) { }
+
+    // limited false runs without any limit. Every run listens on its own port, the sockets of the last one may
+    // take a while to go with the sends in flight.
+    bool run(uint16_t port, bool limited, iocp::SendOverflowPolicy policy, BenchResult &result)
+    {
+        _port = port;
+        _server.setShardCount(_cfg.shards);
+        _server.setSendQueueLimits(limited ? _cfg.queueBytes / 4 : 0, limited ? _cfg.queueBytes / 2 : 0,
+            limited ? _cfg.queueBytes : 0, policy);
+        _server.setSendMemoryLimit(limited ? _cfg.memoryLimit : 0);
+        _full = 0;
+        _server.setSendQueueCallbacks([this](iocp::ClientContext<> *) { ++_full; }, nullptr);
+        _ids.clear();
+        bool ok = _server.startup("127.0.0.1", _port,
+            [this](iocp::ClientContext<> *ctx, const char *, size_t len)->size_t {
+                _idMutex.lock();
+                _ids.push_back(ctx->getId());
+                _idMutex.unlock();
+                return len;
+            },
+            [](iocp::ClientContext<> *) { });
+        if (!ok)
+        {
+            return false;
+        }
+
+        std::vector<SOCKET> sockets;
+        if (!connect(_cfg.fast + _cfg.slow, sockets))
+        {
+            closeAll(sockets);
+            _server.shutdown();
+            return false;
+        }
+
+        _stop = false;
+        _fastBytes = 0;
+        std::vector<std::thread *> threads;
+        for (int i = 0; i < _cfg.fast; ++i)
+        {
+            SOCKET s = sockets[i];
+            threads.push_back(new std::thread([this, s]() { runFast(s); }));
+        }
+        threads.push_back(new std::thread([this]() { publish(); }));
+
+        // The slow connections never read, sample the memory meanwhile.
+        result.peakBytes = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (elapsedSince(start) < _cfg.seconds)
+        {
+            size_t bytes = iocp::SendBuffer::totalBytes();
+            if (bytes > result.peakBytes)
+            {
+                result.peakBytes = bytes;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        double seconds = elapsedSince(start);
+        result.fastRate = (double)_fastBytes.load() / _cfg.messageSize / seconds / (_cfg.fast > 0 ? _cfg.fast : 1);
+        result.slowLeft = (int)_server.getClientCount() - _cfg.fast;
+        result.full = _full.load();
+
+        _stop = true;
+        threads.back()->join();  // The publisher.
+        closeAll(sockets);
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            if (i + 1 < threads.size())
+            {
+                threads[i]->join();
+            }
+            delete threads[i];
+        }
+        _server.shutdown();
+        return true;
+    }
+
+private:
+    bool connect(int connections, std::vector<SOCKET> &sockets)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        for (int i = 0; i < connections; ++i)
+        {
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+            {
+                printf("connect failed after %d connections\n", i);
+                if (s != INVALID_SOCKET)
+                {
+                    close_socket(s);
+                }
+                return false;
+            }
+            sockets.push_back(s);
+        }
+
+        // Registers the IDs, all the connections are published to.
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+            ::send(sockets[i], "x", 1, 0);
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (elapsedSince(start) < 5)
+        {
+            _idMutex.lock();
+            size_t registered = _ids.size();
+            _idMutex.unlock();
+            if (registered == sockets.size())
+            {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        printf("registering timed out\n");
+        return false;
+    }
+
+    static void closeAll(std::vector<SOCKET> &sockets)
+    {
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+            ::shutdown(sockets[i], 2);  // Wakes the reader up, both SD_BOTH and SHUT_RDWR.
+            close_socket(sockets[i]);
+        }
+        sockets.clear();
+    }
+
+    // Every millisecond, the messages due to every connection. The key of a message is its sequence number
+    // modulo the keys, so COALESCE keeps the latest of each one.
+    void publish()
+    {
+        std::vector<iocp::ConnectionId> ids;
+        _idMutex.lock();
+        ids = _ids;
+        _idMutex.unlock();
+
+        std::vector<char> message(_cfg.messageSize, 'x');
+        uint64_t seq = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (!_stop)
+        {
+            uint64_t due = (uint64_t)(elapsedSince(start) * _cfg.rate);
+            for (; seq < due && !_stop; ++seq)
+            {
+                memcpy(&message[0], &seq, message.size() < sizeof(seq) ? message.size() : sizeof(seq));
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    _server.postSend(ids[i], &message[0], message.size(), seq % _cfg.keys + 1);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void runFast(SOCKET s)
+    {
+        char buf[65536];
+        while (!_stop)
+        {
+            int ret = ::recv(s, buf, sizeof(buf), 0);
+            if (ret <= 0)
+            {
+                break;
+            }
+            _fastBytes.fetch_add((uint64_t)ret, std::memory_order_relaxed);
+        }
+    }
+
+    BenchConfig _cfg;
+    uint16_t _port;
+    iocp::ServerFramework<> _server;
+    volatile bool _stop;
+    std::atomic<uint64_t> _fastBytes;
+    std::atomic<uint64_t> _full;
+    std::vector<iocp::ConnectionId> _ids;  // In the order of connecting, the fast ones first.
+    iocp::mutex _idMutex;
+};
+
+static void usage()
+{
+    printf("usage: backpressure-bench [-f fast connections] [-s slow connections] [-m message bytes] [-r messages/s]\n"
+        "                          [-q queue bytes] [-L memory limit] [-k keys] [-t seconds] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-f") == 0) cfg.fast = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.slow = atoi(val);
+        else if (strcmp(opt, "-m") == 0) cfg.messageSize = atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.rate = atoi(val);
+        else if (strcmp(opt, "-q") == 0) cfg.queueBytes = (size_t)atoi(val);
+        else if (strcmp(opt, "-L") == 0) cfg.memoryLimit = (size_t)atoi(val);
+        else if (strcmp(opt, "-k") == 0) cfg.keys = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) cfg.shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.fast < 0 || cfg.slow < 0 || cfg.fast + cfg.slow == 0 || cfg.messageSize <= 0
+        || cfg.rate <= 0 || cfg.queueBytes == 0 || cfg.keys <= 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    struct Mode
+    {
+        const char *name;
+        bool limited;
+        iocp::SendOverflowPolicy policy;
+    };
+    static const Mode modes[] = {
+        { "none", false, iocp::SendOverflowPolicy::DROP_NEWEST },
+        { "newest", true, iocp::SendOverflowPolicy::DROP_NEWEST },
+        { "oldest", true, iocp::SendOverflowPolicy::DROP_OLDEST },
+        { "close", true, iocp::SendOverflowPolicy::DISCONNECT },
+        { "coalesce", true, iocp::SendOverflowPolicy::COALESCE },
+    };
+
+    iocp::ServerFramework<>::initialize();
+    BackpressureBench bench(cfg);
+    printf("%d fast connections, %d slow ones, %d messages/s of %d bytes, %lu bytes of queue, %lu of memory, %d keys\n",
+        cfg.fast, cfg.slow, cfg.rate, cfg.messageSize, (unsigned long)cfg.queueBytes, (unsigned long)cfg.memoryLimit,
+        cfg.keys);
+    printf("%-9s %10s %10s %10s %10s\n", "policy", "peak MB", "fast/s", "slow left", "full");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+    {
+        BenchResult r;
+        if (!bench.run((uint16_t)(cfg.port + i), modes[i].limited, modes[i].policy, r))
+        {
+            printf("startup failed\n");
+            iocp::ServerFramework<>::uninitialize();
+            return 1;
+        }
+        printf("%-9s %10.1f %10.0f %10d %10llu\n", modes[i].name, r.peakBytes / 1048576.0, r.fastRate, r.slowLeft,
+            (unsigned long long)r.full);
+    }
+
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
@@ -0,0 +1,244 @@
+// Send batching benchmark.
+//
+// Runs a server in process which answers every 4-byte request with K messages of 32 bytes, each one by its own
+// postSend from onRecv, as a game server pushes many small updates. C connections keep D requests in flight.
+// It runs with every send started at once, with the sends batched per dispatch cycle, and batched with flush()
+// after every message, and reports the messages/s, and the send syscalls per message from getSendStats.
+//
+// usage: batch-bench [-c connections] [-k messages per request] [-d depth] [-t seconds] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define REQUEST_SIZE 4
+#define MESSAGE_SIZE 32
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool sendAll(SOCKET s, const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::send(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool recvAll(SOCKET s, char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::recv(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+enum SendMode
+{
+    SEND_IMMEDIATE,
+    SEND_BATCHED,
+    SEND_FLUSHED,
+};
+
+struct BenchConfig
+{
+    int connections = 16;
+    int messages = 16;
+    int depth = 4;
+    int seconds = 3;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+};
+
+struct BenchResult
+{
+    double messageRate = 0.0;
+    double writesPerMessage = 0.0;
+};
+
+class BatchBench
+{
+public:
+    explicit BatchBench(const BenchConfig &cfg) : _cfg(cfg), _stop(false), _received(0) { }
+
+    bool run(SendMode mode, BenchResult &result)
+    {
+        _server.setShardCount(_cfg.shards);
+        _server.setSendBatching(mode != SEND_IMMEDIATE);
+        bool flush = mode == SEND_FLUSHED;
+        int messages = _cfg.messages;
+        bool ok = _server.startup("127.0.0.1", _cfg.port,
+            [flush, messages](iocp::ClientContext<> *ctx, const char *buf, size_t len)->size_t {
+                size_t processed = 0;
+                for (; len - processed >= REQUEST_SIZE; processed += REQUEST_SIZE)
+                {
+                    char message[MESSAGE_SIZE];
+                    memcpy(message, buf + processed, REQUEST_SIZE);
+                    memset(message + REQUEST_SIZE, 'x', MESSAGE_SIZE - REQUEST_SIZE);
+                    for (int i = 0; i < messages; ++i)
+                    {
+                        ctx->postSend(message, MESSAGE_SIZE);
+                        if (flush)
+                        {
+                            ctx->flush();
+                        }
+                    }
+                }
+                return processed;
+            },
+            [](iocp::ClientContext<> *) { });
+        if (!ok)
+        {
+            return false;
+        }
+
+        _stop = false;
+        _received = 0;
+        std::vector<std::thread *> threads;
+        for (int i = 0; i < _cfg.connections; ++i)
+        {
+            threads.push_back(new std::thread([this]() { runClient(); }));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));  // Connected and warmed up.
+
+        uint64_t receivedBefore = _received.load();
+        iocp::SendStats before = _server.getSendStats();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(_cfg.seconds));
+        double seconds = elapsedSince(start);
+        iocp::SendStats after = _server.getSendStats();
+        result.messageRate = (_received.load() - receivedBefore) / seconds;
+        uint64_t sent = after.messages - before.messages;
+        result.writesPerMessage = sent > 0 ? (double)(after.writes - before.writes) / sent : 0.0;
+
+        _stop = true;
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+        _server.shutdown();
+        return true;
+    }
+
+private:
+    void runClient()
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_cfg.port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+        {
+            if (s != INVALID_SOCKET)
+            {
+                close_socket(s);
+            }
+            return;
+        }
+
+        char request[REQUEST_SIZE] = { 0 };
+        std::vector<char> reply(MESSAGE_SIZE * _cfg.messages);
+        bool ok = true;
+        for (int i = 0; i < _cfg.depth && ok; ++i)
+        {
+            ok = sendAll(s, request, REQUEST_SIZE);
+        }
+        while (ok && !_stop)
+        {
+            ok = recvAll(s, &reply[0], (int)reply.size()) && sendAll(s, request, REQUEST_SIZE);
+            _received.fetch_add((uint64_t)_cfg.messages, std::memory_order_relaxed);
+        }
+        close_socket(s);
+    }
+
+    BenchConfig _cfg;
+    iocp::ServerFramework<> _server;
+    volatile bool _stop;
+    std::atomic<uint64_t> _received;
+};
+
+static void usage()
+{
+    printf("usage: batch-bench [-c connections] [-k messages per request] [-d depth] [-t seconds] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-k") == 0) cfg.messages = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) cfg.shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.connections <= 0 || cfg.messages <= 0 || cfg.depth <= 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    static const char *modes[] = { "immediate", "batched", "flushed" };
+
+    iocp::ServerFramework<>::initialize();
+    BatchBench bench(cfg);
+    printf("%d connections %d deep, %d messages of %d bytes per request\n", cfg.connections, cfg.depth, cfg.messages,
+        MESSAGE_SIZE);
+    printf("%-10s %12s %10s %14s\n", "mode", "messages/s", "MB/s", "writes/message");
+    for (int mode = SEND_IMMEDIATE; mode <= SEND_FLUSHED; ++mode)
+    {
+        BenchResult r;
+        if (!bench.run((SendMode)mode, r))
+        {
+            printf("startup failed\n");
+            iocp::ServerFramework<>::uninitialize();
+            return 1;
+        }
+        printf("%-10s %12.0f %10.2f %14.3f\n", modes[mode], r.messageRate, r.messageRate * MESSAGE_SIZE / 1048576.0,
+            r.writesPerMessage);
+    }
+
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
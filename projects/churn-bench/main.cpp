@@ -0,0 +1,363 @@
+// Connect/disconnect churn benchmark.
+//
+// The table part registers and removes connections from 1 to N threads, with the ConnectionTable and with the
+// std::list guarded by a mutex it replaced, so the cost of a connection storm on the registry shows alone.
+// The socket part runs an echo server in process, and the client threads connect, exchange one packet and reset
+// the connection as fast as they can, while another thread keeps sending to the IDs of the connections seen lately,
+// most of which have gone already. The hits and misses of the ClientContext pool show how many connections
+// were served without allocating.
+// With -x 1 the server closes instead: the client sends two packets at once, and the onRecv of the server calls
+// disconnect on the first one, unanswered, and leaves the second, so a connection is closed in the middle of its
+// dispatch.
+// Every onRecv must be followed by one disconnect and no more onRecv, or the run fails.
+//
+// usage: churn-bench [-n max threads] [-p port] [-c client threads] [-S shards] [-t seconds] [-W warm contexts]
+//                    [-x server closes 0/1]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define LIVE_WINDOW 64  // The connections every table thread keeps alive.
+#define RECENT_IDS 1024
+
+struct Dummy
+{
+    std::list<Dummy *>::iterator it;
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Every thread keeps LIVE_WINDOW connections, and replaces the oldest one by a new one until time's up.
+// Returns the replacements per second.
+template <class _Insert, class _Remove> static double runChurn(unsigned threads, int seconds, _Insert insert, _Remove remove)
+{
+    std::atomic<uint64_t> total(0);
+    volatile bool shouldQuit = false;
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.push_back(std::thread([&]() {
+            std::vector<Dummy> objs(LIVE_WINDOW);
+            std::vector<iocp::ConnectionId> ids(LIVE_WINDOW);
+            for (size_t k = 0; k < LIVE_WINDOW; ++k)
+            {
+                ids[k] = insert(&objs[k]);
+            }
+
+            uint64_t count = 0;
+            size_t k = 0;
+            while (!shouldQuit)
+            {
+                for (int batch = 0; batch < 1024; ++batch)
+                {
+                    remove(ids[k], &objs[k]);
+                    ids[k] = insert(&objs[k]);
+                    k = (k + 1) % LIVE_WINDOW;
+                }
+                count += 1024;
+            }
+
+            for (size_t j = 0; j < LIVE_WINDOW; ++j)
+            {
+                remove(ids[j], &objs[j]);
+            }
+            total += count;
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    shouldQuit = true;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    return (double)total / elapsedSince(start);
+}
+
+static void benchTable(unsigned maxThreads, int seconds)
+{
+    printf("registry churn, %d connections alive per thread, %d seconds per run\n", LIVE_WINDOW, seconds);
+    printf("%8s %16s %16s %16s\n", "threads", "list+mutex/s", "table/s", "table+lookup/s");
+
+    for (unsigned threads = 1; threads <= maxThreads; ++threads)
+    {
+        iocp::mutex mtx;
+        std::list<Dummy *> list;
+        double listRate = runChurn(threads, seconds,
+            [&](Dummy *obj)->iocp::ConnectionId {
+                mtx.lock();
+                list.push_front(obj);
+                obj->it = list.begin();
+                mtx.unlock();
+                return 0;
+            },
+            [&](iocp::ConnectionId, Dummy *obj) {
+                mtx.lock();
+                list.erase(obj->it);
+                mtx.unlock();
+            });
+
+        iocp::ConnectionTable<Dummy> table;
+        double tableRate = runChurn(threads, seconds,
+            [&](Dummy *obj)->iocp::ConnectionId { return table.insert(obj); },
+            [&](iocp::ConnectionId id, Dummy *) { table.remove(id); });
+
+        // Every replacement also looks up a live ID and a stale one, as sending by ID does.
+        double lookupRate = runChurn(threads, seconds,
+            [&](Dummy *obj)->iocp::ConnectionId { return table.insert(obj); },
+            [&](iocp::ConnectionId id, Dummy *) {
+                if (table.acquire(id) != nullptr)
+                {
+                    table.release(id);
+                }
+                table.remove(id);
+                if (table.acquire(id) != nullptr)
+                {
+                    printf("stale ID %llu acquired!\n", (unsigned long long)id);
+                    abort();
+                }
+            });
+
+        printf("%8u %16.0f %16.0f %16.0f\n", threads, listRate, tableRate, lookupRate);
+    }
+}
+
+static SOCKET connectOnce(uint16_t port)
+{
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        close_socket(s);
+        return INVALID_SOCKET;
+    }
+
+    // Reset instead of FIN, or the ephemeral ports run out in TIME_WAIT soon.
+    struct linger lg;
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    ::setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *)&lg, sizeof(lg));
+    return s;
+}
+
+// Connects, sends a 4-byte packet, waits for the echo and resets the connection.
+// If the server closes, sends two packets and waits for the close instead of the echo.
+static bool churnOnce(uint16_t port, bool serverCloses)
+{
+    SOCKET s = connectOnce(port);
+    if (s == INVALID_SOCKET)
+    {
+        return false;
+    }
+
+    static const char packets[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };  // Empty bodies.
+    int len = serverCloses ? 8 : 4;
+    bool ok = ::send(s, packets, len, 0) == len;
+    char buf[256];
+    int received = 0;
+    while (ok && (serverCloses || received < len))
+    {
+        int ret = ::recv(s, buf, sizeof(buf), 0);
+        if (ret <= 0 && serverCloses)
+        {
+            break;  // Closed, or reset with the second packet unread.
+        }
+        ok = ret > 0;
+        received += ret;
+    }
+    close_socket(s);
+    return ok;
+}
+
+static bool benchSockets(uint16_t port, unsigned clientThreads, unsigned shards, int seconds, size_t warmContexts,
+    bool serverCloses)
+{
+    std::atomic<uint64_t> recentIds[RECENT_IDS];
+    for (size_t i = 0; i < RECENT_IDS; ++i)
+    {
+        recentIds[i] = 0;
+    }
+    std::atomic<uint64_t> received(0);
+    std::atomic<uint64_t> disconnected(0);
+
+    iocp::ServerFramework<> server;
+    server.setShardCount(shards);
+    server.setContextPoolSize(warmContexts, warmContexts > CONTEXT_POOL_MAX_IDLE ? warmContexts : CONTEXT_POOL_MAX_IDLE);
+    bool started = server.startup("127.0.0.1", port,
+        [&](iocp::ClientContext<> *ctx, const char *buf, size_t len)->size_t {
+            uint64_t n = received++;
+            recentIds[n % RECENT_IDS] = ctx->getId();
+            if (serverCloses)
+            {
+                server.disconnect(ctx->getId());  // Closed at once, on the strand of the connection.
+                return len < 4 ? len : 4;
+            }
+            ctx->postSend(buf, len);
+            return len;
+        },
+        [&](iocp::ClientContext<> *) { ++disconnected; });
+    if (!started)
+    {
+        printf("startup failed\n");
+        return false;
+    }
+
+    volatile bool shouldQuit = false;
+    std::atomic<uint64_t> connections(0);
+    std::atomic<uint64_t> failures(0);
+    std::vector<std::thread> clients;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < clientThreads; ++i)
+    {
+        clients.push_back(std::thread([&]() {
+            while (!shouldQuit)
+            {
+                if (churnOnce(port, serverCloses))
+                {
+                    ++connections;
+                }
+                else
+                {
+                    ++failures;
+                }
+            }
+        }));
+    }
+
+    // Addresses the connections by the IDs kept, racing with their disconnection.
+    uint64_t sentById = 0;
+    uint64_t goneById = 0;
+    std::thread pusher([&]() {
+        static const char packet[4] = { 0, 0, 0, 0 };
+        while (!shouldQuit)
+        {
+            for (size_t i = 0; i < RECENT_IDS; ++i)
+            {
+                iocp::ConnectionId id = recentIds[i];
+                if (id == 0)
+                {
+                    continue;
+                }
+                if (server.postSend(id, packet, sizeof(packet)) == iocp::ClientContext<>::POST_RESULT::FAIL)
+                {
+                    ++goneById;
+                }
+                else
+                {
+                    ++sentById;
+                }
+            }
+        }
+    });
+
+    for (int sec = 1; sec <= seconds; ++sec)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        printf("%3ds %12llu connections %8llu failed %8lu alive\n", sec,
+            (unsigned long long)connections.load(), (unsigned long long)failures.load(), (unsigned long)server.getClientCount());
+    }
+    shouldQuit = true;
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        clients[i].join();
+    }
+    pusher.join();
+    double elapsed = elapsedSince(start);
+
+    // Let the server see the last resets.
+    for (int i = 0; i < 100 && server.getClientCount() > 0; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    printf("%.0f connections/s, %llu disconnected by the server, %lu left\n",
+        (double)connections / elapsed, (unsigned long long)disconnected.load(), (unsigned long)server.getClientCount());
+    printf("sends by ID: %llu delivered, %llu to gone connections\n", (unsigned long long)sentById, (unsigned long long)goneById);
+    iocp::ContextPoolStats pool = server.getContextPoolStats();
+    printf("context pool: %llu hits, %llu misses, %lu idle\n",
+        (unsigned long long)pool.hits, (unsigned long long)pool.misses, (unsigned long)pool.idle);
+    server.shutdown();
+
+    if (serverCloses && received != disconnected)
+    {
+        printf("closed by onRecv: %llu onRecv for %llu disconnects!\n", (unsigned long long)received.load(),
+            (unsigned long long)disconnected.load());
+        return false;
+    }
+    return true;
+}
+
+static void usage()
+{
+    printf("usage: churn-bench [-n max threads] [-p port] [-c client threads] [-S shards] [-t seconds] [-W warm contexts]\n"
+        "                   [-x server closes 0/1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned maxThreads = std::thread::hardware_concurrency();
+    uint16_t port = 8899;
+    unsigned clientThreads = 4;
+    unsigned shards = 0;
+    int seconds = 3;
+    size_t warmContexts = 64;
+    bool serverCloses = false;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) maxThreads = (unsigned)atoi(val);
+        else if (strcmp(opt, "-p") == 0) port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-c") == 0) clientThreads = (unsigned)atoi(val);
+        else if (strcmp(opt, "-S") == 0) shards = (unsigned)atoi(val);
+        else if (strcmp(opt, "-t") == 0) seconds = atoi(val);
+        else if (strcmp(opt, "-W") == 0) warmContexts = (size_t)atoi(val);
+        else if (strcmp(opt, "-x") == 0) serverCloses = atoi(val) != 0;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || maxThreads == 0 || clientThreads == 0 || seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    benchTable(maxThreads, seconds);
+
+    iocp::ServerFramework<>::initialize();
+    printf("\nsocket churn, %u client threads, %s%s\n", clientThreads, shards == 0 ? "shared mode" : "sharded mode",
+        serverCloses ? ", closed by the server" : "");
+    bool ok = benchSockets(port, clientThreads, shards, seconds, warmContexts, serverCloses);
+    iocp::ServerFramework<>::uninitialize();
+    return ok ? 0 : 1;
+}
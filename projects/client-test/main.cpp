@@ -30,7 +30,7 @@ int main() {
     std::thread t([&cc]() {
         std::vector<char> buf;
         while (1) {
-            if (cc.peekBuf(&buf)) {
+            if (cc.waitBuf(&buf, 1000)) {
                 msgpack::sbuffer sbuf;
                 sbuf.write(&buf[0], buf.size());
 
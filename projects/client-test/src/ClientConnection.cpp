@@ -1,42 +1,34 @@
 #include "ClientConnection.h"
 #include <utility>
+#include <chrono>
 #include <assert.h>
 #include <stdio.h>
 
 #if PLATFORM_IS_WINDOWS
-#pragma comment(lib, "ws2_32.lib")
+#else
+#   include <unistd.h>
+#   include <fcntl.h>
+#   include <errno.h>
+#   include <netinet/tcp.h>
 #endif
 
 #define LOG_DEBUG printf
 
-#if PLATFORM_IS_WINDOWS
-struct WinSockLibLoader {
-    WinSockLibLoader() {
-        WSADATA data;
-        WORD ver = MAKEWORD(2, 2);
-        int ret = ::WSAStartup(ver, &data);
-        if (ret != 0) {
-            LOG_DEBUG("WSAStartup failed: last error %d", ::WSAGetLastError());
-        }
-    }
-    ~WinSockLibLoader() {
-        ::WSACleanup();
+ClientConnection::ClientConnection(ClientLoop *loop) {
+    if (loop == nullptr) {
+        _ownLoop = new ClientLoop();
+        loop = _ownLoop;
     }
-};
-#endif
-
-ClientConnection::ClientConnection() {
-#if PLATFORM_IS_WINDOWS
-    static WinSockLibLoader loader;
-#endif
+    _loop = loop;
 }
 
 ClientConnection::~ClientConnection() {
-
+    quit();
+    delete _ownLoop;
 }
 
 void ClientConnection::connentToServer(const char *ip, unsigned short port) {
-    if (_isConnectSuccess || _connectThread != nullptr) {
+    if (_isAdded || !_loop->isRunning()) {
         return;
     }
 
@@ -45,164 +37,130 @@ void ClientConnection::connentToServer(const char *ip, unsigned short port) {
         return;
     }
 
-    _isWaiting = true;
-    _connectThread = new std::thread(std::bind(&ClientConnection::_connectToServer, this, ip, port));
-}
+    // The queued packets go out in one send, so don't delay them further.
+    int noDelay = 1;
+    ::setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
 
-void ClientConnection::quit() {
-    if (_socket != INVALID_SOCKET) {
+#if PLATFORM_IS_WINDOWS
+    u_long nonBlocking = 1;
+    bool ok = ::ioctlsocket(_socket, FIONBIO, &nonBlocking) == 0;
+#else
+    int flags = ::fcntl(_socket, F_GETFL, 0);
+    bool ok = flags != -1 && ::fcntl(_socket, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+
+    struct sockaddr_in serverAddr = { 0 };
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = ::inet_addr(ip);
+    serverAddr.sin_port = htons(port);
+
+    if (ok && ::connect(_socket, (struct sockaddr *)&serverAddr, sizeof(struct sockaddr)) == SOCKET_ERROR) {
+#if PLATFORM_IS_WINDOWS
+        ok = ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        ok = errno == EINPROGRESS;
+#endif
+    }
+    if (!ok) {
+        LOG_DEBUG("Cannot connect to %s:%hu\n", ip, port);
 #if PLATFORM_IS_WINDOWS
         ::closesocket(_socket);
 #else
-        ::shutdown(_socket, SHUT_RDWR);
+        ::close(_socket);
 #endif
         _socket = INVALID_SOCKET;
+        _isWaiting = false;
+        _isConnectSuccess = false;
+        return;
     }
 
-    if (_connectThread != nullptr) {
-        _connectThread->join();
-        delete _connectThread;
-        _connectThread = nullptr;
-    }
+    _isWaiting = true;
+    _isConnectSuccess = false;
+    _connecting = true;
+    _isAdded = true;
+    _isRemoved = false;
+    _sendMutex.lock();
+    _sendOpen = true;
+    _sendNotified = !_sendQueue.empty();  // Sent once connected.
+    _sendMutex.unlock();
+    _loop->_add(this);
+}
 
-    if (_sendThread != nullptr) {
-        _sendNeedQuit = true;
-        _sendThread->join();
-        delete _sendThread;
-        _sendThread = nullptr;
+void ClientConnection::quit() {
+    if (!_isAdded) {
+        return;
     }
 
-    if (_recvThread != nullptr) {
-        _recvNeedQuit = true;
-        _recvThread->join();
-        delete _recvThread;
-        _recvThread = nullptr;
-    }
+    // No send is notified after the removal, so the loop never sees this connection again.
+    _sendMutex.lock();
+    _sendOpen = false;
+    _sendNotified = false;
+    _sendMutex.unlock();
+    _loop->_remove(this);
+
+    _isAdded = false;
+    _isWaiting = false;
     _isConnectSuccess = false;
+    _writeBuf.clear();
+    _writeOffset = 0;
+    _readLen = 0;
 }
 
 void ClientConnection::sendBuf(const char *buf, int len) {
-    _sendMutex.lock();
-    _sendQueue.push_back(std::move(std::vector<char>(buf, buf + len)));
-    _sendMutex.unlock();
+    assert(len >= 0);
+    char header[4];
+    header[0] = (char)((len >> 24) & 0xFF);
+    header[1] = (char)((len >> 16) & 0xFF);
+    header[2] = (char)((len >> 8) & 0xFF);
+    header[3] = (char)(len & 0xFF);
+
+    std::lock_guard<std::mutex> lock(_sendMutex);
+    _sendQueue.insert(_sendQueue.end(), header, header + 4);
+    _sendQueue.insert(_sendQueue.end(), buf, buf + len);
+    if (_sendOpen && !_sendNotified) {
+        _sendNotified = true;
+        _loop->_notifySend(this);
+    }
 }
 
 bool ClientConnection::peekBuf(std::vector<char> *buf) {
     assert(buf != nullptr);
-    _recvMutex.lock();
+    std::lock_guard<std::mutex> lock(_recvMutex);
     if (_recvQueue.empty()) {
-        _recvMutex.unlock();
         return false;
     }
     *buf = std::move(_recvQueue.front());
     _recvQueue.pop_front();
-    _recvMutex.unlock();
     return true;
 }
 
-void ClientConnection::_connectToServer(const char *ip, unsigned short port) {
-    struct sockaddr_in serverAddr = { 0 };
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = ::inet_addr(ip);
-    serverAddr.sin_port = htons(port);
-
-    int ret = ::connect(_socket, (struct sockaddr *)&serverAddr, sizeof(struct sockaddr));
-    if (ret == SOCKET_ERROR) {
-        LOG_DEBUG("Cannot connect to %s:%hu\n", ip, port);
-        _isWaiting = false;
-        _isConnectSuccess = false;
-        return;
+bool ClientConnection::waitBuf(std::vector<char> *buf, int timeout) {
+    assert(buf != nullptr);
+    std::unique_lock<std::mutex> lock(_recvMutex);
+    _recvCond.wait_for(lock, std::chrono::milliseconds(timeout), [this]() {
+        return !_recvQueue.empty() || (!_isWaiting && !_isConnectSuccess);
+    });
+    if (_recvQueue.empty()) {
+        return false;
     }
-    LOG_DEBUG("connect to %s:%hu\n", ip, port);
-
-    _isWaiting = false;
-    _isConnectSuccess = true;
-    _sendThread = new std::thread(std::bind(&ClientConnection::_sendThreadFunc, this));
-    _recvThread = new std::thread(std::bind(&ClientConnection::_recvThreadFunc, this));
+    *buf = std::move(_recvQueue.front());
+    _recvQueue.pop_front();
+    return true;
 }
 
-void ClientConnection::_recvThreadFunc() {
-    char buf[4];
-    int ret;
-    while (!_recvNeedQuit) {
-        ret = ::recv(_socket, &buf[0], 1, 0);
-        if (ret == SOCKET_ERROR) {
-            LOG_DEBUG("Recv error\n");
-            break;
-        }
-        ret = ::recv(_socket, &buf[1], 1, 0);
-        if (ret == SOCKET_ERROR) {
-            LOG_DEBUG("Recv error\n");
-            break;
-        }
-        ret = ::recv(_socket, &buf[2], 1, 0);
-        if (ret == SOCKET_ERROR) {
-            LOG_DEBUG("Recv error\n");
-            break;
-        }
-        ret = ::recv(_socket, &buf[3], 1, 0);
-        if (ret == SOCKET_ERROR) {
-            LOG_DEBUG("Recv error\n");
-            break;
-        }
-        size_t len = buf[0];
-        len <<= 8;
-        len |= buf[1];
-        len <<= 8;
-        len |= buf[2];
-        len <<= 8;
-        len |= buf[3];
-        assert(len <= INT_MAX);
-
-        std::vector<char> cache;
-        cache.resize(len);
-        int cnt = 0;
-    again:
-        ret = ::recv(_socket, &cache[cnt], len - cnt, 0);
-        if (ret == SOCKET_ERROR) {
-            LOG_DEBUG("Recv error\n");
-            break;
-        }
-        cnt += ret;
-        if (cnt < (int)len) {
-            goto again;
-        }
-
-        LOG_DEBUG("recv: %.*s\n", (int)len, &cache[0]);
-
-        _recvMutex.lock();
-        _recvQueue.push_back(std::move(cache));
-        _recvMutex.unlock();
+void ClientConnection::_deliver(const char *buf, size_t len) {
+    if (_recvCallback) {
+        _recvCallback(buf, len);
+        return;
     }
+    std::lock_guard<std::mutex> lock(_recvMutex);
+    _recvQueue.push_back(std::vector<char>(buf, buf + len));
+    _recvCond.notify_one();
 }
 
-void ClientConnection::_sendThreadFunc() {
-    char buf[4];
-    while (!_sendNeedQuit) {
-        _sendMutex.lock();
-        if (_sendQueue.empty()) {
-            _sendMutex.unlock();
-        }
-        else {
-            std::vector<char> packet(std::move(_sendQueue.front()));
-            _sendQueue.pop_front();
-            _sendMutex.unlock();
-
-            size_t len = packet.size();
-            assert(len <= INT_MAX);
-
-            buf[0] = (len >> 24) & 0xFF;
-            buf[1] = (len >> 16) & 0xFF;
-            buf[2] = (len >> 8) & 0xFF;
-            buf[3] = len & 0xFF;
-            if (::send(_socket, buf, 4, 0) != 4) {
-                LOG_DEBUG("Send error\n");
-                break;
-            }
-            if (::send(_socket, &packet[0], len, 0) != len) {
-                LOG_DEBUG("Send error\n");
-                break;
-            }
-        }
-    }
+void ClientConnection::_disconnected() {
+    _isWaiting = false;
+    _isConnectSuccess = false;
+    std::lock_guard<std::mutex> lock(_recvMutex);
+    _recvCond.notify_all();
 }
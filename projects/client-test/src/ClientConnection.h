@@ -1,30 +1,21 @@
 #ifndef _CLIENT_CONNECTION_H_
 #define _CLIENT_CONNECTION_H_
-#if (defined _WIN32) || (defined WIN32)
-#   define PLATFORM_IS_WINDOWS 1
-#   include <winsock2.h>
-#   include <mswsock.h>
-#   include <windows.h>
-#else
-#   define PLATFORM_IS_WINDOWS 0
-#   include <sys/socket.h>
-#   include <netinet/in.h>
-#   include <arpa/inet.h>
-#   define INVALID_SOCKET (-1)
-#   define SOCKET_ERROR (-1)
-typedef int SOCKET;
-#endif
+
+#include "ClientLoop.h"
 
 #include <functional>
-#include <thread>
-#include <mutex>
 #include <deque>
 #include <vector>
 
+// A connection sending and receiving packets of a 4-byte big-endian length and the body. Its socket is
+// non-blocking and runs on a ClientLoop, so one loop thread can drive thousands of connections: pass the same loop
+// to many of them, or none to have the connection run its own.
 class ClientConnection final {
 
 public:
-    ClientConnection();
+    typedef std::function<void (const char *buf, size_t len)> RecvCallback;
+
+    explicit ClientConnection(ClientLoop *loop = nullptr);
     ~ClientConnection();
 
     void connentToServer(const char *ip, unsigned short port);
@@ -32,33 +23,59 @@ public:
 
     bool isWaiting() const { return _isWaiting; }
     bool isConnectSuccess() const { return _isConnectSuccess; }
+
+    // Queues a packet, it can be called before the connection is connected.
     void sendBuf(const char *buf, int len);
+
+    // Takes the oldest packet received, waitBuf waits up to timeout ms for one (or until disconnected).
     bool peekBuf(std::vector<char> *buf);
+    bool waitBuf(std::vector<char> *buf, int timeout);
+
+    // Before connentToServer, hands every packet to callback on the loop thread instead of queueing it for
+    // peekBuf, e.g. for a load generator answering in place.
+    void setRecvCallback(const RecvCallback &callback) { _recvCallback = callback; }
 
 private:
+    friend class ClientLoop;
+
     ClientConnection(const ClientConnection &) = delete;
     ClientConnection(ClientConnection &&) = delete;
     ClientConnection &operator=(const ClientConnection &) = delete;
     ClientConnection &operator=(ClientConnection &&) = delete;
 
+    ClientLoop                      *_loop              = nullptr;
+    ClientLoop                      *_ownLoop           = nullptr;
     SOCKET                          _socket             = INVALID_SOCKET;
-    std::thread                     *_connectThread     = nullptr;
+    bool                            _isAdded            = false;
     volatile bool                   _isWaiting          = true;
     volatile bool                   _isConnectSuccess   = false;
 
-    std::thread                     *_sendThread        = nullptr;
     std::mutex                      _sendMutex;
-    std::deque<std::vector<char> >  _sendQueue;
-    volatile bool                   _sendNeedQuit       = false;
+    std::vector<char>               _sendQueue;         // The packets queued, with their headers.
+    bool                            _sendOpen           = false;
+    bool                            _sendNotified       = false;
 
-    std::thread                     *_recvThread        = nullptr;
     std::mutex                      _recvMutex;
+    std::condition_variable         _recvCond;
     std::deque<std::vector<char> >  _recvQueue;
-    volatile bool                   _recvNeedQuit       = false;
+    RecvCallback                    _recvCallback;
+
+    bool                            _isRemoved          = false;  // Guarded by the mutex of the loop.
+
+    // Owned by the loop thread.
+    std::vector<char>               _writeBuf;
+    size_t                          _writeOffset        = 0;
+    std::vector<char>               _readBuf;
+    size_t                          _readLen            = 0;
+    bool                            _connecting         = false;
+    bool                            _writeWatched       = false;
+    bool                            _sendPending        = false;
+#if PLATFORM_IS_WINDOWS
+    size_t                          _pollIndex          = 0;
+#endif
 
-    void _connectToServer(const char *ip, unsigned short port);
-    void _recvThreadFunc();
-    void _sendThreadFunc();
+    void _deliver(const char *buf, size_t len);
+    void _disconnected();
 };
 
 #endif
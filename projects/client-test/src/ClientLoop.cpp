@@ -0,0 +1,503 @@
+#include "ClientLoop.h"
+#include "ClientConnection.h"
+#include "iocp/FrameCodec.h"
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#if PLATFORM_IS_WINDOWS
+#pragma comment(lib, "ws2_32.lib")
+#   define SEND_FLAGS 0
+#else
+#   include <unistd.h>
+#   include <errno.h>
+#   include <sys/epoll.h>
+#   include <sys/eventfd.h>
+#   define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define LOG_DEBUG printf
+
+#define INITIAL_READ_SIZE 4096
+#define MIN_READ_SIZE 1024  // The buffer doubles when less is free.
+#define MAX_EVENTS 256
+
+// The 4-byte big-endian body size of the server, up to any size: the buffer grows to hold it.
+static const iocp::FrameDecoder frameDecoder(iocp::FrameFormat::fixed(4, true, UINT32_MAX));
+
+#if PLATFORM_IS_WINDOWS
+struct WinSockLibLoader {
+    WinSockLibLoader() {
+        WSADATA data;
+        WORD ver = MAKEWORD(2, 2);
+        int ret = ::WSAStartup(ver, &data);
+        if (ret != 0) {
+            LOG_DEBUG("WSAStartup failed: last error %d", ::WSAGetLastError());
+        }
+    }
+    ~WinSockLibLoader() {
+        ::WSACleanup();
+    }
+};
+#endif
+
+static void closeSocket(SOCKET s) {
+#if PLATFORM_IS_WINDOWS
+    ::closesocket(s);
+#else
+    ::close(s);
+#endif
+}
+
+static bool wouldBlock() {
+#if PLATFORM_IS_WINDOWS
+    return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+ClientLoop::ClientLoop() {
+#if PLATFORM_IS_WINDOWS
+    static WinSockLibLoader loader;
+
+    // A UDP socket connected to itself, which the wakeups make readable.
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    int addrLen = sizeof(addr);
+    u_long nonBlocking = 1;
+    _wakeupSocket = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (_wakeupSocket == INVALID_SOCKET
+        || ::bind(_wakeupSocket, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR
+        || ::getsockname(_wakeupSocket, (struct sockaddr *)&addr, &addrLen) == SOCKET_ERROR
+        || ::connect(_wakeupSocket, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR
+        || ::ioctlsocket(_wakeupSocket, FIONBIO, &nonBlocking) != 0) {
+        LOG_DEBUG("Cannot create the wakeup socket: last error %d\n", ::WSAGetLastError());
+        if (_wakeupSocket != INVALID_SOCKET) {
+            closeSocket(_wakeupSocket);
+            _wakeupSocket = INVALID_SOCKET;
+        }
+        return;
+    }
+    WSAPOLLFD pollFd = { 0 };
+    pollFd.fd = _wakeupSocket;
+    pollFd.events = POLLRDNORM;
+    _pollFds.push_back(pollFd);
+    _pollConns.push_back(nullptr);
+#else
+    _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    _eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (_epollFd == -1 || _eventFd == -1 || ::epoll_ctl(_epollFd, EPOLL_CTL_ADD, _eventFd, &ev) == -1) {
+        LOG_DEBUG("Cannot create the epoll: errno %d\n", errno);
+        if (_epollFd != -1) {
+            ::close(_epollFd);
+            _epollFd = -1;
+        }
+        if (_eventFd != -1) {
+            ::close(_eventFd);
+            _eventFd = -1;
+        }
+        return;
+    }
+#endif
+    _thread = new std::thread(std::bind(&ClientLoop::_threadFunc, this));
+}
+
+// The connections should have quit before.
+ClientLoop::~ClientLoop() {
+    if (_thread != nullptr) {
+        _needQuit = true;
+        _wakeup();
+        _thread->join();
+        delete _thread;
+        _thread = nullptr;
+    }
+#if PLATFORM_IS_WINDOWS
+    if (_wakeupSocket != INVALID_SOCKET) {
+        closeSocket(_wakeupSocket);
+    }
+#else
+    if (_epollFd != -1) {
+        ::close(_epollFd);
+    }
+    if (_eventFd != -1) {
+        ::close(_eventFd);
+    }
+#endif
+}
+
+void ClientLoop::_add(ClientConnection *conn) {
+    _pushCommand(ADD, conn);
+}
+
+void ClientLoop::_remove(ClientConnection *conn) {
+    if (_inLoopThread()) {
+        // Quit by a callback: nothing waits for the loop, drop the commands not run yet.
+        bool watched = true;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (std::vector<Command>::iterator it = _commands.begin(); it != _commands.end(); ) {
+                if (it->conn == conn) {
+                    watched = watched && it->type != ADD;
+                    it = _commands.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            conn->_isRemoved = true;
+        }
+        if (conn->_socket != INVALID_SOCKET) {
+            if (watched) {
+                _unwatch(conn);
+            }
+            closeSocket(conn->_socket);
+            conn->_socket = INVALID_SOCKET;
+        }
+        _pendingSends.erase(std::remove(_pendingSends.begin(), _pendingSends.end(), conn), _pendingSends.end());
+        conn->_sendPending = false;
+        return;
+    }
+
+    _pushCommand(REMOVE, conn);
+    std::unique_lock<std::mutex> lock(_mutex);
+    _removed.wait(lock, [conn]() { return conn->_isRemoved; });
+}
+
+void ClientLoop::_notifySend(ClientConnection *conn) {
+    if (!_inLoopThread()) {
+        _pushCommand(SEND, conn);
+    }
+    else if (!conn->_sendPending) {
+        // Flushed before the next wait, with whatever else the callbacks send meanwhile.
+        conn->_sendPending = true;
+        _pendingSends.push_back(conn);
+    }
+}
+
+bool ClientLoop::_inLoopThread() const {
+    return _thread != nullptr && std::this_thread::get_id() == _thread->get_id();
+}
+
+void ClientLoop::_pushCommand(CommandType type, ClientConnection *conn) {
+    // Only the command which finds the queue empty wakes the loop up, it runs the later ones with it.
+    bool wakeup;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        wakeup = _commands.empty();
+        Command command = { type, conn };
+        _commands.push_back(command);
+    }
+    if (wakeup) {
+        _wakeup();
+    }
+}
+
+void ClientLoop::_wakeup() {
+#if PLATFORM_IS_WINDOWS
+    char c = 0;
+    ::send(_wakeupSocket, &c, 1, 0);
+#else
+    uint64_t one = 1;
+    ssize_t ret = ::write(_eventFd, &one, sizeof(one));
+    (void)ret;
+#endif
+}
+
+void ClientLoop::_drainWakeup() {
+#if PLATFORM_IS_WINDOWS
+    char buf[256];
+    while (::recv(_wakeupSocket, buf, sizeof(buf), 0) > 0) {
+        continue;
+    }
+#else
+    uint64_t count;
+    ssize_t ret = ::read(_eventFd, &count, sizeof(count));
+    (void)ret;
+#endif
+}
+
+void ClientLoop::_threadFunc() {
+    std::vector<std::pair<ClientConnection *, int> > ready;
+    while (!_needQuit) {
+        _processCommands();
+
+        for (size_t i = 0; i < _pendingSends.size(); ++i) {
+            ClientConnection *conn = _pendingSends[i];
+            conn->_sendPending = false;
+            if (conn->_socket != INVALID_SOCKET && !conn->_connecting && !conn->_writeWatched && !_flushSend(conn)) {
+                _close(conn);
+            }
+        }
+        _pendingSends.clear();
+
+        // The events are taken first, a callback may close any connection.
+        ready.clear();
+#if PLATFORM_IS_WINDOWS
+        int ret = ::WSAPoll(&_pollFds[0], (ULONG)_pollFds.size(), -1);
+        if (ret == SOCKET_ERROR) {
+            LOG_DEBUG("WSAPoll failed: last error %d\n", ::WSAGetLastError());
+            break;
+        }
+        for (size_t i = 0; i < _pollFds.size(); ++i) {
+            if (_pollFds[i].revents != 0) {
+                ready.push_back(std::make_pair(_pollConns[i], (int)_pollFds[i].revents));
+            }
+        }
+        for (size_t i = 0; i < ready.size(); ++i) {
+            int what = ready[i].second;
+            if (ready[i].first == nullptr) {
+                _drainWakeup();
+                continue;
+            }
+            _handleEvents(ready[i].first, (what & (POLLRDNORM | POLLHUP)) != 0, (what & POLLWRNORM) != 0,
+                (what & (POLLERR | POLLNVAL)) != 0);
+        }
+#else
+        struct epoll_event events[MAX_EVENTS];
+        int ret = ::epoll_wait(_epollFd, events, MAX_EVENTS, -1);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_DEBUG("epoll_wait failed: errno %d\n", errno);
+            break;
+        }
+        for (int i = 0; i < ret; ++i) {
+            ready.push_back(std::make_pair((ClientConnection *)events[i].data.ptr, (int)events[i].events));
+        }
+        for (size_t i = 0; i < ready.size(); ++i) {
+            int what = ready[i].second;
+            if (ready[i].first == nullptr) {
+                _drainWakeup();
+                continue;
+            }
+            _handleEvents(ready[i].first, (what & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) != 0, (what & EPOLLOUT) != 0,
+                (what & EPOLLERR) != 0);
+        }
+#endif
+    }
+}
+
+void ClientLoop::_processCommands() {
+    std::vector<Command> commands;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_commands.empty()) {
+            return;
+        }
+        commands.swap(_commands);
+    }
+
+    bool removed = false;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        ClientConnection *conn = commands[i].conn;
+        switch (commands[i].type) {
+        case ADD:
+            _watch(conn);
+            break;
+        case SEND:
+            if (!conn->_sendPending) {
+                conn->_sendPending = true;
+                _pendingSends.push_back(conn);
+            }
+            break;
+        case REMOVE:
+            if (conn->_socket != INVALID_SOCKET) {
+                _unwatch(conn);
+                closeSocket(conn->_socket);
+                conn->_socket = INVALID_SOCKET;
+            }
+            _pendingSends.erase(std::remove(_pendingSends.begin(), _pendingSends.end(), conn), _pendingSends.end());
+            conn->_sendPending = false;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                conn->_isRemoved = true;
+            }
+            removed = true;
+            break;
+        default:
+            break;
+        }
+    }
+    if (removed) {
+        _removed.notify_all();
+    }
+}
+
+void ClientLoop::_watch(ClientConnection *conn) {
+    // Writable once connected.
+    conn->_writeWatched = true;
+#if PLATFORM_IS_WINDOWS
+    WSAPOLLFD pollFd = { 0 };
+    pollFd.fd = conn->_socket;
+    pollFd.events = POLLRDNORM | POLLWRNORM;
+    conn->_pollIndex = _pollFds.size();
+    _pollFds.push_back(pollFd);
+    _pollConns.push_back(conn);
+#else
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    ev.data.ptr = conn;
+    if (::epoll_ctl(_epollFd, EPOLL_CTL_ADD, conn->_socket, &ev) == -1) {
+        LOG_DEBUG("epoll_ctl failed: errno %d\n", errno);
+        closeSocket(conn->_socket);
+        conn->_socket = INVALID_SOCKET;
+        conn->_connecting = false;
+        conn->_writeWatched = false;
+        conn->_disconnected();
+    }
+#endif
+}
+
+void ClientLoop::_unwatch(ClientConnection *conn) {
+    conn->_writeWatched = false;
+#if PLATFORM_IS_WINDOWS
+    size_t index = conn->_pollIndex;
+    _pollFds[index] = _pollFds.back();
+    _pollConns[index] = _pollConns.back();
+    _pollConns[index]->_pollIndex = index;
+    _pollFds.pop_back();
+    _pollConns.pop_back();
+#else
+    ::epoll_ctl(_epollFd, EPOLL_CTL_DEL, conn->_socket, nullptr);
+#endif
+}
+
+void ClientLoop::_updateEvents(ClientConnection *conn) {
+#if PLATFORM_IS_WINDOWS
+    _pollFds[conn->_pollIndex].events = conn->_writeWatched ? (POLLRDNORM | POLLWRNORM) : POLLRDNORM;
+#else
+    struct epoll_event ev = { 0 };
+    ev.events = conn->_writeWatched ? (EPOLLIN | EPOLLRDHUP | EPOLLOUT) : (EPOLLIN | EPOLLRDHUP);
+    ev.data.ptr = conn;
+    ::epoll_ctl(_epollFd, EPOLL_CTL_MOD, conn->_socket, &ev);
+#endif
+}
+
+void ClientLoop::_handleEvents(ClientConnection *conn, bool readable, bool writable, bool error) {
+    if (conn->_socket == INVALID_SOCKET) {
+        return;
+    }
+    if (conn->_connecting) {
+        if (!writable && !error) {
+            return;
+        }
+        if (!_finishConnect(conn)) {
+            _close(conn);
+            return;
+        }
+        writable = true;  // Sends the packets queued meanwhile.
+    }
+    else if (error) {
+        _close(conn);
+        return;
+    }
+
+    if (readable && !_readSocket(conn)) {
+        return;
+    }
+    if (writable && !_flushSend(conn)) {
+        _close(conn);
+    }
+}
+
+bool ClientLoop::_finishConnect(ClientConnection *conn) {
+    int err = 0;
+#if PLATFORM_IS_WINDOWS
+    int len = sizeof(err);
+#else
+    socklen_t len = sizeof(err);
+#endif
+    if (::getsockopt(conn->_socket, SOL_SOCKET, SO_ERROR, (char *)&err, &len) == SOCKET_ERROR || err != 0) {
+        LOG_DEBUG("Cannot connect: error %d\n", err);
+        return false;
+    }
+    conn->_connecting = false;
+    conn->_isConnectSuccess = true;
+    conn->_isWaiting = false;
+    return true;
+}
+
+// Sends the queued bytes until the socket is full, then waits for it to be writable.
+bool ClientLoop::_flushSend(ClientConnection *conn) {
+    for (;;) {
+        if (conn->_writeOffset == conn->_writeBuf.size()) {
+            conn->_writeBuf.clear();
+            conn->_writeOffset = 0;
+            std::lock_guard<std::mutex> lock(conn->_sendMutex);
+            conn->_writeBuf.swap(conn->_sendQueue);
+            conn->_sendNotified = false;
+            if (conn->_writeBuf.empty()) {
+                break;
+            }
+        }
+        size_t len = std::min(conn->_writeBuf.size() - conn->_writeOffset, (size_t)INT_MAX);
+        int ret = (int)::send(conn->_socket, conn->_writeBuf.data() + conn->_writeOffset, (int)len, SEND_FLAGS);
+        if (ret == SOCKET_ERROR) {
+            if (wouldBlock()) {
+                break;
+            }
+            LOG_DEBUG("Send error\n");
+            return false;
+        }
+        conn->_writeOffset += ret;
+    }
+
+    bool watch = conn->_writeOffset < conn->_writeBuf.size();
+    if (watch != conn->_writeWatched) {
+        conn->_writeWatched = watch;
+        _updateEvents(conn);
+    }
+    return true;
+}
+
+// Reads once into the free space, then hands out the whole packets. Returns false if the connection has gone.
+bool ClientLoop::_readSocket(ClientConnection *conn) {
+    if (conn->_readBuf.size() - conn->_readLen < MIN_READ_SIZE) {
+        conn->_readBuf.resize(std::max((size_t)INITIAL_READ_SIZE, conn->_readBuf.size() * 2));
+    }
+    int ret = (int)::recv(conn->_socket, conn->_readBuf.data() + conn->_readLen,
+        (int)std::min(conn->_readBuf.size() - conn->_readLen, (size_t)INT_MAX), 0);
+    if (ret == 0 || (ret == SOCKET_ERROR && !wouldBlock())) {
+        if (ret != 0) {
+            LOG_DEBUG("Recv error\n");
+        }
+        _close(conn);
+        return false;
+    }
+    if (ret == SOCKET_ERROR) {
+        return true;
+    }
+    conn->_readLen += ret;
+
+    iocp::FrameDecoder::Result result;
+    bool quit = false;
+    size_t offset = frameDecoder.decodeAll(conn->_readBuf.data(), conn->_readLen, [conn, &quit](const iocp::Frame &frame)->bool {
+        conn->_deliver(frame.body.data(), frame.body.size());
+        quit = conn->_socket == INVALID_SOCKET;
+        return !quit;
+    }, &result);
+    if (quit) {
+        return false;  // Quit by the callback.
+    }
+    if (offset > 0) {
+        memmove(conn->_readBuf.data(), conn->_readBuf.data() + offset, conn->_readLen - offset);
+        conn->_readLen -= offset;
+    }
+    return true;
+}
+
+void ClientLoop::_close(ClientConnection *conn) {
+    _unwatch(conn);
+    closeSocket(conn->_socket);
+    conn->_socket = INVALID_SOCKET;
+    conn->_connecting = false;
+    conn->_disconnected();
+}
@@ -0,0 +1,93 @@
+#ifndef _CLIENT_LOOP_H_
+#define _CLIENT_LOOP_H_
+#if (defined _WIN32) || (defined WIN32)
+#   define PLATFORM_IS_WINDOWS 1
+#   include <winsock2.h>
+#   include <mswsock.h>
+#   include <windows.h>
+#else
+#   define PLATFORM_IS_WINDOWS 0
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <arpa/inet.h>
+#   define INVALID_SOCKET (-1)
+#   define SOCKET_ERROR (-1)
+typedef int SOCKET;
+#endif
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+class ClientConnection;
+
+// Runs the sockets of any number of ClientConnections on one thread. It waits on epoll (WSAPoll on Windows), and
+// is woken up by an eventfd (a loopback socket on Windows) only when a connection is added or removed, or has
+// bytes to send while its socket isn't waited for writing.
+class ClientLoop final {
+
+public:
+    ClientLoop();
+    ~ClientLoop();
+
+    bool isRunning() const { return _thread != nullptr; }
+
+private:
+    friend class ClientConnection;
+
+    ClientLoop(const ClientLoop &) = delete;
+    ClientLoop(ClientLoop &&) = delete;
+    ClientLoop &operator=(const ClientLoop &) = delete;
+    ClientLoop &operator=(ClientLoop &&) = delete;
+
+    enum CommandType {
+        ADD,
+        REMOVE,
+        SEND,
+    };
+
+    struct Command {
+        CommandType         type;
+        ClientConnection    *conn;
+    };
+
+    // Called by ClientConnection. _remove returns once the loop has closed the socket and forgotten the connection.
+    void _add(ClientConnection *conn);
+    void _remove(ClientConnection *conn);
+    void _notifySend(ClientConnection *conn);
+
+    bool _inLoopThread() const;
+    void _pushCommand(CommandType type, ClientConnection *conn);
+    void _wakeup();
+    void _drainWakeup();
+    void _threadFunc();
+    void _processCommands();
+    void _watch(ClientConnection *conn);
+    void _unwatch(ClientConnection *conn);
+    void _updateEvents(ClientConnection *conn);
+    void _handleEvents(ClientConnection *conn, bool readable, bool writable, bool error);
+    bool _finishConnect(ClientConnection *conn);
+    bool _flushSend(ClientConnection *conn);
+    bool _readSocket(ClientConnection *conn);
+    void _close(ClientConnection *conn);
+
+#if PLATFORM_IS_WINDOWS
+    SOCKET                          _wakeupSocket       = INVALID_SOCKET;
+    std::vector<WSAPOLLFD>          _pollFds;
+    std::vector<ClientConnection *> _pollConns;
+#else
+    int                             _epollFd            = -1;
+    int                             _eventFd            = -1;
+#endif
+    std::thread                     *_thread            = nullptr;
+    volatile bool                   _needQuit           = false;
+
+    std::mutex                      _mutex;
+    std::condition_variable         _removed;
+    std::vector<Command>            _commands;
+
+    std::vector<ClientConnection *> _pendingSends;     // Sends posted on the loop thread, flushed before the wait.
+};
+
+#endif
@@ -0,0 +1,356 @@
+// Compute benchmark.
+//
+// Runs a server in process with a mixed workload. Every frame is a 4-byte header (the payload length, the type)
+// followed by an 8-byte payload:
+//   light - echoed at once, L connections send one every I milliseconds, and their round trips are measured
+//   heavy - hashed for about W microseconds of CPU before the reply, H connections keep D of them in flight
+// The server dispatches the heavy type to the compute pool, or runs everything on the IO worker threads inline,
+// and reports the heavy requests/s and the latency of the light ones for both.
+//
+// usage: compute-bench [-l light connections] [-i light interval ms] [-H heavy connections] [-d depth] [-w work us]
+//                      [-t seconds] [-C compute threads] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   include <netinet/tcp.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define HEADER_SIZE 4
+#define PAYLOAD_SIZE 8
+#define FRAME_SIZE (HEADER_SIZE + PAYLOAD_SIZE)
+
+enum MessageType : uint8_t
+{
+    MESSAGE_LIGHT = 0,
+    MESSAGE_HEAVY = 1,
+    MESSAGE_TYPE_COUNT
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// About iterations steps of CPU work, which the compiler can't skip.
+static uint64_t burn(uint64_t seed, uint64_t iterations)
+{
+    uint64_t x = seed | 1;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    return x;
+}
+
+static uint64_t calibrate(uint64_t micros)
+{
+    uint64_t iterations = 1000000;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    volatile uint64_t sink = burn(1, iterations);
+    (void)sink;
+    double perIteration = elapsedSince(start) / iterations;
+    return (uint64_t)(micros / 1e6 / perIteration) + 1;
+}
+
+static void makeFrame(char *frame, MessageType type, uint64_t payload)
+{
+    uint16_t len = PAYLOAD_SIZE;
+    memcpy(frame, &len, 2);
+    frame[2] = (char)type;
+    frame[3] = 0;
+    memcpy(frame + HEADER_SIZE, &payload, PAYLOAD_SIZE);
+}
+
+static bool sendAll(SOCKET s, const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::send(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool recvAll(SOCKET s, char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::recv(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+struct BenchConfig
+{
+    int light = 4;
+    int interval = 1;
+    int heavy = 16;
+    int depth = 4;
+    uint64_t workMicros = 1000;
+    int seconds = 5;
+    unsigned computeThreads = 0;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+};
+
+struct BenchResult
+{
+    uint64_t heavyDone = 0;
+    std::vector<double> rtts;  // Microseconds.
+    iocp::ComputePoolStats stats;
+};
+
+class ComputeBench
+{
+public:
+    explicit ComputeBench(const BenchConfig &cfg) : _cfg(cfg), _iterations(calibrate(cfg.workMicros)), _stop(false), _heavyDone(0) { }
+
+    // computeThreads 0 runs everything inline.
+    bool run(unsigned computeThreads, BenchResult &result)
+    {
+        // Which types go to the compute pool.
+        bool heavy[MESSAGE_TYPE_COUNT] = { false, true };
+
+        _server.setShardCount(_cfg.shards);
+        _server.setComputeThreads(computeThreads);
+        uint64_t iterations = _iterations;
+        bool ok = _server.startup("127.0.0.1", _cfg.port,
+            [iterations, heavy](iocp::ClientContext<> *ctx, const char *buf, size_t len)->size_t {
+                size_t processed = 0;
+                while (len - processed >= FRAME_SIZE)
+                {
+                    const char *frame = buf + processed;
+                    MessageType type = (MessageType)frame[2];
+                    uint64_t payload = 0;
+                    memcpy(&payload, frame + HEADER_SIZE, PAYLOAD_SIZE);
+                    processed += FRAME_SIZE;
+
+                    ctx->dispatch([type, payload, iterations](iocp::ClientContext<> *ctx) {
+                        char reply[FRAME_SIZE];
+                        makeFrame(reply, type, type == MESSAGE_HEAVY ? burn(payload, iterations) : payload);
+                        ctx->postSend(reply, FRAME_SIZE);
+                    }, type < MESSAGE_TYPE_COUNT && heavy[type]);
+                }
+                return processed;
+            },
+            [](iocp::ClientContext<> *) { });
+        if (!ok)
+        {
+            return false;
+        }
+
+        _stop = false;
+        _heavyDone = 0;
+        std::vector<std::thread *> threads;
+        std::vector<std::vector<double> > rtts(_cfg.light);
+        for (int i = 0; i < _cfg.heavy; ++i)
+        {
+            threads.push_back(new std::thread([this]() { runHeavy(); }));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));  // Let the compute work pile up first.
+
+        uint64_t heavyBefore = _heavyDone.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < _cfg.light; ++i)
+        {
+            threads.push_back(new std::thread([this, &rtts, i]() { runLight(rtts[i]); }));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(_cfg.seconds));
+        double seconds = elapsedSince(start);
+        result.heavyDone = (uint64_t)((_heavyDone.load() - heavyBefore) / seconds);
+        result.stats = _server.getComputeStats();
+
+        _stop = true;
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+        _server.shutdown();
+
+        result.rtts.clear();
+        for (size_t i = 0; i < rtts.size(); ++i)
+        {
+            result.rtts.insert(result.rtts.end(), rtts[i].begin(), rtts[i].end());
+        }
+        std::sort(result.rtts.begin(), result.rtts.end());
+        return true;
+    }
+
+private:
+    SOCKET connect()
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_cfg.port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+        {
+            if (s != INVALID_SOCKET)
+            {
+                close_socket(s);
+            }
+            return INVALID_SOCKET;
+        }
+        int one = 1;
+        ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+        return s;
+    }
+
+    void runHeavy()
+    {
+        SOCKET s = connect();
+        if (s == INVALID_SOCKET)
+        {
+            return;
+        }
+        char frame[FRAME_SIZE];
+        uint64_t seq = 0;
+        bool ok = true;
+        for (int i = 0; i < _cfg.depth && ok; ++i)
+        {
+            makeFrame(frame, MESSAGE_HEAVY, ++seq);
+            ok = sendAll(s, frame, FRAME_SIZE);
+        }
+        while (ok && !_stop)
+        {
+            ok = recvAll(s, frame, FRAME_SIZE);
+            ++_heavyDone;
+            makeFrame(frame, MESSAGE_HEAVY, ++seq);
+            ok = ok && sendAll(s, frame, FRAME_SIZE);
+        }
+        close_socket(s);
+    }
+
+    void runLight(std::vector<double> &rtts)
+    {
+        SOCKET s = connect();
+        if (s == INVALID_SOCKET)
+        {
+            return;
+        }
+        char frame[FRAME_SIZE];
+        while (!_stop)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            makeFrame(frame, MESSAGE_LIGHT, 0);
+            if (!sendAll(s, frame, FRAME_SIZE) || !recvAll(s, frame, FRAME_SIZE))
+            {
+                break;
+            }
+            rtts.push_back(elapsedSince(start) * 1e6);
+            std::this_thread::sleep_for(std::chrono::milliseconds(_cfg.interval));
+        }
+        close_socket(s);
+    }
+
+    BenchConfig _cfg;
+    uint64_t _iterations;
+    iocp::ServerFramework<> _server;
+    volatile bool _stop;
+    std::atomic<uint64_t> _heavyDone;
+};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    return sorted[(size_t)(p * (double)(sorted.size() - 1))];
+}
+
+static void printResult(const char *mode, const BenchResult &r)
+{
+    printf("%-8s %12llu %10lu %10.0f %10.0f %10.0f %10llu\n", mode, (unsigned long long)r.heavyDone,
+        (unsigned long)r.rtts.size(), percentile(r.rtts, 0.5), percentile(r.rtts, 0.99), percentile(r.rtts, 1.0),
+        (unsigned long long)r.stats.steals);
+}
+
+static void usage()
+{
+    printf("usage: compute-bench [-l light connections] [-i light interval ms] [-H heavy connections] [-d depth] [-w work us]\n"
+        "                     [-t seconds] [-C compute threads] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-l") == 0) cfg.light = atoi(val);
+        else if (strcmp(opt, "-i") == 0) cfg.interval = atoi(val);
+        else if (strcmp(opt, "-H") == 0) cfg.heavy = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-w") == 0) cfg.workMicros = (uint64_t)atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-C") == 0) cfg.computeThreads = (unsigned)atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) cfg.shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.light <= 0 || cfg.interval < 0 || cfg.heavy < 0 || cfg.depth <= 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+    if (cfg.computeThreads == 0)
+    {
+        cfg.computeThreads = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    iocp::ServerFramework<>::initialize();
+    ComputeBench bench(cfg);
+    printf("%d light connections, %d heavy ones %d deep, %llu us of work per heavy request, %u compute threads\n",
+        cfg.light, cfg.heavy, cfg.depth, (unsigned long long)cfg.workMicros, cfg.computeThreads);
+    printf("%-8s %12s %10s %10s %10s %10s %10s\n", "mode", "heavy/s", "light", "p50 us", "p99 us", "max us", "steals");
+
+    BenchResult inlineResult;
+    BenchResult poolResult;
+    if (!bench.run(0, inlineResult) || !bench.run(cfg.computeThreads, poolResult))
+    {
+        printf("startup failed\n");
+        iocp::ServerFramework<>::uninitialize();
+        return 1;
+    }
+    printResult("inline", inlineResult);
+    printResult("pool", poolResult);
+
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
@@ -0,0 +1,276 @@
+// Message dispatch benchmark.
+//
+// Dispatches N messages of 16 IDs in a random order, with payloads of 8 to 64 bytes, to handlers which add up the
+// payload sizes, by:
+//   switch   - an onRecv std::function holding a switch over the IDs, called per message, as the applications do
+//   map      - a std::unordered_map of the IDs to std::function handlers
+//   router   - MessageRouter::dispatch, the table of the routes built at compile time
+// then the same messages as a stream of frames fed to onRecv in chunks of K bytes, by framed with the switch in the
+// frame callback (a std::function per message), and by routed. It reports the nanoseconds and the messages/s of
+// every way, and checks that every one handled all the messages.
+//
+// usage: dispatch-bench [-n messages] [-k chunk bytes] [-r rounds]
+
+#include "iocp/MessageRouter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+
+#define MIN_PAYLOAD_SIZE 8
+#define MAX_PAYLOAD_SIZE 64
+
+// Sparse on purpose, the table holds an entry per ID up to the largest.
+#define MESSAGE_IDS(X) X(1) X(2) X(3) X(5) X(8) X(13) X(21) X(34) X(55) X(89) X(144) X(233) X(377) X(610) X(987) X(1597)
+
+typedef iocp::ClientContext<> Context;
+
+struct BenchConfig
+{
+    int messages = 1000000;
+    size_t chunk = 4096;
+    int rounds = 5;
+};
+
+static uint64_t handled[MAX_PAYLOAD_SIZE + 1];  // Per payload size, so no handler is alike.
+
+template <uint16_t _ID>
+static void onMessage(Context *, const iocp::FrameView &payload)
+{
+    handled[payload.size()] += _ID;
+}
+
+typedef iocp::MessageRouter<void,
+    iocp::Route<void, 1, onMessage<1> >,
+    iocp::Route<void, 2, onMessage<2> >,
+    iocp::Route<void, 3, onMessage<3> >,
+    iocp::Route<void, 5, onMessage<5> >,
+    iocp::Route<void, 8, onMessage<8> >,
+    iocp::Route<void, 13, onMessage<13> >,
+    iocp::Route<void, 21, onMessage<21> >,
+    iocp::Route<void, 34, onMessage<34> >,
+    iocp::Route<void, 55, onMessage<55> >,
+    iocp::Route<void, 89, onMessage<89> >,
+    iocp::Route<void, 144, onMessage<144> >,
+    iocp::Route<void, 233, onMessage<233> >,
+    iocp::Route<void, 377, onMessage<377> >,
+    iocp::Route<void, 610, onMessage<610> >,
+    iocp::Route<void, 987, onMessage<987> >,
+    iocp::Route<void, 1597, onMessage<1597> >
+> Router;
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t sumHandled()
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i <= MAX_PAYLOAD_SIZE; ++i)
+    {
+        sum += handled[i] * (i + 1);
+    }
+    return sum;
+}
+
+// The switch of an application's onRecv. Returns false for an unknown ID.
+static bool switchMessage(Context *ctx, const char *buf, size_t len)
+{
+    if (len < Router::ID_SIZE)
+    {
+        return false;
+    }
+    uint16_t id = (uint16_t)(((uint8_t)buf[0] << 8) | (uint8_t)buf[1]);
+    iocp::FrameView payload(buf + Router::ID_SIZE, len - Router::ID_SIZE);
+    switch (id)
+    {
+#define SWITCH_CASE(id) case id: onMessage<id>(ctx, payload); return true;
+        MESSAGE_IDS(SWITCH_CASE)
+#undef SWITCH_CASE
+    default:
+        return false;
+    }
+}
+
+// The messages, every one as a frame: the 4-byte size, the ID and the payload. views are the messages in stream.
+static std::vector<char> makeStream(const BenchConfig &cfg, std::vector<iocp::FrameView> *views, uint64_t *checksum)
+{
+    static const uint16_t ids[] = {
+#define LIST_ID(id) id,
+        MESSAGE_IDS(LIST_ID)
+#undef LIST_ID
+    };
+    std::mt19937 rng(20201017);
+    std::uniform_int_distribution<size_t> idDist(0, sizeof(ids) / sizeof(ids[0]) - 1);
+    std::uniform_int_distribution<size_t> sizeDist(MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE);
+    iocp::FrameDecoder decoder(iocp::FrameFormat::fixed(4, true, Router::ID_SIZE + MAX_PAYLOAD_SIZE));
+
+    std::vector<char> stream;
+    std::vector<size_t> offsets;
+    memset(handled, 0, sizeof(handled));
+    for (int i = 0; i < cfg.messages; ++i)
+    {
+        uint16_t id = ids[idDist(rng)];
+        size_t payloadSize = sizeDist(rng);
+        char header[iocp::FrameDecoder::MAX_HEADER_SIZE + Router::ID_SIZE];
+        size_t headerSize = decoder.encodeHeader(Router::ID_SIZE + payloadSize, header);
+        Router::writeId(id, header + headerSize);
+        offsets.push_back(stream.size() + headerSize);
+        stream.insert(stream.end(), header, header + headerSize + Router::ID_SIZE);
+        stream.insert(stream.end(), payloadSize, (char)i);
+        handled[payloadSize] += id;
+    }
+    *checksum = sumHandled();
+
+    views->clear();
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        size_t end = i + 1 < offsets.size() ? offsets[i + 1] - 4 : stream.size();
+        views->push_back(iocp::FrameView(stream.data() + offsets[i], end - offsets[i]));
+    }
+    return stream;
+}
+
+// Feeds the stream to onRecv in chunks, as the receive ring of a connection. Returns false if a chunk stalled it.
+static bool feed(const std::vector<char> &stream, size_t chunk, const iocp::ServerFramework<>::RecvCallback &onRecv)
+{
+    std::vector<char> buf(chunk + Router::ID_SIZE + MAX_PAYLOAD_SIZE + 4);
+    size_t len = 0;
+    for (size_t offset = 0; offset < stream.size(); offset += chunk)
+    {
+        size_t n = stream.size() - offset < chunk ? stream.size() - offset : chunk;
+        memcpy(buf.data() + len, stream.data() + offset, n);
+        len += n;
+        size_t processed = onRecv(nullptr, buf.data(), len);
+        memmove(buf.data(), buf.data() + processed, len - processed);
+        len -= processed;
+    }
+    return len == 0;
+}
+
+template <class _Run>
+static bool runCase(const char *name, const BenchConfig &cfg, uint64_t checksum, _Run run)
+{
+    double best = 0.0;
+    for (int round = 0; round < cfg.rounds; ++round)
+    {
+        memset(handled, 0, sizeof(handled));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = run();
+        double seconds = elapsedSince(start);
+        if (!ok || sumHandled() != checksum)
+        {
+            printf("%-16s wrong: not every message was handled\n", name);
+            return false;
+        }
+        if (round == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    printf("%-16s %8.2f ns/message %10.2f M messages/s\n", name, best * 1e9 / cfg.messages,
+        cfg.messages / best / 1e6);
+    return true;
+}
+
+static void usage()
+{
+    printf("usage: dispatch-bench [-n messages] [-k chunk bytes] [-r rounds]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) cfg.messages = atoi(val);
+        else if (strcmp(opt, "-k") == 0) cfg.chunk = (size_t)atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.rounds = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.messages <= 0 || cfg.chunk == 0 || cfg.rounds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<iocp::FrameView> views;
+    uint64_t checksum = 0;
+    std::vector<char> stream = makeStream(cfg, &views, &checksum);
+    printf("%d messages of 16 IDs, %d-%d bytes of payload, best of %d rounds\n", cfg.messages,
+        MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE, cfg.rounds);
+
+    std::function<size_t (Context *ctx, const char *buf, size_t len)> onRecvSwitch =
+        [](Context *ctx, const char *buf, size_t len)->size_t {
+        return switchMessage(ctx, buf, len) ? len : 0;
+    };
+    std::unordered_map<uint16_t, std::function<void (Context *ctx, const iocp::FrameView &payload)> > handlers;
+#define MAP_HANDLER(id) handlers[id] = onMessage<id>;
+    MESSAGE_IDS(MAP_HANDLER)
+#undef MAP_HANDLER
+
+    bool ok = runCase("switch", cfg, checksum, [&]()->bool {
+        bool all = true;
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            all &= onRecvSwitch(nullptr, views[i].data(), views[i].size()) != 0;
+        }
+        return all;
+    });
+    ok = runCase("map", cfg, checksum, [&]()->bool {
+        bool all = true;
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            const iocp::FrameView &message = views[i];
+            uint16_t id = (uint16_t)(((uint8_t)message[0] << 8) | (uint8_t)message[1]);
+            auto it = handlers.find(id);
+            if (it == handlers.end())
+            {
+                all = false;
+                continue;
+            }
+            it->second(nullptr, iocp::FrameView(message.data() + Router::ID_SIZE, message.size() - Router::ID_SIZE));
+        }
+        return all;
+    }) && ok;
+    ok = runCase("router", cfg, checksum, [&]()->bool {
+        bool all = true;
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            all &= Router::dispatch(nullptr, views[i]);
+        }
+        return all;
+    }) && ok;
+
+    iocp::ServerFramework<>::initialize();
+    {
+        iocp::ServerFramework<> server;
+        iocp::FrameFormat format = iocp::FrameFormat::fixed(4, true, Router::ID_SIZE + MAX_PAYLOAD_SIZE);
+        iocp::ServerFramework<>::RecvCallback framed = server.framed(format,
+            [](Context *ctx, const iocp::Frame &frame) {
+            switchMessage(ctx, frame.body.data(), frame.body.size());
+        });
+        iocp::ServerFramework<>::RecvCallback routed = server.routed<Router>(format);
+
+        ok = runCase("framed + switch", cfg, checksum, [&]() {
+            return feed(stream, cfg.chunk, framed);
+        }) && ok;
+        ok = runCase("routed", cfg, checksum, [&]() {
+            return feed(stream, cfg.chunk, routed);
+        }) && ok;
+    }
+    iocp::ServerFramework<>::uninitialize();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+// The load of the echo benchmarks, for the iocp-test protocol: every packet is a 4-byte big-endian body size
+// followed by the body. Each connection keeps `depth' packets in flight, and sends a new one whenever a whole packet
+// has been echoed back.
+
+#if (defined _WIN32) || (defined WIN32)
+#   define PLATFORM_IS_WINDOWS 1
+#   include <winsock2.h>
+#   include <windows.h>
+#   pragma comment(lib, "ws2_32.lib")
+#   define poll WSAPoll
+#   define close_socket ::closesocket
+#else
+#   define PLATFORM_IS_WINDOWS 0
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <arpa/inet.h>
+#   include <poll.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#   define INVALID_SOCKET (-1)
+#   define SOCKET_ERROR (-1)
+#   define close_socket ::close
+typedef int SOCKET;
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "EchoLoad.h"
+
+struct Connection
+{
+    SOCKET s = INVALID_SOCKET;
+    std::vector<char> sendBuf;  // Pending packets.
+    size_t sendOffset = 0;
+    uint64_t bytesRecv = 0;     // Echoed bytes of the current packet are counted as well.
+    uint64_t packetsRecv = 0;
+};
+
+struct LoadState
+{
+    std::atomic<uint64_t> totalPackets;
+    std::atomic<uint64_t> totalBytes;
+    std::atomic<int> failedConnections;
+    volatile bool shouldQuit;
+
+    LoadState() : totalPackets(0), totalBytes(0), failedConnections(0), shouldQuit(false) { }
+};
+
+static bool setNonBlocking(SOCKET s)
+{
+#if PLATFORM_IS_WINDOWS
+    u_long mode = 1;
+    return ::ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = ::fcntl(s, F_GETFL, 0);
+    return flags != -1 && ::fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+static bool wouldBlock()
+{
+#if PLATFORM_IS_WINDOWS
+    return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static SOCKET connectTo(const EchoLoadConfig &cfg)
+{
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in serverAddr = { 0 };
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = ::inet_addr(cfg.host);
+    serverAddr.sin_port = htons(cfg.port);
+    if (::connect(s, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR)
+    {
+        close_socket(s);
+        return INVALID_SOCKET;
+    }
+
+    int noDelay = 1;
+    ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+    setNonBlocking(s);
+    return s;
+}
+
+static void runConnections(const EchoLoadConfig &cfg, int count, LoadState &state)
+{
+    const size_t packetLen = 4 + (size_t)cfg.bodySize;
+    std::vector<char> packet(packetLen, 'x');
+    packet[0] = (char)((cfg.bodySize >> 24) & 0xFF);
+    packet[1] = (char)((cfg.bodySize >> 16) & 0xFF);
+    packet[2] = (char)((cfg.bodySize >> 8) & 0xFF);
+    packet[3] = (char)(cfg.bodySize & 0xFF);
+
+    std::vector<Connection> conns(count);
+    std::vector<struct pollfd> fds(count);
+    for (int i = 0; i < count; ++i)
+    {
+        conns[i].s = connectTo(cfg);
+        if (conns[i].s == INVALID_SOCKET)
+        {
+            ++state.failedConnections;
+        }
+        else
+        {
+            for (int k = 0; k < cfg.depth; ++k)
+            {
+                conns[i].sendBuf.insert(conns[i].sendBuf.end(), packet.begin(), packet.end());
+            }
+        }
+        fds[i].fd = conns[i].s;
+        fds[i].events = 0;
+        fds[i].revents = 0;
+    }
+
+    std::vector<char> recvBuf(65536);
+    while (!state.shouldQuit)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            Connection &c = conns[i];
+            fds[i].events = (c.s == INVALID_SOCKET) ? 0 : (short)(POLLIN | (c.sendOffset < c.sendBuf.size() ? POLLOUT : 0));
+        }
+
+        int ready = ::poll(&fds[0], (unsigned long)fds.size(), 100);
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            Connection &c = conns[i];
+            if (c.s == INVALID_SOCKET || fds[i].revents == 0)
+            {
+                continue;
+            }
+
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                close_socket(c.s);
+                c.s = INVALID_SOCKET;
+                fds[i].fd = INVALID_SOCKET;
+                continue;
+            }
+
+            if (fds[i].revents & POLLIN)
+            {
+                int ret = ::recv(c.s, &recvBuf[0], (int)recvBuf.size(), 0);
+                if (ret == 0 || (ret == SOCKET_ERROR && !wouldBlock()))
+                {
+                    close_socket(c.s);
+                    c.s = INVALID_SOCKET;
+                    fds[i].fd = INVALID_SOCKET;
+                    continue;
+                }
+
+                if (ret > 0)
+                {
+                    c.bytesRecv += (uint64_t)ret;
+                    state.totalBytes += (uint64_t)ret;
+
+                    // Every packet has the same size, so a packet is complete each time we cross a packet boundary.
+                    uint64_t packets = c.bytesRecv / packetLen;
+                    for (uint64_t n = c.packetsRecv; n < packets; ++n)
+                    {
+                        c.sendBuf.insert(c.sendBuf.end(), packet.begin(), packet.end());
+                    }
+                    state.totalPackets += packets - c.packetsRecv;
+                    c.packetsRecv = packets;
+                }
+            }
+
+            if (c.sendOffset < c.sendBuf.size())
+            {
+                int ret = ::send(c.s, &c.sendBuf[c.sendOffset], (int)(c.sendBuf.size() - c.sendOffset), 0);
+                if (ret > 0)
+                {
+                    c.sendOffset += (size_t)ret;
+                    if (c.sendOffset == c.sendBuf.size())
+                    {
+                        c.sendBuf.clear();
+                        c.sendOffset = 0;
+                    }
+                }
+                else if (ret == SOCKET_ERROR && !wouldBlock())
+                {
+                    close_socket(c.s);
+                    c.s = INVALID_SOCKET;
+                    fds[i].fd = INVALID_SOCKET;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (conns[i].s != INVALID_SOCKET)
+        {
+            close_socket(conns[i].s);
+        }
+    }
+}
+
+EchoLoadResult runEchoLoad(const EchoLoadConfig &cfg, const EchoLoadReporter &reporter)
+{
+    LoadState state;
+    int threadCnt = (cfg.threads > cfg.connections) ? cfg.connections : cfg.threads;
+    std::vector<std::thread *> threads;
+    for (int i = 0; i < threadCnt; ++i)
+    {
+        int count = cfg.connections / threadCnt + (i < cfg.connections % threadCnt ? 1 : 0);
+        threads.push_back(new std::thread([&cfg, count, &state]() { runConnections(cfg, count, state); }));
+    }
+
+    // Report once per second.
+    auto start = std::chrono::steady_clock::now();
+    for (int sec = 1; sec <= cfg.seconds; ++sec)
+    {
+        std::this_thread::sleep_until(start + std::chrono::seconds(sec));
+        if (reporter)
+        {
+            reporter(sec, state.totalPackets, state.totalBytes);
+        }
+    }
+    state.shouldQuit = true;
+
+    EchoLoadResult result;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.packets = state.totalPackets;
+    result.bytes = state.totalBytes;
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+    result.failedConnections = state.failedConnections;
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef _ECHO_LOAD_H_
+#define _ECHO_LOAD_H_
+
+#include <stdint.h>
+#include <functional>
+
+struct EchoLoadConfig
+{
+    const char *host = "127.0.0.1";
+    uint16_t port = 8899;
+    int connections = 16;
+    int bodySize = 64;
+    int depth = 1;
+    int seconds = 10;
+    int threads = 1;
+};
+
+struct EchoLoadResult
+{
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    int failedConnections = 0;
+};
+
+// Called once per second with the running totals.
+typedef std::function<void (int sec, uint64_t packets, uint64_t bytes)> EchoLoadReporter;
+
+// Connects, drives the load for cfg.seconds, and closes all the connections.
+// The sockets must have been initialized (WSAStartup) on Windows.
+EchoLoadResult runEchoLoad(const EchoLoadConfig &cfg, const EchoLoadReporter &reporter);
+
+#endif
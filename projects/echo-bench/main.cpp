@@ -0,0 +1,80 @@
+// Echo throughput benchmark for the iocp-test protocol, see EchoLoad.h.
+//
+// usage: echo-bench [-h host] [-p port] [-c connections] [-s body size] [-d depth] [-t seconds] [-T threads]
+
+#if (defined _WIN32) || (defined WIN32)
+#   include <winsock2.h>
+#   pragma comment(lib, "ws2_32.lib")
+#   define PLATFORM_IS_WINDOWS 1
+#else
+#   define PLATFORM_IS_WINDOWS 0
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "EchoLoad.h"
+
+static void usage()
+{
+    printf("usage: echo-bench [-h host] [-p port] [-c connections] [-s body size] [-d depth] [-t seconds] [-T threads]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    EchoLoadConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-h") == 0) cfg.host = val;
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.bodySize = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-T") == 0) cfg.threads = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.connections <= 0 || cfg.bodySize < 0 || cfg.depth <= 0 || cfg.seconds <= 0 || cfg.threads <= 0)
+    {
+        usage();
+        return 1;
+    }
+    if (cfg.threads > cfg.connections)
+    {
+        cfg.threads = cfg.connections;
+    }
+
+#if PLATFORM_IS_WINDOWS
+    WSADATA data;
+    ::WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+
+    printf("%s:%hu, %d connections, %d threads, body %d bytes, depth %d, %d seconds\n",
+        cfg.host, cfg.port, cfg.connections, cfg.threads, cfg.bodySize, cfg.depth, cfg.seconds);
+
+    uint64_t lastPackets = 0, lastBytes = 0;
+    EchoLoadResult result = runEchoLoad(cfg, [&lastPackets, &lastBytes](int sec, uint64_t packets, uint64_t bytes) {
+        printf("[%3d] %10llu packets/s %10.2f MB/s\n", sec,
+            (unsigned long long)(packets - lastPackets), (double)(bytes - lastBytes) / (1024.0 * 1024.0));
+        lastPackets = packets;
+        lastBytes = bytes;
+    });
+
+    printf("total: %llu packets in %.2f s, %.0f packets/s, %.2f MB/s, %d connections failed\n",
+        (unsigned long long)result.packets, result.seconds,
+        (double)result.packets / result.seconds, (double)result.bytes / result.seconds / (1024.0 * 1024.0),
+        result.failedConnections);
+
+#if PLATFORM_IS_WINDOWS
+    ::WSACleanup();
+#endif
+
+    return 0;
+}
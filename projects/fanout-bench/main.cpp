@@ -0,0 +1,282 @@
+// One-to-many fan-out benchmark.
+//
+// Runs a server in process with N client connections, and broadcasts one payload to all of them over and over,
+// keeping up to `window' broadcasts unread by the clients. Three ways to fan out are compared:
+//   copy   - postSend(id, buf, len) per connection, every send chain gets its own copy
+//   shared - broadcast(payload, ids, count), every send chain refers to the same SendBuffer
+//   group  - broadcast("all", payload) to a named group
+// For each one it reports broadcasts/s, the bytes delivered, and the peak memory held by the send chains
+// (SendBuffer::totalBytes), which is O(payload x recipients) for copy and O(payload) for the others.
+//
+// usage: fanout-bench [-p port] [-c connections] [-s payload size] [-w window] [-t seconds] [-T client threads]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define poll WSAPoll
+#   define close_socket ::closesocket
+#else
+#   include <poll.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+struct FanoutConfig
+{
+    uint16_t port = 8899;
+    int connections = 500;
+    int payloadSize = 512;
+    int window = 4;
+    int seconds = 3;
+    int threads = 2;
+};
+
+enum class FANOUT_MODE { COPY, SHARED, GROUP };
+
+static bool setNonBlocking(SOCKET s)
+{
+#if PLATFORM_IS_WINDOWS
+    u_long mode = 1;
+    return ::ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = ::fcntl(s, F_GETFL, 0);
+    return flags != -1 && ::fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+static SOCKET connectTo(uint16_t port)
+{
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        close_socket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// Reads and drops everything sent to the sockets, counting the bytes.
+static void drainSockets(std::vector<SOCKET> sockets, std::atomic<uint64_t> *received, volatile bool *shouldQuit)
+{
+    std::vector<struct pollfd> fds(sockets.size());
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        fds[i].fd = sockets[i];
+        fds[i].events = POLLIN;
+    }
+
+    char buf[65536];
+    while (!*shouldQuit)
+    {
+        int cnt = ::poll(&fds[0], (unsigned long)fds.size(), 100);
+        if (cnt <= 0)
+        {
+            continue;
+        }
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            for (;;)
+            {
+                int ret = (int)::recv(fds[i].fd, buf, sizeof(buf), 0);
+                if (ret <= 0)
+                {
+                    break;
+                }
+                bytes += (uint64_t)ret;
+            }
+        }
+        *received += bytes;
+    }
+}
+
+static void runFanout(FANOUT_MODE mode, const char *name, const FanoutConfig &cfg)
+{
+    iocp::mutex idMutex;
+    std::vector<iocp::ConnectionId> ids;
+
+    // Every client says hello once, so the server learns the IDs.
+    iocp::ServerFramework<> server;
+    bool started = server.startup("127.0.0.1", cfg.port,
+        [&](iocp::ClientContext<> *ctx, const char *, size_t len)->size_t {
+            idMutex.lock();
+            ids.push_back(ctx->getId());
+            idMutex.unlock();
+            server.joinGroup("all", ctx->getId());
+            return len;
+        },
+        [](iocp::ClientContext<> *) { });
+    if (!started)
+    {
+        printf("%-8s startup failed\n", name);
+        return;
+    }
+
+    std::vector<SOCKET> sockets;
+    for (int i = 0; i < cfg.connections; ++i)
+    {
+        SOCKET s = connectTo(cfg.port);
+        if (s == INVALID_SOCKET)
+        {
+            break;
+        }
+        ::send(s, "!", 1, 0);
+        setNonBlocking(s);
+        sockets.push_back(s);
+    }
+    for (int i = 0; i < 500; ++i)
+    {
+        idMutex.lock();
+        size_t n = ids.size();
+        idMutex.unlock();
+        if (n >= sockets.size())
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    idMutex.lock();
+    std::vector<iocp::ConnectionId> recipients(ids);
+    idMutex.unlock();
+
+    volatile bool shouldQuit = false;
+    std::atomic<uint64_t> received(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < cfg.threads; ++t)
+    {
+        std::vector<SOCKET> part;
+        for (size_t i = t; i < sockets.size(); i += cfg.threads)
+        {
+            part.push_back(sockets[i]);
+        }
+        readers.push_back(std::thread(drainSockets, part, &received, &shouldQuit));
+    }
+
+    size_t baseline = iocp::SendBuffer::totalBytes();
+    std::vector<char> payload(cfg.payloadSize, 'x');
+    iocp::SendBufferRef shared(mode != FANOUT_MODE::COPY ? iocp::SendBuffer::create(&payload[0], payload.size()) : nullptr);
+    uint64_t perBroadcast = (uint64_t)payload.size() * recipients.size();
+    size_t peak = 0;
+    uint64_t broadcasts = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::seconds(cfg.seconds);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        switch (mode)
+        {
+        case FANOUT_MODE::COPY:
+            for (size_t i = 0; i < recipients.size(); ++i)
+            {
+                server.postSend(recipients[i], &payload[0], payload.size());
+            }
+            break;
+        case FANOUT_MODE::SHARED:
+            server.broadcast(shared, &recipients[0], recipients.size());
+            break;
+        case FANOUT_MODE::GROUP:
+            server.broadcast("all", shared);
+            break;
+        }
+        ++broadcasts;
+
+        size_t held = iocp::SendBuffer::totalBytes() - baseline;
+        peak = held > peak ? held : peak;
+
+        // Keep at most `window' broadcasts unread.
+        while (broadcasts > (uint64_t)cfg.window && received < (broadcasts - cfg.window) * perBroadcast)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    shouldQuit = true;
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        readers[i].join();
+    }
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        close_socket(sockets[i]);
+    }
+    server.shutdown();
+
+    printf("%-8s %12.0f %12.2f %14.2f %14.1f\n", name,
+        (double)broadcasts / elapsed, (double)received / elapsed / 1024 / 1024, (double)peak / 1024 / 1024,
+        (double)peak / (payload.size() > 0 ? payload.size() : 1));
+}
+
+static void usage()
+{
+    printf("usage: fanout-bench [-p port] [-c connections] [-s payload size] [-w window] [-t seconds] [-T client threads]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    FanoutConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.payloadSize = atoi(val);
+        else if (strcmp(opt, "-w") == 0) cfg.window = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-T") == 0) cfg.threads = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.connections <= 0 || cfg.payloadSize <= 0 || cfg.window <= 0 || cfg.seconds <= 0 || cfg.threads <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    iocp::ServerFramework<>::initialize();
+
+    printf("%d connections, payload %d bytes, window %d, %d seconds per run\n",
+        cfg.connections, cfg.payloadSize, cfg.window, cfg.seconds);
+    printf("%-8s %12s %12s %14s %14s\n", "mode", "broadcasts/s", "MB/s", "peak held MB", "peak/payload");
+
+    // Every run listens on its own port, so the connections lingering from the last run don't matter.
+    runFanout(FANOUT_MODE::COPY, "copy", cfg);
+    ++cfg.port;
+    runFanout(FANOUT_MODE::SHARED, "shared", cfg);
+    ++cfg.port;
+    runFanout(FANOUT_MODE::GROUP, "group", cfg);
+
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
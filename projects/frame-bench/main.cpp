@@ -0,0 +1,244 @@
+// Frame decoding benchmark.
+//
+// Encodes N frames of random body sizes into one stream and decodes it as the completions hand it out: in chunks of
+// K bytes appended to a receive buffer, the whole frames decoded out of it and the partial one at the end moved to
+// the front for the next chunk. Every format of FrameDecoder runs, against the hand-written parse of the 4-byte
+// big-endian size which the applications used to copy (MAKE_BODY_SIZE). It reports the frames/s, the MB/s and the
+// nanoseconds per frame, and checks that every frame came out with the size it was encoded with. It checks first
+// that the fixed widths outside 1 to 8 are refused.
+//
+// usage: frame-bench [-n frames] [-s min body[-max body]] [-k chunk bytes] [-r rounds]
+
+#include "iocp/FrameCodec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#define MAKE_BODY_SIZE(a0, a1, a2, a3) ((((uint32_t)(uint8_t)(a0)) << 24) | ((uint32_t)(uint8_t)(a1) << 16) | ((uint32_t)(uint8_t)(a2) << 8) | ((uint32_t)(uint8_t)(a3)))
+
+struct BenchConfig
+{
+    int frames = 1000000;
+    size_t minBody = 16;
+    size_t maxBody = 256;
+    size_t chunk = 4096;
+    int rounds = 5;
+};
+
+struct BenchResult
+{
+    uint64_t frames;
+    uint64_t checksum;  // The sum of the body sizes, and of a byte of every body.
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The body sizes of the stream, and the checksum which every decoder must get out of it.
+static std::vector<size_t> makeSizes(const BenchConfig &cfg, uint64_t *checksum)
+{
+    std::mt19937_64 rng(20201017);
+    std::uniform_int_distribution<size_t> dist(cfg.minBody, cfg.maxBody);
+    std::vector<size_t> sizes((size_t)cfg.frames);
+    *checksum = 0;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        sizes[i] = dist(rng);
+        *checksum += sizes[i] + (sizes[i] > 0 ? (uint8_t)i : 0);
+    }
+    return sizes;
+}
+
+// The body of the i-th frame is filled with (uint8_t)i.
+static std::vector<char> encodeStream(const iocp::FrameDecoder &decoder, const std::vector<size_t> &sizes)
+{
+    std::vector<char> stream;
+    char header[iocp::FrameDecoder::MAX_HEADER_SIZE];
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        size_t headerSize = decoder.encodeHeader(sizes[i], header);
+        stream.insert(stream.end(), header, header + headerSize);
+        stream.insert(stream.end(), sizes[i], (char)(uint8_t)i);
+    }
+    return stream;
+}
+
+// Feeds the stream to parse(buf, len, &result) in chunks, as the receive buffer of a connection: parse returns the
+// bytes of the whole frames, the rest is kept for the next chunk.
+template <class Parse>
+static BenchResult feed(const std::vector<char> &stream, size_t chunk, Parse parse)
+{
+    BenchResult result = { 0, 0 };
+    std::vector<char> buf;
+    buf.reserve(chunk * 2);
+    size_t len = 0;
+    for (size_t offset = 0; offset < stream.size(); offset += chunk)
+    {
+        size_t n = stream.size() - offset < chunk ? stream.size() - offset : chunk;
+        if (buf.size() < len + n)
+        {
+            buf.resize(len + n);
+        }
+        memcpy(buf.data() + len, stream.data() + offset, n);
+        len += n;
+
+        size_t processed = parse(buf.data(), len, &result);
+        if (processed > 0)
+        {
+            memmove(buf.data(), buf.data() + processed, len - processed);
+            len -= processed;
+        }
+    }
+    return result;
+}
+
+static BenchResult decodeWithCodec(const iocp::FrameDecoder &decoder, const std::vector<char> &stream, size_t chunk)
+{
+    return feed(stream, chunk, [&decoder](const char *buf, size_t len, BenchResult *result)->size_t {
+        iocp::FrameDecoder::Result ret;
+        return decoder.decodeAll(buf, len, [result](const iocp::Frame &frame)->bool {
+            ++result->frames;
+            result->checksum += frame.body.size() + (frame.body.empty() ? 0 : (uint8_t)frame.body[0]);
+            return true;
+        }, &ret);
+    });
+}
+
+// The parse of iocp-test and ClientConnection before the codec.
+static BenchResult decodeByHand(const std::vector<char> &stream, size_t chunk)
+{
+    return feed(stream, chunk, [](const char *buf, size_t len, BenchResult *result)->size_t {
+        size_t processed = 0;
+        while (len - processed >= 4)
+        {
+            const char *p = buf + processed;
+            size_t bodySize = MAKE_BODY_SIZE(p[0], p[1], p[2], p[3]);
+            size_t packetLen = bodySize + 4;
+            if (packetLen > len - processed)
+            {
+                break;
+            }
+            ++result->frames;
+            result->checksum += bodySize + (bodySize > 0 ? (uint8_t)p[4] : 0);
+            processed += packetLen;
+        }
+        return processed;
+    });
+}
+
+template <class Run>
+static bool runCase(const char *name, const BenchConfig &cfg, size_t streamSize, uint64_t checksum, Run run)
+{
+    double best = 0.0;
+    for (int round = 0; round < cfg.rounds; ++round)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        BenchResult result = run();
+        double seconds = elapsedSince(start);
+        if (result.frames != (uint64_t)cfg.frames || result.checksum != checksum)
+        {
+            printf("%-16s wrong frames: %llu of %d, checksum %llu of %llu\n", name, (unsigned long long)result.frames,
+                cfg.frames, (unsigned long long)result.checksum, (unsigned long long)checksum);
+            return false;
+        }
+        if (round == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    printf("%-16s %10.2f M frames/s %9.1f MB/s %8.1f ns/frame\n", name, cfg.frames / best / 1e6,
+        streamSize / best / (1024.0 * 1024.0), best * 1e9 / cfg.frames);
+    return true;
+}
+
+// A fixed header of 0 bytes would decode empty frames forever, and one over 8 bytes would overflow the size.
+static bool checkInvalidWidths()
+{
+    static const unsigned widths[] = { 0, 9, 16, UINT32_MAX };
+    char buf[iocp::FrameDecoder::MAX_HEADER_SIZE + 16] = { 0 };
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i)
+    {
+        iocp::FrameDecoder decoder(iocp::FrameFormat::fixed(widths[i], true, 65535));
+        iocp::FrameDecoder::Result result = iocp::FrameDecoder::FRAME;
+        size_t frames = 0;
+        decoder.decodeAll(buf, sizeof(buf), [&](const iocp::Frame &) { return ++frames < 2; }, &result);
+        if (decoder.getFormat().valid() || frames != 0 || result != iocp::FrameDecoder::MALFORMED
+            || decoder.encodeHeader(0, buf) != 0)
+        {
+            printf("fixed width %u not refused\n", widths[i]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void usage()
+{
+    printf("usage: frame-bench [-n frames] [-s min body[-max body]] [-k chunk bytes] [-r rounds]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) cfg.frames = atoi(val);
+        else if (strcmp(opt, "-s") == 0)
+        {
+            cfg.minBody = cfg.maxBody = (size_t)atoi(val);
+            const char *dash = strchr(val, '-');
+            if (dash != nullptr) cfg.maxBody = (size_t)atoi(dash + 1);
+        }
+        else if (strcmp(opt, "-k") == 0) cfg.chunk = (size_t)atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.rounds = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    // The 2-byte header holds up to 65535.
+    if ((argc & 1) == 0 || cfg.frames <= 0 || cfg.minBody > cfg.maxBody || cfg.maxBody > 65535 || cfg.chunk == 0
+        || cfg.rounds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    uint64_t checksum = 0;
+    std::vector<size_t> sizes = makeSizes(cfg, &checksum);
+    printf("%d frames of %lu-%lu bytes, in chunks of %lu bytes, best of %d rounds\n", cfg.frames,
+        (unsigned long)cfg.minBody, (unsigned long)cfg.maxBody, (unsigned long)cfg.chunk, cfg.rounds);
+
+    iocp::FrameDecoder fixed4(iocp::FrameFormat::fixed(4, true, cfg.maxBody));
+    iocp::FrameDecoder fixed2(iocp::FrameFormat::fixed(2, false, cfg.maxBody));
+    iocp::FrameDecoder varint(iocp::FrameFormat::varint(cfg.maxBody));
+    std::vector<char> stream4 = encodeStream(fixed4, sizes);
+    std::vector<char> stream2 = encodeStream(fixed2, sizes);
+    std::vector<char> streamVarint = encodeStream(varint, sizes);
+
+    bool ok = checkInvalidWidths();
+    ok = runCase("by hand, 4 BE", cfg, stream4.size(), checksum, [&]() {
+        return decodeByHand(stream4, cfg.chunk);
+    }) && ok;
+    ok = runCase("fixed 4 BE", cfg, stream4.size(), checksum, [&]() {
+        return decodeWithCodec(fixed4, stream4, cfg.chunk);
+    }) && ok;
+    ok = runCase("fixed 2 LE", cfg, stream2.size(), checksum, [&]() {
+        return decodeWithCodec(fixed2, stream2, cfg.chunk);
+    }) && ok;
+    ok = runCase("varint", cfg, streamVarint.size(), checksum, [&]() {
+        return decodeWithCodec(varint, streamVarint, cfg.chunk);
+    }) && ok;
+    return ok ? 0 : 1;
+}
@@ -1,7 +1,18 @@
-#include <windows.h>
+#include "PlatformConfig.h"
+#if PLATFORM_IS_WINDOWS
+#   include <windows.h>
+#endif
 #include <stdio.h>
+#include <stdarg.h>
 #include "DebugLog.h"
 
+#if !PLATFORM_IS_WINDOWS
+// There is no debugger output window on Linux, so it goes to stderr instead.
+#   define OutputDebugStringA(str) fputs((str), stderr)
+#   define _snprintf snprintf
+#   define _vsnprintf_s(buf, size, count, fmt, args) vsnprintf((buf), (size), (fmt), (args))
+#endif
+
 namespace debug {
     void printfToConsole(const char *tag, const char *fmt, ...)
     {
@@ -12,13 +23,13 @@ namespace debug {
         va_end(args);
     }
 
-    void printfToWindow(const char *tag, char *fmt, ...)
+    void printfToWindow(const char *tag, const char *fmt, ...)
     {
         char buf[1024];
         int n = _snprintf(buf, 1024, "[%s] ", tag);
         va_list args;
         va_start(args, fmt);
-        int ret = _vsnprintf_s(buf + n, 1024 - n, 1024 - n, fmt, args);
+        _vsnprintf_s(buf + n, 1024 - n, 1024 - n, fmt, args);
         OutputDebugStringA(buf);
         OutputDebugStringA("\n");
         va_end(args);
@@ -30,7 +41,7 @@ namespace debug {
         int n = _snprintf(buf, 1024, "[%s] ", tag);
         va_list args;
         va_start(args, fmt);
-        int ret = _vsnprintf_s(buf + n, 1024 - n, 1024 - n, fmt, args);
+        _vsnprintf_s(buf + n, 1024 - n, 1024 - n, fmt, args);
         OutputDebugStringA(buf);
         OutputDebugStringA("\n");
         puts(buf);
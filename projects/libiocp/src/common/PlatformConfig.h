@@ -0,0 +1,36 @@
+#ifndef _PLATFORM_CONFIG_H_
+#define _PLATFORM_CONFIG_H_
+
+#if (defined _WIN32) || (defined WIN32)
+#   define PLATFORM_IS_WINDOWS 1
+#else
+#   define PLATFORM_IS_WINDOWS 0
+#endif
+
+// The IO engine behind ServerFramework is selected at build time.
+// Define IOCP_BACKEND in the project's preprocessor definitions to override the platform default.
+#define IOCP_BACKEND_IOCP 1
+#define IOCP_BACKEND_EPOLL 2
+#define IOCP_BACKEND_IO_URING 3
+
+#ifndef IOCP_BACKEND
+#   if PLATFORM_IS_WINDOWS
+#       define IOCP_BACKEND IOCP_BACKEND_IOCP
+#   else
+#       define IOCP_BACKEND IOCP_BACKEND_EPOLL
+#   endif
+#endif
+
+#if (IOCP_BACKEND == IOCP_BACKEND_IOCP) && !PLATFORM_IS_WINDOWS
+#   error "IOCP backend is only available on Windows"
+#endif
+
+#if (IOCP_BACKEND == IOCP_BACKEND_EPOLL) && PLATFORM_IS_WINDOWS
+#   error "epoll backend is only available on Linux"
+#endif
+
+#if (IOCP_BACKEND == IOCP_BACKEND_IO_URING) && PLATFORM_IS_WINDOWS
+#   error "io_uring backend is only available on Linux"
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+#include "ServerFrameworkImpl.h"
+#include "ImplMacros.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define COMPUTE_THREAD_LOCAL __declspec(thread)
+#else
+#   define COMPUTE_THREAD_LOCAL __thread
+#endif
+
+namespace iocp {
+    namespace {
+        // The pool whose thread the calling thread is, and its index there.
+        COMPUTE_THREAD_LOCAL ComputePool *t_pool = nullptr;
+        COMPUTE_THREAD_LOCAL unsigned t_index = 0;
+    }
+
+    ComputePool::ComputePool()
+        : _workers(nullptr)
+        , _workerCount(0)
+        , _stopping(false)
+        , _nextWorker(0)
+        , _queued(0)
+        , _sleeping(0)
+    {
+    }
+
+    ComputePool::~ComputePool()
+    {
+        stop();
+    }
+
+    bool ComputePool::start(unsigned threadCount)
+    {
+        if (_workers != nullptr)
+        {
+            return false;
+        }
+        if (threadCount == 0)
+        {
+            threadCount = std::thread::hardware_concurrency();
+            if (threadCount == 0)
+            {
+                threadCount = 1;
+            }
+        }
+
+        _workers = new (std::nothrow) _Worker[threadCount];
+        if (_workers == nullptr)
+        {
+            LOG_ERROR("new compute workers out of memory!");
+            return false;
+        }
+        _stopping = false;
+        _queued = 0;
+
+        // Every thread may steal from the others as soon as it starts, so they all exist before.
+        _workerCount = threadCount;
+        for (unsigned i = 0; i < threadCount; ++i)
+        {
+            std::thread *t = new (std::nothrow) std::thread([this, i]() { threadProc(i); });
+            if (t == nullptr)
+            {
+                LOG_ERROR("new std::thread out of memory!");
+                stop();
+                return false;
+            }
+            _workers[i].thread = t;
+        }
+        return true;
+    }
+
+    void ComputePool::stop()
+    {
+        if (_workers == nullptr)
+        {
+            return;
+        }
+
+        _sleepMutex.lock();
+        _stopping = true;
+        _sleepMutex.unlock();
+        _wakeup.notify_all();
+
+        for (unsigned i = 0; i < _workerCount; ++i)
+        {
+            if (_workers[i].thread != nullptr)
+            {
+                _workers[i].thread->join();
+                delete _workers[i].thread;
+            }
+        }
+        delete[] _workers;  // With the tasks never run.
+        _workers = nullptr;
+        _workerCount = 0;
+    }
+
+    bool ComputePool::submit(const ComputeTask &task)
+    {
+        if (!running())
+        {
+            return false;
+        }
+
+        // A pool thread keeps its own tasks, the others spread theirs.
+        unsigned index = t_pool == this ? t_index : _nextWorker.fetch_add(1, std::memory_order_relaxed) % _workerCount;
+        _Worker *worker = &_workers[index];
+        worker->mutex.lock();
+        TRY_BLOCK_BEGIN
+        worker->queue.push_back(task);
+        CATCH_EXCEPTIONS
+        worker->mutex.unlock();
+        return false;
+        CATCH_BLOCK_END
+        worker->mutex.unlock();
+
+        // Counted before looking for the sleepers, and the sleepers count themselves before looking at the count,
+        // so either a sleeper is woken up, or it finds the task before sleeping.
+        _queued.fetch_add(1, std::memory_order_seq_cst);
+        if (_sleeping.load(std::memory_order_seq_cst) > 0)
+        {
+            _sleepMutex.lock();
+            _sleepMutex.unlock();
+            _wakeup.notify_one();
+        }
+        return true;
+    }
+
+    ComputePoolStats ComputePool::getStats() const
+    {
+        ComputePoolStats stats = { 0, 0 };
+        for (unsigned i = 0; i < _workerCount; ++i)
+        {
+            stats.tasks += _workers[i].tasks.load(std::memory_order_relaxed);
+            stats.steals += _workers[i].steals.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    bool ComputePool::popLocal(_Worker *worker, ComputeTask &task)
+    {
+        worker->mutex.lock();
+        bool ret = !worker->queue.empty();
+        if (ret)
+        {
+            task.swap(worker->queue.back());
+            worker->queue.pop_back();
+        }
+        worker->mutex.unlock();
+        return ret;
+    }
+
+    bool ComputePool::steal(unsigned thief, ComputeTask &task)
+    {
+        // Start from the next one, so the thieves don't all go for the same deque.
+        for (unsigned i = 1; i < _workerCount; ++i)
+        {
+            _Worker *victim = &_workers[(thief + i) % _workerCount];
+            if (!victim->mutex.try_lock())
+            {
+                continue;  // Busy, there may be more to take elsewhere.
+            }
+            bool ret = !victim->queue.empty();
+            if (ret)
+            {
+                task.swap(victim->queue.front());
+                victim->queue.pop_front();
+            }
+            victim->mutex.unlock();
+            if (ret)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void ComputePool::threadProc(unsigned index)
+    {
+        t_pool = this;
+        t_index = index;
+        _Worker *self = &_workers[index];
+        ComputeTask task;
+
+        while (!_stopping)
+        {
+            bool stolen = false;
+            if (!popLocal(self, task))
+            {
+                stolen = steal(index, task);
+            }
+
+            if (task)
+            {
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                TRY_BLOCK_BEGIN
+                task();
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+                task = nullptr;
+                self->tasks.fetch_add(1, std::memory_order_relaxed);
+                if (stolen)
+                {
+                    self->steals.fetch_add(1, std::memory_order_relaxed);
+                }
+                continue;
+            }
+
+            // Nothing to run. A task queued to a busy deque which try_lock skipped is seen by the count.
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _sleeping.fetch_add(1, std::memory_order_seq_cst);
+            while (!_stopping && _queued.load(std::memory_order_seq_cst) == 0)
+            {
+                _wakeup.wait(lock);
+            }
+            _sleeping.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        t_pool = nullptr;
+    }
+}  // end of namespace iocp
@@ -0,0 +1,89 @@
+#ifndef _COMPUTE_POOL_H_
+#define _COMPUTE_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "MemoryPool.h"
+
+namespace iocp {
+    typedef std::function<void ()> ComputeTask;
+
+    struct ComputePoolStats
+    {
+        uint64_t tasks;  // Tasks run.
+        uint64_t steals;  // Tasks run by another thread than the one they were queued to.
+    };
+
+    // A work-stealing pool of threads for the CPU-heavy work, so it never blocks the IO worker threads.
+    // Defined in ComputePool.cpp.
+    //
+    // Every thread has its own deque of tasks. A task submitted by a pool thread goes to the back of its own deque,
+    // and the thread pops from the back, the newest first while its data is still in the cache. A thread which runs
+    // out of tasks steals the oldest one from the front of another's deque, so a burst spreads over all the threads.
+    // The other threads, e.g. the IO worker threads, submit to the deques round robin. A thread which finds nothing
+    // to run or steal sleeps until a task is submitted.
+    //
+    // The tasks run in no particular order, see _ClientContext::compute for the tasks of a connection in order.
+    class ComputePool
+    {
+    public:
+        ComputePool();
+        ~ComputePool();
+
+        // Starts threadCount threads, 0 for one per core. Returns false if it's running, or out of memory.
+        bool start(unsigned threadCount);
+
+        // Waits for the tasks running, and drops the ones still queued.
+        void stop();
+
+        bool running() const { return _workerCount > 0 && !_stopping; }
+        unsigned getThreadCount() const { return _workerCount; }
+
+        // From any thread. Returns false if the pool is not running, or out of memory.
+        bool submit(const ComputeTask &task);
+
+        ComputePoolStats getStats() const;
+
+    private:
+        struct _Worker
+        {
+            _Worker() : thread(nullptr), tasks(0), steals(0) { }
+
+            std::mutex mutex;  // Taken by the owner and the thieves, held only to push or pop a task.
+            std::deque<ComputeTask, mp::Allocator<ComputeTask> > queue;
+            std::thread *thread;
+            std::atomic<uint64_t> tasks;
+            std::atomic<uint64_t> steals;
+        };
+
+        void threadProc(unsigned index);
+        bool popLocal(_Worker *worker, ComputeTask &task);
+        bool steal(unsigned thief, ComputeTask &task);
+
+    private:
+        _Worker *_workers;
+        unsigned _workerCount;
+        volatile bool _stopping;
+        std::atomic<unsigned> _nextWorker;  // The deque the next task from outside goes to.
+
+        // The threads with nothing to do sleep until a task is queued.
+        std::atomic<size_t> _queued;
+        std::atomic<unsigned> _sleeping;
+        std::mutex _sleepMutex;
+        std::condition_variable _wakeup;
+
+    private:
+        ComputePool(const ComputePool &) = delete;
+        ComputePool(ComputePool &&) = delete;
+        ComputePool &operator=(const ComputePool &) = delete;
+        ComputePool &operator=(ComputePool &&) = delete;
+    };
+}  // end of namespace iocp
+
+#endif
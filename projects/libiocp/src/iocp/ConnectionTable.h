@@ -0,0 +1,293 @@
+#ifndef _CONNECTION_TABLE_H_
+#define _CONNECTION_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+
+namespace iocp {
+    // Identifies a connection for its lifetime, and is never reused by the later ones. 0 is never a valid ID.
+    typedef uint64_t ConnectionId;
+
+    // A registry of connections in a slot array, addressed by generation-tagged IDs.
+    //
+    // The lower 32 bits of an ID is the slot index plus 1, and the upper 32 bits is the generation of the slot,
+    // which is bumped every time the slot is freed, so the ID of a gone connection never matches a new one.
+    // insert, remove, acquire and release are lock-free, and a lookup is O(1).
+    //
+    // An object is never deleted by the table. remove and release tell the caller to delete it, when the connection
+    // has been removed and no one holds it by acquire any more.
+    //
+    // The slots are allocated in chunks which are never freed before the table, so a stale ID always points to
+    // readable memory.
+    template <class _T> class ConnectionTable
+    {
+    public:
+        ConnectionTable()
+        {
+            for (size_t i = 0; i < MAX_CHUNKS; ++i)
+            {
+                _chunks[i].store(nullptr, std::memory_order_relaxed);
+            }
+            _slotCount.store(0, std::memory_order_relaxed);
+            _freeHead.store(0, std::memory_order_relaxed);
+            _size.store(0, std::memory_order_relaxed);
+        }
+
+        ~ConnectionTable()
+        {
+            for (size_t i = 0; i < MAX_CHUNKS; ++i)
+            {
+                delete[] _chunks[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        // Returns 0 if the table is full or out of memory.
+        ConnectionId insert(_T *obj)
+        {
+            uint32_t index = 0;
+            _Slot *slot = popFreeSlot(&index);
+            if (slot == nullptr)
+            {
+                slot = newSlot(&index);
+                if (slot == nullptr)
+                {
+                    return 0;
+                }
+            }
+
+            // Only the owner of a free slot writes it, the others just fail to acquire it.
+            uint64_t generation = slot->state.load(std::memory_order_relaxed) >> 32;
+            slot->obj.store(obj, std::memory_order_relaxed);
+            slot->state.store((generation << 32) | STATE_ALIVE, std::memory_order_release);
+            _size.fetch_add(1, std::memory_order_relaxed);
+            return (generation << 32) | ((uint64_t)index + 1);
+        }
+
+        // Marks the connection gone, no one can acquire it since now.
+        // Returns true if the caller should delete the object now. Otherwise the object is still acquired by others,
+        // and the last release returns true instead.
+        bool remove(ConnectionId id)
+        {
+            _Slot *slot = slotOf(id);
+            if (slot == nullptr)
+            {
+                return false;
+            }
+
+            uint64_t state = slot->state.load(std::memory_order_acquire);
+            do
+            {
+                if ((state >> 32) != (id >> 32) || (state & STATE_ALIVE) == 0)
+                {
+                    return false;  // Removed already.
+                }
+            } while (!slot->state.compare_exchange_weak(state, state & ~(uint64_t)STATE_ALIVE, std::memory_order_acq_rel, std::memory_order_acquire));
+
+            _size.fetch_sub(1, std::memory_order_relaxed);
+            if ((state & STATE_REFS_MASK) != 0)
+            {
+                return false;
+            }
+            freeSlot(slot, (uint32_t)id - 1);
+            return true;
+        }
+
+        // Returns the object and holds it until release, or nullptr if the connection has gone.
+        // The object won't be deleted while held, even if the connection is removed meanwhile.
+        _T *acquire(ConnectionId id)
+        {
+            _Slot *slot = slotOf(id);
+            if (slot == nullptr)
+            {
+                return nullptr;
+            }
+
+            uint64_t state = slot->state.load(std::memory_order_acquire);
+            do
+            {
+                if ((state >> 32) != (id >> 32) || (state & STATE_ALIVE) == 0)
+                {
+                    return nullptr;
+                }
+            } while (!slot->state.compare_exchange_weak(state, state + STATE_REF, std::memory_order_acq_rel, std::memory_order_acquire));
+            return slot->obj.load(std::memory_order_relaxed);
+        }
+
+        // Adds a hold to an object known not to be deleted, e.g. held by the caller, even if the connection has been
+        // removed. It's dropped by release.
+        void retain(ConnectionId id)
+        {
+            slotOf(id)->state.fetch_add(STATE_REF, std::memory_order_relaxed);
+        }
+
+        // Drops a hold of acquire or retain. Returns true if the connection has been removed and the caller should delete
+        // the object now.
+        bool release(ConnectionId id)
+        {
+            _Slot *slot = slotOf(id);
+            uint64_t state = slot->state.fetch_sub(STATE_REF, std::memory_order_acq_rel) - STATE_REF;
+            if ((state & (STATE_ALIVE | STATE_REFS_MASK)) != 0)
+            {
+                return false;
+            }
+            freeSlot(slot, (uint32_t)id - 1);
+            return true;
+        }
+
+        size_t size() const { return _size.load(std::memory_order_relaxed); }
+
+        // Calls func with every object not deleted yet and empties the table.
+        // It's not thread safe, nothing else may touch the table meanwhile. The IDs given before stay invalid.
+        template <class _Func> void clear(_Func func)
+        {
+            uint32_t slotCount = _slotCount.load(std::memory_order_relaxed);
+            if (slotCount > MAX_CHUNKS * CHUNK_SIZE)
+            {
+                slotCount = MAX_CHUNKS * CHUNK_SIZE;
+            }
+            for (uint32_t i = 0; i < slotCount; ++i)
+            {
+                _Slot *slot = slotAt(i);
+                uint64_t state = slot->state.load(std::memory_order_relaxed);
+                if ((state & (STATE_ALIVE | STATE_REFS_MASK)) != 0)
+                {
+                    func(slot->obj.load(std::memory_order_relaxed));
+                    slot->state.store(((state >> 32) + 1) << 32, std::memory_order_relaxed);
+                }
+                slot->obj.store(nullptr, std::memory_order_relaxed);
+                slot->next.store(i + 2 <= slotCount ? i + 2 : 0, std::memory_order_relaxed);  // Chain all the slots.
+            }
+            _freeHead.store(slotCount > 0 ? 1 : 0, std::memory_order_relaxed);
+            _slotCount.store(slotCount, std::memory_order_relaxed);
+            _size.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        enum : uint32_t
+        {
+            CHUNK_SHIFT = 12,
+            CHUNK_SIZE = 1U << CHUNK_SHIFT,
+            MAX_CHUNKS = 1024,  // Up to 4M connections.
+        };
+
+        // The lower 32 bits of the state: the alive flag, and the count of holds by acquire.
+        enum : uint64_t
+        {
+            STATE_ALIVE = 1,
+            STATE_REF = 2,
+            STATE_REFS_MASK = 0xFFFFFFFEULL,
+        };
+
+        struct _Slot
+        {
+            std::atomic<uint64_t> state;  // generation << 32 | refs << 1 | alive
+            std::atomic<_T *> obj;
+            std::atomic<uint32_t> next;  // The next free slot index plus 1.
+        };
+
+        _Slot *slotAt(uint32_t index) const
+        {
+            return _chunks[index >> CHUNK_SHIFT].load(std::memory_order_acquire) + (index & (CHUNK_SIZE - 1));
+        }
+
+        _Slot *slotOf(ConnectionId id) const
+        {
+            uint32_t index = (uint32_t)id - 1;  // The ID 0 wraps to an index never reached.
+            if (index >= _slotCount.load(std::memory_order_acquire) || index >= MAX_CHUNKS * CHUNK_SIZE)
+            {
+                return nullptr;
+            }
+            _Slot *chunk = _chunks[index >> CHUNK_SHIFT].load(std::memory_order_acquire);
+            return chunk != nullptr ? chunk + (index & (CHUNK_SIZE - 1)) : nullptr;
+        }
+
+        // A Treiber stack, whose head carries an ABA tag in the upper 32 bits.
+        _Slot *popFreeSlot(uint32_t *index)
+        {
+            uint64_t head = _freeHead.load(std::memory_order_acquire);
+            while ((uint32_t)head != 0)
+            {
+                _Slot *slot = slotAt((uint32_t)head - 1);
+                uint64_t next = slot->next.load(std::memory_order_relaxed);
+                if (_freeHead.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | next, std::memory_order_acq_rel, std::memory_order_acquire))
+                {
+                    *index = (uint32_t)head - 1;
+                    return slot;
+                }
+            }
+            return nullptr;
+        }
+
+        void freeSlot(_Slot *slot, uint32_t index)
+        {
+            // Bump the generation, all the IDs given out before become stale.
+            uint64_t state = slot->state.load(std::memory_order_relaxed);
+            slot->state.store(((state >> 32) + 1) << 32, std::memory_order_release);
+
+            uint64_t head = _freeHead.load(std::memory_order_relaxed);
+            uint64_t newHead = 0;
+            do
+            {
+                slot->next.store((uint32_t)head, std::memory_order_relaxed);
+                newHead = (((head >> 32) + 1) << 32) | ((uint64_t)index + 1);
+            } while (!_freeHead.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Takes a never used slot, and allocates its chunk if it's the first one there.
+        _Slot *newSlot(uint32_t *index)
+        {
+            uint32_t i = _slotCount.load(std::memory_order_relaxed);
+            do
+            {
+                if (i >= MAX_CHUNKS * CHUNK_SIZE)
+                {
+                    return nullptr;
+                }
+                if (_chunks[i >> CHUNK_SHIFT].load(std::memory_order_acquire) == nullptr && !allocateChunk(i >> CHUNK_SHIFT))
+                {
+                    return nullptr;
+                }
+            } while (!_slotCount.compare_exchange_weak(i, i + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+            *index = i;
+            return slotAt(i);
+        }
+
+        bool allocateChunk(uint32_t chunkIndex)
+        {
+            _Slot *chunk = new (std::nothrow) _Slot[CHUNK_SIZE];
+            if (chunk == nullptr)
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < CHUNK_SIZE; ++i)
+            {
+                chunk[i].state.store(0, std::memory_order_relaxed);
+                chunk[i].obj.store(nullptr, std::memory_order_relaxed);
+                chunk[i].next.store(0, std::memory_order_relaxed);
+            }
+
+            _Slot *expected = nullptr;
+            if (!_chunks[chunkIndex].compare_exchange_strong(expected, chunk, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                delete[] chunk;  // Allocated by another thread.
+            }
+            return true;
+        }
+
+    private:
+        std::atomic<_Slot *> _chunks[MAX_CHUNKS];
+        std::atomic<uint32_t> _slotCount;  // The slots ever handed out, the chunks are filled in order.
+        std::atomic<uint64_t> _freeHead;  // ABA tag << 32 | (the first free slot index + 1)
+        std::atomic<size_t> _size;
+
+    private:
+        ConnectionTable(const ConnectionTable &) = delete;
+        ConnectionTable(ConnectionTable &&) = delete;
+        ConnectionTable &operator=(const ConnectionTable &) = delete;
+        ConnectionTable &operator=(ConnectionTable &&) = delete;
+    };
+}  // end of namespace iocp
+
+#endif
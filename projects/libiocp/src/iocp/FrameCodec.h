@@ -0,0 +1,249 @@
+#ifndef _FRAME_CODEC_H_
+#define _FRAME_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace iocp {
+    // A view of bytes in place, as std::string_view: a frame points into the receive buffer, so it's valid only
+    // during the onRecv call which hands it out. Copy the bytes to keep them.
+    class FrameView final
+    {
+    public:
+        FrameView() : _data(nullptr), _size(0) { }
+        FrameView(const char *data, size_t size) : _data(data), _size(size) { }
+
+        const char *data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        const char *begin() const { return _data; }
+        const char *end() const { return _data + _size; }
+        char operator[](size_t i) const { return _data[i]; }
+
+        std::string toString() const { return std::string(_data, _size); }
+
+    private:
+        const char *_data;
+        size_t _size;
+    };
+
+    // A frame decoded out of the received bytes: its body, and all of its bytes with the header, e.g. to forward
+    // or echo it as it came.
+    struct Frame
+    {
+        FrameView body;
+        FrameView bytes;
+    };
+
+    // How the size of the body is written before it: a fixed number of bytes in either order, or a varint (7 bits
+    // per byte, the lowest first, as protobuf's). A body over maxFrameSize is an error, it's checked as soon as the
+    // header is read, so a peer can't make the connection buffer it. A FIXED width outside 1 to 8 is invalid, a
+    // decoder of it fails every frame as MALFORMED.
+    struct FrameFormat
+    {
+        enum PrefixType { FIXED, VARINT };
+
+        PrefixType type;
+        unsigned width;  // The bytes of a FIXED header, 1 to 8.
+        bool bigEndian;
+        size_t maxFrameSize;
+
+        bool valid() const { return type == VARINT || (width >= 1 && width <= 8); }
+
+        // e.g. the 4-byte big-endian size of iocp-test: FrameFormat::fixed(4, true, 1 << 20).
+        static FrameFormat fixed(unsigned width, bool bigEndian, size_t maxFrameSize)
+        {
+            FrameFormat format = { FIXED, width, bigEndian, maxFrameSize };
+            return format;
+        }
+
+        static FrameFormat varint(size_t maxFrameSize)
+        {
+            FrameFormat format = { VARINT, 0, false, maxFrameSize };
+            return format;
+        }
+    };
+
+    // Splits the received bytes into frames of a FrameFormat, without copying. It has no state: onRecv hands it
+    // the unprocessed bytes, and returns the bytes of the whole frames decoded, so the partial frame at the end is
+    // handed again with the bytes after it.
+    class FrameDecoder final
+    {
+    public:
+        enum Result
+        {
+            FRAME,
+            INCOMPLETE,  // Not the whole frame yet.
+            TOO_LARGE,   // The body is over maxFrameSize.
+            MALFORMED,   // A varint of more than 10 bytes or 64 bits, or a FrameFormat which isn't valid.
+        };
+
+        enum : size_t { MAX_HEADER_SIZE = 10 };
+
+        explicit FrameDecoder(const FrameFormat &format) : _format(format) { }
+
+        const FrameFormat &getFormat() const { return _format; }
+
+        // Decodes the frame at the front of buf.
+        Result decode(const char *buf, size_t len, Frame *frame) const
+        {
+            size_t headerSize = 0;
+            uint64_t bodySize = 0;
+            Result result = decodeHeader((const unsigned char *)buf, len, &headerSize, &bodySize);
+            if (result != FRAME)
+            {
+                return result;
+            }
+            if (len - headerSize < bodySize)
+            {
+                return INCOMPLETE;
+            }
+            frame->body = FrameView(buf + headerSize, (size_t)bodySize);
+            frame->bytes = FrameView(buf, headerSize + (size_t)bodySize);
+            return FRAME;
+        }
+
+        // Decodes the header at the front of buf alone, for a body which is elsewhere or not received yet.
+        Result decodeHeader(const char *buf, size_t len, size_t *headerSize, uint64_t *bodySize) const
+        {
+            return decodeHeader((const unsigned char *)buf, len, headerSize, bodySize);
+        }
+
+        // Calls onFrame(const Frame &) for every whole frame at the front of buf, and returns their bytes, as onRecv
+        // returns the bytes processed. result is INCOMPLETE once all the whole frames are decoded, or the error
+        // which stopped the decoding. onFrame may return early by returning false.
+        template <class Func>
+        size_t decodeAll(const char *buf, size_t len, Func onFrame, Result *result) const
+        {
+            size_t processed = 0;
+            Frame frame;
+            for (;;)
+            {
+                *result = decode(buf + processed, len - processed, &frame);
+                if (*result != FRAME)
+                {
+                    return processed;
+                }
+                processed += frame.bytes.size();
+                if (!onFrame(frame))
+                {
+                    return processed;
+                }
+            }
+        }
+
+        // Writes the header of a body of size bytes to out, which holds at least MAX_HEADER_SIZE bytes, and returns
+        // its size, or 0 if the size doesn't fit in the header or the format isn't valid.
+        size_t encodeHeader(size_t size, char *out) const
+        {
+            uint64_t value = size;
+            unsigned char *p = (unsigned char *)out;
+            if (_format.type == FrameFormat::VARINT)
+            {
+                size_t n = 0;
+                while (value >= 0x80)
+                {
+                    p[n++] = (unsigned char)(value | 0x80);
+                    value >>= 7;
+                }
+                p[n++] = (unsigned char)value;
+                return n;
+            }
+
+            unsigned width = _format.width;
+            if (width - 1 >= 8 || (width < 8 && (value >> (width * 8)) != 0))
+            {
+                return 0;
+            }
+            for (unsigned i = 0; i < width; ++i)
+            {
+                p[_format.bigEndian ? width - 1 - i : i] = (unsigned char)(value >> (i * 8));
+            }
+            return width;
+        }
+
+    private:
+        Result decodeHeader(const unsigned char *p, size_t len, size_t *headerSize, uint64_t *bodySize) const
+        {
+            uint64_t value = 0;
+            if (_format.type == FrameFormat::VARINT)
+            {
+                size_t n = 0;
+                for (;;)
+                {
+                    if (n == len)
+                    {
+                        // A prefix already over the max is refused before the rest arrives.
+                        return value > _format.maxFrameSize ? TOO_LARGE : INCOMPLETE;
+                    }
+                    if (n == MAX_HEADER_SIZE)
+                    {
+                        return MALFORMED;
+                    }
+                    unsigned char c = p[n];
+                    if (n == MAX_HEADER_SIZE - 1 && c > 1)
+                    {
+                        return MALFORMED;  // Over 64 bits.
+                    }
+                    value |= (uint64_t)(c & 0x7F) << (n * 7);
+                    ++n;
+                    if ((c & 0x80) == 0)
+                    {
+                        break;
+                    }
+                }
+                *headerSize = n;
+            }
+            else
+            {
+                unsigned width = _format.width;
+                if (width - 1 >= 8)
+                {
+                    return MALFORMED;  // 0 would decode empty frames forever, over 8 overflows the size.
+                }
+                if (len < width)
+                {
+                    return INCOMPLETE;
+                }
+                // The usual widths are unrolled.
+                if (width == 4)
+                {
+                    value = _format.bigEndian
+                        ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]
+                        : ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+                }
+                else if (width == 2)
+                {
+                    value = _format.bigEndian ? ((uint32_t)p[0] << 8) | p[1] : ((uint32_t)p[1] << 8) | p[0];
+                }
+                else if (_format.bigEndian)
+                {
+                    for (unsigned i = 0; i < width; ++i)
+                    {
+                        value = (value << 8) | p[i];
+                    }
+                }
+                else
+                {
+                    for (unsigned i = width; i > 0; --i)
+                    {
+                        value = (value << 8) | p[i - 1];
+                    }
+                }
+                *headerSize = width;
+            }
+
+            if (value > _format.maxFrameSize)
+            {
+                return TOO_LARGE;
+            }
+            *bodySize = value;
+            return FRAME;
+        }
+
+        FrameFormat _format;
+    };
+}  // end of namespace iocp
+
+#endif
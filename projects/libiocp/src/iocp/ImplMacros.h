@@ -0,0 +1,24 @@
+#ifndef _IMPL_MACROS_H_
+#define _IMPL_MACROS_H_
+
+// Shared by the backend implementations only, never include it in a public header.
+
+#include "common/DebugConfig.h"
+
+#define CONTINUE_IF(_cond_) if (_cond_) continue
+#define BREAK_IF(_cond_) if (_cond_) break
+
+#define USE_CPP_EXCEPTION
+
+#ifdef USE_CPP_EXCEPTION
+#   define TRY_BLOCK_BEGIN try {
+#   define CATCH_EXCEPTIONS } catch (std::exception &_e) { \
+    LOG_ERROR("Caught exception `%s' at line %d in function `%s' of file `%s'", _e.what(), __LINE__, __FUNCTION__, __FILE__); if (1) {
+#   define CATCH_BLOCK_END } }
+#else
+#   define TRY_BLOCK_BEGIN
+#   define CATCH_EXCEPTIONS if (0) {
+#   define CATCH_BLOCK_END }
+#endif
+
+#endif
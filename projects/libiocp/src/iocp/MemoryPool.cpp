@@ -0,0 +1,426 @@
+#include "MemoryPool.h"
+#if PLATFORM_IS_WINDOWS
+#   include <windows.h>
+#else
+#   include <stdlib.h>
+#   include <pthread.h>
+#endif
+#include <string.h>
+#include <atomic>
+#include <mutex>
+
+#if PLATFORM_IS_WINDOWS
+#   define POOL_THREAD_LOCAL __declspec(thread)
+#else
+#   define POOL_THREAD_LOCAL __thread
+#endif
+
+// The size classes: 16 to 128 in steps of 16, then 4 classes per power of 2 up to MAX_POOLED_SIZE,
+// so a block wastes at most 25% of itself.
+#define SIZE_CLASS_COUNT 40
+#define SLAB_SIZE (64 * 1024)
+#define BATCH_BYTES (32 * 1024)  // A batch moved between a thread cache and the depot, of 2 to 64 blocks.
+
+namespace iocp {
+    namespace mp {
+        namespace {
+            // The first bytes of a free block.
+            struct _FreeBlock
+            {
+                _FreeBlock *next;  // In the same batch or the same cache.
+                _FreeBlock *nextBatch;  // Valid in the first block of a batch in the depot only.
+            };
+
+            struct _SizeClass
+            {
+                size_t blockSize;
+                size_t batchCount;
+
+                std::mutex depotMutex;
+                _FreeBlock *batches;
+                std::atomic<size_t> depotBlocks;
+                std::atomic<size_t> slabBytes;
+
+                // The counters of the threads exited.
+                std::atomic<uint64_t> retiredAllocs;
+                std::atomic<uint64_t> retiredFrees;
+            };
+
+            struct _ThreadCache
+            {
+                struct
+                {
+                    _FreeBlock *head;
+                    size_t count;
+                    uint64_t allocs;
+                    uint64_t frees;
+                } lists[SIZE_CLASS_COUNT];
+
+                _ThreadCache *prev;
+                _ThreadCache *next;
+            };
+
+            struct _Pool
+            {
+                _SizeClass classes[SIZE_CLASS_COUNT];
+
+                std::mutex cachesMutex;
+                _ThreadCache *caches;
+
+                std::atomic<uint64_t> largeAllocs;
+                std::atomic<uint64_t> largeFrees;
+
+#if PLATFORM_IS_WINDOWS
+                DWORD flsIndex;  // Only for the callback on the thread exit.
+#else
+                pthread_key_t key;
+#endif
+            };
+
+            // Never destroyed, the containers of static objects may be freed after main returns.
+            _Pool *s_pool = nullptr;
+            std::once_flag s_poolOnce;
+            POOL_THREAD_LOCAL _ThreadCache *t_cache = nullptr;
+
+            inline void *systemAlloc(size_t size)
+            {
+#if PLATFORM_IS_WINDOWS
+                return ::HeapAlloc(::GetProcessHeap(), 0, size);
+#else
+                return ::malloc(size);
+#endif
+            }
+
+            inline void systemFree(void *ptr)
+            {
+#if PLATFORM_IS_WINDOWS
+                ::HeapFree(::GetProcessHeap(), 0, ptr);
+#else
+                ::free(ptr);
+#endif
+            }
+
+            inline size_t sizeClassOf(size_t size)
+            {
+                if (size <= 128)
+                {
+                    return size == 0 ? 0 : (size - 1) >> 4;
+                }
+                size_t p = 7;  // 2^p < size <= 2^(p+1)
+                while (((size - 1) >> (p + 1)) != 0)
+                {
+                    ++p;
+                }
+                return 8 + (p - 7) * 4 + (((size - 1) - ((size_t)1 << p)) >> (p - 2));
+            }
+
+            inline size_t blockSizeOf(size_t index)
+            {
+                if (index < 8)
+                {
+                    return (index + 1) * 16;
+                }
+                size_t p = 7 + (index - 8) / 4;
+                return ((size_t)1 << p) + (((index - 8) % 4 + 1) << (p - 2));
+            }
+
+            void destroyCache(void *param);
+
+            void initPool()
+            {
+                void *p = systemAlloc(sizeof(_Pool));
+                if (p == nullptr)
+                {
+                    return;
+                }
+                _Pool *pool = new (p) _Pool;
+                for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i)
+                {
+                    _SizeClass &sc = pool->classes[i];
+                    sc.blockSize = blockSizeOf(i);
+                    sc.batchCount = BATCH_BYTES / sc.blockSize;
+                    sc.batchCount = sc.batchCount < 2 ? 2 : (sc.batchCount > 64 ? 64 : sc.batchCount);
+                    sc.batches = nullptr;
+                    sc.depotBlocks = 0;
+                    sc.slabBytes = 0;
+                    sc.retiredAllocs = 0;
+                    sc.retiredFrees = 0;
+                }
+                pool->caches = nullptr;
+                pool->largeAllocs = 0;
+                pool->largeFrees = 0;
+#if PLATFORM_IS_WINDOWS
+                pool->flsIndex = ::FlsAlloc(destroyCache);
+#else
+                ::pthread_key_create(&pool->key, destroyCache);
+#endif
+                s_pool = pool;
+            }
+
+            _Pool *getPool()
+            {
+                if (s_pool == nullptr)
+                {
+                    std::call_once(s_poolOnce, initPool);
+                }
+                return s_pool;
+            }
+
+            _ThreadCache *createCache()
+            {
+                _Pool *pool = getPool();
+                if (pool == nullptr)
+                {
+                    return nullptr;
+                }
+                _ThreadCache *cache = (_ThreadCache *)systemAlloc(sizeof(_ThreadCache));
+                if (cache == nullptr)
+                {
+                    return nullptr;
+                }
+                memset(cache, 0, sizeof(_ThreadCache));
+
+                pool->cachesMutex.lock();
+                cache->next = pool->caches;
+                if (pool->caches != nullptr)
+                {
+                    pool->caches->prev = cache;
+                }
+                pool->caches = cache;
+                pool->cachesMutex.unlock();
+
+                // Only to get destroyCache called when the thread exits.
+#if PLATFORM_IS_WINDOWS
+                ::FlsSetValue(pool->flsIndex, cache);
+#else
+                ::pthread_setspecific(pool->key, cache);
+#endif
+                t_cache = cache;
+                return cache;
+            }
+
+            inline void pushBatch(_SizeClass &sc, _FreeBlock *head, size_t count)
+            {
+                sc.depotMutex.lock();
+                head->nextBatch = sc.batches;
+                sc.batches = head;
+                sc.depotMutex.unlock();
+                sc.depotBlocks.fetch_add(count, std::memory_order_relaxed);
+            }
+
+            // Gives all the blocks of the exiting thread back to the depots.
+            void destroyCache(void *param)
+            {
+                _ThreadCache *cache = (_ThreadCache *)param;
+                _Pool *pool = s_pool;
+                for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i)
+                {
+                    _SizeClass &sc = pool->classes[i];
+                    if (cache->lists[i].head != nullptr)
+                    {
+                        pushBatch(sc, cache->lists[i].head, cache->lists[i].count);
+                    }
+                    sc.retiredAllocs.fetch_add(cache->lists[i].allocs, std::memory_order_relaxed);
+                    sc.retiredFrees.fetch_add(cache->lists[i].frees, std::memory_order_relaxed);
+                }
+
+                pool->cachesMutex.lock();
+                if (cache->prev != nullptr)
+                {
+                    cache->prev->next = cache->next;
+                }
+                else
+                {
+                    pool->caches = cache->next;
+                }
+                if (cache->next != nullptr)
+                {
+                    cache->next->prev = cache->prev;
+                }
+                pool->cachesMutex.unlock();
+
+                if (t_cache == cache)
+                {
+                    t_cache = nullptr;  // A later allocation of this thread creates another one.
+                }
+                systemFree(cache);
+            }
+
+            // Takes a batch from the depot, or carves a new slab into batches.
+            bool refill(_ThreadCache *cache, size_t index)
+            {
+                _SizeClass &sc = s_pool->classes[index];
+
+                sc.depotMutex.lock();
+                _FreeBlock *batch = sc.batches;
+                if (batch != nullptr)
+                {
+                    sc.batches = batch->nextBatch;
+                }
+                sc.depotMutex.unlock();
+
+                if (batch != nullptr)
+                {
+                    size_t count = 0;
+                    for (_FreeBlock *b = batch; b != nullptr; b = b->next)
+                    {
+                        ++count;
+                    }
+                    sc.depotBlocks.fetch_sub(count, std::memory_order_relaxed);
+                    cache->lists[index].head = batch;
+                    cache->lists[index].count = count;
+                    return true;
+                }
+
+                size_t slabSize = sc.blockSize * sc.batchCount * 2;
+                slabSize = slabSize < SLAB_SIZE ? SLAB_SIZE : slabSize;
+                char *slab = (char *)systemAlloc(slabSize);
+                if (slab == nullptr)
+                {
+                    return false;
+                }
+                sc.slabBytes.fetch_add(slabSize, std::memory_order_relaxed);
+
+                // The first batch goes to this thread, the others to the depot.
+                size_t blockCount = slabSize / sc.blockSize;
+                for (size_t first = 0; first < blockCount; first += sc.batchCount)
+                {
+                    size_t last = first + sc.batchCount < blockCount ? first + sc.batchCount : blockCount;
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        _FreeBlock *b = (_FreeBlock *)(slab + i * sc.blockSize);
+                        b->next = i + 1 < last ? (_FreeBlock *)(slab + (i + 1) * sc.blockSize) : nullptr;
+                    }
+                    _FreeBlock *head = (_FreeBlock *)(slab + first * sc.blockSize);
+                    if (first == 0)
+                    {
+                        cache->lists[index].head = head;
+                        cache->lists[index].count = last - first;
+                    }
+                    else
+                    {
+                        pushBatch(sc, head, last - first);
+                    }
+                }
+                return true;
+            }
+        }  // end of anonymous namespace
+
+        void *poolAllocate(size_t size)
+        {
+            if (size > MAX_POOLED_SIZE)
+            {
+                _Pool *pool = getPool();
+                if (pool != nullptr)
+                {
+                    pool->largeAllocs.fetch_add(1, std::memory_order_relaxed);
+                }
+                return systemAlloc(size);
+            }
+
+            _ThreadCache *cache = t_cache != nullptr ? t_cache : createCache();
+            if (cache == nullptr)
+            {
+                return nullptr;
+            }
+            size_t index = sizeClassOf(size);
+            if (cache->lists[index].head == nullptr && !refill(cache, index))
+            {
+                return nullptr;
+            }
+
+            _FreeBlock *b = cache->lists[index].head;
+            cache->lists[index].head = b->next;
+            --cache->lists[index].count;
+            ++cache->lists[index].allocs;
+            return b;
+        }
+
+        void poolDeallocate(void *ptr, size_t size)
+        {
+            if (ptr == nullptr)
+            {
+                return;
+            }
+            if (size > MAX_POOLED_SIZE)
+            {
+                s_pool->largeFrees.fetch_add(1, std::memory_order_relaxed);
+                systemFree(ptr);
+                return;
+            }
+
+            size_t index = sizeClassOf(size);
+            _SizeClass &sc = s_pool->classes[index];
+            _FreeBlock *b = (_FreeBlock *)ptr;
+            _ThreadCache *cache = t_cache != nullptr ? t_cache : createCache();
+            if (cache == nullptr)
+            {
+                b->next = nullptr;
+                pushBatch(sc, b, 1);  // Out of memory for a cache, straight to the depot.
+                return;
+            }
+
+            b->next = cache->lists[index].head;
+            cache->lists[index].head = b;
+            ++cache->lists[index].frees;
+            if (++cache->lists[index].count < sc.batchCount * 2)
+            {
+                return;
+            }
+
+            // Too many cached, move the most recent batch to the depot and keep the rest warm.
+            _FreeBlock *last = b;
+            for (size_t i = 1; i < sc.batchCount; ++i)
+            {
+                last = last->next;
+            }
+            cache->lists[index].head = last->next;
+            cache->lists[index].count -= sc.batchCount;
+            last->next = nullptr;
+            pushBatch(sc, b, sc.batchCount);
+        }
+
+        size_t getPoolStats(PoolStats *stats, size_t maxCount)
+        {
+            if (stats == nullptr)
+            {
+                return SIZE_CLASS_COUNT + 1;
+            }
+            _Pool *pool = getPool();
+            if (pool == nullptr)
+            {
+                return 0;
+            }
+
+            size_t count = 0;
+            pool->cachesMutex.lock();
+            for (size_t i = 0; i < SIZE_CLASS_COUNT && count < maxCount; ++i, ++count)
+            {
+                _SizeClass &sc = pool->classes[i];
+                PoolStats &st = stats[count];
+                st.blockSize = sc.blockSize;
+                st.allocs = sc.retiredAllocs.load(std::memory_order_relaxed);
+                st.frees = sc.retiredFrees.load(std::memory_order_relaxed);
+                st.slabBytes = sc.slabBytes.load(std::memory_order_relaxed);
+                st.depotBlocks = sc.depotBlocks.load(std::memory_order_relaxed);
+                st.cachedBlocks = 0;
+                for (_ThreadCache *cache = pool->caches; cache != nullptr; cache = cache->next)
+                {
+                    st.allocs += cache->lists[i].allocs;
+                    st.frees += cache->lists[i].frees;
+                    st.cachedBlocks += cache->lists[i].count;
+                }
+            }
+            pool->cachesMutex.unlock();
+
+            if (count < maxCount)
+            {
+                PoolStats &st = stats[count++];
+                memset(&st, 0, sizeof(st));
+                st.allocs = pool->largeAllocs.load(std::memory_order_relaxed);
+                st.frees = pool->largeFrees.load(std::memory_order_relaxed);
+            }
+            return count;
+        }
+    }  // end of namespace mp
+}  // end of namespace iocp
@@ -1,11 +1,44 @@
 #ifndef _MEMORY_POOL_H_
 #define _MEMORY_POOL_H_
 
-#include <windows.h>
+#include "common/PlatformConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <utility>
 #include "common/Exceptions.h"
 
 namespace iocp {
     namespace mp {
+        // A slab allocator of size classes, defined in MemoryPool.cpp.
+        //
+        // The blocks up to MAX_POOLED_SIZE are rounded up to a size class and carved from 64 KB slabs. Every thread
+        // caches the free blocks of each class, and moves them to or from the global depot of the class in batches,
+        // so the mutex of the depot is taken once per batch, not per block. A block freed by another thread goes to
+        // the cache of that thread. The slabs are never given back to the system.
+        // The larger blocks go to the system heap directly.
+        enum : size_t { MAX_POOLED_SIZE = 32768 };
+
+        // Returns nullptr if out of memory.
+        void *poolAllocate(size_t size);
+
+        // The size must be the one given to poolAllocate.
+        void poolDeallocate(void *ptr, size_t size);
+
+        struct PoolStats
+        {
+            size_t blockSize;  // 0 for the blocks larger than MAX_POOLED_SIZE, which go to the system heap.
+            uint64_t allocs;
+            uint64_t frees;
+            size_t slabBytes;  // Reserved from the system.
+            size_t depotBlocks;  // Free in the global depot.
+            size_t cachedBlocks;  // Free in the caches of the threads.
+        };
+
+        // Fills the stats of the size classes in ascending order, followed by the one of the large blocks.
+        // Returns the number of entries filled, or the number needed if stats is nullptr.
+        // The counters of the other threads are read without synchronization, so they are approximate.
+        size_t getPoolStats(PoolStats *stats, size_t maxCount);
 
         template <class _T> struct Allocator
         {
@@ -54,20 +87,18 @@ namespace iocp {
                 return *this;
             }
 
-            // deallocate object at _Ptr, ignore size
-            void deallocate(pointer ptr, size_type)
+            // deallocate object at ptr, the size is needed to find its size class
+            void deallocate(pointer ptr, size_type cnt)
             {
-                //delete ptr;
-                //free(ptr);
-                ::HeapFree(::GetProcessHeap(), 0, ptr);
+                poolDeallocate(ptr, cnt * sizeof(_T));
             }
 
             // allocate array of cnt elements
             pointer allocate(size_type cnt)
             {
-                //return _Allocate(cnt, (pointer)0);
-                //return calloc(cnt, sizeof(_T));
-                return (pointer)::HeapAlloc(::GetProcessHeap(), 0, cnt * sizeof(_T));
+                void *ptr = poolAllocate(cnt * sizeof(_T));
+                if (ptr == nullptr) throw std::bad_alloc();
+                return (pointer)ptr;
             }
 
             // allocate array of cnt elements, ignore hint
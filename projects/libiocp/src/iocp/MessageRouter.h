@@ -0,0 +1,150 @@
+#ifndef _MESSAGE_ROUTER_H_
+#define _MESSAGE_ROUTER_H_
+
+#include "ServerFramework.h"
+#include <type_traits>
+
+namespace iocp {
+    // The handler of the messages of an ID. It's a template argument, so the entry of the router's table calls it
+    // directly and the compiler inlines it there.
+    template <class _T, uint16_t _ID, void (*_Handler)(ClientContext<_T> *ctx, const FrameView &payload)>
+    struct Route
+    {
+        enum : size_t { ID = _ID };
+
+        static bool invoke(ClientContext<_T> *ctx, const FrameView &payload)
+        {
+            _Handler(ctx, payload);
+            return true;
+        }
+    };
+
+    namespace _impl {
+        template <size_t... _I> struct IndexList { };
+
+        template <class _Front, class _Back> struct ConcatIndices;
+        template <size_t... _Front, size_t... _Back> struct ConcatIndices<IndexList<_Front...>, IndexList<_Back...> >
+        {
+            typedef IndexList<_Front..., (sizeof...(_Front) + _Back)...> type;
+        };
+
+        // 0 to _N - 1, halved at every level so thousands of IDs stay far within the template depth.
+        template <size_t _N> struct MakeIndices
+        {
+            typedef typename ConcatIndices<typename MakeIndices<_N / 2>::type,
+                typename MakeIndices<_N - _N / 2>::type>::type type;
+        };
+        template <> struct MakeIndices<0> { typedef IndexList<> type; };
+        template <> struct MakeIndices<1> { typedef IndexList<0> type; };
+
+        template <class _T> struct NoRoute
+        {
+            static bool invoke(ClientContext<_T> *, const FrameView &) { return false; }
+        };
+
+        // The route of ID _I, or NoRoute.
+        template <class _T, size_t _I, class... _Routes> struct FindRoute
+        {
+            typedef NoRoute<_T> type;
+        };
+        template <class _T, size_t _I, class _First, class... _Rest> struct FindRoute<_T, _I, _First, _Rest...>
+        {
+            typedef typename std::conditional<_First::ID == _I, _First,
+                typename FindRoute<_T, _I, _Rest...>::type>::type type;
+        };
+
+        template <class... _Routes> struct MaxRouteId
+        {
+            static const size_t value = 0;
+        };
+        template <class _First, class... _Rest> struct MaxRouteId<_First, _Rest...>
+        {
+            static const size_t value = (size_t)_First::ID > MaxRouteId<_Rest...>::value
+                ? (size_t)_First::ID : MaxRouteId<_Rest...>::value;
+        };
+
+        template <size_t _I, class... _Routes> struct HasRoute
+        {
+            static const bool value = false;
+        };
+        template <size_t _I, class _First, class... _Rest> struct HasRoute<_I, _First, _Rest...>
+        {
+            static const bool value = (size_t)_First::ID == _I || HasRoute<_I, _Rest...>::value;
+        };
+
+        template <class... _Routes> struct HasDuplicateRoute
+        {
+            static const bool value = false;
+        };
+        template <class _First, class... _Rest> struct HasDuplicateRoute<_First, _Rest...>
+        {
+            static const bool value = HasRoute<_First::ID, _Rest...>::value || HasDuplicateRoute<_Rest...>::value;
+        };
+
+        // An entry per ID from 0 to the largest, the addresses of the invoke functions, so the array is initialized
+        // statically and a dispatch is one load and one call.
+        template <class _T, class _Indices, class... _Routes> struct RouteTable;
+        template <class _T, size_t... _I, class... _Routes> struct RouteTable<_T, IndexList<_I...>, _Routes...>
+        {
+            typedef bool (*Entry)(ClientContext<_T> *ctx, const FrameView &payload);
+
+            static const Entry entries[sizeof...(_I)];
+        };
+
+        template <class _T, size_t... _I, class... _Routes>
+        const typename RouteTable<_T, IndexList<_I...>, _Routes...>::Entry
+            RouteTable<_T, IndexList<_I...>, _Routes...>::entries[sizeof...(_I)] = {
+            &FindRoute<_T, _I, _Routes...>::type::invoke...
+        };
+    }  // end of namespace _impl
+
+    // Dispatches messages to their handlers by ID, through a table built from the routes at compile time instead of a
+    // switch or a map of std::function:
+    //   void onLogin(ClientContext<Player> *ctx, const FrameView &payload);
+    //   void onMove(ClientContext<Player> *ctx, const FrameView &payload);
+    //   typedef MessageRouter<Player, Route<Player, 1, onLogin>, Route<Player, 2, onMove> > Router;
+    //   server.startup(ip, port, server.routed<Router>(FrameFormat::fixed(4, true, 65536)), onDisconnect);
+    // A message is the 2-byte big-endian ID and the payload, the body of a frame. The table holds an entry per ID up
+    // to the largest one, so keep the IDs dense.
+    template <class _T, class... _Routes> class MessageRouter final
+    {
+    public:
+        enum : size_t
+        {
+            ID_SIZE = 2,
+            MAX_ID = _impl::MaxRouteId<_Routes...>::value
+        };
+
+        static_assert(sizeof...(_Routes) > 0, "MessageRouter needs a route");
+        static_assert(MAX_ID < 4096, "The table holds an entry per ID up to the largest one");
+        static_assert(!_impl::HasDuplicateRoute<_Routes...>::value, "An ID has two routes");
+
+        // Calls the handler of the message with its payload. Returns false if the message is shorter than an ID or
+        // no route handles its ID.
+        static bool dispatch(ClientContext<_T> *ctx, const FrameView &message)
+        {
+            if (message.size() < ID_SIZE)
+            {
+                return false;
+            }
+            size_t id = ((size_t)(uint8_t)message[0] << 8) | (uint8_t)message[1];
+            if (id > MAX_ID)
+            {
+                return false;
+            }
+            return Table::entries[id](ctx, FrameView(message.data() + ID_SIZE, message.size() - ID_SIZE));
+        }
+
+        // Writes the ID of a message to out, which holds ID_SIZE bytes.
+        static void writeId(uint16_t id, char *out)
+        {
+            out[0] = (char)(id >> 8);
+            out[1] = (char)id;
+        }
+
+    private:
+        typedef _impl::RouteTable<_T, typename _impl::MakeIndices<MAX_ID + 1>::type, _Routes...> Table;
+    };
+}  // end of namespace iocp
+
+#endif
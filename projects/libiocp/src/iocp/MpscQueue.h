@@ -0,0 +1,57 @@
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+
+namespace iocp {
+    // A lock-free queue of intrusive nodes, pushed by any threads and popped by one thread at a time.
+    //
+    // The nodes are linked by their `_T *next` field. The producers push onto a stack by CAS, and the consumer takes
+    // the whole stack at once and reverses it, so the nodes come out in the order pushed, a batch at a time.
+    // A node must not be pushed again before it has been popped.
+    template <class _T> class MpscQueue
+    {
+    public:
+        MpscQueue() : _head(nullptr) { }
+
+        // Returns true if the queue was empty, so the consumer may have to be woken up.
+        bool push(_T *node)
+        {
+            _T *head = _head.load(std::memory_order_relaxed);
+            do
+            {
+                node->next = head;
+            } while (!_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+            return head == nullptr;
+        }
+
+        // Takes all the nodes pushed so far, linked by next in the order pushed, or returns nullptr if empty.
+        _T *popAll()
+        {
+            _T *head = _head.exchange(nullptr, std::memory_order_acquire);
+            _T *first = nullptr;
+            while (head != nullptr)
+            {
+                _T *next = head->next;
+                head->next = first;
+                first = head;
+                head = next;
+            }
+            return first;
+        }
+
+        bool empty() const { return _head.load(std::memory_order_relaxed) == nullptr; }
+
+    private:
+        std::atomic<_T *> _head;  // The last node pushed.
+
+    private:
+        MpscQueue(const MpscQueue &) = delete;
+        MpscQueue(MpscQueue &&) = delete;
+        MpscQueue &operator=(const MpscQueue &) = delete;
+        MpscQueue &operator=(MpscQueue &&) = delete;
+    };
+}  // end of namespace iocp
+
+#endif
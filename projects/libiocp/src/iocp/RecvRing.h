@@ -0,0 +1,250 @@
+#ifndef _RECV_RING_H_
+#define _RECV_RING_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "MemoryPool.h"
+
+namespace iocp {
+    namespace _impl {
+        // The received bytes of a connection which have not been processed yet, in a ring the socket receives into.
+        //
+        // The unread bytes start at the read offset and may wrap around the end. Processing the bytes just advances
+        // the read offset, and the offset goes back to 0 whenever the ring is drained, so the bytes are moved only
+        // when a frame straddles the end, or when the ring grows.
+        //
+        // The capacity follows a target adapted to the receives: it doubles when a receive fills all the free space,
+        // so a bulk peer soon needs fewer receives per megabyte, and halves when the receives of a window use less
+        // than a quarter of it, so a chatty peer holds a small block. A larger capacity is taken at once, a smaller
+        // one when the ring is drained, so shrinking never copies.
+        class _RecvRing
+        {
+        public:
+            enum : size_t { SAMPLE_WINDOW = 16 };  // The receives observed before shrinking.
+
+            _RecvRing() : _buf(nullptr), _capacity(0), _read(0), _size(0), _target(0), _peak(0), _samples(0) { }
+            ~_RecvRing() { release(); }
+
+            size_t size() const { return _size; }
+            size_t capacity() const { return _capacity; }
+            size_t target() const { return _target; }
+            bool empty() const { return _size == 0; }
+
+            // Makes room to receive into, allocating the target capacity, or doubling it when less than a quarter
+            // is free, for a frame larger than the ring. Returns false if the ring is full and can't grow any more,
+            // or out of memory.
+            bool prepare(size_t initialCapacity, size_t maxCapacity)
+            {
+                if (_target == 0)
+                {
+                    _target = initialCapacity < maxCapacity ? initialCapacity : maxCapacity;
+                }
+                if (_capacity > 0 && _capacity - _size < _capacity / 4 && _target <= _capacity)
+                {
+                    _target = _capacity * 2 < maxCapacity ? _capacity * 2 : maxCapacity;
+                }
+                if (_target > _capacity || (_target < _capacity && _size == 0))
+                {
+                    if (!reallocate(_target))
+                    {
+                        return _size < _capacity;
+                    }
+                }
+                return _size < _capacity;
+            }
+
+            // The free space in up to 2 parts, to receive into in order. Returns the number of parts.
+            size_t getWritable(char *bufs[2], size_t lens[2]) const
+            {
+                if (_size == _capacity)
+                {
+                    return 0;
+                }
+                size_t write = (_read + _size) % _capacity;
+                if (write >= _read)  // The free space wraps around the end, unless the read offset is 0.
+                {
+                    bufs[0] = _buf + write;
+                    lens[0] = _capacity - write;
+                    if (_read == 0)
+                    {
+                        return 1;
+                    }
+                    bufs[1] = _buf;
+                    lens[1] = _read;
+                    return 2;
+                }
+                bufs[0] = _buf + write;
+                lens[0] = _read - write;
+                return 1;
+            }
+
+            // Accounts the bytes received into the writable parts, whose total size was writable,
+            // and adapts the target capacity between minCapacity and maxCapacity.
+            void commit(size_t len, size_t writable, size_t minCapacity, size_t maxCapacity)
+            {
+                _size += len;
+                if (minCapacity >= maxCapacity)
+                {
+                    return;  // The size is fixed.
+                }
+                if (len == writable)  // There may be more, take more next time.
+                {
+                    _target = _capacity * 2 < maxCapacity ? _capacity * 2 : maxCapacity;
+                    _peak = 0;
+                    _samples = 0;
+                    return;
+                }
+                _peak = len > _peak ? len : _peak;
+                if (++_samples >= SAMPLE_WINDOW)
+                {
+                    if (_peak * 4 <= _capacity && _capacity / 2 >= minCapacity)
+                    {
+                        _target = _capacity / 2;
+                    }
+                    _peak = 0;
+                    _samples = 0;
+                }
+            }
+
+            // Copies the bytes in, growing up to maxCapacity. Returns false if they don't fit.
+            bool append(const char *buf, size_t len, size_t initialCapacity, size_t maxCapacity)
+            {
+                if (_size + len > maxCapacity)
+                {
+                    return false;
+                }
+                if (_size + len > _capacity)
+                {
+                    size_t capacity = _capacity > 0 ? _capacity : initialCapacity;
+                    while (capacity < _size + len)
+                    {
+                        capacity *= 2;
+                    }
+                    if (!reallocate(capacity < maxCapacity ? capacity : maxCapacity))
+                    {
+                        return false;
+                    }
+                }
+
+                char *bufs[2];
+                size_t lens[2];
+                size_t cnt = getWritable(bufs, lens);
+                for (size_t i = 0; i < cnt && len > 0; ++i)
+                {
+                    size_t n = len < lens[i] ? len : lens[i];
+                    memcpy(bufs[i], buf, n);
+                    buf += n;
+                    len -= n;
+                    _size += n;
+                }
+                return true;
+            }
+
+            // The unread bytes up to the end of the ring. The rest follow at the beginning if they wrap around.
+            const char *peek(size_t *len) const
+            {
+                *len = _read + _size <= _capacity ? _size : _capacity - _read;
+                return _buf + _read;
+            }
+
+            void consume(size_t len)
+            {
+                _size -= len;
+                _read = _size > 0 ? (_read + len) % _capacity : 0;
+            }
+
+            // Joins the unread bytes wrapping around the end, so that peek returns all of them.
+            // Returns false if out of memory.
+            bool unwrap()
+            {
+                if (_read + _size <= _capacity)
+                {
+                    return true;
+                }
+                size_t tail = _capacity - _read;
+                size_t head = _size - tail;
+                if (_size > _read)  // No room to shift the head, move both to a new block.
+                {
+                    return reallocate(_capacity);
+                }
+                memmove(_buf + tail, _buf, head);
+                memcpy(_buf, _buf + _read, tail);
+                _read = 0;
+                return true;
+            }
+
+            // Drops the unread bytes, and keeps the memory.
+            void clear()
+            {
+                _read = 0;
+                _size = 0;
+            }
+
+            // Frees the memory, and the unread bytes. The target is kept for the next receive.
+            void release()
+            {
+                if (_buf != nullptr)
+                {
+                    mp::poolDeallocate(_buf, _capacity);
+                    _buf = nullptr;
+                }
+                _capacity = 0;
+                _read = 0;
+                _size = 0;
+            }
+
+            // Frees the memory, and forgets the sizes observed.
+            void reset()
+            {
+                release();
+                _target = 0;
+                _peak = 0;
+                _samples = 0;
+            }
+
+        private:
+            // Moves the unread bytes to the beginning of a new block.
+            bool reallocate(size_t capacity)
+            {
+                char *buf = (char *)mp::poolAllocate(capacity);
+                if (buf == nullptr)
+                {
+                    return false;
+                }
+                size_t len = 0;
+                const char *first = peek(&len);
+                if (len > 0)
+                {
+                    memcpy(buf, first, len);
+                    memcpy(buf + len, _buf, _size - len);
+                }
+                if (_buf != nullptr)
+                {
+                    mp::poolDeallocate(_buf, _capacity);
+                }
+                _buf = buf;
+                _capacity = capacity;
+                _read = 0;
+                return true;
+            }
+
+        private:
+            char *_buf;
+            size_t _capacity;
+            size_t _read;  // The offset of the first unread byte.
+            size_t _size;  // The number of the unread bytes.
+
+            size_t _target;  // The capacity to take at the next prepare.
+            size_t _peak;  // The largest receive in the current window.
+            size_t _samples;  // The receives in the current window.
+
+        private:
+            _RecvRing(const _RecvRing &) = delete;
+            _RecvRing(_RecvRing &&) = delete;
+            _RecvRing &operator=(const _RecvRing &) = delete;
+            _RecvRing &operator=(_RecvRing &&) = delete;
+        };
+    }  // end of namespace _impl
+}  // end of namespace iocp
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef _SEND_BUFFER_H_
+#define _SEND_BUFFER_H_
+
+#include "common/PlatformConfig.h"
+#if PLATFORM_IS_WINDOWS
+#   include <windows.h>
+#else
+#   include <stdlib.h>
+#endif
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <utility>
+#include "MemoryPool.h"
+
+namespace iocp {
+    // A refcounted block of bytes to send.
+    // The send chains of the connections refer to the buffers instead of copying them, so once posted, the bytes
+    // must not be modified any more. The buffer is freed when the last reference is released, after all the sends
+    // referring to it have completed.
+    class SendBuffer final
+    {
+    public:
+        // Returns a buffer of size 0 with one reference, or nullptr if out of memory.
+        static SendBuffer *create(size_t capacity)
+        {
+#if PLATFORM_IS_WINDOWS
+            void *p = ::HeapAlloc(::GetProcessHeap(), 0, sizeof(SendBuffer) + capacity);
+#else
+            void *p = ::malloc(sizeof(SendBuffer) + capacity);
+#endif
+            if (p == nullptr)
+            {
+                return nullptr;
+            }
+            _totalBytes.fetch_add(capacity, std::memory_order_relaxed);
+            return new (p) SendBuffer(capacity);
+        }
+
+        // As create, but from the size classes of the slab pool (see MemoryPool.h), for the short-lived buffers made
+        // per message, e.g. by the streams which serialize into them. Over maxPooledCapacity it's the system heap.
+        static SendBuffer *createPooled(size_t capacity)
+        {
+            void *p = mp::poolAllocate(sizeof(SendBuffer) + capacity);
+            if (p == nullptr)
+            {
+                return nullptr;
+            }
+            _totalBytes.fetch_add(capacity, std::memory_order_relaxed);
+            SendBuffer *sb = new (p) SendBuffer(capacity);
+            sb->_pooled = true;
+            return sb;
+        }
+
+        // The largest capacity createPooled takes from the size classes.
+        static size_t maxPooledCapacity() { return mp::MAX_POOLED_SIZE - sizeof(SendBuffer); }
+
+        // Returns a copy of the bytes with one reference, or nullptr if out of memory.
+        static SendBuffer *create(const char *buf, size_t len)
+        {
+            SendBuffer *sb = create(len);
+            if (sb != nullptr)
+            {
+                memcpy(sb->data(), buf, len);
+                sb->_size = len;
+            }
+            return sb;
+        }
+
+        void retain() { _refs.fetch_add(1, std::memory_order_relaxed); }
+
+        void release()
+        {
+            if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                size_t capacity = _capacity;
+                bool pooled = _pooled;
+                _totalBytes.fetch_sub(capacity, std::memory_order_relaxed);
+                this->~SendBuffer();
+                if (pooled)
+                {
+                    mp::poolDeallocate(this, sizeof(SendBuffer) + capacity);
+                    return;
+                }
+#if PLATFORM_IS_WINDOWS
+                ::HeapFree(::GetProcessHeap(), 0, this);
+#else
+                ::free(this);
+#endif
+            }
+        }
+
+        // Whether the caller holds the only reference.
+        bool unique() const { return _refs.load(std::memory_order_acquire) == 1; }
+
+        char *data() { return (char *)(this + 1); }
+        const char *data() const { return (const char *)(this + 1); }
+
+        size_t size() const { return _size; }
+        size_t capacity() const { return _capacity; }
+
+        // The bytes held by all the SendBuffers alive, i.e. the memory of the send chains of all the connections.
+        static size_t totalBytes() { return _totalBytes.load(std::memory_order_relaxed); }
+
+        // Fill the bytes in data() before, up to the capacity.
+        void setSize(size_t size) { _size = size <= _capacity ? size : _capacity; }
+
+        // Copies as more bytes as it can hold to the end, returns the number of bytes copied.
+        size_t append(const char *buf, size_t len)
+        {
+            size_t room = _capacity - _size;
+            if (len > room)
+            {
+                len = room;
+            }
+            memcpy(data() + _size, buf, len);
+            _size += len;
+            return len;
+        }
+
+    private:
+        explicit SendBuffer(size_t capacity) : _refs(1), _size(0), _capacity(capacity), _pooled(false) { }
+        ~SendBuffer() { }
+
+        std::atomic<unsigned> _refs;
+        size_t _size;
+        size_t _capacity;
+        bool _pooled;  // Allocated by createPooled.
+        // The bytes follow.
+
+        static std::atomic<size_t> _totalBytes;  // Defined in ServerFrameworkCommon.cpp.
+
+    private:
+        SendBuffer(const SendBuffer &) = delete;
+        SendBuffer(SendBuffer &&) = delete;
+        SendBuffer &operator=(const SendBuffer &) = delete;
+        SendBuffer &operator=(SendBuffer &&) = delete;
+    };
+
+    // Holds a reference of a SendBuffer, like a std::shared_ptr without the control block.
+    class SendBufferRef final
+    {
+    public:
+        SendBufferRef() : _buf(nullptr) { }
+
+        // Takes over the reference the caller holds, i.e. the one SendBuffer::create returns.
+        explicit SendBufferRef(SendBuffer *buf) : _buf(buf) { }
+
+        SendBufferRef(const SendBufferRef &other) : _buf(other._buf)
+        {
+            if (_buf != nullptr) _buf->retain();
+        }
+
+        SendBufferRef(SendBufferRef &&other) : _buf(other._buf)
+        {
+            other._buf = nullptr;
+        }
+
+        ~SendBufferRef()
+        {
+            if (_buf != nullptr) _buf->release();
+        }
+
+        SendBufferRef &operator=(const SendBufferRef &other)
+        {
+            SendBufferRef(other).swap(*this);
+            return *this;
+        }
+
+        SendBufferRef &operator=(SendBufferRef &&other)
+        {
+            SendBufferRef(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        void swap(SendBufferRef &other)
+        {
+            SendBuffer *t = _buf;
+            _buf = other._buf;
+            other._buf = t;
+        }
+
+        void reset()
+        {
+            SendBufferRef().swap(*this);
+        }
+
+        SendBuffer *get() const { return _buf; }
+        SendBuffer *operator->() const { return _buf; }
+        explicit operator bool() const { return _buf != nullptr; }
+
+    private:
+        SendBuffer *_buf;
+    };
+}  // end of namespace iocp
+
+#endif
@@ -2,6 +2,7 @@
 #define _SERVER_FRAMEWORK_H_
 
 #include "ServerFrameworkImpl.h"
+#include "FrameCodec.h"
 
 namespace iocp {
     template <class _T = void> class ClientContext final : public _impl::_ClientContext
@@ -14,6 +15,31 @@ namespace iocp {
         const _T &getUserData() const { return _userData; }
         void setUserData(const _T &userData) { _userData = userData; }
 
+        // The default reset of a pooled ClientContext, see ServerFramework::setResetCallback.
+        void resetUserData() { _userData = _T(); }
+
+        // See _ClientContext::post, compute and dispatch.
+        bool post(const std::function<void (ClientContext<_T> *ctx)> &task)
+        {
+            return _impl::_ClientContext::post([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<_T> *)ctx);
+            });
+        }
+
+        bool compute(const std::function<void (ClientContext<_T> *ctx)> &task)
+        {
+            return _impl::_ClientContext::compute([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<_T> *)ctx);
+            });
+        }
+
+        bool dispatch(const std::function<void (ClientContext<_T> *ctx)> &task, bool heavy)
+        {
+            return _impl::_ClientContext::dispatch([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<_T> *)ctx);
+            }, heavy);
+        }
+
         _T *operator->()
         {
             return &_userData;
@@ -29,6 +55,29 @@ namespace iocp {
 
     template <> class ClientContext<void> : public _impl::_ClientContext
     {
+    public:
+        void resetUserData() { }
+
+        bool post(const std::function<void (ClientContext<void> *ctx)> &task)
+        {
+            return _impl::_ClientContext::post([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<void> *)ctx);
+            });
+        }
+
+        bool compute(const std::function<void (ClientContext<void> *ctx)> &task)
+        {
+            return _impl::_ClientContext::compute([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<void> *)ctx);
+            });
+        }
+
+        bool dispatch(const std::function<void (ClientContext<void> *ctx)> &task, bool heavy)
+        {
+            return _impl::_ClientContext::dispatch([task](_impl::_ClientContext *ctx) {
+                task((ClientContext<void> *)ctx);
+            }, heavy);
+        }
     };
 
     template <class _T = void> class ServerFramework final : public _impl::_ServerFramework
@@ -42,6 +91,9 @@ namespace iocp {
             _deallocateCtx = [](_impl::_ClientContext *ctx) {
                 delete (ClientContext<_T> *)ctx;
             };
+            _resetCtx = [](_impl::_ClientContext *ctx) {
+                ((ClientContext<_T> *)ctx)->resetUserData();
+            };
         }
 
         ~ServerFramework() { }
@@ -67,7 +119,188 @@ namespace iocp {
 
         using _impl::_ServerFramework::shutdown;
 
+        typedef std::function<void (ClientContext<_T> *ctx, const Frame &frame)> FrameCallback;
+
+        // An onRecv which splits the bytes into the frames of format, however many a receive holds, and calls
+        // onFrame with every one in place. A frame over the max size or a malformed header closes the connection.
+        // Keep the max within the highWater of setRecvBufferSize, a frame completes only if it fits in the ring. e.g.
+        //   server.startup(ip, port, server.framed(FrameFormat::fixed(4, true, 65536), onFrame), onDisconnect);
+        RecvCallback framed(const FrameFormat &format, const FrameCallback &onFrame)
+        {
+            FrameDecoder decoder(format);
+            return [this, decoder, onFrame](ClientContext<_T> *ctx, const char *buf, size_t len)->size_t {
+                FrameDecoder::Result result;
+                size_t processed = decoder.decodeAll(buf, len, [ctx, &onFrame](const Frame &frame)->bool {
+                    onFrame(ctx, frame);
+                    return true;
+                }, &result);
+                if (result == FrameDecoder::TOO_LARGE || result == FrameDecoder::MALFORMED)
+                {
+                    // Closed after the receive. The bad frame is left unprocessed meanwhile, so nothing after it
+                    // is decoded.
+                    ctx->post([this](ClientContext<_T> *ctx) { disconnect(ctx->getId()); });
+                }
+                return processed;
+            };
+        }
+
+        // An onRecv which splits the bytes into the frames of format, as framed does, and dispatches every one by
+        // _Router, a MessageRouter (see MessageRouter.h), with no std::function call per message. A message which no
+        // route handles goes to onUnrouted, or closes the connection as a bad frame does if it's nullptr.
+        template <class _Router>
+        RecvCallback routed(const FrameFormat &format, const FrameCallback &onUnrouted = nullptr)
+        {
+            FrameDecoder decoder(format);
+            return [this, decoder, onUnrouted](ClientContext<_T> *ctx, const char *buf, size_t len)->size_t {
+                FrameDecoder::Result result;
+                size_t unrouted = 0;
+                size_t processed = decoder.decodeAll(buf, len, [ctx, &onUnrouted, &unrouted](const Frame &frame)->bool {
+                    if (_Router::dispatch(ctx, frame.body))
+                    {
+                        return true;
+                    }
+                    if (onUnrouted)
+                    {
+                        onUnrouted(ctx, frame);
+                        return true;
+                    }
+                    unrouted = frame.bytes.size();
+                    return false;
+                }, &result);
+                if (unrouted > 0 || result == FrameDecoder::TOO_LARGE || result == FrameDecoder::MALFORMED)
+                {
+                    // Left unprocessed as a bad frame, so nothing after it is dispatched before the close.
+                    ctx->post([this](ClientContext<_T> *ctx) { disconnect(ctx->getId()); });
+                }
+                return processed - unrouted;
+            };
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx, bool connected)> ConnectCallback;
+
+        // See _ServerFramework::connect, e.g. a backend of a gateway:
+        //   ConnectionId id = server.connect("10.0.0.2", 9000, onConnect, onRecv, onDisconnect);
+        //   server.postSend(id, request, len);  // Queued until connected.
+        // Any callback may be nullptr.
+        ConnectionId connect(const char *ip, uint16_t port,
+            const ConnectCallback &onConnect,
+            const RecvCallback &onRecv,
+            const DisconnectCallback &onDisconnect)
+        {
+            return _impl::_ServerFramework::connect(ip, port, makeHandler(onConnect, onRecv, onDisconnect));
+        }
+
+        // See _ServerFramework::addUpstream, the callbacks are the ones of every connection of the upstream.
+        bool addUpstream(const char *key, const char *ip, uint16_t port, size_t count,
+            const ConnectCallback &onConnect,
+            const RecvCallback &onRecv,
+            const DisconnectCallback &onDisconnect)
+        {
+            return _impl::_ServerFramework::addUpstream(key, ip, port, count, makeHandler(onConnect, onRecv, onDisconnect));
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx)> ResetCallback;
+
+        // Called when the ClientContext of a closed connection goes back to the pool, to clear the user data
+        // for the next connection. By default the user data is assigned _T().
+        // If it throws, the ClientContext is deleted instead.
+        void setResetCallback(const ResetCallback &onReset)
+        {
+            _resetCtx = [onReset](_impl::_ClientContext *ctx) {
+                onReset((ClientContext<_T> *)ctx);
+            };
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx)> SendQueueCallback;
+
+        // Called on the strand of a connection when its send queue grows over the high-water mark, and when it
+        // drains back to the low-water mark, see _ServerFramework::setSendQueueLimits. e.g. stop feeding a slow
+        // reader on onSendQueueFull, and catch it up on onWritable. Either may be nullptr. Set them before startup.
+        void setSendQueueCallbacks(const SendQueueCallback &onSendQueueFull, const SendQueueCallback &onWritable)
+        {
+            _onSendQueueFull = nullptr;
+            _onWritable = nullptr;
+            if (onSendQueueFull)
+            {
+                _onSendQueueFull = [onSendQueueFull](_impl::_ClientContext *ctx) {
+                    onSendQueueFull((ClientContext<_T> *)ctx);
+                };
+            }
+            if (onWritable)
+            {
+                _onWritable = [onWritable](_impl::_ClientContext *ctx) {
+                    onWritable((ClientContext<_T> *)ctx);
+                };
+            }
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx)> VisitCallback;
+
+        bool visitClient(ConnectionId id, const VisitCallback &visitor)
+        {
+            return _impl::_ServerFramework::visitClient(id, [&visitor](_impl::_ClientContext *ctx) {
+                visitor((ClientContext<_T> *)ctx);
+            });
+        }
+
+        bool post(const std::function<void ()> &task)
+        {
+            return _impl::_ServerFramework::post(task);
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx)> PostCallback;
+
+        // See _ServerFramework::post, e.g. from a game logic thread:
+        //   server.post(id, [](ClientContext<_T> *ctx) { ctx->postSend("tick", 4); });
+        bool post(ConnectionId id, const PostCallback &task)
+        {
+            return _impl::_ServerFramework::post(id, [task](_impl::_ClientContext *ctx) {
+                task((ClientContext<_T> *)ctx);
+            });
+        }
+
+        TimerId setTimer(uint64_t delay, uint64_t period, const TimerCallback &callback)
+        {
+            return _impl::_ServerFramework::setTimer(delay, period, callback);
+        }
+
+        typedef std::function<void (ClientContext<_T> *ctx, TimerId timerId)> ConnectionTimerCallback;
+
+        // See _ServerFramework::setTimer, e.g. a heartbeat:
+        //   server.setTimer(ctx->getId(), 30000, 30000, [](ClientContext<_T> *ctx, TimerId) { ctx->postSend("ping", 4); });
+        TimerId setTimer(ConnectionId id, uint64_t delay, uint64_t period, const ConnectionTimerCallback &callback)
+        {
+            return _impl::_ServerFramework::setTimer(id, delay, period, [callback](_impl::_ClientContext *ctx, TimerId timerId) {
+                callback((ClientContext<_T> *)ctx, timerId);
+            });
+        }
+
     private:
+        static _impl::_ConnectHandler makeHandler(const ConnectCallback &onConnect, const RecvCallback &onRecv,
+            const DisconnectCallback &onDisconnect)
+        {
+            _impl::_ConnectHandler handler;
+            if (onConnect)
+            {
+                handler.onConnect = [onConnect](_impl::_ClientContext *ctx, bool connected) {
+                    onConnect((ClientContext<_T> *)ctx, connected);
+                };
+            }
+            if (onRecv)
+            {
+                handler.onRecv = [onRecv](_impl::_ClientContext *ctx, const char *buf, size_t len)->size_t {
+                    return onRecv((ClientContext<_T> *)ctx, buf, len);
+                };
+            }
+            if (onDisconnect)
+            {
+                handler.onDisconnect = [onDisconnect](_impl::_ClientContext *ctx) {
+                    onDisconnect((ClientContext<_T> *)ctx);
+                };
+            }
+            return handler;
+        }
+
         ServerFramework(const ServerFramework &) = delete;
         ServerFramework(ServerFramework &&) = delete;
         ServerFramework &operator=(const ServerFramework &) = delete;
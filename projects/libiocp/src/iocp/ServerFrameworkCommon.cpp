@@ -0,0 +1,2157 @@
+#include <algorithm>
+
+#include "ServerFrameworkImpl.h"
+#include "ImplMacros.h"
+#include "common/Exceptions.h"
+
+#include <string.h>
+#if !PLATFORM_IS_WINDOWS
+#   include <unistd.h>
+#endif
+
+#if PLATFORM_IS_WINDOWS
+#   define STRAND_THREAD_LOCAL __declspec(thread)
+#else
+#   define STRAND_THREAD_LOCAL __thread
+#endif
+
+// The parts shared by all the backends.
+
+namespace iocp {
+    std::atomic<size_t> SendBuffer::_totalBytes(0);
+
+    namespace _impl {
+        static STRAND_THREAD_LOCAL _ClientContext *t_strandCtx = nullptr;  // The connection whose strand the thread runs.
+
+        bool _ServerFramework::dispatchRecv(_ClientContext *ctx) const
+        {
+            _RecvRing &ring = ctx->_recvRing;
+            while (!ring.empty())
+            {
+                size_t len = 0;
+                const char *buf = ring.peek(&len);
+                size_t bytesProcessed = notifyRecv(ctx, buf, len);
+                if (ctx->_closing)
+                {
+                    return false;  // Closed by the handler, e.g. by disconnect, the bytes left are dropped.
+                }
+                if (bytesProcessed > len)
+                {
+                    bytesProcessed = len;
+                }
+                ring.consume(bytesProcessed);
+                CONTINUE_IF(bytesProcessed == len);  // Go on with the bytes wrapped around, if any.
+
+                if (len == ring.size() + bytesProcessed)  // All the bytes have been seen, wait for more.
+                {
+                    break;
+                }
+
+                // The remainder straddles the end of the ring, join it with the bytes wrapped around and retry.
+                if (!ring.unwrap())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool _ServerFramework::dispatchRecv(_ClientContext *ctx, const char *buf, size_t len) const
+        {
+            _RecvRing &ring = ctx->_recvRing;
+            while (len > 0)
+            {
+                if (ring.empty())  // Process the bytes where they are.
+                {
+                    size_t bytesProcessed = notifyRecv(ctx, buf, len);
+                    if (ctx->_closing)
+                    {
+                        return false;  // Closed by the handler.
+                    }
+                    if (bytesProcessed >= len)
+                    {
+                        return true;
+                    }
+                    buf += bytesProcessed;
+                    len -= bytesProcessed;
+                }
+
+                // Cache the remainder bytes, as much as the ring holds, so a frame up to its size still completes.
+                const _RecvBufferSize &recvSize = ctx->_shard->recvSize;
+                size_t room = recvSize.highWater - ring.size();
+                size_t n = len < room ? len : room;
+                if (n == 0 || !ring.append(buf, n, recvSize.minSize, recvSize.highWater))
+                {
+                    return false;  // The ring takes too much memory.
+                }
+                buf += n;
+                len -= n;
+                if (!dispatchRecv(ctx))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t _ServerFramework::notifyRecv(_ClientContext *ctx, const char *buf, size_t len) const
+        {
+            if (ctx->_handler == nullptr)
+            {
+                return _onRecv(ctx, buf, len);
+            }
+            return ctx->_handler->onRecv ? ctx->_handler->onRecv(ctx, buf, len) : len;
+        }
+
+        void _ServerFramework::notifyDisconnect(_ClientContext *ctx)
+        {
+            const _ConnectHandler *handler = ctx->_handler.get();
+            if (handler == nullptr)
+            {
+                _onDisconnect(ctx);
+            }
+            else if (ctx->_connecting)
+            {
+                LOG_DEBUG("%16s:%5hu connect failed", ctx->_ip, ctx->_port);
+                if (handler->onConnect)
+                {
+                    handler->onConnect(ctx, false);
+                }
+            }
+            else if (handler->onDisconnect)
+            {
+                handler->onDisconnect(ctx);
+            }
+        }
+
+        void _ServerFramework::initSocket(SOCKET s) const
+        {
+            if (_noDelay)
+            {
+                int on = 1;
+                ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+            }
+        }
+
+        bool _ServerFramework::addClient(_Shard *shard, _ClientContext *ctx)
+        {
+            ctx->_shard = shard;
+            ctx->_id = _connections.insert(ctx);
+            if (ctx->_id == 0)
+            {
+                LOG_ERROR("connection table full!");
+                return false;
+            }
+            LOG_DEBUG("shard %u client count %lu", shard->index, (unsigned long)_connections.size());
+            return true;
+        }
+
+        void _ServerFramework::removeClient(_ClientContext *ctx)
+        {
+            LOG_DEBUG("shard %u client count %lu", ctx->_shard->index, (unsigned long)_connections.size() - 1);
+            _Shard *shard = ctx->_shard;
+            if (shard->timeouts.enabled())
+            {
+                shard->timerMutex.lock();
+                shard->timers.cancel(ctx->_timeoutTimer);
+                ctx->_timeoutTimer = 0;
+                shard->timerMutex.unlock();
+            }
+            if (_connections.remove(ctx->_id))
+            {
+                deallocateContext(ctx);
+            }
+        }
+
+        _ClientContext *_ServerFramework::acquireClient(ConnectionId id)
+        {
+            return _connections.acquire(id);
+        }
+
+        void _ServerFramework::releaseClient(_ClientContext *ctx)
+        {
+            if (_connections.release(ctx->_id))  // Removed while being held.
+            {
+                deallocateContext(ctx);
+            }
+        }
+
+        _ClientContext *_ServerFramework::allocateContext()
+        {
+            _ctxPoolMutex.lock();
+            if (!_ctxPool.empty())
+            {
+                _ClientContext *ctx = _ctxPool.back();
+                _ctxPool.pop_back();
+                ++_ctxPoolHits;
+                _ctxPoolMutex.unlock();
+                return ctx;
+            }
+            ++_ctxPoolMisses;
+            _ctxPoolMutex.unlock();
+            return _allocateCtx();
+        }
+
+        void _ServerFramework::deallocateContext(_ClientContext *ctx)
+        {
+            ctx->reset();
+            try
+            {
+                _resetCtx(ctx);
+            }
+            catch (...)
+            {
+                LOG_ERROR("reset callback threw, delete the context");
+                _deallocateCtx(ctx);
+                return;
+            }
+
+            bool pooled = false;
+            _ctxPoolMutex.lock();
+            if (_ctxPool.size() < _ctxMaxIdle && !_shouldQuit)
+            {
+                TRY_BLOCK_BEGIN
+                _ctxPool.push_back(ctx);
+                pooled = true;
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+            }
+            _ctxPoolMutex.unlock();
+
+            if (!pooled)
+            {
+                _deallocateCtx(ctx);
+            }
+        }
+
+        void _ServerFramework::warmContextPool()
+        {
+            _ctxPoolMutex.lock();
+            TRY_BLOCK_BEGIN
+            size_t warmSize = _ctxWarmSize < _ctxMaxIdle ? _ctxWarmSize : _ctxMaxIdle;
+            _ctxPool.reserve(warmSize);
+            while (_ctxPool.size() < warmSize)
+            {
+                _ClientContext *ctx = _allocateCtx();
+                BREAK_IF(ctx == nullptr);
+                _ctxPool.push_back(ctx);
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _ctxPoolMutex.unlock();
+        }
+
+        void _ServerFramework::drainContextPool()
+        {
+            mp::vector<_ClientContext *> pool;
+            _ctxPoolMutex.lock();
+            pool.swap(_ctxPool);
+            _ctxPoolMutex.unlock();
+            std::for_each(pool.begin(), pool.end(), _deallocateCtx);
+        }
+
+        ContextPoolStats _ServerFramework::getContextPoolStats()
+        {
+            ContextPoolStats stats;
+            _ctxPoolMutex.lock();
+            stats.hits = _ctxPoolHits;
+            stats.misses = _ctxPoolMisses;
+            stats.idle = _ctxPool.size();
+            _ctxPoolMutex.unlock();
+            return stats;
+        }
+
+        bool _ServerFramework::disconnect(ConnectionId id)
+        {
+            return postCall(id, [this](_ClientContext *ctx) { closeConnection(ctx); });
+        }
+
+        _ClientContext::POST_RESULT _ServerFramework::postSend(ConnectionId id, const char *buf, size_t len, uint64_t key)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return _ClientContext::POST_RESULT::FAIL;
+            }
+
+            _ClientContext::POST_RESULT ret = ctx->postSend(buf, len, key);
+            releaseClient(ctx);
+            return ret;
+        }
+
+        _ClientContext::POST_RESULT _ServerFramework::postSend(ConnectionId id, const SendBufferRef &buf)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return _ClientContext::POST_RESULT::FAIL;
+            }
+
+            _ClientContext::POST_RESULT ret = ctx->postSend(buf);
+            releaseClient(ctx);
+            return ret;
+        }
+
+        bool _ServerFramework::visitClient(ConnectionId id, const std::function<void (_ClientContext *ctx)> &visitor)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return false;
+            }
+
+            try
+            {
+                visitor(ctx);
+            }
+            catch (...)  // Never leak the hold, or the ClientContext is never deleted.
+            {
+                releaseClient(ctx);
+                throw;
+            }
+            releaseClient(ctx);
+            return true;
+        }
+
+        size_t _ServerFramework::broadcast(const SendBufferRef &payload, const ConnectionId *ids, size_t count)
+        {
+            size_t sent = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (postSend(ids[i], payload) != _ClientContext::POST_RESULT::FAIL)
+                {
+                    ++sent;
+                }
+            }
+            return sent;
+        }
+
+        bool _ServerFramework::joinGroup(const char *group, ConnectionId id)
+        {
+            _groupMutex.lock();
+            TRY_BLOCK_BEGIN
+            mp::vector<ConnectionId> &members = _groups[group];
+            if (std::find(members.begin(), members.end(), id) == members.end())
+            {
+                members.push_back(id);
+            }
+            CATCH_EXCEPTIONS
+            _groupMutex.unlock();
+            return false;
+            CATCH_BLOCK_END
+            _groupMutex.unlock();
+            return true;
+        }
+
+        void _ServerFramework::leaveGroup(const char *group, ConnectionId id)
+        {
+            _groupMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, mp::vector<ConnectionId> >::iterator it = _groups.find(group);
+            if (it != _groups.end())
+            {
+                mp::vector<ConnectionId> &members = it->second;
+                members.erase(std::remove(members.begin(), members.end(), id), members.end());
+                if (members.empty())
+                {
+                    _groups.erase(it);
+                }
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _groupMutex.unlock();
+        }
+
+        size_t _ServerFramework::getGroupSize(const char *group)
+        {
+            size_t size = 0;
+            _groupMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, mp::vector<ConnectionId> >::const_iterator it = _groups.find(group);
+            size = (it != _groups.end()) ? it->second.size() : 0;
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _groupMutex.unlock();
+            return size;
+        }
+
+        size_t _ServerFramework::broadcast(const char *group, const SendBufferRef &payload)
+        {
+            // Send to a snapshot of the members, so that the sends don't block joining and leaving.
+            mp::vector<ConnectionId> members;
+            _groupMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, mp::vector<ConnectionId> >::const_iterator it = _groups.find(group);
+            if (it != _groups.end())
+            {
+                members = it->second;
+            }
+            CATCH_EXCEPTIONS
+            _groupMutex.unlock();
+            return 0;
+            CATCH_BLOCK_END
+            _groupMutex.unlock();
+
+            size_t sent = 0;
+            mp::vector<ConnectionId> gone;
+            for (size_t i = 0; i < members.size(); ++i)
+            {
+                if (postSend(members[i], payload) != _ClientContext::POST_RESULT::FAIL)
+                {
+                    ++sent;
+                    continue;
+                }
+                _ClientContext *ctx = acquireClient(members[i]);
+                if (ctx != nullptr)  // Failed to send, but not gone.
+                {
+                    releaseClient(ctx);
+                    continue;
+                }
+                TRY_BLOCK_BEGIN
+                gone.push_back(members[i]);
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+            }
+
+            if (!gone.empty())  // Drop the gone connections.
+            {
+                _groupMutex.lock();
+                TRY_BLOCK_BEGIN
+                std::map<std::string, mp::vector<ConnectionId> >::iterator it = _groups.find(group);
+                if (it != _groups.end())
+                {
+                    mp::vector<ConnectionId> &m = it->second;
+                    for (size_t i = 0; i < gone.size(); ++i)
+                    {
+                        m.erase(std::remove(m.begin(), m.end(), gone[i]), m.end());
+                    }
+                    if (m.empty())
+                    {
+                        _groups.erase(it);
+                    }
+                }
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+                _groupMutex.unlock();
+            }
+            return sent;
+        }
+
+        void _ServerFramework::setRecvBufferSize(size_t minSize, size_t initialSize, size_t highWater)
+        {
+            // Keep 64 <= minSize <= initialSize <= highWater.
+            _recvSize.highWater = highWater < 64 ? 64 : highWater;
+            _recvSize.minSize = minSize < 64 ? 64 : (minSize > _recvSize.highWater ? _recvSize.highWater : minSize);
+            _recvSize.initialSize = initialSize < _recvSize.minSize ? _recvSize.minSize
+                : (initialSize > _recvSize.highWater ? _recvSize.highWater : initialSize);
+        }
+
+        void _ServerFramework::setConnectionTimeouts(uint32_t idle, uint32_t read, uint32_t write)
+        {
+            _timeouts.idle = idle;
+            _timeouts.read = read;
+            _timeouts.write = write;
+        }
+
+        void _ServerFramework::setSendQueueLimits(size_t lowWater, size_t highWater, size_t maxBytes, SendOverflowPolicy policy)
+        {
+            // Keep lowWater <= highWater.
+            _sendLimits.lowWater = lowWater < highWater ? lowWater : highWater;
+            _sendLimits.highWater = highWater;
+            _sendLimits.maxBytes = maxBytes;
+            _sendLimits.policy = policy;
+        }
+
+        ConnectionId _ServerFramework::connect(const char *ip, uint16_t port, const _ConnectHandler &handler)
+        {
+            if (_shards.empty() || _shouldQuit || ip == nullptr)
+            {
+                return 0;
+            }
+
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = ::inet_addr(ip);
+            if (addr.sin_addr.s_addr == INADDR_NONE)
+            {
+                LOG_ERROR("connect to %s: not an IPv4 address", ip);
+                return 0;
+            }
+
+            // Spread over the shards as the accepted connections.
+            _Shard *shard = _shards[_nextConnectShard++ % _shards.size()];
+            _ClientContext *ctx = nullptr;
+            TRY_BLOCK_BEGIN
+            ctx = allocateContext();
+            if (ctx != nullptr)
+            {
+                ctx->_handler = std::make_shared<_ConnectHandler>(handler);
+            }
+            CATCH_EXCEPTIONS
+            if (ctx != nullptr)
+            {
+                deallocateContext(ctx);
+            }
+            return 0;
+            CATCH_BLOCK_END
+            if (ctx == nullptr)
+            {
+                LOG_ERROR("new context out of memory!");
+                return 0;
+            }
+            if (!addClient(shard, ctx))
+            {
+                deallocateContext(ctx);
+                return 0;
+            }
+
+            strncpy(ctx->_ip, ip, 16);
+            ctx->_port = port;
+            ctx->_connectAddr = addr;
+            ctx->_connecting = true;
+            ctx->_sending = true;
+
+            // Nobody knows the ID yet, so the connection stays until the connect begins on its strand, which runs
+            // it before any send. The connect may be done by then.
+            ConnectionId id = ctx->_id;
+            if (!ctx->post([this](_ClientContext *ctx) { beginConnect(ctx); }))
+            {
+                ctx->_connecting = false;
+                ctx->_sending = false;
+                removeClient(ctx);
+                return 0;
+            }
+
+            if (_connectTimeout != 0)
+            {
+                setTimer(id, _connectTimeout, 0, [this](_ClientContext *ctx, TimerId) {
+                    if (ctx->_connecting && !ctx->_closing)
+                    {
+                        LOG_DEBUG("%16s:%5hu connect timeout", ctx->_ip, ctx->_port);
+                        closeConnection(ctx);
+                    }
+                });
+            }
+            return id;
+        }
+
+        bool _ServerFramework::finishConnect(_ClientContext *ctx)
+        {
+            ctx->_connecting = false;
+            ctx->_sending = false;
+            LOG_DEBUG("%16s:%5hu connected", ctx->_ip, ctx->_port);
+            if (ctx->_handler->onConnect)
+            {
+                ctx->_handler->onConnect(ctx, true);
+            }
+
+            // The sends queued while connecting.
+            return ctx->_closing || ctx->_sendChain.empty() || ctx->scheduleFlush() != _ClientContext::POST_RESULT::FAIL;
+        }
+
+        void _ServerFramework::setReconnectBackoff(uint32_t initial, uint32_t max)
+        {
+            // Keep 1 <= initial <= max.
+            _reconnectInitial = initial < 1 ? 1 : initial;
+            _reconnectMax = max < _reconnectInitial ? _reconnectInitial : max;
+        }
+
+        bool _ServerFramework::addUpstream(const char *key, const char *ip, uint16_t port, size_t count, const _ConnectHandler &handler)
+        {
+            if (count == 0 || _shards.empty() || ip == nullptr)
+            {
+                return false;
+            }
+
+            std::shared_ptr<_Upstream> upstream;
+            bool added = false;
+            TRY_BLOCK_BEGIN
+            upstream = std::make_shared<_Upstream>();
+            strncpy(upstream->ip, ip, 16);
+            upstream->port = port;
+            upstream->handler = handler;
+            _UpstreamSlot slot = { 0, false, 0 };
+            upstream->slots.assign(count, slot);
+            CATCH_EXCEPTIONS
+            return false;
+            CATCH_BLOCK_END
+
+            _upstreamMutex.lock();
+            TRY_BLOCK_BEGIN
+            added = _upstreams.insert(std::make_pair(std::string(key), upstream)).second;
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _upstreamMutex.unlock();
+            if (!added)
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                connectUpstream(upstream, i);
+            }
+            return true;
+        }
+
+        void _ServerFramework::removeUpstream(const char *key)
+        {
+            mp::vector<ConnectionId> ids;
+            _upstreamMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, std::shared_ptr<_Upstream> >::iterator it = _upstreams.find(key);
+            if (it != _upstreams.end())
+            {
+                _Upstream *upstream = it->second.get();
+                upstream->removed = true;
+                for (size_t i = 0; i < upstream->slots.size(); ++i)
+                {
+                    if (upstream->slots[i].connected)
+                    {
+                        ids.push_back(upstream->slots[i].id);
+                    }
+                }
+                _upstreams.erase(it);
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _upstreamMutex.unlock();
+
+            // The ones still connecting are closed once they connect.
+            for (size_t i = 0; i < ids.size(); ++i)
+            {
+                disconnect(ids[i]);
+            }
+        }
+
+        void _ServerFramework::clearUpstreams()
+        {
+            _upstreamMutex.lock();
+            std::map<std::string, std::shared_ptr<_Upstream> >::iterator it = _upstreams.begin();
+            for (; it != _upstreams.end(); ++it)
+            {
+                it->second->removed = true;
+            }
+            _upstreams.clear();
+            _upstreamMutex.unlock();
+        }
+
+        ConnectionId _ServerFramework::getUpstream(const char *key, uint64_t affinity)
+        {
+            ConnectionId id = 0;
+            _upstreamMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, std::shared_ptr<_Upstream> >::const_iterator it = _upstreams.find(key);
+            if (it != _upstreams.end())
+            {
+                // From the slot of the affinity, or the next one, to the first connected.
+                _Upstream *upstream = it->second.get();
+                size_t count = upstream->slots.size();
+                size_t first = affinity != 0 ? (size_t)(affinity % count) : upstream->next;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    size_t index = (first + i) % count;
+                    CONTINUE_IF(!upstream->slots[index].connected);
+                    id = upstream->slots[index].id;
+                    if (affinity == 0)
+                    {
+                        upstream->next = (index + 1) % count;
+                    }
+                    break;
+                }
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _upstreamMutex.unlock();
+            return id;
+        }
+
+        size_t _ServerFramework::getUpstreamSize(const char *key)
+        {
+            size_t size = 0;
+            _upstreamMutex.lock();
+            TRY_BLOCK_BEGIN
+            std::map<std::string, std::shared_ptr<_Upstream> >::const_iterator it = _upstreams.find(key);
+            if (it != _upstreams.end())
+            {
+                const mp::vector<_UpstreamSlot> &slots = it->second->slots;
+                for (size_t i = 0; i < slots.size(); ++i)
+                {
+                    size += slots[i].connected ? 1 : 0;
+                }
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            _upstreamMutex.unlock();
+            return size;
+        }
+
+        void _ServerFramework::connectUpstream(const std::shared_ptr<_Upstream> &upstream, size_t index)
+        {
+            // The slot follows its connection by the callbacks, which run on its strand.
+            ConnectionId id = 0;
+            TRY_BLOCK_BEGIN
+            _ConnectHandler handler;
+            handler.onConnect = [this, upstream, index](_ClientContext *ctx, bool connected) {
+                _upstreamMutex.lock();
+                _UpstreamSlot &slot = upstream->slots[index];
+                slot.connected = connected;
+                if (connected)
+                {
+                    slot.id = ctx->_id;
+                    slot.backoff = 0;
+                }
+                bool removed = upstream->removed;
+                _upstreamMutex.unlock();
+
+                if (upstream->handler.onConnect)
+                {
+                    upstream->handler.onConnect(ctx, connected);
+                }
+                if (!connected)
+                {
+                    reconnectUpstream(upstream, index);
+                }
+                else if (removed)
+                {
+                    closeConnection(ctx);  // Connected after removeUpstream.
+                }
+            };
+            handler.onRecv = upstream->handler.onRecv;
+            handler.onDisconnect = [this, upstream, index](_ClientContext *ctx) {
+                _upstreamMutex.lock();
+                upstream->slots[index].connected = false;
+                _upstreamMutex.unlock();
+
+                if (upstream->handler.onDisconnect)
+                {
+                    upstream->handler.onDisconnect(ctx);
+                }
+                reconnectUpstream(upstream, index);
+            };
+            id = connect(upstream->ip, upstream->port, handler);
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            if (id == 0)
+            {
+                reconnectUpstream(upstream, index);
+            }
+        }
+
+        void _ServerFramework::reconnectUpstream(const std::shared_ptr<_Upstream> &upstream, size_t index)
+        {
+            _upstreamMutex.lock();
+            if (upstream->removed || _shouldQuit)
+            {
+                _upstreamMutex.unlock();
+                return;
+            }
+            _UpstreamSlot &slot = upstream->slots[index];
+            slot.backoff = slot.backoff == 0 ? _reconnectInitial
+                : (slot.backoff < _reconnectMax / 2 ? slot.backoff * 2 : _reconnectMax);
+
+            // Anywhere in the upper half, so the connections to a restarted server don't come back in lockstep.
+            upstream->seed = upstream->seed * 1103515245 + 12345;
+            uint32_t delay = slot.backoff / 2 + (upstream->seed >> 8) % (slot.backoff / 2 + 1);
+            _upstreamMutex.unlock();
+
+            LOG_DEBUG("%16s:%5hu reconnect in %u ms", upstream->ip, upstream->port, delay);
+            if (setTimer(delay, 0, [this, upstream, index](TimerId) { connectUpstream(upstream, index); }) == 0)
+            {
+                LOG_ERROR("%16s:%5hu reconnect failed", upstream->ip, upstream->port);
+            }
+        }
+
+        TimerId _ServerFramework::setTimer(uint64_t delay, uint64_t period, const TimerCallback &callback)
+        {
+            if (_shards.empty())
+            {
+                return 0;
+            }
+            _Shard *shard = _shards[_nextTimerShard++ % _shards.size()];
+            return scheduleTimer(shard, delay, period, callback);
+        }
+
+        TimerId _ServerFramework::setTimer(ConnectionId id, uint64_t delay, uint64_t period,
+            const std::function<void (_ClientContext *ctx, TimerId timerId)> &callback)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return 0;
+            }
+            _Shard *shard = ctx->_shard;
+            releaseClient(ctx);
+
+            return scheduleTimer(shard, delay, period, [this, id, callback](TimerId timerId) {
+                if (!postCall(id, [callback, timerId](_ClientContext *ctx) { callback(ctx, timerId); }))
+                {
+                    cancelTimer(timerId);  // The connection has gone.
+                }
+            });
+        }
+
+        bool _ServerFramework::cancelTimer(TimerId id)
+        {
+            // The shard is the tag of the ID.
+            size_t index = (size_t)(id >> 56);
+            if (index >= _shards.size())
+            {
+                return false;
+            }
+            _Shard *shard = _shards[index];
+            shard->timerMutex.lock();
+            bool ret = shard->timers.cancel(id);
+            shard->timerMutex.unlock();
+            return ret;
+        }
+
+        TimerId _ServerFramework::scheduleTimer(_Shard *shard, uint64_t delay, uint64_t period, const TimerCallback &callback)
+        {
+            uint64_t now = TimerWheel::currentTime();
+            uint64_t expiry = delay < UINT64_MAX - now ? now + delay : UINT64_MAX;
+            TimerId id = 0;
+            bool wake = false;
+
+            shard->timerMutex.lock();
+            TRY_BLOCK_BEGIN
+            id = shard->timers.schedule(now, delay, period, callback);
+            if (expiry < shard->timerDeadline)  // Not while the timers run, the wait is computed after them.
+            {
+                shard->timerDeadline = expiry;
+                wake = true;
+            }
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            shard->timerMutex.unlock();
+
+            if (wake)
+            {
+                wakeShard(shard);
+            }
+            return id;
+        }
+
+        uint64_t _ServerFramework::runTimers(_Shard *shard, mp::vector<ExpiredTimer> &expired)
+        {
+            uint64_t now = TimerWheel::currentTime();
+            shard->timerMutex.lock();
+            TRY_BLOCK_BEGIN
+            shard->timers.advance(now, expired);
+            CATCH_EXCEPTIONS
+            CATCH_BLOCK_END
+            shard->timerDeadline = 0;
+            shard->timerMutex.unlock();
+
+            // Out of the lock, so the callbacks can schedule and cancel timers.
+            for (size_t i = 0; i < expired.size(); ++i)
+            {
+                TRY_BLOCK_BEGIN
+                expired[i].callback(expired[i].id);
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+            }
+            expired.clear();
+
+            shard->timerMutex.lock();
+            uint64_t next = shard->timers.nextExpiry();
+            shard->timerDeadline = next;
+            shard->timerMutex.unlock();
+
+            if (next == UINT64_MAX)
+            {
+                return UINT64_MAX;
+            }
+            now = TimerWheel::currentTime();
+            return next > now ? next - now : 0;
+        }
+
+        void _ServerFramework::startTimeouts(_ClientContext *ctx)
+        {
+            const _ConnectionTimeouts &timeouts = ctx->_shard->timeouts;
+            if (!timeouts.enabled())
+            {
+                return;
+            }
+
+            uint64_t now = TimerWheel::currentTime();
+            ctx->_lastRecvTime.store(now, std::memory_order_relaxed);
+            ctx->_lastSendTime.store(now, std::memory_order_relaxed);
+
+            uint32_t delay = UINT32_MAX;
+            if (timeouts.idle != 0 && timeouts.idle < delay) delay = timeouts.idle;
+            if (timeouts.read != 0 && timeouts.read < delay) delay = timeouts.read;
+            if (timeouts.write != 0 && timeouts.write < delay) delay = timeouts.write;
+            armTimeout(ctx, delay);
+        }
+
+        void _ServerFramework::armTimeout(_ClientContext *ctx, uint64_t delay)
+        {
+            // Only the worker threads of the shard arm it, which compute their waits after, so no need to wake them up.
+            ConnectionId id = ctx->_id;
+            _Shard *shard = ctx->_shard;
+            uint64_t now = TimerWheel::currentTime();
+            shard->timerMutex.lock();
+            TRY_BLOCK_BEGIN
+            ctx->_timeoutTimer = shard->timers.schedule(now, delay, 0, [this, id](TimerId) {
+                postCall(id, [this](_ClientContext *ctx) { checkTimeouts(ctx); });
+            });
+            CATCH_EXCEPTIONS
+            ctx->_timeoutTimer = 0;
+            CATCH_BLOCK_END
+            shard->timerMutex.unlock();
+        }
+
+        void _ServerFramework::checkTimeouts(_ClientContext *ctx)
+        {
+            if (ctx->_closing)
+            {
+                return;
+            }
+
+            const _ConnectionTimeouts &timeouts = ctx->_shard->timeouts;
+            uint64_t lastRecv = ctx->_lastRecvTime.load(std::memory_order_relaxed);
+            uint64_t lastSend = ctx->_lastSendTime.load(std::memory_order_relaxed);
+            bool sendPending = !ctx->_sendChain.empty();
+
+            // The earliest deadline of the timeouts on, a write one only counts while bytes are waiting.
+            uint64_t deadline = UINT64_MAX;
+            const char *reason = nullptr;
+            if (timeouts.idle != 0 && (lastRecv > lastSend ? lastRecv : lastSend) + timeouts.idle < deadline)
+            {
+                deadline = (lastRecv > lastSend ? lastRecv : lastSend) + timeouts.idle;
+                reason = "idle";
+            }
+            if (timeouts.read != 0 && lastRecv + timeouts.read < deadline)
+            {
+                deadline = lastRecv + timeouts.read;
+                reason = "read";
+            }
+            if (timeouts.write != 0 && sendPending && lastSend + timeouts.write < deadline)
+            {
+                deadline = lastSend + timeouts.write;
+                reason = "write";
+            }
+
+            uint64_t now = TimerWheel::currentTime();
+            if (deadline <= now)
+            {
+                LOG_DEBUG("%16s:%5hu %s timeout", ctx->_ip, ctx->_port, reason);
+                (void)reason;
+                closeConnection(ctx);
+            }
+            else
+            {
+                // Nothing counts for a write timeout alone until a send waits, look again a timeout later.
+                armTimeout(ctx, deadline != UINT64_MAX ? deadline - now : timeouts.write);
+            }
+        }
+
+        bool _ServerFramework::queueTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task)
+        {
+            // Pushed before counted, so the thread running the strand always finds the tasks it counts.
+            ctx->_strandQueue.push(task);
+            if (ctx->_strandPending.fetch_add(1, std::memory_order_acq_rel) != 0)
+            {
+                return false;  // Runs after the ones queued before.
+            }
+            _connections.retain(ctx->_id);
+            return true;
+        }
+
+        void _ServerFramework::postTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task)
+        {
+            if (queueTask(ctx, task))
+            {
+                scheduleStrand(ctx);
+            }
+        }
+
+        bool _ServerFramework::postCall(ConnectionId id, const std::function<void (_ClientContext *ctx)> &func)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return false;
+            }
+
+            if (ctx->onStrand())
+            {
+                try
+                {
+                    func(ctx);
+                }
+                catch (...)  // Never leak the hold, or the ClientContext is never deleted.
+                {
+                    releaseClient(ctx);
+                    throw;
+                }
+                releaseClient(ctx);
+                return true;
+            }
+
+            _CALL_TASK_DATA *task = newCallTask(func);
+            if (task != nullptr)
+            {
+                postTask(ctx, task);
+            }
+            releaseClient(ctx);
+            return task != nullptr;
+        }
+
+        bool _ServerFramework::post(const std::function<void ()> &task)
+        {
+            if (_shards.empty())
+            {
+                return false;
+            }
+
+            // The tasks of a thread go to the same shard, so a burst of them is run in a batch.
+            _Shard *shard = _shards[std::hash<std::thread::id>()(std::this_thread::get_id()) % _shards.size()];
+
+            void *p = mp::poolAllocate(sizeof(_POST_TASK_DATA));
+            if (p == nullptr)
+            {
+                LOG_ERROR("new post task out of memory!");
+                return false;
+            }
+            _POST_TASK_DATA *posted = new (p) _POST_TASK_DATA;
+            posted->type = _OPERATION_TYPE::POST_TASK;
+            TRY_BLOCK_BEGIN
+            posted->call = task;
+            CATCH_EXCEPTIONS
+            posted->~_POST_TASK_DATA();
+            mp::poolDeallocate(posted, sizeof(_POST_TASK_DATA));
+            return false;
+            CATCH_BLOCK_END
+
+            if (shard->postedTasks.push(posted))
+            {
+                scheduleTasks(shard);  // The worker thread takes the ones pushed meanwhile too.
+            }
+            return true;
+        }
+
+        bool _ServerFramework::post(ConnectionId id, const std::function<void (_ClientContext *ctx)> &task)
+        {
+            _ClientContext *ctx = acquireClient(id);
+            if (ctx == nullptr)
+            {
+                return false;
+            }
+            bool ret = ctx->post(task);
+            releaseClient(ctx);
+            return ret;
+        }
+
+        SendStats _ServerFramework::getSendStats() const
+        {
+            SendStats stats = { 0, 0 };
+            for (size_t i = 0; i < _shards.size(); ++i)
+            {
+                stats.messages += _shards[i]->sendMessages.load(std::memory_order_relaxed);
+                stats.writes += _shards[i]->sendWrites.load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+
+        void _ServerFramework::flushSend(_ClientContext *ctx)
+        {
+            ctx->_flushPending = false;
+            if (ctx->_closing || ctx->_sendChain.empty())
+            {
+                return;
+            }
+            if (ctx->startSend() == _ClientContext::POST_RESULT::FAIL)
+            {
+                // The senders have been told it's queued, and the stream can't go on without the messages.
+                LOG_DEBUG("%16s:%5hu flush failed", ctx->_ip, ctx->_port);
+                closeConnection(ctx);
+                return;
+            }
+            ctx->checkSendWater();
+        }
+
+#if IOCP_BACKEND != IOCP_BACKEND_IOCP
+        void _ServerFramework::flushSends(_Shard *shard)
+        {
+            // By index, the callbacks of checkSendWater may queue more.
+            mp::vector<_ClientContext *> &flushList = shard->flushList;
+            for (size_t i = 0; i < flushList.size(); ++i)
+            {
+                _ClientContext *ctx = flushList[i];
+                flushSend(ctx);
+                releaseClient(ctx);  // Deleted here if the connection has been closed meanwhile.
+            }
+            flushList.clear();
+        }
+#endif
+
+        PostStats _ServerFramework::getPostStats() const
+        {
+            PostStats stats = { 0, 0 };
+            for (size_t i = 0; i < _shards.size(); ++i)
+            {
+                stats.tasks += _shards[i]->tasksRun.load(std::memory_order_relaxed);
+                stats.batches += _shards[i]->taskBatches.load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+
+        void _ServerFramework::runPostedTasks(_Shard *shard)
+        {
+            _PER_IO_OPERATION_DATA *task = shard->postedTasks.popAll();
+            if (task == nullptr)
+            {
+                return;
+            }
+
+            uint64_t count = 0;
+            while (task != nullptr)
+            {
+                _POST_TASK_DATA *posted = (_POST_TASK_DATA *)task;
+                task = task->next;
+                TRY_BLOCK_BEGIN
+                posted->call();
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+                posted->~_POST_TASK_DATA();
+                mp::poolDeallocate(posted, sizeof(_POST_TASK_DATA));
+                ++count;
+            }
+            shard->tasksRun.fetch_add(count, std::memory_order_relaxed);
+            shard->taskBatches.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void _ServerFramework::dropPostedTasks(_Shard *shard)
+        {
+            _PER_IO_OPERATION_DATA *task = shard->postedTasks.popAll();
+            while (task != nullptr)
+            {
+                _POST_TASK_DATA *posted = (_POST_TASK_DATA *)task;
+                task = task->next;
+                posted->~_POST_TASK_DATA();
+                mp::poolDeallocate(posted, sizeof(_POST_TASK_DATA));
+            }
+        }
+
+        void _ServerFramework::runStrand(_ClientContext *ctx)
+        {
+            t_strandCtx = ctx;
+            for (size_t ran = 1; ; ++ran)
+            {
+                if (ctx->_strandLocal == nullptr)
+                {
+                    ctx->_strandLocal = ctx->_strandQueue.popAll();
+                }
+                _PER_IO_OPERATION_DATA *task = ctx->_strandLocal;
+                ctx->_strandLocal = task->next;
+                runTask(ctx, task);
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+                // The end of the tasks taken, flush the sends while the strand is still ours.
+                if (ctx->_flushPending && (ctx->_strandLocal == nullptr || ran == STRAND_BATCH_SIZE))
+                {
+                    flushSend(ctx);
+                }
+#endif
+
+                if (ctx->_strandPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    break;  // Idle.
+                }
+                if (ran == STRAND_BATCH_SIZE)
+                {
+                    // Still held, it's dropped by the worker thread which runs the rest.
+                    t_strandCtx = nullptr;
+                    scheduleStrand(ctx);
+                    return;
+                }
+            }
+            t_strandCtx = nullptr;
+
+            // The ClientContext is deleted here if the connection has been closed meanwhile.
+            releaseClient(ctx);
+        }
+
+        void _ServerFramework::runTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task)
+        {
+            switch (task->type)
+            {
+            case _OPERATION_TYPE::SEND_TASK:
+                runSendTask(ctx, (_SEND_TASK_DATA *)task);
+                break;
+            case _OPERATION_TYPE::CALL_TASK:
+                TRY_BLOCK_BEGIN
+                ((_CALL_TASK_DATA *)task)->call(ctx);
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+                deleteCallTask((_CALL_TASK_DATA *)task);
+                break;
+            default:
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+                doCompletion(ctx, task);
+#endif
+                break;
+            }
+        }
+
+        void _ServerFramework::dropTasks(_ClientContext *ctx)
+        {
+            _PER_IO_OPERATION_DATA *lists[4] = {
+                ctx->_strandLocal, ctx->_strandQueue.popAll(), ctx->_computeLocal, ctx->_computeQueue.popAll()
+            };
+            ctx->_strandLocal = nullptr;
+            ctx->_computeLocal = nullptr;
+            for (int i = 0; i < 4; ++i)
+            {
+                _PER_IO_OPERATION_DATA *task = lists[i];
+                while (task != nullptr)
+                {
+                    _PER_IO_OPERATION_DATA *next = task->next;
+                    if (task->type == _OPERATION_TYPE::SEND_TASK)
+                    {
+                        deleteSendTask((_SEND_TASK_DATA *)task);
+                    }
+                    else if (task->type == _OPERATION_TYPE::CALL_TASK)
+                    {
+                        deleteCallTask((_CALL_TASK_DATA *)task);
+                    }
+                    task = next;
+                }
+            }
+            ctx->_strandPending.store(0, std::memory_order_relaxed);
+            ctx->_computePending.store(0, std::memory_order_relaxed);
+        }
+
+        void _ServerFramework::runCompute(_ClientContext *ctx)
+        {
+            for (size_t ran = 1; ; ++ran)
+            {
+                if (ctx->_computeLocal == nullptr)
+                {
+                    ctx->_computeLocal = ctx->_computeQueue.popAll();
+                }
+                _CALL_TASK_DATA *task = (_CALL_TASK_DATA *)ctx->_computeLocal;
+                ctx->_computeLocal = task->next;
+                TRY_BLOCK_BEGIN
+                task->call(ctx);
+                CATCH_EXCEPTIONS
+                CATCH_BLOCK_END
+                deleteCallTask(task);
+
+                if (ctx->_computePending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    break;  // All done.
+                }
+                if (ran == STRAND_BATCH_SIZE && _computePool.submit([this, ctx]() { runCompute(ctx); }))
+                {
+                    return;  // Still held, it's dropped by the compute thread which runs the rest.
+                }
+            }
+
+            // The ClientContext is deleted here if the connection has been closed meanwhile.
+            releaseClient(ctx);
+        }
+
+        _CALL_TASK_DATA *_ServerFramework::newCallTask(const std::function<void (_ClientContext *ctx)> &func)
+        {
+            void *p = mp::poolAllocate(sizeof(_CALL_TASK_DATA));
+            if (p == nullptr)
+            {
+                LOG_ERROR("new call task out of memory!");
+                return nullptr;
+            }
+            _CALL_TASK_DATA *task = new (p) _CALL_TASK_DATA;
+            task->type = _OPERATION_TYPE::CALL_TASK;
+            TRY_BLOCK_BEGIN
+            task->call = func;
+            CATCH_EXCEPTIONS
+            deleteCallTask(task);
+            return nullptr;
+            CATCH_BLOCK_END
+            return task;
+        }
+
+        void _ServerFramework::deleteCallTask(_CALL_TASK_DATA *task)
+        {
+            task->~_CALL_TASK_DATA();
+            mp::poolDeallocate(task, sizeof(_CALL_TASK_DATA));
+        }
+
+        _SEND_TASK_DATA *_ServerFramework::newSendTask(size_t count, size_t len)
+        {
+            size_t size = sizeof(_SEND_TASK_DATA) + (count > 0 ? count * sizeof(_SendSegment) : len);
+            void *p = mp::poolAllocate(size);
+            if (p == nullptr)
+            {
+                LOG_ERROR("new send task out of memory!");
+                return nullptr;
+            }
+            _SEND_TASK_DATA *task = new (p) _SEND_TASK_DATA;
+            task->type = _OPERATION_TYPE::SEND_TASK;
+            task->count = count;
+            task->len = len;
+            task->key = 0;
+            return task;
+        }
+
+        void _ServerFramework::deleteSendTask(_SEND_TASK_DATA *task)
+        {
+            _SendSegment *segs = (_SendSegment *)(task + 1);
+            for (size_t i = 0; i < task->count; ++i)
+            {
+                segs[i].~_SendSegment();
+            }
+            size_t size = sizeof(_SEND_TASK_DATA) + (task->count > 0 ? task->count * sizeof(_SendSegment) : task->len);
+            mp::poolDeallocate(task, size);
+        }
+
+        void _ServerFramework::runSendTask(_ClientContext *ctx, _SEND_TASK_DATA *task)
+        {
+            if (!ctx->_closing)
+            {
+                if (!ctx->admitSend(task->len, task->key))
+                {
+                    // Dropped by the overflow policy, the messages are whole either way.
+                    LOG_DEBUG("%16s:%5hu posted send dropped", ctx->_ip, ctx->_port);
+                    deleteSendTask(task);
+                    return;
+                }
+                bool queued = task->count > 0 ? ctx->pushSend((const _SendSegment *)(task + 1), task->count)
+                    : ctx->appendSend((const char *)(task + 1), task->len);
+                if (!queued)
+                {
+                    ctx->cancelSend(task->len);
+                }
+                if (!queued || ctx->scheduleFlush() == _ClientContext::POST_RESULT::FAIL)
+                {
+                    // The poster has been told it's queued, and the stream can't go on without the message.
+                    LOG_DEBUG("%16s:%5hu posted send failed", ctx->_ip, ctx->_port);
+                    closeConnection(ctx);
+                }
+                else
+                {
+                    ctx->checkSendWater();
+                }
+            }
+            deleteSendTask(task);
+        }
+
+#if IOCP_BACKEND != IOCP_BACKEND_IOCP
+        void _ServerFramework::scheduleStrand(_ClientContext *ctx)
+        {
+            _Shard *shard = ctx->_shard;
+            if (shard->postedStrands.push(&ctx->_strandIOData))
+            {
+                wakeShard(shard);
+            }
+        }
+
+        void _ServerFramework::runPostedStrands(_Shard *shard)
+        {
+            _PER_IO_OPERATION_DATA *ioData = shard->postedStrands.popAll();
+            while (ioData != nullptr)
+            {
+                _PER_IO_OPERATION_DATA *next = ioData->next;  // It may be posted again while its strand runs.
+                runStrand((_ClientContext *)ioData->completionKey);
+                ioData = next;
+            }
+        }
+#endif
+
+        size_t _ServerFramework::getClientCount() const
+        {
+            return _connections.size();
+        }
+
+        void _ServerFramework::bindToCore(std::thread *t, unsigned core)
+        {
+            unsigned coreCnt = std::thread::hardware_concurrency();
+            if (coreCnt == 0)
+            {
+                return;
+            }
+            core %= coreCnt;
+#if PLATFORM_IS_WINDOWS
+            if (core < sizeof(DWORD_PTR) * 8)
+            {
+                ::SetThreadAffinityMask(t->native_handle(), (DWORD_PTR)1 << core);
+            }
+#else
+            cpu_set_t cpuSet;
+            CPU_ZERO(&cpuSet);
+            CPU_SET(core, &cpuSet);
+            ::pthread_setaffinity_np(t->native_handle(), sizeof(cpuSet), &cpuSet);
+#endif
+        }
+
+        //
+        // _ClientContext
+        //
+
+        bool _ClientContext::onStrand() const
+        {
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            return t_strandCtx == this;
+#else
+            return std::this_thread::get_id() == _shard->threadId;
+#endif
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::scheduleFlush()
+        {
+            if (!_shard->sendBatching)
+            {
+                return startSend();
+            }
+            if (_flushPending)
+            {
+                return POST_RESULT::CACHED;
+            }
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            // Flushed by runStrand, which runs all the work of the connection.
+#else
+            // Flushed by the loop before its next wait, the list holds the connection until then.
+            TRY_BLOCK_BEGIN
+            _shard->flushList.push_back(this);
+            CATCH_EXCEPTIONS
+            return startSend();
+            CATCH_BLOCK_END
+            _shard->server->_connections.retain(_id);
+#endif
+            _flushPending = true;
+            return POST_RESULT::CACHED;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::flush()
+        {
+            if (!onStrand())
+            {
+                return post([](_ClientContext *ctx) { ctx->flush(); }) ? POST_RESULT::CACHED : POST_RESULT::FAIL;
+            }
+            if (_closing)
+            {
+                return POST_RESULT::FAIL;
+            }
+            if (_sendChain.empty())
+            {
+                return POST_RESULT::SUCCESS;
+            }
+            POST_RESULT ret = startSend();  // The pending flush, if any, finds it sent or in flight.
+            checkSendWater();
+            return ret;
+        }
+
+        void _ClientContext::countWrite()
+        {
+            _shard->sendWrites.fetch_add(1, std::memory_order_relaxed);
+            if (_sendUncounted > 0)
+            {
+                _shard->sendMessages.fetch_add(_sendUncounted, std::memory_order_relaxed);
+                _sendUncounted = 0;
+            }
+        }
+
+        bool _ClientContext::post(const std::function<void (_ClientContext *ctx)> &task)
+        {
+            _CALL_TASK_DATA *callTask = _ServerFramework::newCallTask(task);
+            if (callTask == nullptr)
+            {
+                return false;
+            }
+            _shard->server->postTask(this, callTask);
+            return true;
+        }
+
+        bool _ClientContext::compute(const std::function<void (_ClientContext *ctx)> &task)
+        {
+            _ServerFramework *server = _shard->server;
+            if (!server->_computePool.running())
+            {
+                return post(task);
+            }
+
+            _CALL_TASK_DATA *callTask = _ServerFramework::newCallTask(task);
+            if (callTask == nullptr)
+            {
+                return false;
+            }
+
+            // The same as the strand, the thread which raises the count from 0 submits the connection, which is held
+            // until the count drops back to 0.
+            _computeQueue.push(callTask);
+            if (_computePending.fetch_add(1, std::memory_order_acq_rel) == 0)
+            {
+                server->_connections.retain(_id);
+                if (!server->_computePool.submit([server, this]() { server->runCompute(this); }))
+                {
+                    server->runCompute(this);  // The pool is stopping, or out of memory.
+                }
+            }
+            return true;
+        }
+
+        bool _ClientContext::dispatch(const std::function<void (_ClientContext *ctx)> &task, bool heavy)
+        {
+            // Without the compute pool, all of them run here in order anyway.
+            if (_shard->server->_computePool.running() && (heavy || _computePending.load(std::memory_order_acquire) != 0))
+            {
+                return compute(task);
+            }
+            task(this);
+            return true;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postSend(const char *buf, size_t len, uint64_t key)
+        {
+            if (len == 0)
+            {
+                return POST_RESULT::SUCCESS;
+            }
+
+            if (!onStrand())
+            {
+                _SEND_TASK_DATA *task = _ServerFramework::newSendTask(0, len);
+                if (task == nullptr)
+                {
+                    return POST_RESULT::FAIL;
+                }
+                task->key = key;
+                memcpy(task + 1, buf, len);
+                _shard->server->postTask(this, task);
+                return POST_RESULT::CACHED;
+            }
+
+            if (_closing || !admitSend(len, key))
+            {
+                return POST_RESULT::FAIL;
+            }
+            if (!appendSend(buf, len))
+            {
+                cancelSend(len);
+                return POST_RESULT::FAIL;
+            }
+            POST_RESULT ret = scheduleFlush();
+            checkSendWater();
+            return ret;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postSendInPlace(size_t len,
+            const std::function<void (char *data)> &write, uint64_t key)
+        {
+            if (len == 0)
+            {
+                return POST_RESULT::SUCCESS;
+            }
+            if (!onStrand() || _closing || !admitSend(len, key))
+            {
+                return POST_RESULT::FAIL;
+            }
+            char *data = reserveSend(len);
+            if (data == nullptr)
+            {
+                cancelSend(len);
+                return POST_RESULT::FAIL;
+            }
+            write(data);
+            if (!commitSend(data, len))
+            {
+                cancelSend(len);
+                return POST_RESULT::FAIL;
+            }
+            POST_RESULT ret = scheduleFlush();
+            checkSendWater();
+            return ret;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postSend(const SendBufferRef &buf, size_t offset, size_t len, uint64_t key)
+        {
+            if (!buf || offset > buf->size() || len > buf->size() - offset)
+            {
+                return POST_RESULT::FAIL;
+            }
+            if (len == 0)
+            {
+                return POST_RESULT::SUCCESS;
+            }
+
+            if (!onStrand())
+            {
+                _SEND_TASK_DATA *task = _ServerFramework::newSendTask(1, len);
+                if (task == nullptr)
+                {
+                    return POST_RESULT::FAIL;
+                }
+                task->key = key;
+                _SendSegment seg = { buf, offset, len, false };
+                new ((_SendSegment *)(task + 1)) _SendSegment(std::move(seg));
+                _shard->server->postTask(this, task);
+                return POST_RESULT::CACHED;
+            }
+
+            if (_closing || !admitSend(len, key))
+            {
+                return POST_RESULT::FAIL;
+            }
+            if (!pushSend(buf, offset, len))
+            {
+                cancelSend(len);
+                return POST_RESULT::FAIL;
+            }
+            POST_RESULT ret = scheduleFlush();
+            checkSendWater();
+            return ret;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postSend(const SendBufferRef *bufs, size_t count)
+        {
+            if (!onStrand())
+            {
+                // One task for all of them, so a message made of several buffers is never cut by the other posts.
+                size_t segCount = 0;
+                size_t len = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    CONTINUE_IF(!bufs[i] || bufs[i]->size() == 0);
+                    ++segCount;
+                    len += bufs[i]->size();
+                }
+                if (segCount == 0)
+                {
+                    return POST_RESULT::SUCCESS;
+                }
+                _SEND_TASK_DATA *task = _ServerFramework::newSendTask(segCount, len);
+                if (task == nullptr)
+                {
+                    return POST_RESULT::FAIL;
+                }
+                _SendSegment *segs = (_SendSegment *)(task + 1);
+                for (size_t i = 0, k = 0; i < count; ++i)
+                {
+                    CONTINUE_IF(!bufs[i] || bufs[i]->size() == 0);
+                    _SendSegment seg = { bufs[i], 0, bufs[i]->size(), false };
+                    new (&segs[k++]) _SendSegment(std::move(seg));
+                }
+                _shard->server->postTask(this, task);
+                return POST_RESULT::CACHED;
+            }
+
+            size_t len = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                CONTINUE_IF(!bufs[i]);
+                len += bufs[i]->size();
+            }
+            if (len == 0)
+            {
+                return POST_RESULT::SUCCESS;
+            }
+            if (_closing || !admitSend(len, 0))
+            {
+                return POST_RESULT::FAIL;
+            }
+
+            // All or nothing, so a message made of several buffers is never cut.
+            size_t chainSize = _sendChain.size();
+            for (size_t i = 0; i < count; ++i)
+            {
+                CONTINUE_IF(!bufs[i] || bufs[i]->size() == 0);
+                if (!pushSend(bufs[i], 0, bufs[i]->size()))
+                {
+                    while (_sendChain.size() > chainSize)
+                    {
+                        _sendChain.pop_back();
+                    }
+                    cancelSend(len);
+                    return POST_RESULT::FAIL;
+                }
+            }
+            POST_RESULT ret = scheduleFlush();
+            checkSendWater();
+            return ret;
+        }
+
+        bool _ClientContext::admitSend(size_t len, uint64_t key)
+        {
+            const _SendQueueLimits &limits = _shard->sendLimits;
+            _ServerFramework *server = _shard->server;
+            size_t over = overSend(len);
+            if (limits.policy == SendOverflowPolicy::COALESCE && key != 0
+                && (over > 0 || (limits.highWater != 0 && _sendQueued + len > limits.highWater)))
+            {
+                dropKeyedSend(key);
+                over = overSend(len);
+            }
+            if (over > 0)
+            {
+                switch (limits.policy)
+                {
+                case SendOverflowPolicy::DROP_OLDEST:
+                    if (!dropOldestSend(over))
+                    {
+                        return false;
+                    }
+                    break;
+                case SendOverflowPolicy::DISCONNECT:
+                    // Closed on the strand after the caller, e.g. an onRecv which goes on with the connection.
+                    LOG_DEBUG("%16s:%5hu send queue overflow", _ip, _port);
+                    post([](_ClientContext *ctx) { ctx->_shard->server->closeConnection(ctx); });
+                    return false;
+                default:
+                    return false;
+                }
+            }
+
+            if (limits.tracksMessages())
+            {
+                TRY_BLOCK_BEGIN
+                _SendMessage msg = { len, key };
+                _sendMessages.push_back(msg);
+                CATCH_EXCEPTIONS
+                return false;
+                CATCH_BLOCK_END
+            }
+            _sendQueued += len;
+            if (limits.memoryLimit != 0)
+            {
+                server->_sendMemory.fetch_add(len, std::memory_order_relaxed);
+            }
+            ++_sendUncounted;
+            return true;
+        }
+
+        size_t _ClientContext::overSend(size_t len) const
+        {
+            // The bytes over the budget of the connection, or over the memory limit of the server.
+            const _SendQueueLimits &limits = _shard->sendLimits;
+            size_t over = 0;
+            if (limits.maxBytes != 0 && _sendQueued + len > limits.maxBytes)
+            {
+                over = _sendQueued + len - limits.maxBytes;
+            }
+            if (limits.memoryLimit != 0)
+            {
+                size_t total = _shard->server->_sendMemory.load(std::memory_order_relaxed) + len;
+                if (total > limits.memoryLimit && total - limits.memoryLimit > over)
+                {
+                    over = total - limits.memoryLimit;
+                }
+            }
+            return over;
+        }
+
+        void _ClientContext::cancelSend(size_t len)
+        {
+            if (_shard->sendLimits.tracksMessages())
+            {
+                _sendMessages.pop_back();
+            }
+            uncountSend(len);
+            --_sendUncounted;
+        }
+
+        void _ClientContext::uncountSend(size_t len)
+        {
+            _sendQueued -= len;
+            if (_shard->sendLimits.memoryLimit != 0)
+            {
+                _shard->server->_sendMemory.fetch_sub(len, std::memory_order_relaxed);
+            }
+        }
+
+        size_t _ClientContext::lockedSend() const
+        {
+            // The bytes in flight, and the rest of the front message if it's partly sent.
+            size_t locked = _sendInFlight;
+            if (_sendFrontStarted && !_sendMessages.empty() && _sendMessages.front().len > locked)
+            {
+                locked = _sendMessages.front().len;
+            }
+            return locked;
+        }
+
+        bool _ClientContext::dropOldestSend(size_t bytes)
+        {
+            // Skip the messages which have started, then drop the oldest of the others until there is room.
+            size_t locked = lockedSend();
+            size_t pos = 0;
+            mp::deque<_SendMessage>::iterator first = _sendMessages.begin();
+            while (first != _sendMessages.end() && pos < locked)
+            {
+                pos += first->len;
+                ++first;
+            }
+            size_t dropped = 0;
+            mp::deque<_SendMessage>::iterator last = first;
+            while (last != _sendMessages.end() && dropped < bytes)
+            {
+                dropped += last->len;
+                ++last;
+            }
+            if (dropped < bytes || !eraseSend(pos, dropped))
+            {
+                return false;
+            }
+            _sendMessages.erase(first, last);
+            uncountSend(dropped);
+            return true;
+        }
+
+        void _ClientContext::dropKeyedSend(uint64_t key)
+        {
+            size_t locked = lockedSend();
+            size_t pos = 0;
+            for (mp::deque<_SendMessage>::iterator it = _sendMessages.begin(); it != _sendMessages.end(); ++it)
+            {
+                if (it->key == key && pos >= locked)
+                {
+                    size_t len = it->len;
+                    if (eraseSend(pos, len))
+                    {
+                        _sendMessages.erase(it);
+                        uncountSend(len);
+                    }
+                    return;  // There is one at most, the older ones have been replaced.
+                }
+                pos += it->len;
+            }
+        }
+
+        bool _ClientContext::eraseSend(size_t pos, size_t len)
+        {
+            if (len == 0)
+            {
+                return true;
+            }
+            mp::deque<_SendSegment>::iterator it = _sendChain.begin();
+            while (pos >= it->len)
+            {
+                pos -= it->len;
+                ++it;
+            }
+            if (pos > 0)  // Split the segment, the bytes before stay.
+            {
+                TRY_BLOCK_BEGIN
+                // Not appendable any more, its buffer is still referred to by the part after.
+                _SendSegment head = { it->buf, it->offset, pos, false };
+                it = _sendChain.insert(it, std::move(head)) + 1;
+                CATCH_EXCEPTIONS
+                return false;
+                CATCH_BLOCK_END
+                it->offset += pos;
+                it->len -= pos;
+            }
+            while (len > 0)
+            {
+                if (len < it->len)
+                {
+                    it->offset += len;
+                    it->len -= len;
+                    break;
+                }
+                len -= it->len;
+                it = _sendChain.erase(it);
+            }
+            return true;
+        }
+
+        void _ClientContext::checkSendWater()
+        {
+            const _SendQueueLimits &limits = _shard->sendLimits;
+            if (limits.highWater == 0 || _closing)
+            {
+                return;
+            }
+            _ServerFramework *server = _shard->server;
+            if (!_sendFull && _sendQueued > limits.highWater)
+            {
+                _sendFull = true;
+                if (server->_onSendQueueFull)
+                {
+                    server->_onSendQueueFull(this);
+                }
+            }
+            else if (_sendFull && _sendQueued <= limits.lowWater)
+            {
+                _sendFull = false;
+                if (server->_onWritable)
+                {
+                    server->_onWritable(this);
+                }
+            }
+        }
+
+        bool _ClientContext::appendSend(const char *buf, size_t len)
+        {
+            if (_sendChain.empty())  // A write timeout counts from now on.
+            {
+                stampSend();
+            }
+
+            // Fill the room of the last buffer first. The rest goes to another one, which is queued before,
+            // so nothing is appended if it can't be.
+            _SendSegment *back = nullptr;
+            size_t room = 0;
+            if (!_sendChain.empty())
+            {
+                _SendSegment &seg = _sendChain.back();
+                if (seg.appendable && seg.offset + seg.len == seg.buf->size())
+                {
+                    back = &seg;
+                    room = seg.buf->capacity() - seg.buf->size();
+                }
+            }
+            size_t copied = len < room ? len : room;
+            size_t rest = len - copied;
+
+            if (rest > 0)
+            {
+                SendBufferRef sb;
+                if (_sendSpare && rest <= _sendSpare->capacity())
+                {
+                    sb = std::move(_sendSpare);
+                }
+                else
+                {
+                    sb = SendBufferRef(SendBuffer::create(rest > OVERLAPPED_BUF_SIZE ? rest : OVERLAPPED_BUF_SIZE));
+                    if (!sb)
+                    {
+                        LOG_ERROR("new send buffer out of memory!");
+                        return false;
+                    }
+                }
+                sb->append(buf + copied, rest);
+
+                TRY_BLOCK_BEGIN
+                _SendSegment seg = { std::move(sb), 0, rest, true };
+                _sendChain.push_back(std::move(seg));  // The references to the others stay valid.
+                CATCH_EXCEPTIONS
+                return false;
+                CATCH_BLOCK_END
+            }
+            if (copied > 0)
+            {
+                back->buf->append(buf, copied);
+                back->len += copied;
+            }
+            return true;
+        }
+
+        char *_ClientContext::reserveSend(size_t len)
+        {
+            if (!_sendChain.empty())
+            {
+                _SendSegment &seg = _sendChain.back();
+                if (seg.appendable && seg.offset + seg.len == seg.buf->size() && seg.buf->capacity() - seg.buf->size() >= len)
+                {
+                    return seg.buf->data() + seg.buf->size();
+                }
+            }
+            if (!_sendSpare || _sendSpare->capacity() < len)
+            {
+                SendBufferRef sb(SendBuffer::create(len > OVERLAPPED_BUF_SIZE ? len : OVERLAPPED_BUF_SIZE));
+                if (!sb)
+                {
+                    LOG_ERROR("new send buffer out of memory!");
+                    return nullptr;
+                }
+                _sendSpare = std::move(sb);
+            }
+            return _sendSpare->data();
+        }
+
+        bool _ClientContext::commitSend(const char *data, size_t len)
+        {
+            if (_sendChain.empty())  // A write timeout counts from now on.
+            {
+                stampSend();
+            }
+            if (!_sendSpare || data != _sendSpare->data())  // In the last buffer, nothing was queued since the reserve.
+            {
+                _SendSegment &seg = _sendChain.back();
+                seg.buf->setSize(seg.buf->size() + len);
+                seg.len += len;
+                return true;
+            }
+
+            _sendSpare->setSize(len);
+            TRY_BLOCK_BEGIN
+            _SendSegment seg = { std::move(_sendSpare), 0, len, true };
+            _sendChain.push_back(std::move(seg));
+            CATCH_EXCEPTIONS
+            return false;
+            CATCH_BLOCK_END
+            return true;
+        }
+
+        bool _ClientContext::pushSend(const SendBufferRef &buf, size_t offset, size_t len)
+        {
+            if (_sendChain.empty())  // A write timeout counts from now on.
+            {
+                stampSend();
+            }
+            TRY_BLOCK_BEGIN
+            _SendSegment seg = { buf, offset, len, false };
+            _sendChain.push_back(std::move(seg));
+            CATCH_EXCEPTIONS
+            return false;
+            CATCH_BLOCK_END
+            return true;
+        }
+
+        bool _ClientContext::pushSend(const _SendSegment *segs, size_t count)
+        {
+            size_t chainSize = _sendChain.size();
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (!pushSend(segs[i].buf, segs[i].offset, segs[i].len))
+                {
+                    while (_sendChain.size() > chainSize)
+                    {
+                        _sendChain.pop_back();
+                    }
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t _ClientContext::gatherSend(_SendVec *vecs, size_t maxCount, size_t &bytes) const
+        {
+            size_t cnt = 0;
+            bytes = 0;
+            for (mp::deque<_SendSegment>::const_iterator it = _sendChain.begin(); it != _sendChain.end() && cnt < maxCount; ++it, ++cnt)
+            {
+                bytes += it->len;
+#if PLATFORM_IS_WINDOWS
+                vecs[cnt].buf = it->buf->data() + it->offset;
+                vecs[cnt].len = (ULONG)it->len;
+#else
+                vecs[cnt].iov_base = it->buf->data() + it->offset;
+                vecs[cnt].iov_len = it->len;
+#endif
+            }
+            return cnt;
+        }
+
+        void _ClientContext::reset()
+        {
+            if (_socket != INVALID_SOCKET)
+            {
+#if PLATFORM_IS_WINDOWS
+                ::closesocket(_socket);
+#else
+                ::close(_socket);
+#endif
+                _socket = INVALID_SOCKET;
+            }
+
+            if (_shard != nullptr && _sendQueued > 0)  // The bytes never sent leave the memory limit.
+            {
+                uncountSend(_sendQueued);
+            }
+
+            _ip[0] = '\0';
+            _port = 0;
+            _shard = nullptr;
+            _handler.reset();
+            _connecting = false;
+            _id = 0;
+            _timeoutTimer = 0;
+
+            // The receive ring goes back to the memory pool, the next connection may differ.
+            // The spare send buffer is kept.
+            _recvRing.reset();
+            _sendChain.clear();
+            _sendMessages.clear();
+            _sendQueued = 0;
+            _sendInFlight = 0;
+            _sendFrontStarted = false;
+            _sendFull = false;
+            _flushPending = false;
+            _sendUncounted = 0;
+            _sending = false;
+            _closing = false;
+#if IOCP_BACKEND == IOCP_BACKEND_IO_URING
+            _recvArmed = false;
+#elif IOCP_BACKEND == IOCP_BACKEND_IOCP
+            _recvPosted = false;
+#endif
+        }
+
+        bool _ClientContext::prepareRecv()
+        {
+            const _RecvBufferSize &recvSize = _shard->recvSize;
+            return _recvRing.prepare(recvSize.initialSize, recvSize.highWater);
+        }
+
+        void _ClientContext::commitRecv(size_t bytesRecv, size_t writable)
+        {
+            const _RecvBufferSize &recvSize = _shard->recvSize;
+            _recvRing.commit(bytesRecv, writable, recvSize.minSize, recvSize.highWater);
+            stampRecv();
+        }
+
+        void _ClientContext::stampRecv()
+        {
+            const _ConnectionTimeouts &timeouts = _shard->timeouts;
+            if (timeouts.idle != 0 || timeouts.read != 0)
+            {
+                _lastRecvTime.store(TimerWheel::currentTime(), std::memory_order_relaxed);
+            }
+        }
+
+        void _ClientContext::stampSend()
+        {
+            const _ConnectionTimeouts &timeouts = _shard->timeouts;
+            if (timeouts.idle != 0 || timeouts.write != 0)
+            {
+                _lastSendTime.store(TimerWheel::currentTime(), std::memory_order_relaxed);
+            }
+        }
+
+        void _ClientContext::consumeSend(size_t bytesSent)
+        {
+            if (bytesSent > 0)
+            {
+                stampSend();
+            }
+            _sendInFlight = 0;  // The send has completed, the rest is sent again.
+            uncountSend(bytesSent < _sendQueued ? bytesSent : _sendQueued);
+            for (size_t n = bytesSent; n > 0 && !_sendMessages.empty(); )
+            {
+                _SendMessage &front = _sendMessages.front();
+                if (n < front.len)
+                {
+                    front.len -= n;
+                    _sendFrontStarted = true;
+                    break;
+                }
+                n -= front.len;
+                _sendMessages.pop_front();
+                _sendFrontStarted = false;
+            }
+
+            while (bytesSent > 0 && !_sendChain.empty())
+            {
+                _SendSegment &front = _sendChain.front();
+                if (bytesSent < front.len)  // Partially sent, just skip the bytes sent.
+                {
+                    front.offset += bytesSent;
+                    front.len -= bytesSent;
+                    return;
+                }
+
+                bytesSent -= front.len;
+                if (front.appendable && front.buf->capacity() == OVERLAPPED_BUF_SIZE)  // Keep it for the next copies.
+                {
+                    front.buf->setSize(0);
+                    _sendSpare = std::move(front.buf);
+                }
+                _sendChain.pop_front();
+            }
+        }
+    }  // end of namespace _impl
+}  // end of namespace iocp
@@ -0,0 +1,605 @@
+#include <algorithm>
+
+#include "ServerFrameworkImpl.h"
+#include "ImplMacros.h"
+#include "common/Exceptions.h"
+
+#if IOCP_BACKEND == IOCP_BACKEND_EPOLL
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <limits.h>
+
+#define WORK_THREAD_RESERVE_SIZE 10
+#define MAX_EPOLL_EVENTS 256
+
+// The keys of the events. A connection is keyed by its ID, which is never 0 nor has the lower 32 bits 0.
+#define WAKEUP_EVENT_KEY 0
+#define LISTEN_EVENT_KEY ((uint64_t)1 << 32)
+
+namespace iocp {
+    namespace _impl {
+
+        //
+        // _ServerFramework
+        //
+
+        bool _ServerFramework::initialize()
+        {
+            // A peer resetting the connection must not kill the process, errors are reported by send() instead.
+            ::signal(SIGPIPE, SIG_IGN);
+            return true;
+        }
+
+        bool _ServerFramework::uninitialize()
+        {
+            return true;
+        }
+
+        _ServerFramework::_ServerFramework()
+            : _workerThreads(WORK_THREAD_RESERVE_SIZE)
+            , _sendMemory(0)
+            , _nextTimerShard(0)
+            , _nextConnectShard(0)
+        {
+            _workerThreads.resize(0);
+
+            _ip[0] = '\0';
+        }
+
+        _ServerFramework::~_ServerFramework()
+        {
+        }
+
+        static SOCKET createListenSocket(const struct sockaddr_in &serverAddr, bool reusePort)
+        {
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (s == INVALID_SOCKET)
+            {
+                return INVALID_SOCKET;
+            }
+
+            int on = 1;
+            ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            // Every shard listens on the same port, and the kernel spreads the incoming connections among them.
+            if (reusePort && ::setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+            {
+                LOG_ERROR("SO_REUSEPORT failed: errno %d", errno);
+                ::close(s);
+                return INVALID_SOCKET;
+            }
+
+            if (::bind(s, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR
+                || ::listen(s, SOMAXCONN) == SOCKET_ERROR)
+            {
+                ::close(s);
+                return INVALID_SOCKET;
+            }
+            return s;
+        }
+
+        // Closes everything the shard owns, but the shared listener.
+        static void destroyShard(_Shard *shard, SOCKET sharedListenSocket)
+        {
+            if (shard->listenSocket != INVALID_SOCKET && shard->listenSocket != sharedListenSocket) ::close(shard->listenSocket);
+            if (shard->epollFd != -1) ::close(shard->epollFd);
+            if (shard->wakeupFd != -1) ::close(shard->wakeupFd);
+            delete shard;
+        }
+
+        bool _ServerFramework::startup(const char *ip, uint16_t port)
+        {
+            _shouldQuit = false;
+            warmContextPool();
+
+            _port = port;
+            struct sockaddr_in serverAddr = { 0 };
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = htons(_port);
+            if (ip != nullptr)
+            {
+                strncpy(_ip, ip, 16);
+                serverAddr.sin_addr.s_addr = ::inet_addr(ip);
+            }
+
+            bool sharded = (_shardCount > 0);
+            if (!sharded)
+            {
+                _listenSocket = createListenSocket(serverAddr, false);
+                if (_listenSocket == INVALID_SOCKET)
+                {
+                    return false;
+                }
+            }
+
+            unsigned workerThreadCnt = sharded ? _shardCount : std::thread::hardware_concurrency();
+            if (workerThreadCnt == 0)
+            {
+                workerThreadCnt = 1;
+            }
+            LOG_DEBUG("hardware_concurrency = %u, workerThreadCnt = %u, sharded = %d", std::thread::hardware_concurrency(), workerThreadCnt, (int)sharded);
+
+            // The compute pool first, the connections may use it as soon as they're accepted.
+            if (_computeThreads > 0 && !_computePool.start(_computeThreads))
+            {
+                shutdown();
+                return false;
+            }
+
+            TRY_BLOCK_BEGIN
+            _workerThreads.reserve(workerThreadCnt);
+            _shards.reserve(workerThreadCnt);
+
+            // Worker threads, each one runs its own shard.
+            for (unsigned i = 0; i < workerThreadCnt; ++i)
+            {
+                _Shard *shard = new (std::nothrow) _Shard;
+                if (shard == nullptr)
+                {
+                    LOG_ERROR("new _Shard out of memory!");
+                    continue;
+                }
+                // The position in _shards, which the IDs of its timers are tagged with. A shard failed before is
+                // not there.
+                shard->index = (unsigned)_shards.size();
+                shard->server = this;
+                shard->recvSize = _recvSize;
+                shard->timeouts = _timeouts;
+                shard->sendLimits = _sendLimits;
+                shard->sendBatching = _sendBatching;
+                shard->timers.setTag((uint8_t)shard->index);
+
+                shard->listenSocket = sharded ? createListenSocket(serverAddr, true) : _listenSocket;
+                shard->epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+                shard->wakeupFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (shard->listenSocket == INVALID_SOCKET || shard->epollFd == -1 || shard->wakeupFd == -1)
+                {
+                    LOG_ERROR("create shard %u failed: errno %d", i, errno);
+                    destroyShard(shard, _listenSocket);
+                    continue;
+                }
+
+                struct epoll_event ev = { 0 };
+                ev.events = EPOLLIN;
+                ev.data.u64 = WAKEUP_EVENT_KEY;
+                ::epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->wakeupFd, &ev);
+
+                // Every worker thread waits on its listenSocket, and keeps the connections it accepts.
+                ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+                if (!sharded)
+                {
+                    ev.events |= EPOLLEXCLUSIVE;  // Avoid the thundering herd on the shared listener.
+                }
+#endif
+                ev.data.u64 = LISTEN_EVENT_KEY;
+                ::epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->listenSocket, &ev);
+
+                std::thread *t = new (std::nothrow) std::thread([this, shard]() { worketThreadProc(shard); });
+                if (t == nullptr)
+                {
+                    LOG_ERROR("new std::thread out of memory!");
+                    destroyShard(shard, _listenSocket);
+                    continue;
+                }
+                if (sharded)
+                {
+                    bindToCore(t, i);
+                }
+                _shards.push_back(shard);
+                _workerThreads.push_back(t);
+            }
+            CATCH_EXCEPTIONS
+            shutdown();
+            return false;
+            CATCH_BLOCK_END
+
+            if (_workerThreads.empty())
+            {
+                shutdown();
+                return false;
+            }
+
+            return true;
+        }
+
+        void _ServerFramework::shutdown()
+        {
+            _shouldQuit = true;
+            clearUpstreams();
+
+            // Terminate all the worker threads.
+            std::for_each(_shards.begin(), _shards.end(), [](_Shard *shard) {
+                uint64_t one = 1;
+                ssize_t ret = ::write(shard->wakeupFd, &one, sizeof(one));
+                (void)ret;
+            });
+
+            std::for_each(_workerThreads.begin(), _workerThreads.end(), [](std::thread *t) {
+                t->join();
+                delete t;
+            });
+            _workerThreads.clear();
+
+            _computePool.stop();  // The compute tasks left go with their ClientContexts.
+
+            // Delete all the ClientContext, and the shards.
+            _connections.clear([this](_ClientContext *ctx) {
+                dropTasks(ctx);
+                _deallocateCtx(ctx);
+            });
+            drainContextPool();
+            std::for_each(_shards.begin(), _shards.end(), [this](_Shard *shard) {
+                dropPostedTasks(shard);
+                destroyShard(shard, _listenSocket);
+            });
+            _shards.clear();
+
+            if (_listenSocket != INVALID_SOCKET)
+            {
+                ::close(_listenSocket);
+                _listenSocket = INVALID_SOCKET;
+            }
+        }
+
+        void _ServerFramework::closeConnection(_ClientContext *ctx)
+        {
+            if (ctx->_closing)
+            {
+                return;
+            }
+
+            LOG_DEBUG("%16s:%5hu disconnected", ctx->_ip, ctx->_port);
+            notifyDisconnect(ctx);
+
+            // The sends posted by the other threads still queued to the strand find it closing, and never touch
+            // the fd, which may be reused by a new connection.
+            SOCKET s = ctx->_socket;  // Save the socket.
+            ctx->_socket = INVALID_SOCKET;
+            ctx->_closing = true;
+            removeClient(ctx);
+
+            // Closing the last reference also removes it from the epoll instance.
+            if (s != INVALID_SOCKET)  // Unless closed before the connect began.
+            {
+                ::close(s);
+            }
+        }
+
+        void _ServerFramework::wakeShard(_Shard *shard)
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(shard->wakeupFd, &one, sizeof(one));
+            (void)ret;
+        }
+
+        void _ServerFramework::scheduleTasks(_Shard *shard)
+        {
+            wakeShard(shard);
+        }
+
+        void _ServerFramework::worketThreadProc(_Shard *shard)
+        {
+            struct epoll_event events[MAX_EPOLL_EVENTS];
+            mp::vector<ExpiredTimer> expired;
+            shard->threadId = std::this_thread::get_id();
+
+            while (!_shouldQuit)
+            {
+                // Wait until the next timer expires, or forever if none.
+                uint64_t wait = runTimers(shard, expired);
+                flushSends(shard);  // The sends of the last iteration and of the timers.
+                int timeout = wait == UINT64_MAX ? -1 : (wait < INT_MAX ? (int)wait : INT_MAX);
+                int cnt = ::epoll_wait(shard->epollFd, events, MAX_EPOLL_EVENTS, timeout);
+                if (cnt == -1)
+                {
+                    CONTINUE_IF(errno == EINTR);
+                    LOG_ERROR("epoll_wait failed: errno %d", errno);
+                    break;
+                }
+
+                for (int i = 0; i < cnt; ++i)
+                {
+                    uint64_t key = events[i].data.u64;
+                    uint32_t what = events[i].events;
+
+                    if (key == WAKEUP_EVENT_KEY)  // Woken up by shutdown, for a timer, or to run the strands posted.
+                    {
+                        uint64_t value = 0;
+                        ssize_t ret = ::read(shard->wakeupFd, &value, sizeof(value));
+                        (void)ret;
+                        continue;
+                    }
+
+                    if (key == LISTEN_EVENT_KEY)
+                    {
+                        doAccept(shard);
+                        continue;
+                    }
+
+                    // Held during the dispatch, so the handlers may close the connection, e.g. by disconnect in
+                    // onRecv. Gone if closed by the events before, e.g. by the onRecv of another connection.
+                    _ClientContext *ctx = acquireClient(key);
+                    CONTINUE_IF(ctx == nullptr);
+
+                    bool ok = (what & EPOLLERR) == 0;
+
+                    // The first EPOLLOUT of a connect ends it, no byte can be received before.
+                    if (ok && ctx->_connecting)
+                    {
+                        ok = (what & EPOLLOUT) != 0 && doConnect(ctx);
+                    }
+
+                    if (ok && !ctx->_closing && (what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                    {
+                        ok = doRecv(ctx);
+                    }
+
+                    if (ok && (what & EPOLLOUT))
+                    {
+                        ok = doSend(ctx);
+                    }
+
+                    if (!ok)
+                    {
+                        closeConnection(ctx);
+                    }
+                    releaseClient(ctx);  // The ClientContext is deleted here if it has been closed.
+                }
+
+                // After the events, a strand may close its connection, whose event would be left in the array.
+                runPostedStrands(shard);
+                runPostedTasks(shard);
+            }
+            flushSends(shard);  // Drops the holds.
+        }
+
+        void _ServerFramework::doAccept(_Shard *shard)
+        {
+            for (;;)
+            {
+                struct sockaddr_in remoteAddr;
+                socklen_t remoteLen = sizeof(remoteAddr);
+                SOCKET clientSocket = ::accept4(shard->listenSocket, (struct sockaddr *)&remoteAddr, &remoteLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (clientSocket == INVALID_SOCKET)
+                {
+                    CONTINUE_IF(errno == EINTR || errno == ECONNABORTED);
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        LOG_ERROR("accept4 failed: errno %d", errno);
+                    }
+                    return;  // No more pending connections, or another worker thread took them.
+                }
+
+                char ip[16];
+                ::inet_ntop(AF_INET, &remoteAddr.sin_addr, ip, sizeof(ip));
+                uint16_t port = ntohs(remoteAddr.sin_port);
+
+                LOG_DEBUG("remote address %s %hu", ip, port);
+
+                _ClientContext *ctx = nullptr;
+                TRY_BLOCK_BEGIN
+                ctx = allocateContext();
+                CATCH_EXCEPTIONS
+                ::close(clientSocket);
+                continue;
+                CATCH_BLOCK_END
+                if (ctx == nullptr)
+                {
+                    LOG_ERROR("new context out of memory!");
+                    ::close(clientSocket);
+                    continue;
+                }
+
+                if (!addClient(shard, ctx))
+                {
+                    deallocateContext(ctx);
+                    ::close(clientSocket);
+                    continue;
+                }
+
+                ctx->_socket = clientSocket;
+                initSocket(clientSocket);
+                strncpy(ctx->_ip, ip, 16);
+                ctx->_port = port;
+
+                // Edge-triggered, the readiness is reported once when it changes, so both the recv and send paths
+                // must run until EAGAIN. Registering the socket reports the current readiness, so the bytes arrived
+                // before here won't be missed.
+                struct epoll_event ev = { 0 };
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.u64 = ctx->_id;
+                if (::epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, clientSocket, &ev) == -1)
+                {
+                    LOG_DEBUG("%16s:%5hu epoll_ctl failed", ip, port);
+                    closeConnection(ctx);
+                    continue;
+                }
+
+                LOG_DEBUG("%16s:%5hu connected", ip, port);
+                startTimeouts(ctx);
+            }
+        }
+
+        void _ServerFramework::beginConnect(_ClientContext *ctx)
+        {
+            if (ctx->_closing)  // Disconnected before it began.
+            {
+                return;
+            }
+
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (s == INVALID_SOCKET)
+            {
+                LOG_ERROR("socket failed: errno %d", errno);
+                closeConnection(ctx);
+                return;
+            }
+            ctx->_socket = s;
+            initSocket(s);
+            startTimeouts(ctx);
+
+            // Registered as the accepted ones, the socket turns writable once the connect is done either way.
+            struct epoll_event ev = { 0 };
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = ctx->_id;
+            if ((::connect(s, (const struct sockaddr *)&ctx->_connectAddr, sizeof(ctx->_connectAddr)) == -1 && errno != EINPROGRESS)
+                || ::epoll_ctl(ctx->_shard->epollFd, EPOLL_CTL_ADD, s, &ev) == -1)
+            {
+                closeConnection(ctx);
+            }
+        }
+
+        bool _ServerFramework::doConnect(_ClientContext *ctx)
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (::getsockopt(ctx->_socket, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+            {
+                return false;
+            }
+            return finishConnect(ctx);
+        }
+
+        bool _ServerFramework::doRecv(_ClientContext *ctx) const
+        {
+            // Only the owner thread reads the socket.
+            _RecvRing &ring = ctx->_recvRing;
+            for (;;)
+            {
+                if (!ctx->prepareRecv())
+                {
+                    LOG_ERROR("%16s:%5hu recv ring full", ctx->_ip, ctx->_port);
+                    return false;  // The remainder bytes take too much memory.
+                }
+
+                char *bufs[2];
+                size_t lens[2];
+                struct iovec vecs[2];
+                size_t writable = 0;
+                int cnt = (int)ring.getWritable(bufs, lens);
+                for (int i = 0; i < cnt; ++i)
+                {
+                    vecs[i].iov_base = bufs[i];
+                    vecs[i].iov_len = lens[i];
+                    writable += lens[i];
+                }
+
+                ssize_t bytesRecv = ::readv(ctx->_socket, vecs, cnt);
+                if (bytesRecv == 0)
+                {
+                    return false;  // Closed by peer.
+                }
+
+                if (bytesRecv == -1)
+                {
+                    CONTINUE_IF(errno == EINTR);
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        return false;
+                    }
+
+                    // Drained, wait for the next edge. Nothing left to process, so hold no memory meanwhile,
+                    // unless the size is fixed.
+                    const _RecvBufferSize &recvSize = ctx->_shard->recvSize;
+                    if (ring.empty() && recvSize.minSize < recvSize.highWater)
+                    {
+                        ring.release();
+                    }
+                    return true;
+                }
+
+                ctx->commitRecv((size_t)bytesRecv, writable);
+                if (!dispatchRecv(ctx))
+                {
+                    return false;
+                }
+            }
+        }
+
+        bool _ServerFramework::doSend(_ClientContext *ctx) const
+        {
+            ctx->_sending = false;  // Writable again.
+            if (ctx->_closing)
+            {
+                return true;
+            }
+            if (ctx->startSend() == _ClientContext::POST_RESULT::FAIL)
+            {
+                return false;
+            }
+            ctx->checkSendWater();
+            return true;
+        }
+
+        //
+        // _ClientContext
+        //
+
+        _ClientContext::_ClientContext()
+            : _strandPending(0)
+            , _computePending(0)
+            , _lastRecvTime(0)
+            , _lastSendTime(0)
+        {
+            _strandIOData.completionKey = this;
+            _strandIOData.type = _OPERATION_TYPE::STRAND_POSTED;
+        }
+
+        _ClientContext::~_ClientContext()
+        {
+            if (_socket != INVALID_SOCKET)
+            {
+                ::close(_socket);
+                _socket = INVALID_SOCKET;
+            }
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postRecv()
+        {
+            // Nothing to post, the worker thread reads as soon as epoll reports the socket readable.
+            return POST_RESULT::SUCCESS;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::startSend()
+        {
+            if (_sending)  // The socket is full, the worker thread sends the chain on EPOLLOUT.
+            {
+                return POST_RESULT::CACHED;
+            }
+
+            // Send on the worker thread directly, the bytes the kernel refused stay in the chain.
+            _SendVec vecs[MAX_SEND_SEGMENTS];
+            size_t bytes = 0;
+            while (!_sendChain.empty())
+            {
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = vecs;
+                msg.msg_iovlen = gatherSend(vecs, MAX_SEND_SEGMENTS, bytes);
+                countWrite();
+                ssize_t bytesSent = ::sendmsg(_socket, &msg, MSG_NOSIGNAL);
+                if (bytesSent == -1)
+                {
+                    CONTINUE_IF(errno == EINTR);
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        _sending = true;
+                        return POST_RESULT::CACHED;
+                    }
+                    return POST_RESULT::FAIL;
+                }
+                consumeSend((size_t)bytesSent);
+            }
+            return POST_RESULT::SUCCESS;
+        }
+    }  // end of namespace _impl
+}  // end of namespace iocp
+
+#endif  // IOCP_BACKEND == IOCP_BACKEND_EPOLL
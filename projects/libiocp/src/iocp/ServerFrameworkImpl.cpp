@@ -1,28 +1,18 @@
 #include <algorithm>
 
 #include "ServerFrameworkImpl.h"
-#include "common/DebugConfig.h"
+#include "ImplMacros.h"
 #include "common/Exceptions.h"
 
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+
 #define MAX_POST_ACCEPT_COUNT 10
 #define WORK_THREAD_RESERVE_SIZE 10
 #define FREE_SOCKET_POOL_RESERVE_SIZE 128
 
-#define CONTINUE_IF(_cond_) if (_cond_) continue
-#define BREAK_IF(_cond_) if (_cond_) break
-
-#define USE_CPP_EXCEPTION
-
-#ifdef USE_CPP_EXCEPTION
-#   define TRY_BLOCK_BEGIN try {
-#   define CATCH_EXCEPTIONS } catch (std::exception &_e) { \
-    LOG_ERROR("Caught exception `%s' at line %d in function `%s' of file `%s'", _e.what(), __LINE__, __FUNCTION__, __FILE__); if (1) {
-#   define CATCH_BLOCK_END } }
-#else
-#   define TRY_BLOCK_BEGIN
-#   define CATCH_EXCEPTIONS if (0) {
-#   define CATCH_BLOCK_END }
-#endif
+// The buffer of an AcceptEx keeps the addresses, followed by the clientSocket and the shard which posted it.
+#define ACCEPT_IO_DATA_SOCKET(ioData) (*(SOCKET *)&((_ACCEPT_IO_DATA *)(ioData))->buf[(sizeof(struct sockaddr_in) + 16) * 2])
+#define ACCEPT_IO_DATA_SHARD(ioData) (*(_Shard **)&((_ACCEPT_IO_DATA *)(ioData))->buf[(sizeof(struct sockaddr_in) + 16) * 2 + sizeof(SOCKET)])
 
 namespace iocp {
     namespace _impl {
@@ -51,12 +41,11 @@ namespace iocp {
 
         _ServerFramework::_ServerFramework()
             : _workerThreads(WORK_THREAD_RESERVE_SIZE)
-            , _allAcceptIOData(MAX_POST_ACCEPT_COUNT)
-            , _freeSocketPool(FREE_SOCKET_POOL_RESERVE_SIZE)
+            , _sendMemory(0)
+            , _nextTimerShard(0)
+            , _nextConnectShard(0)
         {
             _workerThreads.resize(0);
-            _allAcceptIOData.resize(0);
-            _freeSocketPool.resize(0);
 
             _ip[0] = '\0';
         }
@@ -68,43 +57,11 @@ namespace iocp {
         bool _ServerFramework::startup(const char *ip, uint16_t port)
         {
             _shouldQuit = false;
-
-            // Completion Port.
-            _ioCompletionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-            if (_ioCompletionPort == NULL)
-            {
-                return false;
-            }
-
-            SYSTEM_INFO systemInfo;
-            GetSystemInfo(&systemInfo);
-            DWORD workerThreadCnt = systemInfo.dwNumberOfProcessors * 2 + 2;
-            LOG_DEBUG("systemInfo.dwNumberOfProcessors = %u, workerThreadCnt = %u", systemInfo.dwNumberOfProcessors, workerThreadCnt);
-
-            TRY_BLOCK_BEGIN
-            _workerThreads.reserve(workerThreadCnt);
-
-            // Worker threads.
-            while (workerThreadCnt-- > 0)
-            {
-                std::thread *t = new (std::nothrow) std::thread([this]() { worketThreadProc(); });
-                if (t != nullptr)
-                {
-                    _workerThreads.push_back(t);
-                }
-                else
-                {
-                    LOG_ERROR("new std::thread out of memory!");
-                }
-            }
-            CATCH_EXCEPTIONS
-            return false;
-            CATCH_BLOCK_END
+            warmContextPool();
 
             _listenSocket = ::WSASocket(AF_INET, SOCK_STREAM, 0, nullptr, 0, WSA_FLAG_OVERLAPPED);
             if (_listenSocket == INVALID_SOCKET)
             {
-                _shouldQuit = true;
                 return false;
             }
 
@@ -118,26 +75,110 @@ namespace iocp {
                 serverAddr.sin_addr.s_addr = ::inet_addr(ip);
             }
 
-            if (::bind(_listenSocket, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR)
+            if (::bind(_listenSocket, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR
+                || ::listen(_listenSocket, SOMAXCONN) == SOCKET_ERROR
+                || !getFunctionPointers())
             {
-                _shouldQuit = true;
+                ::closesocket(_listenSocket);
+                _listenSocket = INVALID_SOCKET;
                 return false;
             }
 
-            if (::listen(_listenSocket, SOMAXCONN) == SOCKET_ERROR)
+            SYSTEM_INFO systemInfo;
+            GetSystemInfo(&systemInfo);
+
+            // The shared mode runs a single shard served by a pool of worker threads,
+            // the sharded mode runs one worker thread per shard, bound to a core.
+            bool sharded = (_shardCount > 0);
+            DWORD shardCnt = sharded ? _shardCount : 1;
+            DWORD threadsPerShard = sharded ? 1 : systemInfo.dwNumberOfProcessors * 2 + 2;
+            LOG_DEBUG("systemInfo.dwNumberOfProcessors = %u, shardCnt = %u, threadsPerShard = %u", systemInfo.dwNumberOfProcessors, shardCnt, threadsPerShard);
+
+            // The compute pool first, the connections may use it as soon as they're accepted.
+            if (_computeThreads > 0 && !_computePool.start(_computeThreads))
             {
-                _shouldQuit = true;
+                shutdown();
                 return false;
             }
 
-            _clientCount = 0;
+            TRY_BLOCK_BEGIN
+            _shards.reserve(shardCnt);
+            _workerThreads.reserve(shardCnt * threadsPerShard);
+
+            for (DWORD i = 0; i < shardCnt; ++i)
+            {
+                _Shard *shard = new (std::nothrow) _Shard;
+                if (shard == nullptr)
+                {
+                    LOG_ERROR("new _Shard out of memory!");
+                    continue;
+                }
+                // The position in _shards, which the IDs of its timers are tagged with. A shard failed before is
+                // not there.
+                shard->index = (unsigned)_shards.size();
+                shard->server = this;
+                shard->recvSize = _recvSize;
+                shard->timeouts = _timeouts;
+                shard->sendLimits = _sendLimits;
+                shard->sendBatching = _sendBatching;
+                shard->timers.setTag((uint8_t)shard->index);
+                shard->listenSocket = _listenSocket;
+
+                // Completion Port.
+                shard->ioCompletionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+                if (shard->ioCompletionPort == NULL)
+                {
+                    delete shard;
+                    continue;
+                }
+                memset(&shard->postIOData, 0, sizeof(shard->postIOData));
+                shard->postIOData.type = _OPERATION_TYPE::TASKS_POSTED;
+                shard->allAcceptIOData.reserve(MAX_POST_ACCEPT_COUNT);
+                shard->freeSocketPool.reserve(FREE_SOCKET_POOL_RESERVE_SIZE);
+                _shards.push_back(shard);
+
+                // Worker threads.
+                for (DWORD k = 0; k < threadsPerShard; ++k)
+                {
+                    std::thread *t = new (std::nothrow) std::thread([this, shard]() { worketThreadProc(shard); });
+                    if (t != nullptr)
+                    {
+                        if (sharded)
+                        {
+                            bindToCore(t, i);
+                        }
+                        _workerThreads.push_back(t);
+                    }
+                    else
+                    {
+                        LOG_ERROR("new std::thread out of memory!");
+                    }
+                }
+            }
+            CATCH_EXCEPTIONS
+            shutdown();
+            return false;
+            CATCH_BLOCK_END
+
+            if (_shards.empty() || _workerThreads.empty())
+            {
+                shutdown();
+                return false;
+            }
 
-            return beginAccept();
+            // Associate the listenSocket with the CompletionPort of the first shard.
+            // We just use the address of listenSocket as the CompletionKey.
+            // The accepted sockets are handed over to the shards which posted the AcceptEx.
+            ::CreateIoCompletionPort((HANDLE)_listenSocket, _shards[0]->ioCompletionPort, (ULONG_PTR)&_listenSocket, 0);
+
+            std::for_each(_shards.begin(), _shards.end(), [this](_Shard *shard) { beginAccept(shard); });
+            return true;
         }
 
         void _ServerFramework::shutdown()
         {
             _shouldQuit = true;
+            clearUpstreams();
             if (_listenSocket != INVALID_SOCKET)
             {
                 ::closesocket(_listenSocket);
@@ -145,10 +186,13 @@ namespace iocp {
             }
 
             // Terminate all the worker threads.
-            for (size_t i = _workerThreads.size(); i > 0; --i)
-            {
-                ::PostQueuedCompletionStatus(_ioCompletionPort, 0, (ULONG_PTR)nullptr, nullptr);
-            }
+            size_t threadCnt = _workerThreads.size();
+            std::for_each(_shards.begin(), _shards.end(), [threadCnt](_Shard *shard) {
+                for (size_t i = threadCnt; i > 0; --i)
+                {
+                    ::PostQueuedCompletionStatus(shard->ioCompletionPort, 0, (ULONG_PTR)nullptr, nullptr);
+                }
+            });
 
             std::for_each(_workerThreads.begin(), _workerThreads.end(), [](std::thread *t) {
                 t->join();
@@ -156,147 +200,236 @@ namespace iocp {
             });
             _workerThreads.clear();
 
+            _computePool.stop();  // The compute tasks left go with their ClientContexts.
+
             // Delete all the ClientContext.
-            std::for_each(_clientList.begin(), _clientList.end(), _deallocateCtx);
-            _clientList.clear();
+            _connections.clear([this](_ClientContext *ctx) {
+                dropTasks(ctx);
+                _deallocateCtx(ctx);
+            });
+            drainContextPool();
+
+            std::for_each(_shards.begin(), _shards.end(), [this](_Shard *shard) {
+                // Delete all the AcceptIOData.
+                std::for_each(shard->allAcceptIOData.begin(), shard->allAcceptIOData.end(), [](_ACCEPT_IO_DATA *ioData) { delete ioData; });
+                shard->allAcceptIOData.clear();
 
-            // Delete all the AcceptIOData.
-            std::for_each(_allAcceptIOData.begin(), _allAcceptIOData.end(), [](_PER_IO_OPERATION_DATA *ioData) { delete ioData; });
-            _allAcceptIOData.clear();
+                ::CloseHandle(shard->ioCompletionPort);
+                shard->ioCompletionPort = NULL;
+                dropPostedTasks(shard);
 
-            ::CloseHandle(_ioCompletionPort);
-            _ioCompletionPort = NULL;
+                std::for_each(shard->freeSocketPool.begin(), shard->freeSocketPool.end(), &::closesocket);
+                shard->freeSocketPool.clear();
 
-            std::for_each(_freeSocketPool.begin(), _freeSocketPool.end(), &::closesocket);
-            _freeSocketPool.clear();
+                delete shard;
+            });
+            _shards.clear();
         }
 
-        void _ServerFramework::recycleSocket(SOCKET s)
+        void _ServerFramework::recycleSocket(_Shard *shard, SOCKET s)
         {
             _disconnectEx(s, nullptr, TF_REUSE_SOCKET, 0);
-            _poolMutex.lock();
+            shard->poolMutex.lock();
             TRY_BLOCK_BEGIN
-            _freeSocketPool.push_back(s);
+            shard->freeSocketPool.push_back(s);
             CATCH_EXCEPTIONS
             ::closesocket(s);
             CATCH_BLOCK_END
-            _poolMutex.unlock();
+            shard->poolMutex.unlock();
         }
 
-        void _ServerFramework::worketThreadProc()
+        void _ServerFramework::wakeShard(_Shard *shard)
         {
-            static std::function<void (_ClientContext *)> removeExceptionalConnection = [this](_ClientContext *ctx) {
-                LOG_DEBUG("%16s:%5hu disconnected", ctx->_ip, ctx->_port);
-                _onDisconnect(ctx);
+            ::PostQueuedCompletionStatus(shard->ioCompletionPort, 0, (ULONG_PTR)nullptr, nullptr);
+        }
 
-                SOCKET s = ctx->_socket;  // Save the socket.
+        void _ServerFramework::scheduleTasks(_Shard *shard)
+        {
+            if (!::PostQueuedCompletionStatus(shard->ioCompletionPort, 0, (ULONG_PTR)nullptr, &shard->postIOData.overlapped))
+            {
+                LOG_ERROR("PostQueuedCompletionStatus failed: last error %d", ::GetLastError());
+            }
+        }
 
-                _clientMutex.lock();
-                ctx->_socket = INVALID_SOCKET;
-                _clientList.erase(ctx->_iterator);  // Remove from the ClientContext list.
-                _deallocateCtx(ctx);
-                --_clientCount;
-                LOG_DEBUG("client count %lu", _clientCount);
-                _clientMutex.unlock();
+        void _ServerFramework::scheduleStrand(_ClientContext *ctx)
+        {
+            if (!::PostQueuedCompletionStatus(ctx->_shard->ioCompletionPort, 0, (ULONG_PTR)ctx, &ctx->_strandIOData.overlapped))
+            {
+                LOG_ERROR("PostQueuedCompletionStatus failed: last error %d", ::GetLastError());
+            }
+        }
+
+        void _ServerFramework::closeConnection(_ClientContext *ctx)
+        {
+            if (ctx->_closing)
+            {
+                return;
+            }
+
+            LOG_DEBUG("%16s:%5hu disconnected", ctx->_ip, ctx->_port);
+            notifyDisconnect(ctx);
+            ctx->_closing = true;
+
+            // Make the receive and the send in flight complete with ERROR_OPERATION_ABORTED, the ClientContext is
+            // deleted after all of them.
+            ::CancelIoEx((HANDLE)ctx->_socket, nullptr);
+            releaseIfIdle(ctx);
+        }
 
-                recycleSocket(s);
-            };
+        void _ServerFramework::releaseIfIdle(_ClientContext *ctx)
+        {
+            if (ctx->_recvPosted || ctx->_sending)
+            {
+                return;
+            }
 
+            // The sends posted by the other threads still queued to the strand find it closing, and never touch
+            // the socket, which is recycled for a new connection. The ones of connect are not, AcceptEx takes them.
+            SOCKET s = ctx->_socket;  // Save the socket.
+            ctx->_socket = INVALID_SOCKET;
+            _Shard *owner = ctx->_shard;
+            bool outbound = ctx->_handler != nullptr;
+            removeClient(ctx);
+
+            if (s == INVALID_SOCKET)  // Closed before the connect began.
+            {
+                return;
+            }
+            if (outbound)
+            {
+                ::closesocket(s);
+            }
+            else
+            {
+                recycleSocket(owner, s);
+            }
+        }
+
+        void _ServerFramework::worketThreadProc(_Shard *shard)
+        {
             LPOVERLAPPED overlapped = nullptr;
             ULONG_PTR completionKey = 0;
             DWORD bytesTransfered = 0;
+            mp::vector<ExpiredTimer> expired;
 
             while (!_shouldQuit)
             {
-                BOOL ret = ::GetQueuedCompletionStatus(_ioCompletionPort, &bytesTransfered, &completionKey, &overlapped, INFINITE);
+                // Every worker thread of the shard waits until the next timer expires, the first one awake runs it.
+                uint64_t wait = runTimers(shard, expired);
+                DWORD timeout = wait < INFINITE ? (DWORD)wait : INFINITE;
+                BOOL ret = ::GetQueuedCompletionStatus(shard->ioCompletionPort, &bytesTransfered, &completionKey, &overlapped, timeout);
+                DWORD lastError = ret ? 0 : ::GetLastError();
 
                 _ClientContext *ctx = (_ClientContext *)completionKey;
-                CONTINUE_IF(ctx == nullptr);
+                if (ctx == nullptr)
+                {
+                    if (overlapped == &shard->postIOData.overlapped)
+                    {
+                        runPostedTasks(shard);  // Posted by post, otherwise it's a wakeup.
+                    }
+                    continue;
+                }
 
                 _PER_IO_OPERATION_DATA *ioData = (_PER_IO_OPERATION_DATA *)overlapped;
                 CONTINUE_IF(ioData == nullptr);
 
-                if (!ret)
+                // Since socket is the 1st field of ClientContext,
+                // we can just compare the address to determine whether the completion event is posted by listenSocket.
+                if ((void *)ctx == (void *)&_listenSocket)
                 {
-                    DWORD lastError = ::GetLastError();
-                    if (lastError == ERROR_NETNAME_DELETED)
+                    if (!ret)
                     {
-                        // Since socket is the 1st field of ClientContext,
-                        // we can just compare the address to determine whether the completion event is posted by listenSocket.
-                        if ((void *)ctx == (void *)&_listenSocket)
+                        if (lastError == ERROR_NETNAME_DELETED)
                         {
                             // We should post a new AcceptEx as a supplement, if something goes wrong when accepting.
-                            postAccept(ioData);
-                        }
-                        else
-                        {
-                            removeExceptionalConnection(ctx);
+                            postAccept(ACCEPT_IO_DATA_SHARD(ioData), (_ACCEPT_IO_DATA *)ioData);
                         }
                         continue;
                     }
 
-                    CONTINUE_IF(lastError == WAIT_TIMEOUT);
-                    CONTINUE_IF(overlapped != nullptr);
-                    break;
+                    if (ACCEPT_IO_DATA_SHARD(ioData) != shard)
+                    {
+                        // The listenSocket completes on the first shard, hand it over to the shard which posted the AcceptEx.
+                        ::PostQueuedCompletionStatus(ACCEPT_IO_DATA_SHARD(ioData)->ioCompletionPort, bytesTransfered, completionKey, overlapped);
+                        continue;
+                    }
+                    doAccept(shard, (_ACCEPT_IO_DATA *)ioData);
+                    continue;
                 }
 
-                switch (ioData->type)
+                if (ioData->type == _OPERATION_TYPE::STRAND_POSTED)
                 {
-                case _OPERATION_TYPE::ACCEPT_POSTED:
-                    doAccept(ioData);
-                    break;
-                case _OPERATION_TYPE::RECV_POSTED:
-                    if (bytesTransfered == 0 || !doRecv(ctx, ioData->buf, bytesTransfered))
-                    {
-                        removeExceptionalConnection(ctx);
-                    }
-                    break;
-                case _OPERATION_TYPE::SEND_POSTED:
-                    doSend(ctx);
-                    break;
-                case _OPERATION_TYPE::NULL_POSTED:
-                    break;
-                default:
-                    break;
+                    runStrand(ctx);  // Held by the thread which posted it.
+                    continue;
+                }
+
+                // A completion of the connection. It runs on the strand, so if another worker thread is running
+                // the connection, e.g. its onRecv, it's queued there instead of blocking this thread.
+                ioData->bytesTransferred = bytesTransfered;
+                ioData->error = lastError;
+                if (queueTask(ctx, ioData))
+                {
+                    runStrand(ctx);
                 }
             }
         }
 
-        bool _ServerFramework::beginAccept()
+        void _ServerFramework::doCompletion(_ClientContext *ctx, _PER_IO_OPERATION_DATA *ioData)
         {
-            // Associate the listenSocket with CompletionPort.
-            // We just use the address of listenSocket as the CompletionKey.
-            ::CreateIoCompletionPort((HANDLE)_listenSocket, _ioCompletionPort, (ULONG_PTR)&_listenSocket, 0);
+            bool ok = ioData->error == 0;
+            switch (ioData->type)
+            {
+            case _OPERATION_TYPE::RECV_POSTED:
+                ctx->_recvPosted = false;
+                ok = ok && !ctx->_closing && ioData->bytesTransferred != 0 && doRecv(ctx, ioData->bytesTransferred);
+                break;
+            case _OPERATION_TYPE::ZERO_RECV_POSTED:
+                ctx->_recvPosted = false;
+                ok = ok && !ctx->_closing && doZeroRecv(ctx);
+                break;
+            case _OPERATION_TYPE::SEND_POSTED:
+                ctx->_sending = false;
+                ok = ok && doSend(ctx, ioData->bytesTransferred);
+                break;
+            case _OPERATION_TYPE::CONNECT_POSTED:
+                ctx->_sending = false;
+                ok = ok && !ctx->_closing && doConnect(ctx);
+                break;
+            default:
+                break;
+            }
 
-            if (!getFunctionPointers())
+            if (ctx->_closing)
             {
-                _shouldQuit = true;
-                return false;
+                releaseIfIdle(ctx);  // The operations cancelled by the close complete one by one.
+            }
+            else if (!ok)
+            {
+                closeConnection(ctx);  // Closed by peer, or something goes wrong.
             }
+        }
 
-            static std::function<bool ()> postAcceptFunc = [this](){
+        bool _ServerFramework::beginAccept(_Shard *shard)
+        {
+            // Post AcceptEx.
+            for (int i = 0; i < MAX_POST_ACCEPT_COUNT; ++i)
+            {
                 // Prepare the ioData for posting AcceptEx.
-                _PER_IO_OPERATION_DATA *ioData = new (std::nothrow) _PER_IO_OPERATION_DATA;
+                _ACCEPT_IO_DATA *ioData = new (std::nothrow) _ACCEPT_IO_DATA;
                 if (ioData == nullptr)
                 {
                     LOG_ERROR("new IODATA out of memory!");
                     return false;
                 }
 
-                if (postAccept(ioData))
+                if (postAccept(shard, ioData))
                 {
-                    _allAcceptIOData.push_back(ioData);
-                    return true;
+                    shard->allAcceptIOData.push_back(ioData);
+                }
+                else
+                {
+                    delete ioData;
                 }
-
-                delete ioData;
-                return false;
-            };
-
-            // Post AcceptEx.
-            for (int i = 0; i < MAX_POST_ACCEPT_COUNT; ++i)
-            {
-                postAcceptFunc();
             }
 
             return true;
@@ -333,24 +466,33 @@ namespace iocp {
                 return false;
             }
 
+            GUID guidConnectEx = WSAID_CONNECTEX;
+            if (::WSAIoctl(_listenSocket, SIO_GET_EXTENSION_FUNCTION_POINTER,
+                &guidConnectEx, sizeof(GUID),
+                &_connectEx, sizeof(LPFN_CONNECTEX),
+                &bytes, nullptr, nullptr) == SOCKET_ERROR)
+            {
+                return false;
+            }
+
             return true;
         }
 
-        bool _ServerFramework::postAccept(_PER_IO_OPERATION_DATA *ioData)
+        bool _ServerFramework::postAccept(_Shard *shard, _ACCEPT_IO_DATA *ioData)
         {
             SOCKET clientSocket = INVALID_SOCKET;
 
-            _poolMutex.lock();
-            if (_freeSocketPool.empty())
+            shard->poolMutex.lock();
+            if (shard->freeSocketPool.empty())
             {
-                _poolMutex.unlock();
+                shard->poolMutex.unlock();
                 clientSocket = ::socket(AF_INET, SOCK_STREAM, 0);  // Create a new one.
             }
             else
             {
-                clientSocket = _freeSocketPool.back();  // Reuse.
-                _freeSocketPool.pop_back();
-                _poolMutex.unlock();
+                clientSocket = shard->freeSocketPool.back();  // Reuse.
+                shard->freeSocketPool.pop_back();
+                shard->poolMutex.unlock();
             }
 
             if (clientSocket == INVALID_SOCKET)
@@ -362,8 +504,9 @@ namespace iocp {
             char *buf = ioData->buf;
             ioData->type = _OPERATION_TYPE::ACCEPT_POSTED;
 
-            // Store the clientSocket in the buffer.
-            *(SOCKET *)&buf[(sizeof(struct sockaddr_in) + 16) * 2] = clientSocket;
+            // Store the clientSocket and the shard in the buffer.
+            ACCEPT_IO_DATA_SOCKET(ioData) = clientSocket;
+            ACCEPT_IO_DATA_SHARD(ioData) = shard;
             DWORD bytes = 0;
 
             // To make AcceptEx to complete as soon as a connection arrives, we set the 4th parameter 0.
@@ -380,10 +523,10 @@ namespace iocp {
             return true;
         }
 
-        bool _ServerFramework::doAccept(_PER_IO_OPERATION_DATA *ioData)
+        bool _ServerFramework::doAccept(_Shard *shard, _ACCEPT_IO_DATA *ioData)
         {
             // Get the clientSocket we've stored before.
-            SOCKET clientSocket = *(SOCKET *)&ioData->buf[(sizeof(struct sockaddr_in) + 16) * 2];
+            SOCKET clientSocket = ACCEPT_IO_DATA_SOCKET(ioData);
 
             struct sockaddr_in *remoteAddr = nullptr;
             struct sockaddr_in *localAddr = nullptr;
@@ -401,182 +544,135 @@ namespace iocp {
 
             _ClientContext *ctx = nullptr;
             TRY_BLOCK_BEGIN
-            ctx = _allocateCtx();
+            ctx = allocateContext();
             CATCH_EXCEPTIONS
-            recycleSocket(clientSocket);
+            recycleSocket(shard, clientSocket);
             return false;
             CATCH_BLOCK_END
             if (ctx == nullptr)
             {
                 LOG_ERROR("new context out of memory!");
-                recycleSocket(clientSocket);
+                recycleSocket(shard, clientSocket);
                 return false;
             }
-            else
+
+            if (!addClient(shard, ctx))
             {
-                _clientMutex.lock();
-                TRY_BLOCK_BEGIN
-                _clientList.push_front(nullptr);  // Push a nullptr as a placeholder.
-                // Then get the iterator, which won't become invalid when we erased other elements.
-                mp::list<_ClientContext *>::iterator it = _clientList.begin();
-                ++_clientCount;
-                LOG_DEBUG("client count %lu", _clientCount);
-                _clientMutex.unlock();
-
-                ctx->_socket = clientSocket;
-                strncpy(ctx->_ip, ip, 16);
-                ctx->_port = port;
-                ctx->_iterator = it;
-                *it = ctx;  // Replace the placeholder with the new ClientContext.
-
-                // Associate the clientSocket with CompletionPort.
-                if (::CreateIoCompletionPort((HANDLE)clientSocket, _ioCompletionPort, (ULONG_PTR)ctx, 0) != NULL)
-                {
-                    if (ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS)
-                    {
-                        LOG_DEBUG("%16s:%5hu connected", ip, port);
-                    }
-                    else
-                    {
-                        LOG_DEBUG("%16s:%5hu post recv failed", ip, port);
-                    }
-                }
-                CATCH_EXCEPTIONS
-                _clientMutex.unlock();
-                recycleSocket(clientSocket);
+                deallocateContext(ctx);
+                recycleSocket(shard, clientSocket);
                 return false;
-                CATCH_BLOCK_END
             }
-            return postAccept(ioData);
-        }
 
-        bool _ServerFramework::doRecv(_ClientContext *ctx, const char *buf, size_t len) const
-        {
-            ctx->_recvMutex.lock();
-            mp::vector<char> &_recvCache = ctx->_recvCache;
-            if (_recvCache.empty())
+            ctx->_socket = clientSocket;
+            initSocket(clientSocket);
+            strncpy(ctx->_ip, ip, 16);
+            ctx->_port = port;
+
+            // Associate the clientSocket with the CompletionPort of the shard.
+            // The first receive may complete on another worker thread at once, so the ClientContext is left alone
+            // after posting it.
+            startTimeouts(ctx);
+            if (::CreateIoCompletionPort((HANDLE)clientSocket, shard->ioCompletionPort, (ULONG_PTR)ctx, 0) != NULL
+                && ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS)
             {
-                size_t bytesProcessed = _onRecv(ctx, buf, len);
-                if (bytesProcessed < len)  // Cache the remainder bytes.
-                {
-                    size_t remainder = len - bytesProcessed;
-                    TRY_BLOCK_BEGIN
-                    _recvCache.resize(remainder);
-                    memcpy(&_recvCache[0], buf + bytesProcessed, remainder);
-                    CATCH_EXCEPTIONS
-                    ctx->_recvMutex.unlock();
-                    return false;
-                    CATCH_BLOCK_END
-                }
+                LOG_DEBUG("%16s:%5hu connected", ip, port);
             }
             else
             {
-                size_t size = _recvCache.size();
-                if (size + len > RECV_CACHE_LIMIT_SIZE)  // The recvCache takes too much memory.
-                {
-                    ctx->_recvMutex.unlock();
-                    return false;
-                }
-
-                TRY_BLOCK_BEGIN
-                _recvCache.resize(size + len);
-                CATCH_EXCEPTIONS
-                ctx->_recvMutex.unlock();
-                return false;
-                CATCH_BLOCK_END
-
-                memcpy(&_recvCache[size], buf, len);
-                size_t bytesProcessed = _onRecv(ctx, &_recvCache[0], _recvCache.size());
-                if (bytesProcessed >= _recvCache.size())  // All the cached bytes has been processed.
-                {
-                    _recvCache.clear();
-                }
-                else if (bytesProcessed > 0)  // Cache the remainder bytes.
-                {
-                    size_t remainder = len - bytesProcessed;
-                    memmove(&_recvCache[0], &_recvCache[bytesProcessed], remainder);
-                    _recvCache.resize(remainder);
-                }
+                LOG_DEBUG("%16s:%5hu post recv failed", ip, port);
+                closeConnection(ctx);  // Nothing is in flight, so it's deleted at once.
             }
-            bool ret = (ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS);  // Post a new WSARecv.
-            ctx->_recvMutex.unlock();
-            return ret;
+            return postAccept(shard, ioData);
         }
 
-        void _ServerFramework::doSend(_ClientContext *ctx) const
+        void _ServerFramework::beginConnect(_ClientContext *ctx)
         {
-            ctx->_sendMutex.lock();
-            mp::vector<char> &_sendCache = ctx->_sendCache;
-            if (_sendCache.empty())
+            if (ctx->_closing)  // Disconnected before it began.
             {
-                ctx->_sendMutex.unlock();
-                return;  // Nothing to send.
+                ctx->_sending = false;
+                releaseIfIdle(ctx);
+                return;
             }
 
-            SOCKET _socket = ctx->_socket;
-            _PER_IO_OPERATION_DATA &_sendIOData = ctx->_sendIOData;
-            memset(&_sendIOData.overlapped, 0, sizeof(OVERLAPPED));
-            _sendIOData.type = _OPERATION_TYPE::SEND_POSTED;
-            DWORD bytesSent = 0;
-
-            WSABUF wsaBuf;
-            wsaBuf.buf = _sendIOData.buf;
-            wsaBuf.len = OVERLAPPED_BUF_SIZE;
-            if (_sendCache.size() <= OVERLAPPED_BUF_SIZE)  // Is the buffer large enough to carry cached bytes?
+            // ConnectEx takes a bound socket, and completes on the strand as the sends, in the place of one.
+            SOCKET s = ::WSASocket(AF_INET, SOCK_STREAM, 0, nullptr, 0, WSA_FLAG_OVERLAPPED);
+            ctx->_socket = s;
+            if (s != INVALID_SOCKET)
             {
-                memcpy(_sendIOData.buf, &_sendCache[0], _sendCache.size());
-                wsaBuf.len = _sendCache.size();
-
-                _sendCache.resize(0);
-                mp::deque<mp::vector<char> > &_sendQueue = ctx->_sendQueue;
-                while (!_sendQueue.empty())  // Merge the buffers as more as possible.
-                {
-                    _sendCache = std::move(_sendQueue.front());
-                    _sendQueue.pop_front();
-                    BREAK_IF(wsaBuf.len == OVERLAPPED_BUF_SIZE);  // Full ?
+                initSocket(s);
+            }
+            startTimeouts(ctx);
+
+            struct sockaddr_in localAddr = { 0 };
+            localAddr.sin_family = AF_INET;
+            memset(&ctx->_sendIOData.overlapped, 0, sizeof(OVERLAPPED));
+            ctx->_sendIOData.type = _OPERATION_TYPE::CONNECT_POSTED;
+            if (s == INVALID_SOCKET
+                || ::bind(s, (const struct sockaddr *)&localAddr, sizeof(localAddr)) == SOCKET_ERROR
+                || ::CreateIoCompletionPort((HANDLE)s, ctx->_shard->ioCompletionPort, (ULONG_PTR)ctx, 0) == NULL
+                || (!_connectEx(s, (const struct sockaddr *)&ctx->_connectAddr, sizeof(ctx->_connectAddr), nullptr, 0, nullptr,
+                    &ctx->_sendIOData.overlapped) && ::WSAGetLastError() != ERROR_IO_PENDING))
+            {
+                ctx->_sending = false;
+                closeConnection(ctx);  // Nothing is in flight, so it's deleted at once.
+            }
+        }
 
-                    ULONG leftSize = OVERLAPPED_BUF_SIZE - wsaBuf.len;
-                    mp::vector<char>::size_type frontSize = _sendCache.size();
-                    if (frontSize > leftSize)  // Until full.
-                    {
-                        memcpy(_sendIOData.buf + wsaBuf.len, &_sendCache[0], leftSize);
-                        wsaBuf.len += leftSize;
+        bool _ServerFramework::doConnect(_ClientContext *ctx)
+        {
+            // Makes the socket a full one, for shutdown and getpeername.
+            ::setsockopt(ctx->_socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0);
+            if (!finishConnect(ctx))
+            {
+                return false;
+            }
+            return ctx->_closing || ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS;
+        }
 
-                        // Cache the remainder bytes.
-                        memmove(&_sendCache[0], &_sendCache[leftSize], frontSize - leftSize);
-                        _sendCache.resize(frontSize - leftSize);
-                        break;
-                    }
+        bool _ServerFramework::doRecv(_ClientContext *ctx, size_t bytesRecv) const
+        {
+            // Received into the ring directly, whose free space is still the one posted.
+            char *bufs[2];
+            size_t lens[2];
+            size_t writable = 0;
+            size_t cnt = ctx->_recvRing.getWritable(bufs, lens);
+            for (size_t i = 0; i < cnt; ++i)
+            {
+                writable += lens[i];
+            }
+            ctx->commitRecv(bytesRecv, writable);
 
-                    memcpy(_sendIOData.buf + wsaBuf.len, &_sendCache[0], frontSize);
-                    wsaBuf.len += frontSize;
-                    _sendCache.resize(0);
-                }
+            bool ret = dispatchRecv(ctx);
+            if (ret)
+            {
+                // Post a new WSARecv. Unless the receive filled the ring, so that more bytes are likely waiting,
+                // a drained connection waits with no buffer.
+                const _RecvBufferSize &recvSize = ctx->_shard->recvSize;
+                bool idle = ctx->_recvRing.empty() && recvSize.minSize < recvSize.highWater
+                    && ctx->_recvRing.target() <= ctx->_recvRing.capacity();
+                ret = (idle ? ctx->postZeroRecv() : ctx->postRecv()) == _ClientContext::POST_RESULT::SUCCESS;
+            }
+            return ret;
+        }
 
-                ::WSASend(_socket, &wsaBuf, 1, &bytesSent, 0, (LPOVERLAPPED)&_sendIOData, nullptr);
+        bool _ServerFramework::doZeroRecv(_ClientContext *ctx) const
+        {
+            // The bytes have arrived, receive them with a buffer.
+            return ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS;
+        }
 
-                // Perpare next buffer.
-                //if (_sendQueue.empty())
-                //{
-                //    _sendCache.clear();
-                //}
-                //else
-                //{
-                //    _sendCache = std::move(_sendQueue.front());
-                //    _sendQueue.pop_front();
-                //}
-            }
-            else
+        bool _ServerFramework::doSend(_ClientContext *ctx, size_t bytesSent) const
+        {
+            ctx->consumeSend(bytesSent);
+            if (!ctx->_closing && !ctx->_sendChain.empty())  // Send the rest of the chain.
             {
-                // Send the full size bytes in buffer.
-                memcpy(_sendIOData.buf, &_sendCache[0], OVERLAPPED_BUF_SIZE);
-                ::WSASend(_socket, &wsaBuf, 1, &bytesSent, 0, (LPOVERLAPPED)&_sendIOData, nullptr);
-
-                // Cache the remainder bytes.
-                memmove(&_sendCache[0], &_sendCache[OVERLAPPED_BUF_SIZE], _sendCache.size() - OVERLAPPED_BUF_SIZE);
-                _sendCache.resize(_sendCache.size() - OVERLAPPED_BUF_SIZE);
+                if (ctx->startSend() == _ClientContext::POST_RESULT::FAIL)
+                {
+                    return false;
+                }
             }
-            ctx->_sendMutex.unlock();
+            ctx->checkSendWater();
+            return true;
         }
 
         //
@@ -584,11 +680,12 @@ namespace iocp {
         //
 
         _ClientContext::_ClientContext()
-            : _sendCache(OVERLAPPED_BUF_SIZE)
-            , _recvCache(OVERLAPPED_BUF_SIZE)
+            : _strandPending(0)
+            , _computePending(0)
+            , _lastRecvTime(0)
+            , _lastSendTime(0)
         {
-            _sendCache.resize(0);
-            _recvCache.resize(0);
+            _strandIOData.type = _OPERATION_TYPE::STRAND_POSTED;
         }
 
         _ClientContext::~_ClientContext()
@@ -606,68 +703,79 @@ namespace iocp {
             _recvIOData.type = _OPERATION_TYPE::RECV_POSTED;
             DWORD bytesRecv = 0, flags = 0;
 
+            // Receive into the free space of the ring, which may wrap around the end.
+            if (!prepareRecv())
+            {
+                return POST_RESULT::FAIL;  // The remainder bytes take too much memory.
+            }
+            char *bufs[2];
+            size_t lens[2];
+            WSABUF wsaBufs[2];
+            DWORD cnt = (DWORD)_recvRing.getWritable(bufs, lens);
+            for (DWORD i = 0; i < cnt; ++i)
+            {
+                wsaBufs[i].buf = bufs[i];
+                wsaBufs[i].len = (ULONG)lens[i];
+            }
+
+            // Flagged before, the completion may be queued to the strand by another worker thread at once.
+            _recvPosted = true;
+            int ret = ::WSARecv(_socket, wsaBufs, cnt, &bytesRecv, &flags, (LPOVERLAPPED)&_recvIOData, nullptr);
+            if (ret == SOCKET_ERROR && ::WSAGetLastError() != ERROR_IO_PENDING)
+            {
+                _recvPosted = false;
+                return POST_RESULT::FAIL;
+            }
+            return POST_RESULT::SUCCESS;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postZeroRecv()
+        {
+            _recvRing.release();  // Hold no memory while waiting.
+
+            memset(&_recvIOData, 0, sizeof(OVERLAPPED));
+            _recvIOData.type = _OPERATION_TYPE::ZERO_RECV_POSTED;
+            DWORD bytesRecv = 0, flags = 0;
+
             WSABUF wsaBuf;
-            wsaBuf.buf = _recvIOData.buf;
-            wsaBuf.len = OVERLAPPED_BUF_SIZE;
+            wsaBuf.buf = nullptr;
+            wsaBuf.len = 0;
+            _recvPosted = true;
             int ret = ::WSARecv(_socket, &wsaBuf, 1, &bytesRecv, &flags, (LPOVERLAPPED)&_recvIOData, nullptr);
             if (ret == SOCKET_ERROR && ::WSAGetLastError() != ERROR_IO_PENDING)
             {
+                _recvPosted = false;
                 return POST_RESULT::FAIL;
             }
             return POST_RESULT::SUCCESS;
         }
 
-        _ClientContext::POST_RESULT _ClientContext::postSend(const char *buf, size_t len)
+        _ClientContext::POST_RESULT _ClientContext::startSend()
         {
-            if (!_sendCache.empty())  // Other bytes sending now, so we put the new buffer to the queue.
+            if (_sending)  // Only one send is in flight, the chain is sent in order on its completion.
             {
-                TRY_BLOCK_BEGIN
-                mp::vector<char> temp(len);
-                memcpy(&temp[0], buf, len);
-                _sendQueue.push_back(std::move(temp));
                 return POST_RESULT::CACHED;
-                CATCH_EXCEPTIONS
-                return POST_RESULT::FAIL;
-                CATCH_BLOCK_END
             }
 
-            memset(&_sendIOData, 0, sizeof(OVERLAPPED));
+            memset(&_sendIOData.overlapped, 0, sizeof(OVERLAPPED));
             _sendIOData.type = _OPERATION_TYPE::SEND_POSTED;
 
+            // WSASend takes a copy of the WSABUFs, but the bytes must stay untouched until the completion.
+            _SendVec vecs[MAX_SEND_SEGMENTS];
+            DWORD cnt = (DWORD)gatherSend(vecs, MAX_SEND_SEGMENTS, _sendInFlight);
             DWORD bytesSent = 0;
-            WSABUF wsaBuf;
-            wsaBuf.buf = _sendIOData.buf;
-            wsaBuf.len = OVERLAPPED_BUF_SIZE;
-            if (len <= OVERLAPPED_BUF_SIZE)  // Is the buffer large enough to carry the bytes to be sent?
-            {
-                memcpy(_sendIOData.buf, buf, len);
-                wsaBuf.len = len;
-                int ret = ::WSASend(_socket, &wsaBuf, 1, &bytesSent, 0, (LPOVERLAPPED)&_sendIOData, nullptr);
-                if (ret == SOCKET_ERROR && ::WSAGetLastError() != ERROR_IO_PENDING)
-                {
-                    return POST_RESULT::FAIL;
-                }
-                return POST_RESULT::SUCCESS;
-            }
-            else
+            _sending = true;
+            countWrite();
+            int ret = ::WSASend(_socket, vecs, cnt, &bytesSent, 0, (LPOVERLAPPED)&_sendIOData, nullptr);
+            if (ret == SOCKET_ERROR && ::WSAGetLastError() != ERROR_IO_PENDING)
             {
-                TRY_BLOCK_BEGIN
-                // Cache the remainder bytes.
-                _sendCache.resize(len - OVERLAPPED_BUF_SIZE);
-                CATCH_EXCEPTIONS
+                _sending = false;
+                _sendInFlight = 0;
                 return POST_RESULT::FAIL;
-                CATCH_BLOCK_END
-                memcpy(&_sendCache[0], buf + OVERLAPPED_BUF_SIZE, len - OVERLAPPED_BUF_SIZE);
-
-                // Send the full size bytes in the buffer.
-                memcpy(_sendIOData.buf, buf, OVERLAPPED_BUF_SIZE);
-                int ret = ::WSASend(_socket, &wsaBuf, 1, &bytesSent, 0, (LPOVERLAPPED)&_sendIOData, nullptr);
-                if (ret == SOCKET_ERROR && ::WSAGetLastError() != ERROR_IO_PENDING)
-                {
-                    return POST_RESULT::FAIL;
-                }
-                return POST_RESULT::SUCCESS;
             }
+            return POST_RESULT::SUCCESS;
         }
     }  // end of namespace _impl
 }  // end of namespace iocp
+
+#endif  // IOCP_BACKEND == IOCP_BACKEND_IOCP
@@ -1,26 +1,59 @@
 #ifndef _SERVER_FRAMEWORK_IMPL_H_
 #define _SERVER_FRAMEWORK_IMPL_H_
 
-#include <winsock2.h>
-#include <mswsock.h>
-#include <windows.h>
+#include "common/PlatformConfig.h"
+#if PLATFORM_IS_WINDOWS
+#   include <winsock2.h>
+#   include <mswsock.h>
+#   include <windows.h>
+#else
+#   include <sys/socket.h>
+#   include <sys/uio.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <arpa/inet.h>
+#   include <pthread.h>
+#endif
 #include <stdint.h>
 #include <vector>
 #include <list>
 #include <deque>
 #include <utility>
+#include <string>
+#include <map>
+#include <functional>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include "MemoryPool.h"
-
+#include "ConnectionTable.h"
+#include "MpscQueue.h"
+#include "ComputePool.h"
+#include "SendBuffer.h"
+#include "RecvRing.h"
+#include "TimerWheel.h"
+
+#if PLATFORM_IS_WINDOWS
 #pragma comment(lib, "ws2_32.lib")
+#else
+#   define INVALID_SOCKET (-1)
+#   define SOCKET_ERROR (-1)
+typedef int SOCKET;
+#endif
 
 #define ACCEPT_BUF_SIZE 1024
 
 #define OVERLAPPED_BUF_SIZE 4096
+#define MAX_SEND_SEGMENTS 64  // The most segments of the send chain handed to one gather send.
 #define RECV_CACHE_LIMIT_SIZE 32767
+#define RECV_RING_MAX_SIZE (RECV_CACHE_LIMIT_SIZE + 1)  // The default high-water mark of the receive ring.
+#define RECV_RING_MIN_SIZE 512  // The default size an idle connection's receive ring shrinks to.
+#define CONTEXT_POOL_MAX_IDLE 1024  // The default number of the idle ClientContexts kept for reuse.
+#define STRAND_BATCH_SIZE 64  // The most tasks a strand runs before it yields the worker thread to the others.
 
 namespace iocp {
+#if PLATFORM_IS_WINDOWS
     class mutex
     {
     public:
@@ -34,6 +67,21 @@ namespace iocp {
     private:
         CRITICAL_SECTION _cs;
     };
+#else
+    class mutex
+    {
+    public:
+        mutex() { ::pthread_mutex_init(&_mtx, nullptr); }
+        ~mutex() { ::pthread_mutex_destroy(&_mtx); }
+
+        void lock() { ::pthread_mutex_lock(&_mtx); }
+        bool try_lock() { return ::pthread_mutex_trylock(&_mtx) == 0; }
+        void unlock() { ::pthread_mutex_unlock(&_mtx); }
+
+    private:
+        pthread_mutex_t _mtx;
+    };
+#endif
 
     namespace mp {
         template <typename _T> using vector = std::vector<_T, Allocator<_T> >;
@@ -41,6 +89,40 @@ namespace iocp {
         template <typename _T> using deque = std::deque<_T, Allocator<_T> >;
     }
 
+    struct ContextPoolStats
+    {
+        uint64_t hits;  // Connections served by a pooled ClientContext.
+        uint64_t misses;  // Connections which had to allocate one.
+        size_t idle;  // ClientContexts in the pool now.
+    };
+
+    // The tasks run by ServerFramework::post, and the batches they ran in. Every batch costs one wakeup of
+    // a worker thread at most.
+    struct PostStats
+    {
+        uint64_t tasks;
+        uint64_t batches;
+    };
+
+    // The messages queued by postSend, and the send syscalls which carried them. The sends of a dispatch cycle
+    // go out in one gather write, see ServerFramework::setSendBatching.
+    struct SendStats
+    {
+        uint64_t messages;
+        uint64_t writes;
+    };
+
+    // What a connection does with a send which would take its send queue over its budget, or the send queues of
+    // all the connections over the memory limit of the server, see ServerFramework::setSendQueueLimits.
+    enum class SendOverflowPolicy
+    {
+        DROP_NEWEST,  // The send fails (default).
+        DROP_OLDEST,  // The oldest messages not started yet are dropped to make room, otherwise the send fails.
+        DISCONNECT,  // The send fails, and the connection is closed next on its strand.
+        COALESCE,  // Over the high-water mark, a send with a key replaces the queued message of the same key,
+                   // e.g. the state of an entity. Otherwise as DROP_NEWEST.
+    };
+
     namespace _impl {
         class _ServerFramework;
 
@@ -50,16 +132,220 @@ namespace iocp {
             ACCEPT_POSTED,
             RECV_POSTED,
             SEND_POSTED,
+            ZERO_RECV_POSTED,  // A WSARecv without buffer, completes when the bytes arrive.
+            STRAND_POSTED,  // Runs the strand of a connection, posted by another thread.
+            SEND_TASK,  // A send posted to a strand by another thread.
+            CALL_TASK,  // A call posted to a strand.
+            POST_TASK,  // A task posted to a shard.
+            TASKS_POSTED,  // Runs the tasks posted to a shard, on IOCP.
+            CONNECT_POSTED,  // A ConnectEx or IORING_OP_CONNECT, in the place of the send.
         };
 
         // Extend OVERLAPPED structure. Typically, we set original OVERLAPPED as the first field.
+        // The connections receive into their receive rings and send from their send chains, so there is no buffer.
+        // The completions and the tasks of a connection wait in its strand as _PER_IO_OPERATION_DATAs, linked by next.
         typedef struct _PER_IO_OPERATION_DATA
         {
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
             OVERLAPPED overlapped;
+            DWORD bytesTransferred;  // The result of the completion, kept while it waits in the strand.
+            DWORD error;
+#else
+            // The user_data of a SQE points to its _PER_IO_OPERATION_DATA, and there is no CompletionKey,
+            // so we carry it here. The strands posted to an epoll shard are found the same way.
+            void *completionKey;
+#endif
             _OPERATION_TYPE type;
-            char buf[OVERLAPPED_BUF_SIZE];
+            struct _PER_IO_OPERATION_DATA *next;
         } _PER_IO_OPERATION_DATA;
 
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+        // AcceptEx writes the addresses to the buffer.
+        struct _ACCEPT_IO_DATA : _PER_IO_OPERATION_DATA
+        {
+            char buf[ACCEPT_BUF_SIZE];
+        };
+#endif
+
+        // The receive ring of every connection adapts its size between minSize and highWater, starting at
+        // initialSize. It is fixed if minSize equals highWater.
+        struct _RecvBufferSize
+        {
+            _RecvBufferSize() : minSize(RECV_RING_MIN_SIZE), initialSize(OVERLAPPED_BUF_SIZE), highWater(RECV_RING_MAX_SIZE) { }
+
+            size_t minSize;
+            size_t initialSize;
+            size_t highWater;
+        };
+
+        // The timeouts of every connection in milliseconds, 0 turns one off.
+        struct _ConnectionTimeouts
+        {
+            _ConnectionTimeouts() : idle(0), read(0), write(0) { }
+
+            bool enabled() const { return idle != 0 || read != 0 || write != 0; }
+
+            uint32_t idle;  // Nothing received or sent.
+            uint32_t read;  // Nothing received.
+            uint32_t write;  // Bytes waiting to be sent, and none sent.
+        };
+
+        // The budget of the send queue of every connection in bytes, and the one of all of them. 0 turns one off.
+        struct _SendQueueLimits
+        {
+            _SendQueueLimits() : lowWater(0), highWater(0), maxBytes(0), memoryLimit(0), policy(SendOverflowPolicy::DROP_NEWEST) { }
+
+            // Only the policies which drop queued messages need to know where the messages are.
+            bool tracksMessages() const
+            {
+                return policy == SendOverflowPolicy::DROP_OLDEST || policy == SendOverflowPolicy::COALESCE;
+            }
+
+            size_t lowWater;  // onWritable when the queue drains to it after onSendQueueFull.
+            size_t highWater;  // onSendQueueFull when the queue grows over it.
+            size_t maxBytes;  // The policy applies over it.
+            size_t memoryLimit;  // The same, over the bytes queued by all the connections.
+            SendOverflowPolicy policy;
+        };
+
+#if IOCP_BACKEND == IOCP_BACKEND_IO_URING
+        struct _UringLoop;
+#endif
+
+        class _ClientContext;
+
+        // The callbacks of a connection made by _ServerFramework::connect, called instead of the ones of the server.
+        // onConnect tells whether the connect succeeded, onDisconnect follows only a successful one.
+        struct _ConnectHandler
+        {
+            std::function<void (_ClientContext *ctx, bool connected)> onConnect;
+            std::function<size_t (_ClientContext *ctx, const char *buf, size_t len)> onRecv;
+            std::function<void (_ClientContext *ctx)> onDisconnect;
+        };
+
+        // A connection of an upstream, see _ServerFramework::addUpstream.
+        struct _UpstreamSlot
+        {
+            ConnectionId id;  // The last connection which connected.
+            bool connected;
+            uint32_t backoff;  // The last delay before reconnecting, 0 since the last connect.
+        };
+
+        // The connections kept to a server under a key, guarded by the upstream mutex of the server.
+        struct _Upstream
+        {
+            _Upstream() : port(0), next(0), seed(1), removed(false) { ip[0] = '\0'; }
+
+            char ip[16];
+            uint16_t port;
+            _ConnectHandler handler;  // The user's.
+            mp::vector<_UpstreamSlot> slots;
+            size_t next;  // The slot of the next pick, round robin.
+            uint32_t seed;  // Of the jitter of the backoff.
+            bool removed;  // Its connections are not reconnected any more.
+        };
+
+        // A part of a SendBuffer in the send chain of a connection.
+        struct _SendSegment
+        {
+            SendBufferRef buf;
+            size_t offset;
+            size_t len;
+            bool appendable;  // Allocated for the copied bytes, so the later copies can be appended.
+        };
+
+        // A message in the send chain, for the overflow policies which drop whole messages.
+        struct _SendMessage
+        {
+            size_t len;  // The bytes not sent yet.
+            uint64_t key;  // 0 for none.
+        };
+
+        // The tasks posted to a strand by another thread, allocated from the memory pool.
+        // A send is followed by its segments, or by the bytes copied if count is 0.
+        struct _SEND_TASK_DATA : _PER_IO_OPERATION_DATA
+        {
+            size_t count;
+            size_t len;  // The bytes of the message.
+            uint64_t key;  // See SendOverflowPolicy::COALESCE.
+        };
+
+        struct _CALL_TASK_DATA : _PER_IO_OPERATION_DATA
+        {
+            std::function<void (_ClientContext *ctx)> call;
+        };
+
+        struct _POST_TASK_DATA : _PER_IO_OPERATION_DATA
+        {
+            std::function<void ()> call;
+        };
+
+#if PLATFORM_IS_WINDOWS
+        typedef WSABUF _SendVec;
+#else
+        typedef struct iovec _SendVec;
+#endif
+
+        // A shard is an event queue with its worker thread(s), and the connections accepted there.
+        // A connection stays in the shard which accepted it for its lifetime.
+        struct _Shard
+        {
+            _Shard() : sendMessages(0), sendWrites(0), tasksRun(0), taskBatches(0) { }
+
+            unsigned index = 0;
+            _ServerFramework *server = nullptr;
+
+            _RecvBufferSize recvSize;  // The one of the server at startup.
+            _ConnectionTimeouts timeouts;  // The ones of the server at startup.
+            _SendQueueLimits sendLimits;  // The ones of the server at startup.
+            bool sendBatching = true;  // The one of the server at startup.
+            std::atomic<uint64_t> sendMessages;
+            std::atomic<uint64_t> sendWrites;
+
+            // The timers of the shard, run by its worker thread(s) between the waits, which last until the next expiry.
+            TimerWheel timers;
+            mutex timerMutex;
+            uint64_t timerDeadline = 0;  // When the worker thread wakes up by itself, 0 while it runs the timers.
+
+            // The tasks posted to the shard, run by a worker thread a batch at a time. Only the post which finds
+            // the queue empty wakes it up, so a burst of posts costs one wakeup.
+            MpscQueue<_PER_IO_OPERATION_DATA> postedTasks;
+            std::atomic<uint64_t> tasksRun;
+            std::atomic<uint64_t> taskBatches;
+
+            // The sharded mode gives every shard its own listener, otherwise it is the shared one of the server.
+            SOCKET listenSocket = INVALID_SOCKET;
+
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            HANDLE ioCompletionPort = NULL;
+
+            mp::vector<_ACCEPT_IO_DATA *> allAcceptIOData;
+
+            mp::vector<SOCKET> freeSocketPool;
+            mutex poolMutex;
+
+            _PER_IO_OPERATION_DATA postIOData;  // The packet which has a worker thread run the posted tasks.
+#else
+#   if IOCP_BACKEND == IOCP_BACKEND_EPOLL
+            int epollFd = -1;
+            int wakeupFd = -1;  // eventfd, to wake the worker thread up when shutdown, for an earlier timer or a strand.
+#   elif IOCP_BACKEND == IOCP_BACKEND_IO_URING
+            _UringLoop *loop = nullptr;
+#   endif
+
+            // The only worker thread, which runs all the work of the connections of the shard.
+            std::thread::id threadId;
+
+            // The strands posted by the other threads, linked by their _strandIOData, run by the worker thread
+            // when it's woken up.
+            MpscQueue<_PER_IO_OPERATION_DATA> postedStrands;
+
+            // The connections which have queued sends during this iteration of the loop, held until they're
+            // flushed before the next wait.
+            mp::vector<_ClientContext *> flushList;
+#endif
+        };
+
 
         //
         // _ClientContext
@@ -67,25 +353,125 @@ namespace iocp {
 
         class _ClientContext  // User-defined CompletionKey.
         {
+        public:
+            enum class POST_RESULT { SUCCESS, FAIL, CACHED };
+
         private:
             // Socket is the 1st field, so that listenSocket can just use the socket as the CompletionKey.
             SOCKET _socket = INVALID_SOCKET;
 
+#if IOCP_BACKEND != IOCP_BACKEND_EPOLL
             _PER_IO_OPERATION_DATA _sendIOData;
             _PER_IO_OPERATION_DATA _recvIOData;
-            mutex _sendMutex;
-            mutex _recvMutex;
+#endif
 
             char _ip[16];
             uint16_t _port = 0;
 
-            // The iterator for itself in the Server's ClientContext list, so that remove it expediently.
-            // This is based on a characteristic that std::list's iterator won't become invalid when we erased other elements.
-            mp::list<_ClientContext *>::iterator _iterator;
+            _Shard *_shard = nullptr;  // The shard which accepted the connection.
+
+            // Set on the connections made by _ServerFramework::connect. While connecting, _sending holds the sends
+            // back, and the connect takes the place of the send in flight.
+            std::shared_ptr<_ConnectHandler> _handler;
+            bool _connecting = false;
+            struct sockaddr_in _connectAddr;
+
+            ConnectionId _id = 0;  // The key in the server's connection table.
+
+            // The strand runs all the work of the connection one piece at a time, in order, on whichever worker thread
+            // picks it up, so nothing of the connection is locked. The completions on IOCP, and the tasks posted by the
+            // other threads, are queued to it, _strandPending counts the ones not run yet, and the thread which raises
+            // it from 0 runs the strand, or posts _strandIOData to have a worker thread run it.
+            // On epoll and io_uring the worker thread of the shard handles the events directly, it's the only one
+            // which runs the strands there.
+            MpscQueue<_PER_IO_OPERATION_DATA> _strandQueue;
+            _PER_IO_OPERATION_DATA *_strandLocal = nullptr;  // Taken from the queue and not run yet.
+            std::atomic<size_t> _strandPending;
+            _PER_IO_OPERATION_DATA _strandIOData;
+
+            // The compute tasks of the connection, run in order on the compute pool the same way, by one compute
+            // thread at a time. They hold the connection until they're all done.
+            MpscQueue<_PER_IO_OPERATION_DATA> _computeQueue;
+            _PER_IO_OPERATION_DATA *_computeLocal = nullptr;
+            std::atomic<size_t> _computePending;
+
+            // The last times the bytes were received and sent, stamped only if the timeouts are on.
+            std::atomic<uint64_t> _lastRecvTime;
+            std::atomic<uint64_t> _lastSendTime;
+            TimerId _timeoutTimer = 0;  // Checks the timeouts, guarded by the timerMutex of the shard.
+            void stampRecv();
+            void stampSend();
+
+            // The bytes received and not processed yet. Epoll and IOCP receive into it directly.
+            _RecvRing _recvRing;
+
+            // The receive after a completion of the socket.
+            // An idle connection releases the ring on epoll, and waits with a zero-byte receive on IOCP.
+            bool prepareRecv();
+            void commitRecv(size_t bytesRecv, size_t writable);
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            POST_RESULT postZeroRecv();
+            bool _recvPosted = false;  // A WSARecv is in flight.
+#endif
+
+            // The bytes to send in order, as parts of SendBuffers. The front ones may be in a send.
+            mp::deque<_SendSegment> _sendChain;
+            SendBufferRef _sendSpare;  // A drained buffer kept for the next copied bytes.
+            bool _sending = false;  // A gather send is in flight, or the socket is full on epoll.
+            bool _closing = false;  // Nothing can be sent since now.
+
+            // The budget of the send chain, see _SendQueueLimits. The messages are tracked only if the policy drops
+            // them, and never the front ones which are partly sent or in flight, so the stream stays whole.
+            mp::deque<_SendMessage> _sendMessages;
+            size_t _sendQueued = 0;  // The bytes in the chain.
+            size_t _sendInFlight = 0;  // The bytes handed to the send in flight on IOCP and io_uring.
+            bool _sendFrontStarted = false;  // The front message is partly sent.
+            bool _sendFull = false;  // Over the high-water mark, until it drains to the low-water one.
+
+            // The sends of a dispatch cycle are queued, and flushed in one gather write at the end of the cycle:
+            // at the end of the strand's run on IOCP, before the next wait of the loop on epoll and io_uring.
+            bool _flushPending = false;
+            size_t _sendUncounted = 0;  // The messages queued since the last write, for SendStats.
+            POST_RESULT scheduleFlush();
+            void countWrite();  // By the backend at every send syscall.
+
+#if IOCP_BACKEND == IOCP_BACKEND_IO_URING
+            // The msghdr of the send in flight, it's read by the kernel when the worker thread submits.
+            struct msghdr _sendMsg;
+            struct iovec _sendVecs[MAX_SEND_SEGMENTS];
+
+            bool _recvArmed = false;  // Whether the multishot recv is still armed.
+#endif
 
-            mp::vector<char> _sendCache;
-            mp::vector<char> _recvCache;
-            mp::deque<mp::vector<char> > _sendQueue;
+            // The send chain, only on the strand. A message is admitted by the overflow policy and counted before
+            // it's queued, and uncounted by cancelSend if it can't be.
+            bool admitSend(size_t len, uint64_t key);
+            void cancelSend(size_t len);
+            bool appendSend(const char *buf, size_t len);  // All or nothing.
+            char *reserveSend(size_t len);  // Contiguous room for len bytes, in the last buffer or _sendSpare.
+            bool commitSend(const char *data, size_t len);  // Appends the bytes written in the room.
+            bool pushSend(const SendBufferRef &buf, size_t offset, size_t len);
+            bool pushSend(const _SendSegment *segs, size_t count);  // All or nothing.
+            size_t gatherSend(_SendVec *vecs, size_t maxCount, size_t &bytes) const;
+            void consumeSend(size_t bytesSent);
+
+            // Dropping queued messages by the overflow policy.
+            size_t overSend(size_t len) const;  // The bytes over the limits if len more were queued.
+            size_t lockedSend() const;  // The bytes at the front which must be sent.
+            bool dropOldestSend(size_t bytes);
+            void dropKeyedSend(uint64_t key);
+            bool eraseSend(size_t pos, size_t len);  // Cuts the bytes out of the chain.
+            void uncountSend(size_t len);
+
+            // Calls onSendQueueFull or onWritable when the chain crosses a watermark.
+            void checkSendWater();
+
+            // Starts a gather send of the chain unless one is in flight, by the backend. Only on the strand.
+            POST_RESULT startSend();
+
+            // Closes the socket and brings the state back to a new one, keeping the buffers allocated,
+            // so the context can serve the next connection.
+            void reset();
 
             friend class _ServerFramework;
 
@@ -94,14 +480,57 @@ namespace iocp {
             ~_ClientContext();
 
         public:
-            enum class POST_RESULT { SUCCESS, FAIL, CACHED };
-
             POST_RESULT postRecv();
-            POST_RESULT postSend(const char *buf, size_t len);
+
+            // Copies the bytes to the send chain.
+            // On another thread than the strand's, the send is posted to the strand, so it returns CACHED, and
+            // the connection is closed if the send fails there, since the message is lost.
+            // A key other than 0 lets SendOverflowPolicy::COALESCE replace the message by a newer one of the key
+            // while it waits in the queue.
+            POST_RESULT postSend(const char *buf, size_t len, uint64_t key = 0);
+
+            // Sends the bytes of the buffers without copying, the chain holds the references until they are sent.
+            POST_RESULT postSend(const SendBufferRef &buf) { return postSend(&buf, 1); }
+            POST_RESULT postSend(const SendBufferRef &buf, size_t offset, size_t len, uint64_t key = 0);
+            POST_RESULT postSend(const SendBufferRef *bufs, size_t count);  // As one message.
+
+            // Queues a message of len bytes which write(data) writes in place in the send chain, in the room at the
+            // end of its last buffer or in a new one, instead of copying them as postSend(buf, len, key). So small
+            // messages serialized there share the buffers as the copied ones do. Only on the strand, elsewhere it
+            // fails at once without calling write.
+            POST_RESULT postSendInPlace(size_t len, const std::function<void (char *data)> &write, uint64_t key = 0);
+
+            // Starts the send of the bytes queued at once instead of at the end of the dispatch cycle, for the
+            // latency-critical messages. On another thread than the strand's, it's posted to the strand.
+            POST_RESULT flush();
+
+            // Calls task on the strand of the connection after the work queued before, even if it's called there.
+            // Call it where the connection is held: in its callbacks or a visitor of visitClient, otherwise use
+            // _ServerFramework::post with the ID. The task still runs if the connection is closed meanwhile,
+            // then its sends just fail. Returns false if out of memory.
+            bool post(const std::function<void (_ClientContext *ctx)> &task);
+
+            // Calls task on a thread of the compute pool after the compute tasks of the connection queued before,
+            // so a heavy one doesn't hold up the IO. Call it where the connection is held, as post. The task sends
+            // by postSend as any other thread, or gets back to the strand by post. Without the compute pool,
+            // it's posted to the strand. Returns false if out of memory.
+            bool compute(const std::function<void (_ClientContext *ctx)> &task);
+
+            // Calls task at once, or by compute if heavy, e.g. by the type of the message. The light ones are queued
+            // after the heavy ones still running, so the messages of a connection are handled in order either way.
+            // Only on the strand, e.g. in onRecv.
+            bool dispatch(const std::function<void (_ClientContext *ctx)> &task, bool heavy);
+
+            // Whether the calling thread runs the work of the connection, so it can touch the state directly.
+            bool onStrand() const;
 
             const char *getIp() const { return _ip; }
             uint16_t getPort() const { return _port; }
 
+            // The ID can be kept anywhere, and addresses the connection safely even after it's gone,
+            // see _ServerFramework::postSend and visitClient.
+            ConnectionId getId() const { return _id; }
+
         private:
             _ClientContext(const _ClientContext &) = delete;
             _ClientContext(_ClientContext &&) = delete;
@@ -128,48 +557,346 @@ namespace iocp {
 
             const char *getIp() const { return _ip; }
             uint16_t getPort() const { return _port; }
-            size_t getClientCount() const { return _clientCount; }
+            size_t getClientCount() const;
+
+            // 0 for the shared mode (default), in which all the worker threads serve one listener.
+            // Otherwise the server runs shardCount shards, each one has its own listener, event queue
+            // and worker thread bound to a core. It takes effect at the next startup.
+            void setShardCount(unsigned shardCount) { _shardCount = shardCount; }
+            unsigned getShardCount() const { return _shardCount; }
+
+            // The receive buffer of every connection starts at initialSize, grows up to highWater while the peer
+            // fills it, and shrinks down to minSize while the receives are small. highWater also bounds the bytes
+            // not processed by onRecv yet, i.e. the largest frame. minSize == highWater fixes the size.
+            // It takes effect at the next startup.
+            void setRecvBufferSize(size_t minSize, size_t initialSize, size_t highWater);
+
+            // Closes the connection of the ID on its strand, as if the peer had reset it.
+            // Returns false if the connection has gone.
+            bool disconnect(ConnectionId id);
+
+            // Sends to the connection of the ID from any thread. Fails if the connection has gone.
+            _ClientContext::POST_RESULT postSend(ConnectionId id, const char *buf, size_t len, uint64_t key = 0);
+            _ClientContext::POST_RESULT postSend(ConnectionId id, const SendBufferRef &buf);
+
+            // Calls visitor with the connection of the ID, and returns false if it has gone. The ClientContext
+            // stays valid during the call even if the connection is closed meanwhile, then its sends just fail.
+            // The visitor runs on the calling thread, so its sends are posted to the strand of the connection.
+            bool visitClient(ConnectionId id, const std::function<void (_ClientContext *ctx)> &visitor);
+
+            // Calls task on a worker thread from any thread. The tasks of a thread go to the same shard, and
+            // a worker thread runs all the tasks queued there at once, so posting costs far fewer wakeups than tasks.
+            // They may run in parallel on IOCP in the shared mode, post to a connection to keep them in order.
+            // Returns false if the server is not running, or out of memory.
+            bool post(const std::function<void ()> &task);
+
+            // Calls task on the strand of the connection of the ID, see _ClientContext::post.
+            // Returns false if the connection has gone.
+            bool post(ConnectionId id, const std::function<void (_ClientContext *ctx)> &task);
+
+            PostStats getPostStats() const;
+
+            // The threads of the compute pool for _ClientContext::compute. 0 (default) turns the pool off, then
+            // the compute tasks run on the strands. It takes effect at the next startup.
+            void setComputeThreads(unsigned threadCount) { _computeThreads = threadCount; }
+            ComputePoolStats getComputeStats() const { return _computePool.getStats(); }
+
+            // Sends the same payload to all the connections, their send chains refer to it instead of copying it,
+            // so the cost is O(payload) whatever the number of the recipients. Don't touch the bytes after posting.
+            // Returns the number of the connections which accepted it, the gone ones are skipped.
+            size_t broadcast(const SendBufferRef &payload, const ConnectionId *ids, size_t count);
+
+            // Named groups of connections to broadcast to. The gone connections are dropped from the group
+            // at the next broadcast, so there is no need to leave before disconnecting.
+            bool joinGroup(const char *group, ConnectionId id);
+            void leaveGroup(const char *group, ConnectionId id);
+            size_t getGroupSize(const char *group);
+            size_t broadcast(const char *group, const SendBufferRef &payload);
+
+            // The ClientContexts of the closed connections are reset and kept for the next ones instead of being
+            // deleted, up to maxIdle of them, and warmSize of them are created at startup, so a reconnect storm
+            // allocates nothing. It takes effect at the next startup.
+            void setContextPoolSize(size_t warmSize, size_t maxIdle) { _ctxWarmSize = warmSize; _ctxMaxIdle = maxIdle; }
+            ContextPoolStats getContextPoolStats();
+
+            // Calls callback on a worker thread delay milliseconds later, and then every period milliseconds if it's
+            // not 0, until cancelled. The timers are spread over the shards, and fire in ticks of
+            // TimerWheel::DEFAULT_TICK milliseconds. Returns 0 if the server is not running, or out of memory.
+            TimerId setTimer(uint64_t delay, uint64_t period, const TimerCallback &callback);
+
+            // The same, run on the strand of the connection, which is held during the call as by visitClient.
+            // The timer cancels itself once the connection has gone, so heartbeats and delayed sends need no cleanup.
+            TimerId setTimer(ConnectionId id, uint64_t delay, uint64_t period,
+                const std::function<void (_ClientContext *ctx, TimerId timerId)> &callback);
+
+            // Returns false if the timer has fired (once) or has been cancelled. A callback already running on
+            // another thread is not waited for.
+            bool cancelTimer(TimerId id);
+
+            // Closes the connections which have received nothing for read milliseconds, have had bytes waiting
+            // to be sent and sent none for write milliseconds, or have done neither for idle milliseconds.
+            // 0 turns one off, all of them are off by default. It takes effect at the next startup.
+            void setConnectionTimeouts(uint32_t idle, uint32_t read, uint32_t write);
+
+            // The bytes waiting in the send queue of every connection. A queue which grows over highWater calls
+            // onSendQueueFull, then onWritable once it drains to lowWater, so the producer can pause and resume.
+            // A send which would take it over maxBytes, or the queues of all the connections over the memory limit,
+            // is handled by the policy. A broadcast payload counts once per connection. 0 turns a limit off,
+            // all of them are off by default. It takes effect at the next startup.
+            void setSendQueueLimits(size_t lowWater, size_t highWater, size_t maxBytes, SendOverflowPolicy policy);
+            void setSendMemoryLimit(size_t maxBytes) { _sendLimits.memoryLimit = maxBytes; }
+
+            // The bytes queued by all the connections, counted only while the memory limit is on. The shards admit
+            // the sends in parallel, so they may go over the limit by a message each.
+            size_t getSendMemory() const { return _sendMemory.load(std::memory_order_relaxed); }
+
+            // Whether the sends of a dispatch cycle, e.g. all the replies of an onRecv, are flushed together in one
+            // gather write at the end of the cycle (default), or each one starts a send at once.
+            // It takes effect at the next startup.
+            void setSendBatching(bool batching) { _sendBatching = batching; }
+
+            // Whether TCP_NODELAY is set on the sockets accepted and connected (default), so a send, e.g. the one
+            // started by flush, goes out at once instead of waiting behind Nagle for the ACK of the one before.
+            // It takes effect at the next connection.
+            void setNoDelay(bool noDelay) { _noDelay = noDelay; }
+            SendStats getSendStats() const;
+
+            // The connects which haven't completed in timeout milliseconds fail, 0 (default) leaves it to the system.
+            void setConnectTimeout(uint32_t timeout) { _connectTimeout = timeout; }
+
+            // An upstream whose connection fails or closes reconnects after a delay, which starts at initial
+            // milliseconds and doubles up to max, with jitter, until it connects again. 100 and 10000 by default.
+            void setReconnectBackoff(uint32_t initial, uint32_t max);
+
+            // Stops reconnecting the connections of the upstream, and closes them.
+            void removeUpstream(const char *key);
+
+            // A connected connection of the upstream, round robin, or the one of the affinity if it's not 0, e.g.
+            // the ID of a client whose requests must stay in order. Returns 0 if none is connected now.
+            ConnectionId getUpstream(const char *key, uint64_t affinity = 0);
+            size_t getUpstreamSize(const char *key);  // The connected ones.
+
+        protected:
+            // Connects to ip:port in the background, the connection runs on a shard of the server as an accepted
+            // one, with its own callbacks. Returns its ID at once, the sends before the connect completes are
+            // queued, and it fails as a send to a gone connection if the connect fails. 0 if the server is not
+            // running, or ip is not an IPv4 address.
+            ConnectionId connect(const char *ip, uint16_t port, const _ConnectHandler &handler);
+
+            // Keeps count connections to ip:port under the key, see getUpstream. Returns false if the key is taken.
+            bool addUpstream(const char *key, const char *ip, uint16_t port, size_t count, const _ConnectHandler &handler);
 
         private:
-            bool beginAccept();
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            bool beginAccept(_Shard *shard);
             bool getFunctionPointers();
 
-            bool doAccept(_PER_IO_OPERATION_DATA *ioData);
-            bool postAccept(_PER_IO_OPERATION_DATA *ioData);
+            bool doAccept(_Shard *shard, _ACCEPT_IO_DATA *ioData);
+            bool postAccept(_Shard *shard, _ACCEPT_IO_DATA *ioData);
+
+            void worketThreadProc(_Shard *shard);
+
+            // Runs a completion of the connection on its strand.
+            void doCompletion(_ClientContext *ctx, _PER_IO_OPERATION_DATA *ioData);
+            bool doRecv(_ClientContext *ctx, size_t bytesRecv) const;
+            bool doZeroRecv(_ClientContext *ctx) const;
+            bool doSend(_ClientContext *ctx, size_t bytesSent) const;
+
+            bool doConnect(_ClientContext *ctx);
+
+            void releaseIfIdle(_ClientContext *ctx);
+            void recycleSocket(_Shard *shard, SOCKET s);
+#elif IOCP_BACKEND == IOCP_BACKEND_EPOLL
+            void doAccept(_Shard *shard);
 
-            void worketThreadProc();
+            void worketThreadProc(_Shard *shard);
 
-            bool doRecv(_ClientContext *ctx, const char *buf, size_t len) const;
-            void doSend(_ClientContext *ctx) const;
+            bool doConnect(_ClientContext *ctx);
+            bool doRecv(_ClientContext *ctx) const;
+            bool doSend(_ClientContext *ctx) const;
+#elif IOCP_BACKEND == IOCP_BACKEND_IO_URING
+            bool postAccept(_Shard *shard);
 
-            void recycleSocket(SOCKET s);
+            void worketThreadProc(_Shard *shard);
+
+            void doAccept(_Shard *shard, int res, bool more);
+            void doConnect(_ClientContext *ctx, int res);
+            void doRecv(_ClientContext *ctx, int res, uint32_t flags);
+            void doSend(_ClientContext *ctx, int res);
+
+            void releaseIfIdle(_ClientContext *ctx);
+#endif
+
+            // Closes the connection as if the peer had reset it, on its strand, by the backend.
+            // The ClientContext is deleted once no operation of it is in flight.
+            void closeConnection(_ClientContext *ctx);
+
+            // The callbacks of the connection, its own ones if it's made by connect, otherwise the server's.
+            // A connection closed while connecting gets onConnect instead of onDisconnect.
+            size_t notifyRecv(_ClientContext *ctx, const char *buf, size_t len) const;
+            void notifyDisconnect(_ClientContext *ctx);
+
+            // Starts the connect of the connection on its strand, by the backend. Once it's done, finishConnect
+            // calls onConnect and flushes the sends queued meanwhile.
+            void beginConnect(_ClientContext *ctx);
+            bool finishConnect(_ClientContext *ctx);
+
+            void connectUpstream(const std::shared_ptr<_Upstream> &upstream, size_t index);
+            void reconnectUpstream(const std::shared_ptr<_Upstream> &upstream, size_t index);
+            void clearUpstreams();  // At shutdown.
+
+            // Feeds the unread bytes of the receive ring to _onRecv as contiguous views, and advances the ring
+            // by the bytes processed. A frame straddling the end of the ring is joined first. Returns false once
+            // the connection fails, or is closed by _onRecv.
+            bool dispatchRecv(_ClientContext *ctx) const;
+
+            // Feeds the bytes received elsewhere to _onRecv, and copies the remainder into the receive ring.
+            bool dispatchRecv(_ClientContext *ctx, const char *buf, size_t len) const;
+
+            // Sets the options of a socket accepted or about to connect, i.e. TCP_NODELAY unless turned off.
+            void initSocket(SOCKET s) const;
+
+            // Registers a new connection accepted by the shard, and removes it then. The ClientContext is deleted
+            // at removeClient, or at the last releaseClient if postSend or visitClient holds it at that time.
+            bool addClient(_Shard *shard, _ClientContext *ctx);
+            void removeClient(_ClientContext *ctx);
+            _ClientContext *acquireClient(ConnectionId id);
+            void releaseClient(_ClientContext *ctx);
+
+            // Takes a ClientContext from the pool or allocates one, and resets it back to the pool or deletes it.
+            // They run on the worker threads, and on the user threads by releaseClient.
+            _ClientContext *allocateContext();
+            void deallocateContext(_ClientContext *ctx);
+            void warmContextPool();
+            void drainContextPool();
+
+            static void bindToCore(std::thread *t, unsigned core);
+
+            // Queues a task to the strand of the connection. Returns true if the strand was idle, then the caller must
+            // run it by runStrand, or have a worker thread run it by scheduleStrand. The strand holds the connection
+            // from then until it's idle again, so the caller must hold it, or know it can't be deleted meanwhile.
+            bool queueTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task);
+
+            // Queues a task from another thread, which holds the connection.
+            void postTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task);
+
+            // Calls func on the strand of the connection of the ID, at once if the calling thread runs it.
+            // Returns false if the connection has gone.
+            bool postCall(ConnectionId id, const std::function<void (_ClientContext *ctx)> &func);
+
+            // Runs the tasks of the strand until it's idle, or until STRAND_BATCH_SIZE of them have run, then the rest
+            // is scheduled again, so a busy connection doesn't starve the others of the worker thread.
+            void runStrand(_ClientContext *ctx);
+            void runTask(_ClientContext *ctx, _PER_IO_OPERATION_DATA *task);
+
+            // Runs the compute tasks of the connection until they're all done, or until STRAND_BATCH_SIZE of them
+            // have run, then the rest is submitted again.
+            void runCompute(_ClientContext *ctx);
+
+            // Frees the tasks never run at shutdown, the completions are parts of the ClientContext.
+            static void dropTasks(_ClientContext *ctx);
+
+            static _CALL_TASK_DATA *newCallTask(const std::function<void (_ClientContext *ctx)> &func);
+            static void deleteCallTask(_CALL_TASK_DATA *task);
+            static _SEND_TASK_DATA *newSendTask(size_t count, size_t len);
+            static void deleteSendTask(_SEND_TASK_DATA *task);
+            void runSendTask(_ClientContext *ctx, _SEND_TASK_DATA *task);
+
+            // Starts the send of the bytes queued by the dispatch cycle, on the strand. The ones of epoll and io_uring
+            // are flushed together by the loop.
+            void flushSend(_ClientContext *ctx);
+#if IOCP_BACKEND != IOCP_BACKEND_IOCP
+            void flushSends(_Shard *shard);
+#endif
+
+            // Has a worker thread of the shard run the strand, by the backend.
+            static void scheduleStrand(_ClientContext *ctx);
+#if IOCP_BACKEND != IOCP_BACKEND_IOCP
+            void runPostedStrands(_Shard *shard);
+#endif
+
+            // Has a worker thread of the shard run the posted tasks, by the backend.
+            static void scheduleTasks(_Shard *shard);
+            static void runPostedTasks(_Shard *shard);
+            static void dropPostedTasks(_Shard *shard);  // At shutdown.
+
+            // Schedules a timer on the shard, and wakes a worker thread up if it fires before the current wait ends.
+            TimerId scheduleTimer(_Shard *shard, uint64_t delay, uint64_t period, const TimerCallback &callback);
+
+            // Runs the expired timers of the shard, and returns the milliseconds to wait for the next expiry,
+            // or UINT64_MAX for no timer.
+            uint64_t runTimers(_Shard *shard, mp::vector<ExpiredTimer> &expired);
+
+            // The timeouts of a connection, checked on its strand by a timer armed for the earliest of them.
+            void startTimeouts(_ClientContext *ctx);
+            void armTimeout(_ClientContext *ctx, uint64_t delay);
+            void checkTimeouts(_ClientContext *ctx);
+
+            // By the backend. The worker threads run the timers at the top of their loops.
+            static void wakeShard(_Shard *shard);
 
         private:
             char _ip[16];
             uint16_t _port = 0;
 
-            HANDLE _ioCompletionPort = NULL;
             mp::vector<std::thread *> _workerThreads;
             volatile bool _shouldQuit = false;
 
-            SOCKET _listenSocket = INVALID_SOCKET;
-            std::thread *_acceptThread = nullptr;
-            mp::vector<_PER_IO_OPERATION_DATA *> _allAcceptIOData;
+            SOCKET _listenSocket = INVALID_SOCKET;  // The shared listener, unused in the sharded mode on Linux.
+
+            unsigned _shardCount = 0;
+            _RecvBufferSize _recvSize;
+            _ConnectionTimeouts _timeouts;
+            _SendQueueLimits _sendLimits;
+            std::atomic<size_t> _sendMemory;  // The bytes in the send chains, while the memory limit is on.
+            bool _sendBatching = true;
+            bool _noDelay = true;
+            std::atomic<unsigned> _nextTimerShard;  // The shard of the next setTimer without connection.
+            std::atomic<unsigned> _nextConnectShard;  // The shard of the next connect.
+            uint32_t _connectTimeout = 0;
+            unsigned _computeThreads = 0;
+            ComputePool _computePool;
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
+            // The shared mode runs one shard, whose completion port is served by all the worker threads.
+            // Windows has no SO_REUSEPORT, so the shards always share the listener, and every shard posts AcceptEx
+            // with the sockets of its own pool.
+#else
+            // Every worker thread runs a shard. An edge-triggered epoll instance or a ring owns the connections it
+            // accepted, so that all the events of a connection are handled by the same thread.
+#endif
+            mp::vector<_Shard *> _shards;
+
+            // All the connections of all the shards, so that an ID is looked up without knowing its shard.
+            ConnectionTable<_ClientContext> _connections;
 
-            mp::vector<SOCKET> _freeSocketPool;
-            mutex _poolMutex;
+            // The broadcast groups, joined and left rarely, so one mutex is enough.
+            std::map<std::string, mp::vector<ConnectionId> > _groups;
+            mutex _groupMutex;
 
+            // The upstreams, whose connections are reconnected by the timers of the shards.
+            std::map<std::string, std::shared_ptr<_Upstream> > _upstreams;
+            mutex _upstreamMutex;
+            uint32_t _reconnectInitial = 100;
+            uint32_t _reconnectMax = 10000;
+
+            mp::vector<_ClientContext *> _ctxPool;
+            mutex _ctxPoolMutex;
+            size_t _ctxWarmSize = 0;
+            size_t _ctxMaxIdle = CONTEXT_POOL_MAX_IDLE;
+            uint64_t _ctxPoolHits = 0;
+            uint64_t _ctxPoolMisses = 0;
+
+#if IOCP_BACKEND == IOCP_BACKEND_IOCP
             LPFN_ACCEPTEX _acceptEx = nullptr;
             LPFN_GETACCEPTEXSOCKADDRS _getAcceptExSockAddrs = nullptr;
             LPFN_DISCONNECTEX _disconnectEx = nullptr;
-
-            mutex _clientMutex;
-            mp::list<_ClientContext *> _clientList;
-            size_t _clientCount = 0;
+            LPFN_CONNECTEX _connectEx = nullptr;
+#endif
 
         protected:
             std::function<_ClientContext *()> _allocateCtx;
             std::function<void (_ClientContext *ctx)> _deallocateCtx;
+            std::function<void (_ClientContext *ctx)> _resetCtx;  // Resets the user data of a pooled ClientContext.
 
             // Returns the number of bytes processed.
             // If the return value less than len, the remainder bytes will be cached.
@@ -177,11 +904,17 @@ namespace iocp {
 
             std::function<void (_ClientContext *ctx)> _onDisconnect;
 
+            // On the strand, see setSendQueueLimits. Optional.
+            std::function<void (_ClientContext *ctx)> _onSendQueueFull;
+            std::function<void (_ClientContext *ctx)> _onWritable;
+
         private:
             _ServerFramework(const _ServerFramework &) = delete;
             _ServerFramework(_ServerFramework &&) = delete;
             _ServerFramework &operator=(const _ServerFramework &) = delete;
             _ServerFramework &operator=(_ServerFramework &&) = delete;
+
+            friend class _ClientContext;
         };
     }  // end of namespace _impl
 }  // endof namespace iocp
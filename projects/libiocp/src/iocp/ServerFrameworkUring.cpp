@@ -0,0 +1,934 @@
+#include <algorithm>
+
+#include "ServerFrameworkImpl.h"
+#include "ImplMacros.h"
+#include "common/Exceptions.h"
+
+#if IOCP_BACKEND == IOCP_BACKEND_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#define WORK_THREAD_RESERVE_SIZE 10
+
+#define URING_ENTRIES 1024          // SQ entries of each ring, the CQ is twice as large.
+#define URING_RECV_BUF_COUNT 512    // Provided buffers of each ring, must be a power of 2.
+#define URING_RECV_BUF_GROUP 0
+
+// This is the proactor model of IOCP on io_uring:
+//   - Every SQE carries the address of a _PER_IO_OPERATION_DATA as its user_data, so a CQE is dispatched by
+//     _OPERATION_TYPE just like a completion packet.
+//   - A multishot accept per ring replaces the pre-posted AcceptEx.
+//   - A multishot recv per connection receives into the buffers provided to the ring, instead of a WSARecv per
+//     completion into the receive ring of the connection. The bytes are processed in the provided buffer, and only
+//     the remainder is copied into the receive ring.
+//   - The send chain of a connection is sent by one IORING_OP_SENDMSG at a time, which gathers its segments, so
+//     the bytes go in order, and a short send just resubmits the rest.
+//   - The wait lasts until the next timer of the shard expires, by the timeout of IORING_ENTER_EXT_ARG.
+//   - Only the worker thread touches the ring. The SQEs prepared during a dispatch are submitted together with
+//     the wait for the next completions, so a single io_uring_enter serves all the messages dispatched in one loop.
+//     The other threads post their sends to the strands of the connections, and wake the worker thread up through
+//     an eventfd, whose read completes as a NULL_POSTED packet, just like PostQueuedCompletionStatus.
+
+namespace iocp {
+    namespace _impl {
+
+        struct _UringLoop
+        {
+            int ringFd = -1;
+
+            // Submission queue.
+            void *sqRingPtr = MAP_FAILED;
+            size_t sqRingSize = 0;
+            unsigned *sqHead = nullptr;
+            unsigned *sqTail = nullptr;
+            unsigned sqMask = 0;
+            unsigned sqEntries = 0;
+            unsigned sqLocalTail = 0;  // SQEs are reserved here, and published to the kernel by a whole chain.
+            struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+            size_t sqesSize = 0;
+
+            // Completion queue.
+            void *cqRingPtr = MAP_FAILED;
+            size_t cqRingSize = 0;
+            unsigned *cqHead = nullptr;
+            unsigned *cqTail = nullptr;
+            unsigned cqMask = 0;
+            struct io_uring_cqe *cqes = nullptr;
+
+            // Provided buffers for the multishot recv.
+            struct io_uring_buf_ring *bufRing = (struct io_uring_buf_ring *)MAP_FAILED;
+            size_t bufRingSize = 0;
+            char *bufBase = (char *)MAP_FAILED;
+            uint16_t bufTail = 0;
+
+            int wakeupFd = -1;
+            uint64_t wakeupValue = 0;
+
+            _PER_IO_OPERATION_DATA acceptIOData;
+            _PER_IO_OPERATION_DATA wakeupIOData;
+        };
+
+        static int uringSetup(unsigned entries, struct io_uring_params *params)
+        {
+            return (int)::syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        static int uringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+        {
+            return (int)::syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+        }
+
+        // Waits for a completion up to timeout milliseconds, or forever for UINT64_MAX. Fails with ETIME on timeout.
+        // The multishot recv with provided buffers needs a later kernel than IORING_ENTER_EXT_ARG anyway.
+        static int uringWait(int ringFd, unsigned toSubmit, uint64_t timeout)
+        {
+            if (timeout == UINT64_MAX)
+            {
+                return uringEnter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+            }
+
+            struct __kernel_timespec ts;
+            ts.tv_sec = (long long)(timeout / 1000);
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            struct io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            return (int)::syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+        }
+
+        static int uringRegister(int ringFd, unsigned opcode, void *arg, unsigned nrArgs)
+        {
+            return (int)::syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+        }
+
+        static void destroyLoop(_UringLoop *loop)
+        {
+            if (loop->bufBase != MAP_FAILED) ::munmap(loop->bufBase, (size_t)URING_RECV_BUF_COUNT * OVERLAPPED_BUF_SIZE);
+            if (loop->bufRing != MAP_FAILED) ::munmap(loop->bufRing, loop->bufRingSize);
+            if (loop->sqes != MAP_FAILED) ::munmap(loop->sqes, loop->sqesSize);
+            if (loop->cqRingPtr != MAP_FAILED && loop->cqRingPtr != loop->sqRingPtr) ::munmap(loop->cqRingPtr, loop->cqRingSize);
+            if (loop->sqRingPtr != MAP_FAILED) ::munmap(loop->sqRingPtr, loop->sqRingSize);
+            if (loop->ringFd != -1) ::close(loop->ringFd);  // Cancels all the requests in flight.
+            if (loop->wakeupFd != -1) ::close(loop->wakeupFd);
+            delete loop;
+        }
+
+        // Hands a provided buffer back to the ring. Only the worker thread of the ring calls it.
+        static void recycleRecvBuffer(_UringLoop *loop, uint16_t bid)
+        {
+            // Index the entries by hand, as __DECLARE_FLEX_ARRAY puts bufs behind an empty struct in C++.
+            // The tail of the ring overlays the resv of the first entry.
+            struct io_uring_buf *bufs = (struct io_uring_buf *)loop->bufRing;
+            struct io_uring_buf *buf = &bufs[loop->bufTail & (URING_RECV_BUF_COUNT - 1)];
+            buf->addr = (uint64_t)(uintptr_t)(loop->bufBase + (size_t)bid * OVERLAPPED_BUF_SIZE);
+            buf->len = OVERLAPPED_BUF_SIZE;
+            buf->bid = bid;
+            ++loop->bufTail;
+            __atomic_store_n(&bufs[0].resv, loop->bufTail, __ATOMIC_RELEASE);
+        }
+
+        static _UringLoop *createLoop()
+        {
+            _UringLoop *loop = new (std::nothrow) _UringLoop;
+            if (loop == nullptr)
+            {
+                LOG_ERROR("new _UringLoop out of memory!");
+                return nullptr;
+            }
+
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            loop->ringFd = uringSetup(URING_ENTRIES, &params);
+            if (loop->ringFd == -1)
+            {
+                LOG_ERROR("io_uring_setup failed: errno %d", errno);
+                destroyLoop(loop);
+                return nullptr;
+            }
+
+            loop->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            loop->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMmap)
+            {
+                loop->sqRingSize = loop->cqRingSize = std::max(loop->sqRingSize, loop->cqRingSize);
+            }
+
+            loop->sqRingPtr = ::mmap(nullptr, loop->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_SQ_RING);
+            if (loop->sqRingPtr == MAP_FAILED)
+            {
+                destroyLoop(loop);
+                return nullptr;
+            }
+            loop->cqRingPtr = singleMmap ? loop->sqRingPtr
+                : ::mmap(nullptr, loop->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_CQ_RING);
+            if (loop->cqRingPtr == MAP_FAILED)
+            {
+                destroyLoop(loop);
+                return nullptr;
+            }
+            loop->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            loop->sqes = (struct io_uring_sqe *)::mmap(nullptr, loop->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_SQES);
+            if (loop->sqes == MAP_FAILED)
+            {
+                destroyLoop(loop);
+                return nullptr;
+            }
+
+            char *sq = (char *)loop->sqRingPtr;
+            loop->sqHead = (unsigned *)(sq + params.sq_off.head);
+            loop->sqTail = (unsigned *)(sq + params.sq_off.tail);
+            loop->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+            loop->sqEntries = *(unsigned *)(sq + params.sq_off.ring_entries);
+            loop->sqLocalTail = *loop->sqTail;
+
+            // Map the SQ array to the SQEs one by one, so the slot of a SQE never changes.
+            unsigned *sqArray = (unsigned *)(sq + params.sq_off.array);
+            for (unsigned i = 0; i < loop->sqEntries; ++i)
+            {
+                sqArray[i] = i;
+            }
+
+            char *cq = (char *)loop->cqRingPtr;
+            loop->cqHead = (unsigned *)(cq + params.cq_off.head);
+            loop->cqTail = (unsigned *)(cq + params.cq_off.tail);
+            loop->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+            loop->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+            // Provided buffers.
+            loop->bufRingSize = URING_RECV_BUF_COUNT * sizeof(struct io_uring_buf);
+            loop->bufRing = (struct io_uring_buf_ring *)::mmap(nullptr, loop->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            loop->bufBase = (char *)::mmap(nullptr, (size_t)URING_RECV_BUF_COUNT * OVERLAPPED_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (loop->bufRing == MAP_FAILED || loop->bufBase == MAP_FAILED)
+            {
+                LOG_ERROR("mmap provided buffers failed: errno %d", errno);
+                destroyLoop(loop);
+                return nullptr;
+            }
+
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t)(uintptr_t)loop->bufRing;
+            reg.ring_entries = URING_RECV_BUF_COUNT;
+            reg.bgid = URING_RECV_BUF_GROUP;
+            if (uringRegister(loop->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+            {
+                LOG_ERROR("IORING_REGISTER_PBUF_RING failed: errno %d", errno);
+                destroyLoop(loop);
+                return nullptr;
+            }
+
+            loop->bufTail = 0;
+            for (uint16_t bid = 0; bid < URING_RECV_BUF_COUNT; ++bid)
+            {
+                recycleRecvBuffer(loop, bid);
+            }
+
+            loop->wakeupFd = ::eventfd(0, EFD_CLOEXEC);
+            if (loop->wakeupFd == -1)
+            {
+                LOG_ERROR("eventfd failed: errno %d", errno);
+                destroyLoop(loop);
+                return nullptr;
+            }
+
+            loop->acceptIOData.type = _OPERATION_TYPE::ACCEPT_POSTED;
+            loop->wakeupIOData.type = _OPERATION_TYPE::NULL_POSTED;
+            loop->wakeupIOData.completionKey = loop;
+            return loop;
+        }
+
+        // Reserves a zeroed SQE, the caller must call publishSqes after filling a whole chain.
+        static struct io_uring_sqe *getSqe(_UringLoop *loop)
+        {
+            unsigned head = __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE);
+            if (loop->sqLocalTail - head >= loop->sqEntries)
+            {
+                // Submit what has been published, a chain still being filled is not visible to the kernel yet.
+                uringEnter(loop->ringFd, *loop->sqTail - head, 0, 0);
+                head = __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE);
+                if (loop->sqLocalTail - head >= loop->sqEntries)
+                {
+                    return nullptr;
+                }
+            }
+
+            struct io_uring_sqe *sqe = &loop->sqes[loop->sqLocalTail & loop->sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            ++loop->sqLocalTail;
+            return sqe;
+        }
+
+        // Makes the reserved SQEs visible to the kernel at once, so a chain of linked SQEs is never split.
+        // The worker thread submits them along with its next wait.
+        static void publishSqes(_UringLoop *loop)
+        {
+            __atomic_store_n(loop->sqTail, loop->sqLocalTail, __ATOMIC_RELEASE);
+        }
+
+        static bool postWakeupRead(_UringLoop *loop)
+        {
+            struct io_uring_sqe *sqe = getSqe(loop);
+            if (sqe == nullptr)
+            {
+                return false;
+            }
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = loop->wakeupFd;
+            sqe->addr = (uint64_t)(uintptr_t)&loop->wakeupValue;
+            sqe->len = sizeof(loop->wakeupValue);
+            sqe->user_data = (uint64_t)(uintptr_t)&loop->wakeupIOData;
+            publishSqes(loop);
+            return true;
+        }
+
+        //
+        // _ServerFramework
+        //
+
+        bool _ServerFramework::initialize()
+        {
+            // A peer resetting the connection must not kill the process, errors are reported by the completions instead.
+            ::signal(SIGPIPE, SIG_IGN);
+            return true;
+        }
+
+        bool _ServerFramework::uninitialize()
+        {
+            return true;
+        }
+
+        _ServerFramework::_ServerFramework()
+            : _workerThreads(WORK_THREAD_RESERVE_SIZE)
+            , _sendMemory(0)
+            , _nextTimerShard(0)
+            , _nextConnectShard(0)
+        {
+            _workerThreads.resize(0);
+
+            _ip[0] = '\0';
+        }
+
+        _ServerFramework::~_ServerFramework()
+        {
+        }
+
+        static SOCKET createListenSocket(const struct sockaddr_in &serverAddr, bool reusePort)
+        {
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (s == INVALID_SOCKET)
+            {
+                return INVALID_SOCKET;
+            }
+
+            int on = 1;
+            ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            // Every shard listens on the same port, and the kernel spreads the incoming connections among them.
+            if (reusePort && ::setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+            {
+                LOG_ERROR("SO_REUSEPORT failed: errno %d", errno);
+                ::close(s);
+                return INVALID_SOCKET;
+            }
+
+            if (::bind(s, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR
+                || ::listen(s, SOMAXCONN) == SOCKET_ERROR)
+            {
+                ::close(s);
+                return INVALID_SOCKET;
+            }
+            return s;
+        }
+
+        // Closes everything the shard owns, but the shared listener.
+        static void destroyShard(_Shard *shard, SOCKET sharedListenSocket)
+        {
+            if (shard->loop != nullptr) destroyLoop(shard->loop);  // Cancels all the requests in flight.
+            if (shard->listenSocket != INVALID_SOCKET && shard->listenSocket != sharedListenSocket) ::close(shard->listenSocket);
+            delete shard;
+        }
+
+        bool _ServerFramework::startup(const char *ip, uint16_t port)
+        {
+            _shouldQuit = false;
+            warmContextPool();
+
+            _port = port;
+            struct sockaddr_in serverAddr = { 0 };
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = htons(_port);
+            if (ip != nullptr)
+            {
+                strncpy(_ip, ip, 16);
+                serverAddr.sin_addr.s_addr = ::inet_addr(ip);
+            }
+
+            bool sharded = (_shardCount > 0);
+            if (!sharded)
+            {
+                _listenSocket = createListenSocket(serverAddr, false);
+                if (_listenSocket == INVALID_SOCKET)
+                {
+                    return false;
+                }
+            }
+
+            unsigned workerThreadCnt = sharded ? _shardCount : std::thread::hardware_concurrency();
+            if (workerThreadCnt == 0)
+            {
+                workerThreadCnt = 1;
+            }
+            LOG_DEBUG("hardware_concurrency = %u, workerThreadCnt = %u, sharded = %d", std::thread::hardware_concurrency(), workerThreadCnt, (int)sharded);
+
+            // The compute pool first, the connections may use it as soon as they're accepted.
+            if (_computeThreads > 0 && !_computePool.start(_computeThreads))
+            {
+                shutdown();
+                return false;
+            }
+
+            TRY_BLOCK_BEGIN
+            _workerThreads.reserve(workerThreadCnt);
+            _shards.reserve(workerThreadCnt);
+
+            // Worker threads, each one runs its own shard with a ring.
+            for (unsigned i = 0; i < workerThreadCnt; ++i)
+            {
+                _Shard *shard = new (std::nothrow) _Shard;
+                if (shard == nullptr)
+                {
+                    LOG_ERROR("new _Shard out of memory!");
+                    continue;
+                }
+                // The position in _shards, which the IDs of its timers are tagged with. A shard failed before is
+                // not there.
+                shard->index = (unsigned)_shards.size();
+                shard->server = this;
+                shard->recvSize = _recvSize;
+                shard->timeouts = _timeouts;
+                shard->sendLimits = _sendLimits;
+                shard->sendBatching = _sendBatching;
+                shard->timers.setTag((uint8_t)shard->index);
+
+                shard->listenSocket = sharded ? createListenSocket(serverAddr, true) : _listenSocket;
+                shard->loop = createLoop();
+                if (shard->listenSocket == INVALID_SOCKET || shard->loop == nullptr)
+                {
+                    LOG_ERROR("create shard %u failed: errno %d", i, errno);
+                    destroyShard(shard, _listenSocket);
+                    continue;
+                }
+
+                shard->loop->acceptIOData.completionKey = shard;
+                if (!postAccept(shard) || !postWakeupRead(shard->loop))
+                {
+                    destroyShard(shard, _listenSocket);
+                    continue;
+                }
+
+                std::thread *t = new (std::nothrow) std::thread([this, shard]() { worketThreadProc(shard); });
+                if (t == nullptr)
+                {
+                    LOG_ERROR("new std::thread out of memory!");
+                    destroyShard(shard, _listenSocket);
+                    continue;
+                }
+                if (sharded)
+                {
+                    bindToCore(t, i);
+                }
+                _shards.push_back(shard);
+                _workerThreads.push_back(t);
+            }
+            CATCH_EXCEPTIONS
+            shutdown();
+            return false;
+            CATCH_BLOCK_END
+
+            if (_workerThreads.empty())
+            {
+                shutdown();
+                return false;
+            }
+
+            return true;
+        }
+
+        void _ServerFramework::shutdown()
+        {
+            _shouldQuit = true;
+            clearUpstreams();
+
+            // Terminate all the worker threads.
+            std::for_each(_shards.begin(), _shards.end(), [](_Shard *shard) {
+                uint64_t one = 1;
+                ssize_t ret = ::write(shard->loop->wakeupFd, &one, sizeof(one));
+                (void)ret;
+            });
+
+            std::for_each(_workerThreads.begin(), _workerThreads.end(), [](std::thread *t) {
+                t->join();
+                delete t;
+            });
+            _workerThreads.clear();
+
+            _computePool.stop();  // The compute tasks left go with their ClientContexts.
+
+            // Closing the rings cancels all the requests in flight, so the ClientContexts can be deleted then.
+            std::for_each(_shards.begin(), _shards.end(), [this](_Shard *shard) {
+                destroyLoop(shard->loop);
+                shard->loop = nullptr;
+                dropPostedTasks(shard);
+                destroyShard(shard, _listenSocket);
+            });
+            _connections.clear([this](_ClientContext *ctx) {
+                dropTasks(ctx);
+                _deallocateCtx(ctx);
+            });
+            drainContextPool();
+            _shards.clear();
+
+            if (_listenSocket != INVALID_SOCKET)
+            {
+                ::close(_listenSocket);
+                _listenSocket = INVALID_SOCKET;
+            }
+        }
+
+        bool _ServerFramework::postAccept(_Shard *shard)
+        {
+            _UringLoop *loop = shard->loop;
+            struct io_uring_sqe *sqe = getSqe(loop);
+            if (sqe == nullptr)
+            {
+                return false;
+            }
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = shard->listenSocket;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = (uint64_t)(uintptr_t)&loop->acceptIOData;
+            publishSqes(loop);
+            return true;
+        }
+
+        void _ServerFramework::worketThreadProc(_Shard *shard)
+        {
+            _UringLoop *loop = shard->loop;
+            shard->threadId = std::this_thread::get_id();
+            mp::vector<ExpiredTimer> expired;
+
+            while (!_shouldQuit)
+            {
+                uint64_t wait = runTimers(shard, expired);
+                flushSends(shard);
+
+                // Submit the SQEs published during the last dispatch, and wait for the next completion, in one call.
+                // Nobody else enters the ring, so exactly the published chains are submitted.
+                unsigned toSubmit = *loop->sqTail - *loop->sqHead;
+                int ret = uringWait(loop->ringFd, toSubmit, wait);
+                if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME)
+                {
+                    LOG_ERROR("io_uring_enter failed: errno %d", errno);
+                    break;
+                }
+
+                unsigned head = *loop->cqHead;
+                unsigned tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+                while (head != tail)
+                {
+                    struct io_uring_cqe *cqe = &loop->cqes[head & loop->cqMask];
+                    _PER_IO_OPERATION_DATA *ioData = (_PER_IO_OPERATION_DATA *)(uintptr_t)cqe->user_data;
+                    int res = cqe->res;
+                    uint32_t flags = cqe->flags;
+
+                    // Hand the CQE back before the dispatch, which may reap no more.
+                    ++head;
+                    __atomic_store_n(loop->cqHead, head, __ATOMIC_RELEASE);
+
+                    CONTINUE_IF(ioData == nullptr);
+
+                    void *completionKey = ioData->completionKey;
+
+                    switch (ioData->type)
+                    {
+                    case _OPERATION_TYPE::ACCEPT_POSTED:
+                        doAccept(shard, res, (flags & IORING_CQE_F_MORE) != 0);
+                        break;
+                    case _OPERATION_TYPE::RECV_POSTED:
+                    case _OPERATION_TYPE::SEND_POSTED:
+                    case _OPERATION_TYPE::CONNECT_POSTED:
+                    {
+                        // Held during the dispatch, so the handlers may close the connection, e.g. by disconnect in
+                        // onRecv. It's not removed before, an operation of it is in flight until now.
+                        _ClientContext *ctx = (_ClientContext *)completionKey;
+                        _connections.retain(ctx->_id);
+                        if (ioData->type == _OPERATION_TYPE::RECV_POSTED)
+                        {
+                            doRecv(ctx, res, flags);
+                        }
+                        else if (ioData->type == _OPERATION_TYPE::SEND_POSTED)
+                        {
+                            doSend(ctx, res);
+                        }
+                        else
+                        {
+                            doConnect(ctx, res);
+                        }
+                        releaseClient(ctx);  // The ClientContext is deleted here if it has been closed.
+                        break;
+                    }
+                    case _OPERATION_TYPE::NULL_POSTED:
+                        // Woken up by another thread to run the strands it posted or for an earlier timer, or by shutdown.
+                        if (!_shouldQuit)
+                        {
+                            postWakeupRead(loop);
+                        }
+                        break;
+                    default:
+                        break;
+                    }
+
+                    tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+                }
+
+                runPostedStrands(shard);
+                runPostedTasks(shard);
+            }
+            flushSends(shard);  // Drops the holds.
+        }
+
+        void _ServerFramework::doAccept(_Shard *shard, int res, bool more)
+        {
+            if (!more && !_shouldQuit)
+            {
+                // The multishot accept has been terminated, we should post a new one as a supplement.
+                postAccept(shard);
+            }
+
+            if (res < 0)
+            {
+                if (res != -ECANCELED)
+                {
+                    LOG_ERROR("accept failed: errno %d", -res);
+                }
+                return;
+            }
+
+            SOCKET clientSocket = res;
+
+            struct sockaddr_in remoteAddr;
+            socklen_t remoteLen = sizeof(remoteAddr);
+            memset(&remoteAddr, 0, sizeof(remoteAddr));
+            ::getpeername(clientSocket, (struct sockaddr *)&remoteAddr, &remoteLen);
+
+            char ip[16];
+            ::inet_ntop(AF_INET, &remoteAddr.sin_addr, ip, sizeof(ip));
+            uint16_t port = ntohs(remoteAddr.sin_port);
+
+            LOG_DEBUG("remote address %s %hu", ip, port);
+
+            _ClientContext *ctx = nullptr;
+            TRY_BLOCK_BEGIN
+            ctx = allocateContext();
+            CATCH_EXCEPTIONS
+            ::close(clientSocket);
+            return;
+            CATCH_BLOCK_END
+            if (ctx == nullptr)
+            {
+                LOG_ERROR("new context out of memory!");
+                ::close(clientSocket);
+                return;
+            }
+
+            if (!addClient(shard, ctx))
+            {
+                deallocateContext(ctx);
+                ::close(clientSocket);
+                return;
+            }
+
+            ctx->_socket = clientSocket;
+            initSocket(clientSocket);
+            strncpy(ctx->_ip, ip, 16);
+            ctx->_port = port;
+            ctx->_recvIOData.completionKey = ctx;
+            ctx->_recvIOData.type = _OPERATION_TYPE::RECV_POSTED;
+            ctx->_sendIOData.completionKey = ctx;
+            ctx->_sendIOData.type = _OPERATION_TYPE::SEND_POSTED;
+
+            if (ctx->postRecv() == _ClientContext::POST_RESULT::SUCCESS)
+            {
+                LOG_DEBUG("%16s:%5hu connected", ip, port);
+                startTimeouts(ctx);
+            }
+            else
+            {
+                LOG_DEBUG("%16s:%5hu post recv failed", ip, port);
+                closeConnection(ctx);
+            }
+        }
+
+        void _ServerFramework::beginConnect(_ClientContext *ctx)
+        {
+            if (ctx->_closing)  // Disconnected before it began.
+            {
+                ctx->_sending = false;
+                releaseIfIdle(ctx);
+                return;
+            }
+
+            // The connect completes in the place of a send, through _sendIOData.
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            ctx->_socket = s;
+            if (s != INVALID_SOCKET)
+            {
+                initSocket(s);
+            }
+            ctx->_recvIOData.completionKey = ctx;
+            ctx->_recvIOData.type = _OPERATION_TYPE::RECV_POSTED;
+            ctx->_sendIOData.completionKey = ctx;
+            ctx->_sendIOData.type = _OPERATION_TYPE::CONNECT_POSTED;
+
+            struct io_uring_sqe *sqe = s != INVALID_SOCKET ? getSqe(ctx->_shard->loop) : nullptr;
+            if (sqe == nullptr)
+            {
+                ctx->_sending = false;
+                closeConnection(ctx);
+                return;
+            }
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd = s;
+            sqe->addr = (uint64_t)(uintptr_t)&ctx->_connectAddr;
+            sqe->off = sizeof(ctx->_connectAddr);
+            sqe->user_data = (uint64_t)(uintptr_t)&ctx->_sendIOData;
+            publishSqes(ctx->_shard->loop);
+            startTimeouts(ctx);
+        }
+
+        void _ServerFramework::doConnect(_ClientContext *ctx, int res)
+        {
+            ctx->_sending = false;
+            ctx->_sendIOData.type = _OPERATION_TYPE::SEND_POSTED;
+            if (ctx->_closing)
+            {
+                releaseIfIdle(ctx);
+                return;
+            }
+
+            if (res < 0 || !finishConnect(ctx) || (!ctx->_closing && ctx->postRecv() != _ClientContext::POST_RESULT::SUCCESS))
+            {
+                closeConnection(ctx);
+            }
+        }
+
+        void _ServerFramework::doRecv(_ClientContext *ctx, int res, uint32_t flags)
+        {
+            _UringLoop *loop = ctx->_shard->loop;
+            if ((flags & IORING_CQE_F_MORE) == 0)
+            {
+                ctx->_recvArmed = false;
+            }
+
+            bool ok = false;
+            if (flags & IORING_CQE_F_BUFFER)
+            {
+                uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+                if (res > 0 && !ctx->_closing)
+                {
+                    ctx->stampRecv();
+                    ok = dispatchRecv(ctx, loop->bufBase + (size_t)bid * OVERLAPPED_BUF_SIZE, (size_t)res);
+                }
+                recycleRecvBuffer(loop, bid);  // Any remainder has been copied into the receive ring.
+                if (ctx->_recvRing.empty())
+                {
+                    ctx->_recvRing.release();  // It only holds the remainders, give the memory back between them.
+                }
+            }
+            else if (res == -ENOBUFS)
+            {
+                ok = true;  // All the provided buffers were in use, they have been handed back by now.
+            }
+
+            if (ctx->_closing)
+            {
+                releaseIfIdle(ctx);
+                return;
+            }
+
+            if (!ok)
+            {
+                closeConnection(ctx);  // Closed by peer, or something goes wrong.
+                return;
+            }
+
+            if (!ctx->_recvArmed && ctx->postRecv() != _ClientContext::POST_RESULT::SUCCESS)
+            {
+                closeConnection(ctx);
+            }
+        }
+
+        void _ServerFramework::doSend(_ClientContext *ctx, int res)
+        {
+            ctx->_sending = false;
+            bool failed = res < 0;
+            if (!failed)
+            {
+                ctx->consumeSend((size_t)res);
+                if (!ctx->_closing && !ctx->_sendChain.empty())  // Send the rest of the chain.
+                {
+                    failed = ctx->startSend() == _ClientContext::POST_RESULT::FAIL;
+                }
+                if (!failed)
+                {
+                    ctx->checkSendWater();
+                }
+            }
+
+            if (ctx->_closing)
+            {
+                releaseIfIdle(ctx);
+            }
+            else if (failed)
+            {
+                closeConnection(ctx);
+            }
+        }
+
+        void _ServerFramework::closeConnection(_ClientContext *ctx)
+        {
+            if (ctx->_closing)
+            {
+                return;
+            }
+
+            LOG_DEBUG("%16s:%5hu disconnected", ctx->_ip, ctx->_port);
+            notifyDisconnect(ctx);
+            ctx->_closing = true;
+
+            // Make the multishot recv and the sends in flight complete, the ClientContext is deleted after all of them.
+            ::shutdown(ctx->_socket, SHUT_RDWR);
+            releaseIfIdle(ctx);
+        }
+
+        void _ServerFramework::wakeShard(_Shard *shard)
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(shard->loop->wakeupFd, &one, sizeof(one));
+            (void)ret;
+        }
+
+        void _ServerFramework::scheduleTasks(_Shard *shard)
+        {
+            wakeShard(shard);
+        }
+
+        void _ServerFramework::releaseIfIdle(_ClientContext *ctx)
+        {
+            if (ctx->_recvArmed || ctx->_sending)
+            {
+                return;
+            }
+
+            SOCKET s = ctx->_socket;  // Save the socket.
+            ctx->_socket = INVALID_SOCKET;
+            removeClient(ctx);
+
+            if (s != INVALID_SOCKET)  // Unless closed before the connect began.
+            {
+                ::close(s);
+            }
+        }
+
+        //
+        // _ClientContext
+        //
+
+        _ClientContext::_ClientContext()
+            : _strandPending(0)
+            , _computePending(0)
+            , _lastRecvTime(0)
+            , _lastSendTime(0)
+        {
+            _strandIOData.completionKey = this;
+            _strandIOData.type = _OPERATION_TYPE::STRAND_POSTED;
+        }
+
+        _ClientContext::~_ClientContext()
+        {
+            if (_socket != INVALID_SOCKET)
+            {
+                ::close(_socket);
+                _socket = INVALID_SOCKET;
+            }
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::postRecv()
+        {
+            if (_recvArmed)
+            {
+                return POST_RESULT::SUCCESS;
+            }
+
+            _UringLoop *loop = _shard->loop;
+            struct io_uring_sqe *sqe = getSqe(loop);
+            if (sqe == nullptr)
+            {
+                return POST_RESULT::FAIL;
+            }
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = _socket;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_RECV_BUF_GROUP;
+            sqe->user_data = (uint64_t)(uintptr_t)&_recvIOData;
+            publishSqes(loop);
+
+            _recvArmed = true;
+            return POST_RESULT::SUCCESS;
+        }
+
+        _ClientContext::POST_RESULT _ClientContext::startSend()
+        {
+            if (_sending)  // Only one send is in flight, the chain is sent in order on its completion.
+            {
+                return POST_RESULT::CACHED;
+            }
+
+            memset(&_sendMsg, 0, sizeof(_sendMsg));
+            _sendMsg.msg_iov = _sendVecs;
+            _sendMsg.msg_iovlen = gatherSend(_sendVecs, MAX_SEND_SEGMENTS, _sendInFlight);
+
+            _UringLoop *loop = _shard->loop;
+            struct io_uring_sqe *sqe = getSqe(loop);
+            if (sqe == nullptr)
+            {
+                _sendInFlight = 0;
+                return POST_RESULT::FAIL;
+            }
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = _socket;
+            sqe->addr = (uint64_t)(uintptr_t)&_sendMsg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = (uint64_t)(uintptr_t)&_sendIOData;
+            publishSqes(loop);
+
+            _sending = true;
+            countWrite();
+            return POST_RESULT::SUCCESS;
+        }
+    }  // end of namespace _impl
+}  // end of namespace iocp
+
+#endif  // IOCP_BACKEND == IOCP_BACKEND_IO_URING
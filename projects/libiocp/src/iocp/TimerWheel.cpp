@@ -0,0 +1,342 @@
+#include "ServerFrameworkImpl.h"
+#include "ImplMacros.h"
+#if PLATFORM_IS_WINDOWS
+#   include <intrin.h>
+#else
+#   include <time.h>
+#endif
+#include <string.h>
+
+#define MAX_DELAY_TICKS 0xFFFFFFFFULL
+
+namespace iocp {
+    namespace {
+        // The index of the lowest bit set, bits must not be 0.
+        inline unsigned lowestBit(uint64_t bits)
+        {
+#if PLATFORM_IS_WINDOWS
+            unsigned long index = 0;
+            if (_BitScanForward(&index, (unsigned long)bits))
+            {
+                return (unsigned)index;
+            }
+            _BitScanForward(&index, (unsigned long)(bits >> 32));
+            return (unsigned)index + 32;
+#else
+            return (unsigned)__builtin_ctzll(bits);
+#endif
+        }
+
+        // The nodes of a slot are scattered over the array, fetch the next one while handling this one.
+        inline void prefetch(const void *p)
+        {
+#if PLATFORM_IS_WINDOWS
+            _mm_prefetch((const char *)p, _MM_HINT_T0);
+#else
+            __builtin_prefetch(p);
+#endif
+        }
+    }
+
+    TimerWheel::TimerWheel(uint32_t tick)
+        : _tick(tick > 0 ? tick : 1)
+    {
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            _heads[i] = NIL;
+        }
+        memset(_bitmap, 0, sizeof(_bitmap));
+    }
+
+    TimerWheel::~TimerWheel()
+    {
+    }
+
+    uint64_t TimerWheel::currentTime()
+    {
+#if PLATFORM_IS_WINDOWS
+        return (uint64_t)::GetTickCount64();
+#else
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+    }
+
+    TimerId TimerWheel::schedule(uint64_t now, uint64_t delay, uint64_t period, const TimerCallback &callback)
+    {
+        if (!_started)
+        {
+            _current = toTicks(now, false);
+            _started = true;
+        }
+
+        uint32_t index = _freeHead;
+        if (index == NIL)
+        {
+            _Node node = _Node();
+            node.slot = NIL;
+            _nodes.push_back(std::move(node));
+            index = (uint32_t)(_nodes.size() - 1);
+        }
+        else
+        {
+            _freeHead = _nodes[index].next;
+        }
+
+        _Node &node = _nodes[index];
+        try
+        {
+            node.callback = callback;
+        }
+        catch (...)
+        {
+            node.next = _freeHead;
+            _freeHead = index;
+            throw;
+        }
+        uint64_t maxDelay = MAX_DELAY_TICKS * _tick;
+        node.expire = toTicks(now + (delay < maxDelay ? delay : maxDelay), true);
+        node.period = period > 0 ? toTicks(period < maxDelay ? period : maxDelay, true) : 0;
+        link(index);
+        ++_count;
+        return ((uint64_t)_tag << 56) | ((uint64_t)node.generation << 32) | ((uint64_t)index + 1);
+    }
+
+    bool TimerWheel::cancel(TimerId id)
+    {
+        uint64_t index = (id & 0xFFFFFFFF) - 1;
+        if ((uint8_t)(id >> 56) != _tag || index >= _nodes.size())
+        {
+            return false;
+        }
+        _Node &node = _nodes[(size_t)index];
+        if (node.slot == NIL || node.generation != ((id >> 32) & 0xFFFFFF))
+        {
+            return false;
+        }
+        unlink((uint32_t)index);
+        freeNode((uint32_t)index);
+        return true;
+    }
+
+    uint64_t TimerWheel::nextExpiry() const
+    {
+        uint64_t tick = nextEventTick();
+        return tick == UINT64_MAX ? UINT64_MAX : tick * _tick;
+    }
+
+    size_t TimerWheel::advance(uint64_t now, std::vector<ExpiredTimer, mp::Allocator<ExpiredTimer> > &expired)
+    {
+        uint64_t target = toTicks(now, false);
+        if (!_started)
+        {
+            _current = target;
+            _started = true;
+        }
+
+        // Jump from one tick with something to do to the next one, the empty ones in between cost nothing.
+        size_t count = expired.size();
+        while (_current <= target)
+        {
+            uint64_t tick = nextEventTick();
+            if (tick > target)
+            {
+                _current = target + 1;
+                break;
+            }
+            _current = tick;
+            expire(tick, expired);
+            _current = tick + 1;
+        }
+        return expired.size() - count;
+    }
+
+    uint64_t TimerWheel::nextEventTick() const
+    {
+        if (_count == 0)
+        {
+            return UINT64_MAX;
+        }
+
+        // The first level, from the slot of the current tick round to the one before it.
+        uint64_t best = UINT64_MAX;
+        unsigned start = (unsigned)(_current & 255);
+        for (unsigned n = 0; n <= 4; ++n)
+        {
+            unsigned word = ((start >> 6) + n) & 3;
+            uint64_t bits = _bitmap[word];
+            if (n == 0)
+            {
+                bits &= ~0ULL << (start & 63);
+            }
+            else if (n == 4)
+            {
+                bits &= (start & 63) != 0 ? (1ULL << (start & 63)) - 1 : 0;
+            }
+            if (bits != 0)
+            {
+                unsigned pos = word * 64 + lowestBit(bits);
+                best = _current + ((pos - start) & 255);
+                break;
+            }
+        }
+
+        // The coarser levels, a slot moves down when the time reaches the start of its span.
+        for (unsigned level = 1; level < LEVELS; ++level)
+        {
+            uint64_t bits = _bitmap[3 + level];
+            CONTINUE_IF(bits == 0);
+            unsigned shift = shiftOf(level);
+            uint64_t span = (_current + ((1ULL << shift) - 1)) >> shift;  // The first span starting from now on.
+            unsigned rot = (unsigned)(span & 63);
+            uint64_t rotated = rot == 0 ? bits : (bits >> rot) | (bits << (64 - rot));
+            uint64_t tick = (span + lowestBit(rotated)) << shift;
+            best = tick < best ? tick : best;
+        }
+        return best;
+    }
+
+    void TimerWheel::link(uint32_t index)
+    {
+        _Node &node = _nodes[index];
+        if (node.expire < _current)
+        {
+            node.expire = _current;
+        }
+        if (node.expire - _current > MAX_DELAY_TICKS)
+        {
+            node.expire = _current + MAX_DELAY_TICKS;
+        }
+
+        // The finest level which spans the delay. A coarser slot is reached at the start of the span of the expiry,
+        // which comes before any other span of the same slot, as the level spans 64 of them.
+        uint64_t delta = node.expire - _current;
+        uint32_t slot = 0;
+        if (delta < 256)
+        {
+            slot = (uint32_t)(node.expire & 255);
+        }
+        else
+        {
+            unsigned level = 1;
+            while (level < LEVELS - 1 && delta >= (1ULL << (shiftOf(level) + 6)))
+            {
+                ++level;
+            }
+            slot = 256 + (level - 1) * 64 + (uint32_t)((node.expire >> shiftOf(level)) & 63);
+        }
+
+        node.slot = slot;
+        node.prev = NIL;
+        node.next = _heads[slot];
+        if (node.next != NIL)
+        {
+            _nodes[node.next].prev = index;
+        }
+        _heads[slot] = index;
+        _bitmap[slot >> 6] |= 1ULL << (slot & 63);
+    }
+
+    void TimerWheel::unlink(uint32_t index)
+    {
+        _Node &node = _nodes[index];
+        if (node.prev != NIL)
+        {
+            _nodes[node.prev].next = node.next;
+        }
+        else
+        {
+            _heads[node.slot] = node.next;
+        }
+        if (node.next != NIL)
+        {
+            _nodes[node.next].prev = node.prev;
+        }
+
+        if (_heads[node.slot] == NIL)
+        {
+            _bitmap[node.slot >> 6] &= ~(1ULL << (node.slot & 63));
+        }
+        node.slot = NIL;
+    }
+
+    void TimerWheel::freeNode(uint32_t index)
+    {
+        _Node &node = _nodes[index];
+        node.callback = nullptr;
+        node.generation = (node.generation + 1) & 0xFFFFFF;
+        node.next = _freeHead;
+        _freeHead = index;
+        --_count;
+    }
+
+    void TimerWheel::cascade(unsigned level, uint32_t slotIndex)
+    {
+        uint32_t slot = 256 + (level - 1) * 64 + slotIndex;
+        uint32_t index = _heads[slot];
+        _heads[slot] = NIL;
+        _bitmap[3 + level] &= ~(1ULL << slotIndex);
+        while (index != NIL)
+        {
+            uint32_t next = _nodes[index].next;
+            if (next != NIL)
+            {
+                prefetch(&_nodes[next]);
+            }
+            link(index);
+            index = next;
+        }
+    }
+
+    void TimerWheel::expire(uint64_t tick, std::vector<ExpiredTimer, mp::Allocator<ExpiredTimer> > &expired)
+    {
+        // Move the slots reaching the start of their spans down, the coarsest first.
+        for (unsigned level = LEVELS - 1; level > 0; --level)
+        {
+            unsigned shift = shiftOf(level);
+            if ((tick & ((1ULL << shift) - 1)) == 0)
+            {
+                cascade(level, (uint32_t)((tick >> shift) & 63));
+            }
+        }
+
+        // All the timers in the slot of the tick expire now. Each one is taken out only once its entry has been
+        // appended, so if that throws, the rest stays in the slot.
+        uint32_t slot = (uint32_t)(tick & 255);
+        while (_heads[slot] != NIL)
+        {
+            uint32_t index = _heads[slot];
+            _Node &node = _nodes[index];
+            if (node.next != NIL)
+            {
+                prefetch(&_nodes[node.next]);
+            }
+
+            expired.push_back(ExpiredTimer());
+            ExpiredTimer &timer = expired.back();
+            timer.id = ((uint64_t)_tag << 56) | ((uint64_t)node.generation << 32) | ((uint64_t)index + 1);
+            if (node.period > 0)  // Scheduled again in a later slot, with a copy of the callback.
+            {
+                try
+                {
+                    timer.callback = node.callback;
+                }
+                catch (...)
+                {
+                    expired.pop_back();
+                    throw;
+                }
+                unlink(index);
+                node.expire = tick + node.period;
+                link(index);
+            }
+            else
+            {
+                timer.callback = std::move(node.callback);
+                unlink(index);
+                freeNode(index);
+            }
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include "MemoryPool.h"
+
+namespace iocp {
+    // Identifies a timer, and is never reused by the later ones of the same wheel. 0 is never a valid ID.
+    typedef uint64_t TimerId;
+
+    // Gets the ID of the timer, so that a periodic one can cancel itself.
+    typedef std::function<void (TimerId id)> TimerCallback;
+
+    struct ExpiredTimer
+    {
+        TimerId id;
+        TimerCallback callback;
+    };
+
+    // A hierarchical timing wheel, defined in TimerWheel.cpp.
+    //
+    // The time is cut into ticks. The timers due in the next 256 ticks hang in the slot of their tick, the later
+    // ones in 4 coarser levels of 64 slots each, whose slots span 256, 16K, 1M and 64M ticks. When the time reaches
+    // a slot of a coarser level, its timers move down to the finer ones. So scheduling and cancelling are O(1), and
+    // a timer moves at most 4 times before it fires, however many timers there are. The delays are capped at 2^32
+    // ticks, i.e. about 497 days of 10 ms ticks.
+    //
+    // The time is given by the caller in milliseconds, usually currentTime(), so the wheel never reads the clock.
+    // It isn't thread-safe, the caller guards it.
+    class TimerWheel
+    {
+    public:
+        enum : uint32_t { DEFAULT_TICK = 10 };  // Milliseconds.
+
+        explicit TimerWheel(uint32_t tick = DEFAULT_TICK);
+        ~TimerWheel();
+
+        // A monotonic clock in milliseconds.
+        static uint64_t currentTime();
+
+        // The upper 8 bits of the IDs, so that the timers of several wheels can be told apart.
+        void setTag(uint8_t tag) { _tag = tag; }
+
+        // Fires the callback once delay milliseconds after now, and then every period milliseconds if it's not 0.
+        // Both are rounded up to ticks. Throws std::bad_alloc if out of memory.
+        TimerId schedule(uint64_t now, uint64_t delay, uint64_t period, const TimerCallback &callback);
+
+        // Returns false if the timer has fired (once), has been cancelled, or is not of this wheel.
+        bool cancel(TimerId id);
+
+        // The timers armed.
+        size_t size() const { return _count; }
+
+        // The time at which advance has something to do, a timer to fire or to move down a level,
+        // or UINT64_MAX if no timer is armed.
+        uint64_t nextExpiry() const;
+
+        // Runs the time up to now, and appends the expired timers to expired in the order of their expiry,
+        // the callbacks are to be called by the caller. A periodic timer is scheduled again at once.
+        // Returns the number of the timers appended.
+        size_t advance(uint64_t now, std::vector<ExpiredTimer, mp::Allocator<ExpiredTimer> > &expired);
+
+    private:
+        enum : uint32_t
+        {
+            NIL = 0xFFFFFFFF,
+            LEVELS = 5,
+            SLOTS = 256 + 64 * (LEVELS - 1),
+        };
+
+        struct _Node
+        {
+            uint64_t expire;  // The tick.
+            uint64_t period;  // Ticks, 0 for a one-shot timer.
+            uint32_t prev;
+            uint32_t next;  // Or the next free node.
+            uint32_t generation;
+            uint32_t slot;  // NIL if the node is free.
+            TimerCallback callback;
+        };
+
+        static unsigned shiftOf(unsigned level) { return level == 0 ? 0 : 8 + 6 * (level - 1); }
+
+        uint64_t toTicks(uint64_t time, bool roundUp) const { return (time + (roundUp ? _tick - 1 : 0)) / _tick; }
+        uint64_t nextEventTick() const;
+
+        void link(uint32_t index);
+        void unlink(uint32_t index);
+        void freeNode(uint32_t index);
+        void cascade(unsigned level, uint32_t slotIndex);
+        void expire(uint64_t tick, std::vector<ExpiredTimer, mp::Allocator<ExpiredTimer> > &expired);
+
+    private:
+        uint64_t _tick;
+        uint64_t _current = 0;  // The next tick to run.
+        bool _started = false;
+        uint8_t _tag = 0;
+
+        std::vector<_Node, mp::Allocator<_Node> > _nodes;
+        uint32_t _freeHead = NIL;
+        size_t _count = 0;
+
+        uint32_t _heads[SLOTS];
+        uint64_t _bitmap[SLOTS / 64];  // A bit per slot not empty, 4 words for the first level, then 1 per level.
+
+    private:
+        TimerWheel(const TimerWheel &) = delete;
+        TimerWheel(TimerWheel &&) = delete;
+        TimerWheel &operator=(const TimerWheel &) = delete;
+        TimerWheel &operator=(TimerWheel &&) = delete;
+    };
+}
+
+#endif
@@ -222,8 +222,15 @@ class DynamicMessage : public Message {
     TypeInfo() : prototype(NULL), default_oneof_instance(NULL) {}
 
     ~TypeInfo() {
-      delete prototype;
-      operator delete(default_oneof_instance);
+      // The prototype was placed in memory of ::operator new, not of
+      // MessageLite::operator new, see GetPrototypeNoLock(), so it's not
+      // freed by delete.
+      if (prototype != NULL) {
+        void* base = const_cast<DynamicMessage*>(prototype);
+        prototype->~DynamicMessage();
+        ::operator delete(base);
+      }
+      ::operator delete(default_oneof_instance);
     }
   };
 
@@ -636,7 +643,7 @@ const Message* DynamicMessageFactory::GetPrototypeNoLock(
   type_info->size = size;
 
   // Allocate the prototype.
-  void* base = operator new(size);
+  void* base = ::operator new(size);
   memset(base, 0, size);
   DynamicMessage* prototype = new(base) DynamicMessage(type_info);
   type_info->prototype = prototype;
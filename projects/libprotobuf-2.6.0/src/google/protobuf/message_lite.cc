@@ -38,6 +38,7 @@
 #include <google/protobuf/stubs/common.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/region.h>
 #include <google/protobuf/stubs/stl_util.h>
 
 namespace google {
@@ -45,6 +46,14 @@ namespace protobuf {
 
 MessageLite::~MessageLite() {}
 
+void* MessageLite::operator new(size_t size) {
+  return internal::RegionAllocate(size);
+}
+
+void MessageLite::operator delete(void* ptr) {
+  internal::RegionFree(ptr);
+}
+
 string MessageLite::InitializationErrorString() const {
   return "(cannot determine missing fields for lite message)";
 }
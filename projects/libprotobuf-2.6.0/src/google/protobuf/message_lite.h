@@ -79,6 +79,14 @@ class LIBPROTOBUF_EXPORT MessageLite {
   inline MessageLite() {}
   virtual ~MessageLite();
 
+  // Messages are allocated from the current Region of the thread if any,
+  // see region.h, and from the heap otherwise.
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+  // Placement, hidden by the above otherwise.
+  static void* operator new(size_t, void* place) { return place; }
+  static void operator delete(void*, void*) {}
+
   // Basic Operations ------------------------------------------------
 
   // Get the name of this message type, e.g. "foo.bar.BazProto".
@@ -0,0 +1,140 @@
+// Region allocation, see region.h.
+
+#include <google/protobuf/region.h>
+#include <google/protobuf/message_lite.h>
+
+#if defined(_MSC_VER)
+#define GOOGLE_PROTOBUF_REGION_THREAD_LOCAL __declspec(thread)
+#else
+#define GOOGLE_PROTOBUF_REGION_THREAD_LOCAL __thread
+#endif
+
+namespace google {
+namespace protobuf {
+
+namespace {
+
+GOOGLE_PROTOBUF_REGION_THREAD_LOCAL Region* current_region = NULL;
+
+// Every allocation of RegionAllocate starts with a header which names its
+// region, or NULL for the heap, so that RegionFree tells them apart by the
+// pointer alone, on any thread and outside of any scope.  8 bytes keep the
+// alignment of Region::Allocate.
+const size_t kHeaderSize = 8;
+GOOGLE_COMPILE_ASSERT(sizeof(Region*) <= kHeaderSize, region_header_too_small);
+
+}  // namespace
+
+#ifndef _MSC_VER
+const size_t Region::kDefaultBlockSize;
+const size_t Region::kMaxBlockSize;
+#endif  // !_MSC_VER
+
+Region::Region(size_t block_size)
+  : ptr_(NULL),
+    limit_(NULL),
+    next_block_size_(block_size > 0 ? block_size : kDefaultBlockSize),
+    allocations_(0),
+    space_allocated_(0) {
+}
+
+Region::~Region() {
+  Reset();
+  for (int i = 0; i < blocks_.size(); i++) {
+    ::operator delete(blocks_[i].data);
+  }
+}
+
+Region::Scope::Scope(Region* region) : previous_(current_region) {
+  current_region = region;
+}
+
+Region::Scope::~Scope() {
+  current_region = previous_;
+}
+
+Region* Region::current() {
+  return current_region;
+}
+
+void Region::Reset() {
+  // The destructors free the parts which came from the heap, the frees of
+  // the memory of the region are ignored by their headers.
+  for (int i = owned_.size() - 1; i >= 0; i--) {
+    delete owned_[i];
+  }
+  owned_.clear();
+
+  if (blocks_.empty()) {
+    return;
+  }
+  Block last = blocks_.back();
+  for (int i = 0; i + 1 < blocks_.size(); i++) {
+    ::operator delete(blocks_[i].data);
+  }
+  blocks_.clear();
+  blocks_.push_back(last);
+  ptr_ = last.data;
+  limit_ = last.data + last.size;
+  allocations_ = 0;
+  space_allocated_ = last.size;
+}
+
+bool Region::Contains(const void* ptr) const {
+  const char* p = static_cast<const char*>(ptr);
+  // The latest blocks are the largest ones.
+  for (int i = blocks_.size() - 1; i >= 0; i--) {
+    if (p >= blocks_[i].data && p < blocks_[i].data + blocks_[i].size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void* Region::AllocateSlow(size_t size) {
+  size_t block_size = next_block_size_;
+  while (block_size < size) {
+    block_size *= 2;
+  }
+  if (next_block_size_ < kMaxBlockSize) {
+    next_block_size_ *= 2;
+  }
+
+  Block block = { static_cast<char*>(::operator new(block_size)), block_size };
+  blocks_.push_back(block);
+  space_allocated_ += block_size;
+  ptr_ = block.data + size;
+  limit_ = block.data + block_size;
+  return block.data;
+}
+
+void Region::Own(MessageLite* message) {
+  owned_.push_back(message);
+}
+
+namespace internal {
+
+void* RegionAllocate(size_t size) {
+  Region* region = current_region;
+  char* header = static_cast<char*>(
+      region != NULL ? region->Allocate(kHeaderSize + size)
+                     : ::operator new(kHeaderSize + size));
+  *reinterpret_cast<Region**>(header) = region;
+  return header + kHeaderSize;
+}
+
+void RegionFree(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  char* header = static_cast<char*>(ptr) - kHeaderSize;
+  // The memory of a region is freed in bulk by its Reset().
+  if (*reinterpret_cast<Region**>(header) == NULL) {
+    ::operator delete(header);
+  }
+}
+
+}  // namespace internal
+
+}  // namespace protobuf
+}  // namespace google
@@ -0,0 +1,160 @@
+// Region allocation for the messages of one request.
+//
+// Not part of the upstream 2.6.0 release, which predates arenas.  A Region
+// hands out memory by bumping a pointer through blocks, and frees all of it
+// at once in Reset() or its destructor, so parsing a message with many
+// sub-messages and repeated fields costs a few block allocations instead of
+// a new and a delete per object.
+//
+// The mode is opt-in: only the messages created by a region, and changed
+// while a Region::Scope of it is active on the thread, take their memory from
+// it:
+//
+//   Region region;
+//   Request* request = region.Create<Request>();
+//   {
+//     Region::Scope scope(&region);
+//     request->ParseFromArray(data, size);
+//   }
+//   ...
+//   region.Reset();  // Destroys the request, and frees its memory in bulk.
+//
+// In a scope, the messages (generated or dynamic) and the elements arrays of
+// RepeatedField and RepeatedPtrField come from the region.  The strings still
+// come from the heap, as the generated API and AddAllocated() / ReleaseLast()
+// hand them to the caller, and are freed by the destructors which Reset runs.
+// Changes made outside a scope allocate from the heap as usual, and are freed
+// as usual by the same destructors, while the memory of the region they
+// replace, e.g. an elements array which grows, is left to Reset.
+//
+// Every message and elements array, of a region or not, starts with a small
+// header naming its region, so a free tells the memory of a region from the
+// heap by itself, on any thread, without a lookup.  A message must hence be
+// allocated by its operator new to be deleted: one placed in other memory is
+// destroyed by its destructor instead.
+//
+// The rules which the mode relies on:
+//  * Never delete a message created by a region, Reset destroys it.
+//  * In a scope, create or change only the messages of the region: a message
+//    created there by anyone, e.g. by new, is in the region too.
+//  * Never move the sub-messages, strings or repeated fields of a region
+//    message to a heap message or back, by Swap, release_*() or
+//    set_allocated_*(); copy them instead.
+//  * A region is used by one thread at a time.
+
+#ifndef GOOGLE_PROTOBUF_REGION_H__
+#define GOOGLE_PROTOBUF_REGION_H__
+
+#include <stddef.h>
+#include <vector>
+#include <google/protobuf/stubs/common.h>
+
+namespace google {
+namespace protobuf {
+
+class MessageLite;
+
+class LIBPROTOBUF_EXPORT Region {
+ public:
+  // The size of the first block.  Every new block is twice the size of the
+  // last one, up to kMaxBlockSize, so a region needs few of them.
+  static const size_t kDefaultBlockSize = 4096;
+  static const size_t kMaxBlockSize = 65536;
+
+  explicit Region(size_t block_size = kDefaultBlockSize);
+  ~Region();  // Reset(), and frees the last block too.
+
+  // Makes the region the current one of the thread until the end of the
+  // scope.  Scopes nest.
+  class LIBPROTOBUF_EXPORT Scope {
+   public:
+    explicit Scope(Region* region);
+    ~Scope();
+
+   private:
+    Region* previous_;
+
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Scope);
+  };
+
+  // Creates a message in the region, owned by it.
+  template <typename T>
+  T* Create() {
+    Scope scope(this);
+    T* message = new T;
+    Own(message);
+    return message;
+  }
+
+  // Creates a message of the type of prototype, e.g. a DynamicMessage or one
+  // of Service::GetRequestPrototype, in the region, owned by it.
+  template <typename T>
+  T* New(const T& prototype) {
+    Scope scope(this);
+    T* message = static_cast<T*>(prototype.New());
+    Own(message);
+    return message;
+  }
+
+  // Destroys the messages owned, and frees the memory in bulk.  The last
+  // block, the largest one, is kept for the next request.
+  void Reset();
+
+  // size bytes aligned to 8.  Never fails, as operator new.
+  void* Allocate(size_t size) {
+    size = (size + 7) & ~static_cast<size_t>(7);
+    ++allocations_;
+    if (static_cast<size_t>(limit_ - ptr_) < size) {
+      return AllocateSlow(size);
+    }
+    void* result = ptr_;
+    ptr_ += size;
+    return result;
+  }
+
+  // Whether ptr points into the memory of the region.
+  bool Contains(const void* ptr) const;
+
+  // The allocations served since the last Reset(), and the bytes of the
+  // blocks held.
+  int64 AllocationCount() const { return allocations_; }
+  int64 SpaceAllocated() const { return space_allocated_; }
+
+  // The region of the innermost scope on the thread, or NULL.
+  static Region* current();
+
+ private:
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  void* AllocateSlow(size_t size);
+  void Own(MessageLite* message);
+
+  char* ptr_;    // The free space of the last block.
+  char* limit_;
+  std::vector<Block> blocks_;
+  std::vector<MessageLite*> owned_;
+  size_t next_block_size_;
+  int64 allocations_;
+  int64 space_allocated_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Region);
+};
+
+namespace internal {
+
+// The allocations of the message runtime: from the current region of the
+// thread if any, else ::operator new, behind a header naming the region.
+// RegionFree(ptr) frees the memory of the heap, and ignores the memory of a
+// region, which Reset() frees in bulk.
+LIBPROTOBUF_EXPORT void* RegionAllocate(size_t size);
+LIBPROTOBUF_EXPORT void RegionFree(void* ptr);
+
+}  // namespace internal
+
+}  // namespace protobuf
+}  // namespace google
+
+#endif  // GOOGLE_PROTOBUF_REGION_H__
@@ -48,10 +48,12 @@ void RepeatedPtrFieldBase::Reserve(int new_size) {
   void** old_elements = elements_;
   total_size_ = max(kMinRepeatedFieldAllocationSize,
                     max(total_size_ * 2, new_size));
-  elements_ = new void*[total_size_];
+  // From the current Region if any, see region.h.
+  elements_ = static_cast<void**>(
+      RegionAllocate(total_size_ * sizeof(elements_[0])));
   if (old_elements != NULL) {
     memcpy(elements_, old_elements, allocated_size_ * sizeof(elements_[0]));
-    delete [] old_elements;
+    RegionFree(old_elements);
   }
 }
 
@@ -74,6 +76,8 @@ void RepeatedPtrFieldBase::Swap(RepeatedPtrFieldBase* other) {
 }
 
 string* StringTypeHandlerBase::New() {
+  // From the heap even in a Region: AddAllocated() and ReleaseLast() pass
+  // the strings to and from the caller, who news and deletes them.
   return new string;
 }
 void StringTypeHandlerBase::Delete(string* value) {
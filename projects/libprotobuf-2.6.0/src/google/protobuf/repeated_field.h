@@ -57,6 +57,7 @@
 #include <google/protobuf/stubs/type_traits.h>
 #include <google/protobuf/generated_message_util.h>
 #include <google/protobuf/message_lite.h>
+#include <google/protobuf/region.h>
 
 namespace google {
 
@@ -611,7 +612,7 @@ inline RepeatedField<Element>::RepeatedField(Iter begin, const Iter& end)
 
 template <typename Element>
 RepeatedField<Element>::~RepeatedField() {
-  delete [] elements_;
+  internal::RegionFree(elements_);
 }
 
 template <typename Element>
@@ -809,10 +810,13 @@ void RepeatedField<Element>::Reserve(int new_size) {
   Element* old_elements = elements_;
   total_size_ = max(google::protobuf::internal::kMinRepeatedFieldAllocationSize,
                     max(total_size_ * 2, new_size));
-  elements_ = new Element[total_size_];
+  // From the current Region if any, see region.h.  The elements are
+  // primitives, which need no construction.
+  elements_ = static_cast<Element*>(
+      internal::RegionAllocate(total_size_ * sizeof(Element)));
   if (old_elements != NULL) {
     MoveArray(elements_, old_elements, current_size_);
-    delete [] old_elements;
+    internal::RegionFree(old_elements);
   }
 }
 
@@ -868,7 +872,7 @@ void RepeatedPtrFieldBase::Destroy() {
   for (int i = 0; i < allocated_size_; i++) {
     TypeHandler::Delete(cast<TypeHandler>(elements_[i]));
   }
-  delete [] elements_;
+  RegionFree(elements_);
 }
 
 inline bool RepeatedPtrFieldBase::empty() const {
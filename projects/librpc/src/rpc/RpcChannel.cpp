@@ -0,0 +1,279 @@
+#include "RpcChannel.h"
+#include "google/protobuf/io/coded_stream.h"
+#include <assert.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::uint8;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+namespace iocp {
+    namespace rpc {
+        namespace {
+            struct PendingCall
+            {
+                ConnectionId connection;
+                google::protobuf::RpcController *controller;
+                google::protobuf::Message *response;
+                google::protobuf::Closure *done;
+            };
+
+            std::atomic<uint64_t> s_channelCount(0);  // Makes the keys of the upstreams unique.
+        }
+
+        struct RpcChannel::State
+        {
+            mutable std::mutex mutex;
+            std::condition_variable cond;  // Signalled by a connect, and by the completion of a blocking call.
+            std::unordered_map<uint64_t, PendingCall> pending;
+            std::unordered_set<ConnectionId> connected;
+            bool closed = false;
+            std::atomic<uint64_t> nextCallId;
+            size_t maxMessageSize;
+
+            explicit State(size_t maxMessageSize) : nextCallId(0), maxMessageSize(maxMessageSize) { }
+
+            // Takes out the calls of the connection, or all of them if it's 0.
+            std::vector<PendingCall> takePending(ConnectionId connection)
+            {
+                std::vector<PendingCall> calls;
+                for (std::unordered_map<uint64_t, PendingCall>::iterator it = pending.begin(); it != pending.end(); )
+                {
+                    if (connection == 0 || it->second.connection == connection)
+                    {
+                        calls.push_back(it->second);
+                        it = pending.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+                return calls;
+            }
+
+            static void fail(const std::vector<PendingCall> &calls, const char *errorText)
+            {
+                for (size_t i = 0; i < calls.size(); ++i)
+                {
+                    calls[i].controller->SetFailed(errorText);
+                    calls[i].done->Run();
+                }
+            }
+
+            void handleResponse(const FrameView &body)
+            {
+                CodedInputStream input((const uint8 *)body.data(), (int)body.size());
+                uint32 type = 0;
+                uint64 callId = 0;
+                if (!input.ReadVarint32(&type) || !input.ReadVarint64(&callId))
+                {
+                    return;
+                }
+
+                PendingCall call;
+                mutex.lock();
+                std::unordered_map<uint64_t, PendingCall>::iterator it = pending.find(callId);
+                if (it == pending.end())
+                {
+                    mutex.unlock();
+                    return;  // Failed already.
+                }
+                call = it->second;
+                pending.erase(it);
+                mutex.unlock();
+
+                if (type == RESPONSE)
+                {
+                    if (!call.response->ParseFromCodedStream(&input))
+                    {
+                        call.controller->SetFailed("Malformed response");
+                    }
+                }
+                else if (type == FAILED)
+                {
+                    std::string errorText;
+                    input.ReadString(&errorText, (int)body.size() - input.CurrentPosition());
+                    call.controller->SetFailed(errorText);
+                }
+                else
+                {
+                    call.controller->SetFailed("Malformed response");
+                }
+                call.done->Run();
+            }
+        };
+
+        namespace {
+            // The done of a call made without one, which waits for it.
+            class BlockingClosure final : public google::protobuf::Closure
+            {
+            public:
+                BlockingClosure(std::mutex &mutex, std::condition_variable &cond)
+                    : _mutex(mutex), _cond(cond), _done(false) { }
+
+                virtual void Run() override
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _done = true;
+                    _cond.notify_all();
+                }
+
+                void wait()
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _cond.wait(lock, [this]() { return _done; });
+                }
+
+            private:
+                std::mutex &_mutex;
+                std::condition_variable &_cond;
+                bool _done;
+            };
+        }
+
+        RpcChannel::RpcChannel(ServerFramework<> &framework, const char *ip, uint16_t port, size_t connections,
+            size_t maxMessageSize)
+            : _framework(framework)
+            , _state(std::make_shared<State>(maxMessageSize))
+        {
+            char key[64];
+            snprintf(key, sizeof(key), "rpc#%llu", (unsigned long long)++s_channelCount);
+            _key = key;
+
+            std::shared_ptr<State> state = _state;
+            _framework.addUpstream(_key.c_str(), ip, port, connections,
+                [state](ClientContext<> *ctx, bool connected) {
+                if (connected)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->connected.insert(ctx->getId());
+                    state->cond.notify_all();
+                }
+            },
+                _framework.framed(getFrameFormat(maxMessageSize), [state](ClientContext<> *, const Frame &frame) {
+                state->handleResponse(frame.body);
+            }),
+                [state](ClientContext<> *ctx) {
+                state->mutex.lock();
+                state->connected.erase(ctx->getId());
+                std::vector<PendingCall> calls = state->takePending(ctx->getId());
+                state->mutex.unlock();
+                State::fail(calls, "Disconnected");
+            });
+        }
+
+        RpcChannel::~RpcChannel()
+        {
+            _framework.removeUpstream(_key.c_str());
+
+            _state->mutex.lock();
+            _state->closed = true;
+            std::vector<PendingCall> calls = _state->takePending(0);
+            _state->mutex.unlock();
+            State::fail(calls, "Channel closed");
+        }
+
+        void RpcChannel::CallMethod(const google::protobuf::MethodDescriptor *method,
+            google::protobuf::RpcController *controller,
+            const google::protobuf::Message *request,
+            google::protobuf::Message *response,
+            google::protobuf::Closure *done)
+        {
+            // A blocking call may go without a controller, it lives as long as the call.
+            assert(controller != nullptr || done == nullptr);
+            RpcController ownController;
+            if (controller == nullptr)
+            {
+                controller = &ownController;
+            }
+            BlockingClosure blocking(_state->mutex, _state->cond);
+            if (done == nullptr)
+            {
+                done = &blocking;
+            }
+
+            uint64_t callId = ++_state->nextCallId;
+            uint32_t serviceId = getServiceId(method->service());
+            uint32_t methodIndex = (uint32_t)method->index();
+            size_t size = getRequestSize(callId, serviceId, methodIndex, *request);
+
+            const char *errorText = nullptr;
+            ConnectionId connection = 0;
+            if (size - HEADER_SIZE > _state->maxMessageSize)
+            {
+                errorText = "Request too large";
+            }
+            else if ((connection = _framework.getUpstream(_key.c_str())) == 0)
+            {
+                errorText = "Not connected";
+            }
+            else
+            {
+                PendingCall call = { connection, controller, response, done };
+                _state->mutex.lock();
+                if (_state->closed)
+                {
+                    errorText = "Channel closed";
+                }
+                else
+                {
+                    _state->pending.insert(std::make_pair(callId, call));
+                }
+                _state->mutex.unlock();
+
+                if (errorText == nullptr && sendFrame(_framework, connection, size, [&](CodedOutputStream *output) {
+                        writeRequest(callId, serviceId, methodIndex, *request, output);
+                    }) == ClientContext<>::POST_RESULT::FAIL)
+                {
+                    // Gone meanwhile, the call fails here unless the disconnect has failed it already.
+                    _state->mutex.lock();
+                    if (_state->pending.erase(callId) > 0)
+                    {
+                        errorText = "Not connected";
+                    }
+                    _state->mutex.unlock();
+                }
+            }
+
+            if (errorText != nullptr)
+            {
+                controller->SetFailed(errorText);
+                done->Run();
+            }
+            if (done == &blocking)
+            {
+                blocking.wait();
+            }
+        }
+
+        bool RpcChannel::waitConnected(uint32_t timeout)
+        {
+            std::unique_lock<std::mutex> lock(_state->mutex);
+            return _state->cond.wait_for(lock, std::chrono::milliseconds(timeout), [this]() {
+                return !_state->connected.empty();
+            });
+        }
+
+        size_t RpcChannel::getConnectedCount() const
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            return _state->connected.size();
+        }
+
+        size_t RpcChannel::getPendingCount() const
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            return _state->pending.size();
+        }
+    }  // end of namespace rpc
+}  // end of namespace iocp
@@ -0,0 +1,57 @@
+#ifndef _RPC_CHANNEL_H_
+#define _RPC_CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include "RpcProtocol.h"
+#include "RpcController.h"
+#include "google/protobuf/service.h"
+
+namespace iocp {
+    namespace rpc {
+        // The channel of the generated stubs to an RpcServer, over a pool of connections kept by the connector of
+        // a running ServerFramework (see addUpstream):
+        //   RpcChannel channel(framework, "10.0.0.2", 9000, 4);
+        //   channel.waitConnected(1000);
+        //   EchoService::Stub stub(&channel);
+        //   stub.Echo(&controller, &request, &response, done);
+        //
+        // Every call goes to a connection round robin, many calls are in flight on each, and the responses are
+        // matched to them by call ID whatever their order. A response is parsed by CodedInputStream straight out
+        // of the receive ring into the response message, and done runs on the worker thread of the connection,
+        // where it may make the next call at once. A call without done blocks until its response, so never make
+        // one on a worker thread of the framework, and only such a call may go without a controller. The calls in
+        // flight on a connection which closes fail, as do the calls made while no connection is up, and the closed
+        // connections reconnect with the backoff of the framework.
+        class RpcChannel final : public google::protobuf::RpcChannel
+        {
+        public:
+            RpcChannel(ServerFramework<> &framework, const char *ip, uint16_t port, size_t connections = 1,
+                size_t maxMessageSize = DEFAULT_MAX_MESSAGE_SIZE);
+            virtual ~RpcChannel();  // Closes the connections, and the calls in flight fail.
+
+            virtual void CallMethod(const google::protobuf::MethodDescriptor *method,
+                google::protobuf::RpcController *controller,
+                const google::protobuf::Message *request,
+                google::protobuf::Message *response,
+                google::protobuf::Closure *done) override;
+
+            // Whether a connection is up, waiting up to timeout milliseconds for one.
+            bool waitConnected(uint32_t timeout);
+
+            size_t getConnectedCount() const;
+            size_t getPendingCount() const;  // The calls in flight.
+
+        private:
+            struct State;
+
+            ServerFramework<> &_framework;
+            std::string _key;  // Of the upstream.
+            std::shared_ptr<State> _state;  // Shared with the callbacks of the connections, which may outlive it.
+        };
+    }  // end of namespace rpc
+}  // end of namespace iocp
+
+#endif
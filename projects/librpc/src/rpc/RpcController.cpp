@@ -0,0 +1,45 @@
+#include "RpcController.h"
+
+namespace iocp {
+    namespace rpc {
+        RpcController::RpcController()
+            : _failed(false)
+            , _onCancel(nullptr)
+        {
+        }
+
+        RpcController::~RpcController()
+        {
+            complete();
+        }
+
+        void RpcController::Reset()
+        {
+            complete();
+            _failed = false;
+            _errorText.clear();
+        }
+
+        void RpcController::SetFailed(const std::string &reason)
+        {
+            _failed = true;
+            _errorText = reason;
+        }
+
+        void RpcController::NotifyOnCancel(google::protobuf::Closure *callback)
+        {
+            complete();
+            _onCancel = callback;
+        }
+
+        void RpcController::complete()
+        {
+            google::protobuf::Closure *callback = _onCancel;
+            _onCancel = nullptr;
+            if (callback != nullptr)
+            {
+                callback->Run();
+            }
+        }
+    }  // end of namespace rpc
+}  // end of namespace iocp
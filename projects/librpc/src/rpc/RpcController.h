@@ -0,0 +1,37 @@
+#ifndef _RPC_CONTROLLER_H_
+#define _RPC_CONTROLLER_H_
+
+#include <string>
+#include "google/protobuf/service.h"
+
+namespace iocp {
+    namespace rpc {
+        // The controller of a call, on either side. The calls can't be cancelled: StartCancel does nothing and
+        // IsCanceled is always false, and the callback of NotifyOnCancel runs once the call completes, as the
+        // interface requires.
+        class RpcController final : public google::protobuf::RpcController
+        {
+        public:
+            RpcController();
+            virtual ~RpcController();
+
+            virtual void Reset() override;
+            virtual bool Failed() const override { return _failed; }
+            virtual std::string ErrorText() const override { return _errorText; }
+            virtual void StartCancel() override { }
+            virtual void SetFailed(const std::string &reason) override;
+            virtual bool IsCanceled() const override { return false; }
+            virtual void NotifyOnCancel(google::protobuf::Closure *callback) override;
+
+            // Runs the callback of NotifyOnCancel, when the call completes.
+            void complete();
+
+        private:
+            bool _failed;
+            std::string _errorText;
+            google::protobuf::Closure *_onCancel;
+        };
+    }  // end of namespace rpc
+}  // end of namespace iocp
+
+#endif
@@ -0,0 +1,164 @@
+#include "RpcProtocol.h"
+#include "google/protobuf/io/coded_stream.h"
+#include <limits.h>
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::uint8;
+
+namespace iocp {
+    namespace rpc {
+        namespace {
+            // Writes the header of a frame of bodySize bytes.
+            void writeHeader(size_t bodySize, CodedOutputStream *output)
+            {
+                uint8 header[HEADER_SIZE] = {
+                    (uint8)(bodySize >> 24), (uint8)(bodySize >> 16), (uint8)(bodySize >> 8), (uint8)bodySize
+                };
+                output->WriteRaw(header, HEADER_SIZE);
+            }
+
+            size_t getRequestBodySize(uint64_t callId, uint32_t serviceId, uint32_t methodIndex, size_t messageSize)
+            {
+                return CodedOutputStream::VarintSize32(REQUEST) + CodedOutputStream::VarintSize64(callId)
+                    + CodedOutputStream::VarintSize32(serviceId) + CodedOutputStream::VarintSize32(methodIndex)
+                    + messageSize;
+            }
+
+            size_t getResponseBodySize(uint64_t callId, size_t messageSize)
+            {
+                return CodedOutputStream::VarintSize32(RESPONSE) + CodedOutputStream::VarintSize64(callId) + messageSize;
+            }
+
+            size_t getFailureBodySize(uint64_t callId, const std::string &errorText)
+            {
+                return CodedOutputStream::VarintSize32(FAILED) + CodedOutputStream::VarintSize64(callId)
+                    + errorText.size();
+            }
+        }
+
+        uint32_t getServiceId(const google::protobuf::ServiceDescriptor *service)
+        {
+            const std::string &name = service->full_name();
+            uint32_t hash = 2166136261U;
+            for (size_t i = 0; i < name.size(); ++i)
+            {
+                hash = (hash ^ (uint8)name[i]) * 16777619U;
+            }
+            return hash;
+        }
+
+        size_t getRequestSize(uint64_t callId, uint32_t serviceId, uint32_t methodIndex,
+            const google::protobuf::Message &request)
+        {
+            return HEADER_SIZE + getRequestBodySize(callId, serviceId, methodIndex, (size_t)request.ByteSize());
+        }
+
+        void writeRequest(uint64_t callId, uint32_t serviceId, uint32_t methodIndex,
+            const google::protobuf::Message &request, CodedOutputStream *output)
+        {
+            writeHeader(getRequestBodySize(callId, serviceId, methodIndex, (size_t)request.GetCachedSize()), output);
+            output->WriteVarint32(REQUEST);
+            output->WriteVarint64(callId);
+            output->WriteVarint32(serviceId);
+            output->WriteVarint32(methodIndex);
+            writeMessage(request, output);
+        }
+
+        size_t getResponseSize(uint64_t callId, const google::protobuf::Message &response)
+        {
+            return HEADER_SIZE + getResponseBodySize(callId, (size_t)response.ByteSize());
+        }
+
+        void writeResponse(uint64_t callId, const google::protobuf::Message &response, CodedOutputStream *output)
+        {
+            writeHeader(getResponseBodySize(callId, (size_t)response.GetCachedSize()), output);
+            output->WriteVarint32(RESPONSE);
+            output->WriteVarint64(callId);
+            writeMessage(response, output);
+        }
+
+        size_t getFailureSize(uint64_t callId, const std::string &errorText)
+        {
+            return HEADER_SIZE + getFailureBodySize(callId, errorText);
+        }
+
+        void writeFailure(uint64_t callId, const std::string &errorText, CodedOutputStream *output)
+        {
+            writeHeader(getFailureBodySize(callId, errorText), output);
+            output->WriteVarint32(FAILED);
+            output->WriteVarint64(callId);
+            output->WriteString(errorText);
+        }
+
+        void writeMessage(const google::protobuf::MessageLite &message, CodedOutputStream *output)
+        {
+            int size = message.GetCachedSize();
+            uint8 *p = output->GetDirectBufferForNBytesAndAdvance(size);
+            if (p != nullptr)
+            {
+                message.SerializeWithCachedSizesToArray(p);
+            }
+            else
+            {
+                message.SerializeWithCachedSizes(output);
+            }
+        }
+
+        FrameDecoder::Result parseMessage(RecvChain *chain, google::protobuf::MessageLite *message,
+            const FrameFormat &format)
+        {
+            if (chain->empty())
+            {
+                return FrameDecoder::INCOMPLETE;
+            }
+            // The header is copied out only if it may span segments.
+            FrameView front = chain->getSegment(0);
+            char header[FrameDecoder::MAX_HEADER_SIZE];
+            const char *p = front.data();
+            size_t len = front.size();
+            if (len < sizeof(header) && len < chain->size())
+            {
+                p = header;
+                len = chain->copyOut(0, header, sizeof(header));
+            }
+            size_t headerSize = 0;
+            uint64_t bodySize = 0;
+            FrameDecoder::Result result = FrameDecoder(format).decodeHeader(p, len, &headerSize, &bodySize);
+            if (result != FrameDecoder::FRAME)
+            {
+                return result;
+            }
+            if (bodySize > (uint64_t)(INT_MAX - headerSize))
+            {
+                return FrameDecoder::TOO_LARGE;  // CodedInputStream counts in int.
+            }
+            if (chain->size() - headerSize < bodySize)
+            {
+                return FrameDecoder::INCOMPLETE;
+            }
+
+            bool parsed = false;
+            if (front.size() >= headerSize + bodySize)
+            {
+                // Whole in the first segment, as most small frames are.
+                CodedInputStream input((const uint8 *)front.data() + headerSize, (int)bodySize);
+                parsed = message->ParseFromCodedStream(&input) && input.ConsumedEntireMessage();
+            }
+            else
+            {
+                RecvChainInputStream stream(*chain);
+                CodedInputStream input(&stream);
+                input.SetTotalBytesLimit(INT_MAX, INT_MAX);  // The frame is bounded by the format instead.
+                if (input.Skip((int)headerSize))
+                {
+                    CodedInputStream::Limit limit = input.PushLimit((int)bodySize);
+                    parsed = message->ParseFromCodedStream(&input) && input.ConsumedEntireMessage();
+                    input.PopLimit(limit);
+                }
+            }
+            chain->consume(headerSize + (size_t)bodySize);
+            return parsed ? FrameDecoder::FRAME : FrameDecoder::MALFORMED;
+        }
+    }  // end of namespace rpc
+}  // end of namespace iocp
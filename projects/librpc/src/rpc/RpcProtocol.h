@@ -0,0 +1,135 @@
+#ifndef _RPC_PROTOCOL_H_
+#define _RPC_PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "iocp/ServerFramework.h"
+#include "ZeroCopyStreams.h"
+#include "google/protobuf/message.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+namespace iocp {
+    namespace rpc {
+        // Every message of the protocol is a frame of a 4-byte big-endian body size, whose body starts with varints:
+        //   REQUEST,  call ID, service ID, method index, then the request message
+        //   RESPONSE, call ID, then the response message
+        //   FAILED,   call ID, then the error text
+        // The client picks the call IDs and only it matches them, so the calls of a connection are pipelined and
+        // their responses come back in the order the calls complete. The service ID is a hash of the full name of
+        // the service (see getServiceId), so the client and the server agree on it without a handshake.
+        enum MessageType
+        {
+            REQUEST = 1,
+            RESPONSE = 2,
+            FAILED = 3,
+        };
+
+        enum : size_t
+        {
+            HEADER_SIZE = 4,
+            DEFAULT_MAX_MESSAGE_SIZE = RECV_CACHE_LIMIT_SIZE - HEADER_SIZE,  // Within the default receive ring.
+        };
+
+        // A frame over maxMessageSize closes the connection. Keep it within the highWater of setRecvBufferSize.
+        inline FrameFormat getFrameFormat(size_t maxMessageSize)
+        {
+            return FrameFormat::fixed(HEADER_SIZE, true, maxMessageSize);
+        }
+
+        // FNV-1a of the full name.
+        uint32_t getServiceId(const google::protobuf::ServiceDescriptor *service);
+
+        // The frames of the protocol: the size of a whole frame with its header, then its bytes, written by
+        // CodedOutputStream wherever it goes. The sizes of the messages are cached by the former for the latter.
+        size_t getRequestSize(uint64_t callId, uint32_t serviceId, uint32_t methodIndex,
+            const google::protobuf::Message &request);
+        void writeRequest(uint64_t callId, uint32_t serviceId, uint32_t methodIndex,
+            const google::protobuf::Message &request, google::protobuf::io::CodedOutputStream *output);
+        size_t getResponseSize(uint64_t callId, const google::protobuf::Message &response);
+        void writeResponse(uint64_t callId, const google::protobuf::Message &response,
+            google::protobuf::io::CodedOutputStream *output);
+        size_t getFailureSize(uint64_t callId, const std::string &errorText);
+        void writeFailure(uint64_t callId, const std::string &errorText,
+            google::protobuf::io::CodedOutputStream *output);
+
+        // Serializes message of its cached size, straight into the buffer of output if it holds all of it, as
+        // MessageLite::SerializeToCodedStream does.
+        void writeMessage(const google::protobuf::MessageLite &message, google::protobuf::io::CodedOutputStream *output);
+
+        // Sends a frame of size bytes, which write(output) writes once, instead of serialized to a string and
+        // copied by postSend. A small one on the strand of the connection is written in place in its send chain
+        // (see ClientContext::postSendInPlace), so it shares the buffers of the chain with the messages around it.
+        // Otherwise it's written into pooled SendBuffers queued by reference (see SendBufferOutputStream).
+        template <class _T, class _Write> typename ClientContext<_T>::POST_RESULT sendFrame(ClientContext<_T> *ctx,
+            size_t size, const _Write &write)
+        {
+            if (size <= OVERLAPPED_BUF_SIZE && ctx->onStrand())
+            {
+                return ctx->postSendInPlace(size, [size, &write](char *data) {
+                    google::protobuf::io::ArrayOutputStream stream(data, (int)size);
+                    google::protobuf::io::CodedOutputStream output(&stream);
+                    write(&output);
+                });
+            }
+
+            SendBufferOutputStream stream(size);
+            {
+                google::protobuf::io::CodedOutputStream output(&stream);
+                write(&output);
+                if (output.HadError())
+                {
+                    return ClientContext<_T>::POST_RESULT::FAIL;  // Out of memory.
+                }
+            }
+            return stream.postTo(ctx);
+        }
+
+        // The same by the ID, which fails if the connection has gone.
+        template <class _T, class _Write> typename ClientContext<_T>::POST_RESULT sendFrame(ServerFramework<_T> &framework,
+            ConnectionId id, size_t size, const _Write &write)
+        {
+            struct Args
+            {
+                size_t size;
+                const _Write *write;
+                typename ClientContext<_T>::POST_RESULT result;
+            } args = { size, &write, ClientContext<_T>::POST_RESULT::FAIL };
+            framework.visitClient(id, [&args](ClientContext<_T> *ctx) {
+                args.result = sendFrame(ctx, args.size, *args.write);
+            });
+            return args.result;
+        }
+
+        // Sends message as a frame of format by sendFrame, e.g. to a peer which decodes it by framed. Returns FAIL
+        // as well if it's over the maxFrameSize of format.
+        template <class _T> typename ClientContext<_T>::POST_RESULT sendMessage(ClientContext<_T> *ctx,
+            const google::protobuf::MessageLite &message,
+            const FrameFormat &format = getFrameFormat(DEFAULT_MAX_MESSAGE_SIZE))
+        {
+            size_t size = (size_t)message.ByteSize();
+            char header[FrameDecoder::MAX_HEADER_SIZE];
+            size_t headerSize = FrameDecoder(format).encodeHeader(size, header);
+            if (size > format.maxFrameSize || headerSize == 0)
+            {
+                return ClientContext<_T>::POST_RESULT::FAIL;
+            }
+            return sendFrame(ctx, headerSize + size, [&message, &header, headerSize](google::protobuf::io::CodedOutputStream *output) {
+                output->WriteRaw(header, (int)headerSize);
+                writeMessage(message, output);
+            });
+        }
+
+        // Parses the frame of format at the front of chain into message, the counterpart of sendMessage for a
+        // reader which receives into a RecvChain: the header is decoded first, and once the whole frame is there,
+        // CodedInputStream parses the body across the segments it came in, bounded by PushLimit, and the frame is
+        // consumed. Returns FRAME, INCOMPLETE until the frame is whole, or TOO_LARGE or MALFORMED, which includes a
+        // body which isn't a valid message, after which the stream can't be trusted any more.
+        FrameDecoder::Result parseMessage(RecvChain *chain, google::protobuf::MessageLite *message,
+            const FrameFormat &format = getFrameFormat(DEFAULT_MAX_MESSAGE_SIZE));
+    }  // end of namespace rpc
+}  // end of namespace iocp
+
+#endif
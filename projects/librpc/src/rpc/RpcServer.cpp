@@ -0,0 +1,217 @@
+#include "RpcServer.h"
+#include "google/protobuf/io/coded_stream.h"
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::uint8;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+#if PLATFORM_IS_WINDOWS
+#   define RPC_THREAD_LOCAL __declspec(thread)
+#else
+#   define RPC_THREAD_LOCAL __thread
+#endif
+
+namespace iocp {
+    namespace rpc {
+        // The Region of a worker thread, which one call at a time takes, see RpcServer::useRegion.
+        struct _WorkerRegion
+        {
+            google::protobuf::Region region;
+            std::atomic<bool> busy;  // Taken by a call, until it's done and region is reset.
+
+            _WorkerRegion() : busy(false) { }
+        };
+
+        namespace {
+            // The worker region of the calling thread, and the serial of its RpcServer.
+            RPC_THREAD_LOCAL _WorkerRegion *t_workerRegion = nullptr;
+            RPC_THREAD_LOCAL uint64_t t_workerRegionServer = 0;
+
+            std::atomic<uint64_t> s_nextSerial(1);
+        }
+
+        RpcServer::RpcServer(ServerFramework<> &framework, size_t maxMessageSize)
+            : _framework(framework)
+            , _maxMessageSize(maxMessageSize)
+            , _serial(s_nextSerial.fetch_add(1))
+            , _calls(0)
+            , _failures(0)
+        {
+        }
+
+        RpcServer::~RpcServer()
+        {
+            for (size_t i = 0; i < _workerRegions.size(); ++i)
+            {
+                delete _workerRegions[i];
+            }
+        }
+
+        bool RpcServer::addService(google::protobuf::Service *service)
+        {
+            return _services.insert(std::make_pair(getServiceId(service->GetDescriptor()), service)).second;
+        }
+
+        bool RpcServer::startup(const char *ip, uint16_t port)
+        {
+            return _framework.startup(ip, port,
+                _framework.framed(getFrameFormat(_maxMessageSize), [this](ClientContext<> *ctx, const Frame &frame) {
+                handleRequest(ctx, frame.body);
+            }), [](ClientContext<> *) { });
+        }
+
+        void RpcServer::shutdown()
+        {
+            _framework.shutdown();
+        }
+
+        void RpcServer::handleRequest(ClientContext<> *ctx, const FrameView &body)
+        {
+            CodedInputStream input((const uint8 *)body.data(), (int)body.size());
+            uint32 type = 0;
+            uint64 callId = 0;
+            uint32 serviceId = 0;
+            uint32 methodIndex = 0;
+            if (!input.ReadVarint32(&type) || type != REQUEST || !input.ReadVarint64(&callId)
+                || !input.ReadVarint32(&serviceId) || !input.ReadVarint32(&methodIndex))
+            {
+                // Not this protocol, closed after the receive.
+                ctx->post([this](ClientContext<> *ctx) { _framework.disconnect(ctx->getId()); });
+                return;
+            }
+
+            std::unordered_map<uint32_t, google::protobuf::Service *>::const_iterator it = _services.find(serviceId);
+            if (it == _services.end())
+            {
+                sendFailure(ctx->getId(), callId, "Unknown service");
+                return;
+            }
+            google::protobuf::Service *service = it->second;
+            const google::protobuf::ServiceDescriptor *descriptor = service->GetDescriptor();
+            if (methodIndex >= (uint32)descriptor->method_count())
+            {
+                sendFailure(ctx->getId(), callId, "Unknown method");
+                return;
+            }
+            const google::protobuf::MethodDescriptor *method = descriptor->method((int)methodIndex);
+
+            Call *call = new Call;
+            call->connection = ctx->getId();
+            call->callId = callId;
+            const google::protobuf::Message &requestPrototype = service->GetRequestPrototype(method);
+            if (_regionTypes.count(requestPrototype.GetDescriptor()) != 0)
+            {
+                // The region of the worker thread if its last call is done, else one of the call.
+                _WorkerRegion *worker = getWorkerRegion();
+                if (!worker->busy.load(std::memory_order_acquire))
+                {
+                    worker->busy.store(true, std::memory_order_relaxed);
+                    call->region = &worker->region;
+                    call->workerRegion = worker;
+                }
+                else
+                {
+                    call->region = new google::protobuf::Region;
+                    call->workerRegion = nullptr;
+                }
+                call->request = call->region->New(requestPrototype);
+                call->response = call->region->New(service->GetResponsePrototype(method));
+            }
+            else
+            {
+                call->region = nullptr;
+                call->workerRegion = nullptr;
+                call->request = requestPrototype.New();
+                call->response = service->GetResponsePrototype(method).New();
+            }
+            bool parsed = false;
+            {
+                google::protobuf::Region::Scope scope(call->region);  // The heap without a region.
+                parsed = call->request->ParseFromCodedStream(&input);
+            }
+            if (!parsed)
+            {
+                sendFailure(call->connection, callId, "Malformed request");
+                destroyCall(call);
+                return;
+            }
+
+            _calls.fetch_add(1, std::memory_order_relaxed);
+            service->CallMethod(method, &call->controller, call->request, call->response,
+                google::protobuf::NewCallback(this, &RpcServer::finishCall, call));
+        }
+
+        // The done of a call, on any thread.
+        void RpcServer::finishCall(Call *call)
+        {
+            size_t size = 0;
+            if (!call->controller.Failed())
+            {
+                size = getResponseSize(call->callId, *call->response);
+                if (size - HEADER_SIZE > _maxMessageSize)
+                {
+                    call->controller.SetFailed("Response too large");
+                }
+            }
+            if (call->controller.Failed())
+            {
+                sendFailure(call->connection, call->callId, call->controller.ErrorText());
+            }
+            else
+            {
+                sendFrame(_framework, call->connection, size, [call](CodedOutputStream *output) {
+                    writeResponse(call->callId, *call->response, output);
+                });
+            }
+
+            call->controller.complete();
+            destroyCall(call);
+        }
+
+        _WorkerRegion *RpcServer::getWorkerRegion()
+        {
+            if (t_workerRegionServer != _serial)
+            {
+                _WorkerRegion *worker = new _WorkerRegion;
+                {
+                    std::lock_guard<std::mutex> lock(_workerRegionsMutex);
+                    _workerRegions.push_back(worker);
+                }
+                t_workerRegion = worker;
+                t_workerRegionServer = _serial;
+            }
+            return t_workerRegion;
+        }
+
+        // On any thread, a worker region is reset there and handed back to its worker.
+        void RpcServer::destroyCall(Call *call)
+        {
+            if (call->workerRegion != nullptr)
+            {
+                call->region->Reset();  // With the messages, keeps the last block.
+                call->workerRegion->busy.store(false, std::memory_order_release);
+            }
+            else if (call->region != nullptr)
+            {
+                delete call->region;  // With the messages.
+            }
+            else
+            {
+                delete call->request;
+                delete call->response;
+            }
+            delete call;
+        }
+
+        void RpcServer::sendFailure(ConnectionId connection, uint64_t callId, const std::string &errorText)
+        {
+            _failures.fetch_add(1, std::memory_order_relaxed);
+            sendFrame(_framework, connection, getFailureSize(callId, errorText),
+                [callId, &errorText](CodedOutputStream *output) {
+                writeFailure(callId, errorText, output);
+            });
+        }
+    }  // end of namespace rpc
+}  // end of namespace iocp
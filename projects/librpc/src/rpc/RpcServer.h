@@ -0,0 +1,87 @@
+#ifndef _RPC_SERVER_H_
+#define _RPC_SERVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "RpcProtocol.h"
+#include "RpcController.h"
+#include "google/protobuf/service.h"
+#include "google/protobuf/region.h"
+
+namespace iocp {
+    namespace rpc {
+        struct _WorkerRegion;  // See RpcServer.cpp.
+
+        // Serves protobuf services on a ServerFramework, see RpcProtocol.h:
+        //   RpcServer server(framework);
+        //   server.addService(&echoService);
+        //   server.startup(nullptr, 9000);
+        //
+        // A request is parsed by CodedInputStream straight out of the receive ring, and Service::CallMethod runs on
+        // the strand of its connection, i.e. on a worker thread. The response is sent when the method runs done,
+        // at once or later from any thread, so a slow call doesn't hold up the ones after it. A method which blocks
+        // holds up every connection of its shard, hand its work to another thread and run done from there.
+        // Every call of the services must be done before the RpcServer is destroyed.
+        class RpcServer final
+        {
+        public:
+            explicit RpcServer(ServerFramework<> &framework, size_t maxMessageSize = DEFAULT_MAX_MESSAGE_SIZE);
+            ~RpcServer();
+
+            // Serves the methods of service, which it doesn't own. Call it before startup. Returns false if a
+            // service of the same ID is served already.
+            bool addService(google::protobuf::Service *service);
+
+            // Creates the requests of requestType and their responses in a Region instead of the heap, so the
+            // messages and repeated fields parsed are freed in bulk when the call completes, see
+            // google/protobuf/region.h. Every worker thread keeps one Region, reset after each call and reused by
+            // the next one with the blocks it grew to. A call made while the one before still holds it, i.e. has
+            // handed done to another thread, has a Region of its own. Only the parse runs in the scope of the
+            // region, what the method sets on them comes from the heap. The method must not Swap or release the
+            // parts of those messages to messages of its own, nor delete them. Call it before startup.
+            void useRegion(const google::protobuf::Descriptor *requestType) { _regionTypes.insert(requestType); }
+
+            // Starts the framework with the callbacks of the protocol.
+            bool startup(const char *ip, uint16_t port);
+            void shutdown();
+
+            uint64_t getCallCount() const { return _calls.load(std::memory_order_relaxed); }
+            uint64_t getFailureCount() const { return _failures.load(std::memory_order_relaxed); }
+
+        private:
+            struct Call
+            {
+                ConnectionId connection;
+                uint64_t callId;
+                google::protobuf::Message *request;
+                google::protobuf::Message *response;
+                google::protobuf::Region *region;  // Which owns the messages, or nullptr.
+                _WorkerRegion *workerRegion;  // Whose region it is, or nullptr if the call owns it.
+                RpcController controller;
+            };
+
+            void handleRequest(ClientContext<> *ctx, const FrameView &body);
+            _WorkerRegion *getWorkerRegion();  // Of the calling thread.
+            void finishCall(Call *call);
+            static void destroyCall(Call *call);
+            void sendFailure(ConnectionId connection, uint64_t callId, const std::string &errorText);
+
+            ServerFramework<> &_framework;
+            size_t _maxMessageSize;
+            std::unordered_map<uint32_t, google::protobuf::Service *> _services;
+            std::unordered_set<const google::protobuf::Descriptor *> _regionTypes;
+            uint64_t _serial;  // Tells the worker regions of this server on a thread from the ones of another.
+            std::mutex _workerRegionsMutex;  // Only taken by the first region call of a thread.
+            std::vector<_WorkerRegion *> _workerRegions;
+            std::atomic<uint64_t> _calls;
+            std::atomic<uint64_t> _failures;
+        };
+    }  // end of namespace rpc
+}  // end of namespace iocp
+
+#endif
@@ -0,0 +1,258 @@
+#include "ZeroCopyStreams.h"
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+namespace iocp {
+    namespace rpc {
+        SendBufferOutputStream::SendBufferOutputStream(size_t sizeHint)
+            : _sizeHint(sizeHint)
+            , _count(0)
+            , _byteCount(0)
+        {
+        }
+
+        SendBufferOutputStream::~SendBufferOutputStream()
+        {
+        }
+
+        bool SendBufferOutputStream::Next(void **data, int *size)
+        {
+            size_t capacity = _sizeHint;
+            _sizeHint = 0;
+            if (capacity == 0)
+            {
+                capacity = _count > 0 ? getBuffers()[_count - 1]->capacity() * 2 : MIN_BUFFER_SIZE;
+                if (capacity > SendBuffer::maxPooledCapacity())
+                {
+                    capacity = SendBuffer::maxPooledCapacity();
+                }
+            }
+            if (capacity > INT_MAX)
+            {
+                capacity = INT_MAX;
+            }
+
+            SendBufferRef buf(SendBuffer::createPooled(capacity));
+            if (!buf)
+            {
+                return false;
+            }
+            buf->setSize(capacity);
+            *data = buf->data();
+            *size = (int)capacity;
+            _byteCount += capacity;
+
+            if (_count < INLINE_BUFFERS && _spilled.empty())
+            {
+                _inline[_count] = std::move(buf);
+            }
+            else
+            {
+                if (_spilled.empty())
+                {
+                    _spilled.reserve(INLINE_BUFFERS * 2);
+                    for (size_t i = 0; i < _count; ++i)
+                    {
+                        _spilled.push_back(std::move(_inline[i]));
+                    }
+                }
+                _spilled.push_back(std::move(buf));
+            }
+            ++_count;
+            return true;
+        }
+
+        void SendBufferOutputStream::BackUp(int count)
+        {
+            assert(_count > 0 && count >= 0);
+            SendBuffer *last = getBuffers()[_count - 1].get();
+            assert((size_t)count <= last->size());
+            last->setSize(last->size() - count);
+            _byteCount -= count;
+        }
+
+        void SendBufferOutputStream::clear()
+        {
+            for (size_t i = 0; i < INLINE_BUFFERS; ++i)
+            {
+                _inline[i].reset();
+            }
+            _spilled.clear();
+            _count = 0;
+            _byteCount = 0;
+        }
+
+        RecvChain::RecvChain(size_t segmentSize)
+            : _segmentSize(segmentSize < mp::MAX_POOLED_SIZE ? segmentSize : mp::MAX_POOLED_SIZE)
+            , _size(0)
+        {
+            assert(_segmentSize > 0);
+        }
+
+        RecvChain::~RecvChain()
+        {
+            clear();
+        }
+
+        char *RecvChain::prepare(size_t *len)
+        {
+            if (_segments.empty() || _segments.back().end == _segmentSize)
+            {
+                char *data = (char *)mp::poolAllocate(_segmentSize);
+                if (data == nullptr)
+                {
+                    return nullptr;
+                }
+                Segment segment = { data, 0, 0 };
+                _segments.push_back(segment);
+            }
+            Segment &last = _segments.back();
+            *len = _segmentSize - last.end;
+            return last.data + last.end;
+        }
+
+        void RecvChain::commit(size_t len)
+        {
+            assert(!_segments.empty() && _segments.back().end + len <= _segmentSize);
+            _segments.back().end += len;
+            _size += len;
+        }
+
+        bool RecvChain::append(const char *buf, size_t len)
+        {
+            while (len > 0)
+            {
+                size_t room = 0;
+                char *p = prepare(&room);
+                if (p == nullptr)
+                {
+                    return false;
+                }
+                size_t n = len < room ? len : room;
+                memcpy(p, buf, n);
+                commit(n);
+                buf += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        void RecvChain::consume(size_t len)
+        {
+            assert(len <= _size);
+            _size -= len;
+            while (len > 0)
+            {
+                Segment &front = _segments.front();
+                size_t n = front.end - front.begin;
+                if (len < n)
+                {
+                    front.begin += len;
+                    return;
+                }
+                len -= n;
+                if (_segments.size() > 1)
+                {
+                    mp::poolDeallocate(front.data, _segmentSize);
+                    _segments.pop_front();
+                }
+                else
+                {
+                    front.begin = front.end = 0;  // Drained, the next receive starts over at the beginning.
+                }
+            }
+        }
+
+        size_t RecvChain::copyOut(size_t offset, char *out, size_t len) const
+        {
+            size_t copied = 0;
+            for (size_t i = 0; i < _segments.size() && copied < len; ++i)
+            {
+                FrameView segment = getSegment(i);
+                if (offset >= segment.size())
+                {
+                    offset -= segment.size();
+                    continue;
+                }
+                size_t n = segment.size() - offset < len - copied ? segment.size() - offset : len - copied;
+                memcpy(out + copied, segment.data() + offset, n);
+                copied += n;
+                offset = 0;
+            }
+            return copied;
+        }
+
+        void RecvChain::clear()
+        {
+            for (size_t i = 0; i < _segments.size(); ++i)
+            {
+                mp::poolDeallocate(_segments[i].data, _segmentSize);
+            }
+            _segments.clear();
+            _size = 0;
+        }
+
+        RecvChainInputStream::RecvChainInputStream(const RecvChain &chain)
+            : _chain(chain)
+            , _index(0)
+            , _offset(0)
+            , _byteCount(0)
+        {
+        }
+
+        RecvChainInputStream::~RecvChainInputStream()
+        {
+        }
+
+        bool RecvChainInputStream::Next(const void **data, int *size)
+        {
+            for (; _index < _chain.getSegmentCount(); ++_index, _offset = 0)
+            {
+                FrameView segment = _chain.getSegment(_index);
+                if (_offset < segment.size())
+                {
+                    *data = segment.data() + _offset;
+                    *size = (int)(segment.size() - _offset);
+                    _byteCount += *size;
+                    _offset = segment.size();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void RecvChainInputStream::BackUp(int count)
+        {
+            assert(count >= 0 && count <= _byteCount);
+            _byteCount -= count;
+            size_t left = (size_t)count;
+            while (left > _offset)
+            {
+                left -= _offset;
+                --_index;
+                _offset = _chain.getSegment(_index).size();
+            }
+            _offset -= left;
+        }
+
+        bool RecvChainInputStream::Skip(int count)
+        {
+            assert(count >= 0);
+            size_t left = (size_t)count;
+            for (; _index < _chain.getSegmentCount(); ++_index, _offset = 0)
+            {
+                size_t available = _chain.getSegment(_index).size() - _offset;
+                if (left < available)
+                {
+                    _offset += left;
+                    _byteCount += left;
+                    return true;
+                }
+                left -= available;
+                _byteCount += available;
+            }
+            return left == 0;
+        }
+    }  // end of namespace rpc
+}  // end of namespace iocp
@@ -0,0 +1,163 @@
+#ifndef _ZERO_COPY_STREAMS_H_
+#define _ZERO_COPY_STREAMS_H_
+
+#include <stddef.h>
+#include <vector>
+#include "iocp/ServerFramework.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+
+namespace iocp {
+    namespace rpc {
+        // A ZeroCopyOutputStream over pooled SendBuffers (see SendBuffer::createPooled), so a message serialized to
+        // it is written straight into the memory which goes to the socket, and the buffers are queued to the send
+        // chain by reference instead of copied:
+        //   SendBufferOutputStream stream(message.ByteSize());
+        //   message.SerializeToZeroCopyStream(&stream);
+        //   stream.postTo(ctx);
+        // The first buffer holds the size given to the constructor or reserve, so a message of a known size fills
+        // one buffer. Past it, every buffer is twice the size of the last one, up to the largest pooled size.
+        class SendBufferOutputStream final : public google::protobuf::io::ZeroCopyOutputStream
+        {
+        public:
+            explicit SendBufferOutputStream(size_t sizeHint = 0);
+            virtual ~SendBufferOutputStream();
+
+            virtual bool Next(void **data, int *size) override;
+            virtual void BackUp(int count) override;
+            virtual google::protobuf::int64 ByteCount() const override { return _byteCount; }
+
+            // The next buffer holds at least size bytes.
+            void reserve(size_t size) { _sizeHint = size; }
+
+            // The bytes written, in order.
+            const SendBufferRef *getBuffers() const { return _spilled.empty() ? _inline : &_spilled[0]; }
+            size_t getBufferCount() const { return _count; }
+
+            // Posts the bytes written as one message, see ClientContext::postSend, and starts over.
+            template <class _T> typename ClientContext<_T>::POST_RESULT postTo(ClientContext<_T> *ctx)
+            {
+                typename ClientContext<_T>::POST_RESULT ret = ctx->postSend(getBuffers(), _count);
+                clear();
+                return ret;
+            }
+
+            // The same by the ID, which fails if the connection has gone.
+            template <class _T> typename ClientContext<_T>::POST_RESULT postTo(ServerFramework<_T> &framework,
+                ConnectionId id)
+            {
+                typename ClientContext<_T>::POST_RESULT ret = ClientContext<_T>::POST_RESULT::FAIL;
+                framework.visitClient(id, [this, &ret](ClientContext<_T> *ctx) {
+                    ret = ctx->postSend(getBuffers(), _count);
+                });
+                clear();
+                return ret;
+            }
+
+            // Drops the bytes written, and starts over.
+            void clear();
+
+        private:
+            enum : size_t
+            {
+                MIN_BUFFER_SIZE = 256,
+                INLINE_BUFFERS = 4,  // Held in place, the rest spill to a vector.
+            };
+
+            size_t _sizeHint;
+            SendBufferRef _inline[INLINE_BUFFERS];
+            std::vector<SendBufferRef> _spilled;  // All of them once there are more than INLINE_BUFFERS.
+            size_t _count;
+            google::protobuf::int64 _byteCount;
+
+        private:
+            SendBufferOutputStream(const SendBufferOutputStream &) = delete;
+            SendBufferOutputStream &operator=(const SendBufferOutputStream &) = delete;
+        };
+
+        // The received bytes of a connection, in a chain of pooled segments of a fixed size, for a reader which
+        // receives by itself, e.g. a client: it receives into the free space at the end (prepare and commit), or
+        // appends the bytes received elsewhere, and a frame spanning many receives stays in the segments it came in,
+        // to be parsed across them by RecvChainInputStream. Unlike a contiguous buffer, nothing is moved to make a
+        // frame whole or to grow, and a large frame needs no block of its size. The drained segments go back to the
+        // pool, but the last one, so a reader which keeps up holds one segment.
+        class RecvChain final
+        {
+        public:
+            enum : size_t { DEFAULT_SEGMENT_SIZE = 16384 };
+
+            explicit RecvChain(size_t segmentSize = DEFAULT_SEGMENT_SIZE);  // Up to mp::MAX_POOLED_SIZE.
+            ~RecvChain();
+
+            size_t size() const { return _size; }  // The unread bytes.
+            bool empty() const { return _size == 0; }
+
+            // The free space at the end to receive into, in a new segment if the last one is full. Returns nullptr
+            // if out of memory.
+            char *prepare(size_t *len);
+            // Accounts len bytes received into the space of prepare.
+            void commit(size_t len);
+            // Copies the bytes in. Returns false if out of memory.
+            bool append(const char *buf, size_t len);
+
+            // Drops the first len unread bytes.
+            void consume(size_t len);
+            // Copies up to len unread bytes from offset to out, and returns the number copied.
+            size_t copyOut(size_t offset, char *out, size_t len) const;
+
+            // The unread bytes, segment by segment.
+            size_t getSegmentCount() const { return _segments.size(); }
+            FrameView getSegment(size_t index) const
+            {
+                const Segment &segment = _segments[index];
+                return FrameView(segment.data + segment.begin, segment.end - segment.begin);
+            }
+
+            // Drops the unread bytes, and frees the segments.
+            void clear();
+
+        private:
+            struct Segment
+            {
+                char *data;
+                size_t begin;  // Of the unread bytes.
+                size_t end;  // Of the received bytes.
+            };
+
+            mp::deque<Segment> _segments;
+            size_t _segmentSize;
+            size_t _size;
+
+        private:
+            RecvChain(const RecvChain &) = delete;
+            RecvChain &operator=(const RecvChain &) = delete;
+        };
+
+        // A ZeroCopyInputStream over the unread bytes of a RecvChain, which hands out the segments in place, so
+        // CodedInputStream parses a message split across receives without joining it first. BackUp and Skip move
+        // across the segments, and the chain must not change while the stream is in use. The stream runs to the
+        // end of the chain, a message in it is bounded by CodedInputStream::PushLimit, as parseMessage does.
+        class RecvChainInputStream final : public google::protobuf::io::ZeroCopyInputStream
+        {
+        public:
+            explicit RecvChainInputStream(const RecvChain &chain);
+            virtual ~RecvChainInputStream();
+
+            virtual bool Next(const void **data, int *size) override;
+            virtual void BackUp(int count) override;
+            virtual bool Skip(int count) override;
+            virtual google::protobuf::int64 ByteCount() const override { return _byteCount; }
+
+        private:
+            const RecvChain &_chain;
+            size_t _index;  // Of the segment.
+            size_t _offset;  // In the unread bytes of the segment.
+            google::protobuf::int64 _byteCount;
+
+        private:
+            RecvChainInputStream(const RecvChainInputStream &) = delete;
+            RecvChainInputStream &operator=(const RecvChainInputStream &) = delete;
+        };
+    }  // end of namespace rpc
+}  // end of namespace iocp
+
+#endif
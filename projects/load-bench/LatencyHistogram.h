@@ -0,0 +1,128 @@
+#ifndef _LATENCY_HISTOGRAM_H_
+#define _LATENCY_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <vector>
+
+// Latencies in microseconds, in log-linear buckets as HdrHistogram's of 2 significant digits: exact below 128, then
+// 64 buckets per power of two, so every value is within 1.6% of its bucket. Recording is O(1) and merging and the
+// percentiles are O(buckets), whatever the number of values. Not thread safe, keep one per thread and merge them.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : _counts(BUCKET_COUNT, 0), _total(0), _max(0), _sum(0.0) { }
+
+    void record(uint64_t value)
+    {
+        if (value > MAX_VALUE)
+        {
+            value = MAX_VALUE;
+        }
+        ++_counts[bucketOf(value)];
+        ++_total;
+        _sum += (double)value;
+        if (value > _max)
+        {
+            _max = value;
+        }
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        {
+            _counts[i] += other._counts[i];
+        }
+        _total += other._total;
+        _sum += other._sum;
+        if (other._max > _max)
+        {
+            _max = other._max;
+        }
+    }
+
+    uint64_t getTotal() const { return _total; }
+    uint64_t getMax() const { return _max; }
+    double getMean() const { return _total > 0 ? _sum / (double)_total : 0.0; }
+
+    // The highest value of the bucket holding the p-th percentile (0 to 100), never more than the max.
+    uint64_t percentile(double p) const
+    {
+        if (_total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)_total + 0.5);
+        if (rank < 1)
+        {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        {
+            seen += _counts[i];
+            if (seen >= rank)
+            {
+                uint64_t value = upperBoundOf(i);
+                return value < _max ? value : _max;
+            }
+        }
+        return _max;
+    }
+
+    // Calls func(highest value, count) for every bucket which isn't empty, in order.
+    template <class Func>
+    void forEachBucket(Func func) const
+    {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        {
+            if (_counts[i] > 0)
+            {
+                func(upperBoundOf(i), _counts[i]);
+            }
+        }
+    }
+
+private:
+    enum
+    {
+        SUB_BUCKET_BITS = 6,
+        LINEAR_COUNT = 2 << SUB_BUCKET_BITS,        // Exact values.
+        SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS,    // Buckets per power of two above.
+        EXPONENT_COUNT = 34,
+        BUCKET_COUNT = LINEAR_COUNT + EXPONENT_COUNT * SUB_BUCKET_COUNT,
+    };
+    static const uint64_t MAX_VALUE = (1ULL << 40) - 1;  // About 12 days.
+
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < LINEAR_COUNT)
+        {
+            return (size_t)value;
+        }
+        unsigned shift = 1;
+        while ((value >> (shift + SUB_BUCKET_BITS + 1)) != 0)
+        {
+            ++shift;
+        }
+        return LINEAR_COUNT + (shift - 1) * SUB_BUCKET_COUNT + (size_t)((value >> shift) - SUB_BUCKET_COUNT);
+    }
+
+    static uint64_t upperBoundOf(size_t index)
+    {
+        if (index < LINEAR_COUNT)
+        {
+            return index;
+        }
+        unsigned shift = (unsigned)((index - LINEAR_COUNT) / SUB_BUCKET_COUNT) + 1;
+        uint64_t sub = (index - LINEAR_COUNT) % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> _counts;
+    uint64_t _total;
+    uint64_t _max;
+    double _sum;
+};
+
+#endif
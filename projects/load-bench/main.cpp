@@ -0,0 +1,483 @@
+// Load generator and latency benchmark for the iocp-test echo protocol: every packet is a 4-byte big-endian body
+// size followed by the body.
+//
+// It opens C connections on T ClientLoop threads. Every connection keeps up to D requests in flight, of sizes drawn
+// from a distribution. It runs closed loop (the next request once one is echoed) or, with -r, open loop at a fixed
+// total rate. At a fixed rate a request is due at its scheduled time. The latency counts from that time, not from the
+// time it went out, so a stalled server or a full pipeline shows up in the latency instead of slowing the load down
+// (the coordinated omission correction of wrk2). The raw latency from the send is reported as well.
+// -o writes the config, the throughput, the percentiles and the histograms as JSON to track regressions.
+//
+// usage: load-bench [-h host] [-p port] [-c connections] [-T threads] [-d depth] [-s min[-max]] [-D fixed|uniform|exp]
+//                   [-r requests/s] [-w warmup seconds] [-t seconds] [-o json file]
+
+#include "../client-test/src/ClientConnection.h"
+#include "LatencyHistogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define HEADER_SIZE 4
+#define STAMP_SIZE 24   // Sequence, scheduled and sent microseconds, at the front of every body.
+
+enum SizeDistribution
+{
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXPONENTIAL,   // Mean of a quarter of the range above the min, cut at the max.
+};
+
+struct BenchConfig
+{
+    const char *host = "127.0.0.1";
+    uint16_t port = 8899;
+    int connections = 100;
+    int threads = 2;
+    int depth = 1;
+    int minSize = 64;
+    int maxSize = 64;
+    SizeDistribution distribution = SIZE_FIXED;
+    double rate = 0.0;      // Requests/s of all the connections, 0 for closed loop.
+    int warmup = 1;
+    int seconds = 10;
+    const char *output = nullptr;
+};
+
+static const char *distributionNames[] = { "fixed", "uniform", "exp" };
+
+static uint64_t nowMicros()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    // splitmix64
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+struct LoadConnection
+{
+    ClientConnection *conn;
+    int index;
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> received;
+    uint64_t offset;    // Of its schedule, so the connections don't send at once.
+
+    LoadConnection(ClientLoop *loop, int i) : conn(new ClientConnection(loop)), index(i), sent(0), received(0), offset(0) { }
+    ~LoadConnection() { delete conn; }
+};
+
+// The connections of a loop thread. Its counters are only touched on the thread.
+struct LoadGroup
+{
+    ClientLoop loop;
+    std::vector<LoadConnection *> conns;
+    LatencyHistogram corrected;
+    LatencyHistogram raw;
+    std::atomic<uint64_t> replies;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> errors;
+
+    LoadGroup() : replies(0), bytes(0), errors(0) { }
+};
+
+class LoadBench
+{
+public:
+    explicit LoadBench(const BenchConfig &cfg) : _cfg(cfg), _start(0), _measureStart(0), _measureEnd(0), _interval(0),
+        _stop(false)
+    {
+    }
+
+    ~LoadBench()
+    {
+        for (size_t i = 0; i < _groups.size(); ++i)
+        {
+            for (size_t k = 0; k < _groups[i]->conns.size(); ++k)
+            {
+                _groups[i]->conns[k]->conn->quit();
+                delete _groups[i]->conns[k];
+            }
+            delete _groups[i];
+        }
+    }
+
+    bool run()
+    {
+        _start = nowMicros();
+        _measureStart = _start + (uint64_t)_cfg.warmup * 1000000;
+        _measureEnd = _measureStart + (uint64_t)_cfg.seconds * 1000000;
+        _interval = _cfg.rate > 0 ? _cfg.connections * 1000000.0 / _cfg.rate : 0.0;
+
+        for (int i = 0; i < _cfg.threads; ++i)
+        {
+            _groups.push_back(new LoadGroup());
+        }
+        for (int i = 0; i < _cfg.connections; ++i)
+        {
+            LoadGroup *group = _groups[i % _cfg.threads];
+            LoadConnection *c = new LoadConnection(&group->loop, i);
+            c->offset = (uint64_t)(_interval * i / _cfg.connections);
+            c->conn->setRecvCallback([this, group, c](const char *buf, size_t len) { onReply(group, c, buf, len); });
+            group->conns.push_back(c);
+            c->conn->connentToServer(_cfg.host, _cfg.port);
+        }
+
+        // The requests queue up until connected, the time it takes counts in the warmup.
+        std::vector<std::thread *> pacers;
+        for (size_t i = 0; i < _groups.size(); ++i)
+        {
+            if (_interval == 0)
+            {
+                for (size_t k = 0; k < _groups[i]->conns.size(); ++k)
+                {
+                    trySend(_groups[i]->conns[k], UINT64_MAX);
+                }
+            }
+            else
+            {
+                LoadGroup *group = _groups[i];
+                pacers.push_back(new std::thread([this, group]() { runPacer(group); }));
+            }
+        }
+
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(_measureStart)));
+        _repliesBefore = countReplies(&_bytesBefore);
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(_measureEnd)));
+        _repliesAfter = countReplies(&_bytesAfter);
+        _stop = true;
+
+        for (size_t i = 0; i < pacers.size(); ++i)
+        {
+            pacers[i]->join();
+            delete pacers[i];
+        }
+        _connected = 0;
+        for (size_t i = 0; i < _groups.size(); ++i)
+        {
+            for (size_t k = 0; k < _groups[i]->conns.size(); ++k)
+            {
+                _connected += _groups[i]->conns[k]->conn->isConnectSuccess() ? 1 : 0;
+                _groups[i]->conns[k]->conn->quit();
+            }
+        }
+        for (size_t i = 0; i < _groups.size(); ++i)
+        {
+            _corrected.merge(_groups[i]->corrected);
+            _raw.merge(_groups[i]->raw);
+            _errors += _groups[i]->errors.load();
+        }
+        return _connected > 0;
+    }
+
+    void report() const
+    {
+        double rate = (double)(_repliesAfter - _repliesBefore) / _cfg.seconds;
+        double mbs = (double)(_bytesAfter - _bytesBefore) / _cfg.seconds / (1024.0 * 1024.0);
+        printf("%d of %d connected, %.0f requests/s, %.2f MB/s echoed, %llu errors\n", _connected, _cfg.connections,
+            rate, mbs, (unsigned long long)_errors);
+        printf("%-10s %10s %10s %10s %10s %10s %10s %10s\n", "latency us", "mean", "p50", "p90", "p99", "p99.9",
+            "p99.99", "max");
+        printLatency(_interval > 0 ? "corrected" : "closed", _corrected);
+        if (_interval > 0)
+        {
+            printLatency("raw", _raw);
+        }
+    }
+
+    bool writeJson(const char *path) const
+    {
+        FILE *fp = fopen(path, "w");
+        if (fp == nullptr)
+        {
+            return false;
+        }
+        fprintf(fp, "{\n  \"config\": {\"host\": \"%s\", \"port\": %hu, \"connections\": %d, \"threads\": %d, "
+            "\"depth\": %d, \"min_size\": %d, \"max_size\": %d, \"distribution\": \"%s\", \"rate\": %.0f, "
+            "\"warmup\": %d, \"seconds\": %d},\n", _cfg.host, _cfg.port, _cfg.connections, _cfg.threads, _cfg.depth,
+            _cfg.minSize, _cfg.maxSize, distributionNames[_cfg.distribution], _cfg.rate, _cfg.warmup, _cfg.seconds);
+        fprintf(fp, "  \"connected\": %d,\n  \"errors\": %llu,\n  \"requests_per_sec\": %.1f,\n"
+            "  \"bytes_per_sec\": %.1f,\n", _connected, (unsigned long long)_errors,
+            (double)(_repliesAfter - _repliesBefore) / _cfg.seconds, (double)(_bytesAfter - _bytesBefore) / _cfg.seconds);
+        fprintf(fp, "  \"latency_us\": ");
+        writeJsonLatency(fp, _corrected);
+        fprintf(fp, ",\n  \"raw_latency_us\": ");
+        writeJsonLatency(fp, _raw);
+        fprintf(fp, "\n}\n");
+        fclose(fp);
+        return true;
+    }
+
+private:
+    int sizeOf(const LoadConnection *c, uint64_t seq) const
+    {
+        int range = _cfg.maxSize - _cfg.minSize;
+        if (_cfg.distribution == SIZE_FIXED || range == 0)
+        {
+            return _cfg.minSize;
+        }
+        // Drawn from the connection and the sequence, so any thread sending it gets the same size.
+        uint64_t r = mix64(((uint64_t)c->index << 40) ^ seq);
+        if (_cfg.distribution == SIZE_UNIFORM)
+        {
+            return _cfg.minSize + (int)(r % (uint64_t)(range + 1));
+        }
+        double u = (double)(r >> 11) / 9007199254740992.0;
+        double size = _cfg.minSize - log(1.0 - u) * range / 4.0;
+        return size < _cfg.maxSize ? (int)size : _cfg.maxSize;
+    }
+
+    uint64_t scheduledAt(const LoadConnection *c, uint64_t seq) const
+    {
+        // Rounded up, so the next request of a connection is always due after the one due by now.
+        return _start + c->offset + (uint64_t)ceil(seq * _interval);
+    }
+
+    // Sends the requests due by now while fewer than depth are in flight. Called by the pacer and by the loop
+    // thread on every reply, the sequences are taken by CAS so every one goes out once.
+    void trySend(LoadConnection *c, uint64_t due)
+    {
+        for (;;)
+        {
+            uint64_t seq = c->sent.load();
+            if (seq >= due || seq - c->received.load() >= (uint64_t)_cfg.depth || _stop)
+            {
+                return;
+            }
+            if (!c->sent.compare_exchange_weak(seq, seq + 1))
+            {
+                continue;
+            }
+
+            int size = sizeOf(c, seq);
+            uint64_t now = nowMicros();
+            uint64_t stamps[3] = { seq, _interval > 0 ? scheduledAt(c, seq) : now, now };
+            char body[4096];
+            std::vector<char> large;
+            char *p = body;
+            if (size > (int)sizeof(body))
+            {
+                large.resize(size);
+                p = &large[0];
+            }
+            memcpy(p, stamps, STAMP_SIZE);
+            memset(p + STAMP_SIZE, 'x', size - STAMP_SIZE);
+            c->conn->sendBuf(p, size);
+        }
+    }
+
+    uint64_t dueBy(const LoadConnection *c, uint64_t now) const
+    {
+        uint64_t first = _start + c->offset;
+        return now < first ? 0 : (uint64_t)((now - first) / _interval) + 1;
+    }
+
+    void onReply(LoadGroup *group, LoadConnection *c, const char *buf, size_t len)
+    {
+        uint64_t now = nowMicros();
+        uint64_t stamps[3] = { 0, 0, 0 };
+        if (len < STAMP_SIZE)
+        {
+            ++group->errors;
+        }
+        else
+        {
+            memcpy(stamps, buf, STAMP_SIZE);
+            if (len != (size_t)sizeOf(c, stamps[0]))
+            {
+                ++group->errors;
+            }
+            else if (stamps[1] >= _measureStart && now <= _measureEnd)
+            {
+                group->corrected.record(now - stamps[1]);
+                group->raw.record(now - stamps[2]);
+            }
+        }
+        group->bytes.fetch_add(len + HEADER_SIZE, std::memory_order_relaxed);
+        group->replies.fetch_add(1, std::memory_order_relaxed);
+        ++c->received;
+        trySend(c, _interval > 0 ? dueBy(c, now) : UINT64_MAX);
+    }
+
+    // Wakes up at the next scheduled request of the group, and sends what's due. A connection with its pipeline
+    // full is caught up by its replies.
+    void runPacer(LoadGroup *group)
+    {
+        typedef std::pair<uint64_t, LoadConnection *> Due;
+        std::priority_queue<Due, std::vector<Due>, std::greater<Due> > queue;
+        for (size_t i = 0; i < group->conns.size(); ++i)
+        {
+            queue.push(Due(scheduledAt(group->conns[i], 0), group->conns[i]));
+        }
+        while (!_stop && !queue.empty())
+        {
+            uint64_t now = nowMicros();
+            if (queue.top().first > now)
+            {
+                std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+                    std::chrono::microseconds(queue.top().first)));
+                continue;
+            }
+            LoadConnection *c = queue.top().second;
+            queue.pop();
+            uint64_t due = dueBy(c, now);
+            trySend(c, due);
+            queue.push(Due(scheduledAt(c, due), c));
+        }
+    }
+
+    uint64_t countReplies(uint64_t *bytes) const
+    {
+        uint64_t replies = 0;
+        *bytes = 0;
+        for (size_t i = 0; i < _groups.size(); ++i)
+        {
+            replies += _groups[i]->replies.load();
+            *bytes += _groups[i]->bytes.load();
+        }
+        return replies;
+    }
+
+    static void printLatency(const char *name, const LatencyHistogram &h)
+    {
+        printf("%-10s %10.0f %10llu %10llu %10llu %10llu %10llu %10llu\n", name, h.getMean(),
+            (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+            (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+            (unsigned long long)h.percentile(99.99), (unsigned long long)h.getMax());
+    }
+
+    static void writeJsonLatency(FILE *fp, const LatencyHistogram &h)
+    {
+        fprintf(fp, "{\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, "
+            "\"p9999\": %llu, \"max\": %llu, \"histogram\": [", (unsigned long long)h.getTotal(), h.getMean(),
+            (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+            (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+            (unsigned long long)h.percentile(99.99), (unsigned long long)h.getMax());
+        bool first = true;
+        h.forEachBucket([fp, &first](uint64_t value, uint64_t count) {
+            fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ", (unsigned long long)value, (unsigned long long)count);
+            first = false;
+        });
+        fprintf(fp, "]}");
+    }
+
+    BenchConfig _cfg;
+    std::vector<LoadGroup *> _groups;
+    uint64_t _start;
+    uint64_t _measureStart;
+    uint64_t _measureEnd;
+    double _interval;       // Microseconds between the requests of a connection, fractional at high rates, 0 for
+                            // closed loop.
+    volatile bool _stop;
+
+    uint64_t _repliesBefore = 0;
+    uint64_t _repliesAfter = 0;
+    uint64_t _bytesBefore = 0;
+    uint64_t _bytesAfter = 0;
+    int _connected = 0;
+    uint64_t _errors = 0;
+    LatencyHistogram _corrected;
+    LatencyHistogram _raw;
+};
+
+static bool parseSizes(const char *val, BenchConfig &cfg)
+{
+    char *end = nullptr;
+    cfg.minSize = (int)strtol(val, &end, 10);
+    cfg.maxSize = cfg.minSize;
+    if (*end == '-')
+    {
+        cfg.maxSize = (int)strtol(end + 1, &end, 10);
+        if (cfg.distribution == SIZE_FIXED)
+        {
+            cfg.distribution = SIZE_UNIFORM;
+        }
+    }
+    return *end == '\0';
+}
+
+static void usage()
+{
+    printf("usage: load-bench [-h host] [-p port] [-c connections] [-T threads] [-d depth] [-s min[-max]] "
+        "[-D fixed|uniform|exp]\n                  [-r requests/s] [-w warmup seconds] [-t seconds] [-o json file]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    bool ok = (argc & 1) != 0;
+    const char *sizes = nullptr;
+    for (int i = 1; ok && i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-h") == 0) cfg.host = val;
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-T") == 0) cfg.threads = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-s") == 0) sizes = val;
+        else if (strcmp(opt, "-r") == 0) cfg.rate = atof(val);
+        else if (strcmp(opt, "-w") == 0) cfg.warmup = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-o") == 0) cfg.output = val;
+        else if (strcmp(opt, "-D") == 0)
+        {
+            if (strcmp(val, "fixed") == 0) cfg.distribution = SIZE_FIXED;
+            else if (strcmp(val, "uniform") == 0) cfg.distribution = SIZE_UNIFORM;
+            else if (strcmp(val, "exp") == 0) cfg.distribution = SIZE_EXPONENTIAL;
+            else ok = false;
+        }
+        else ok = false;
+    }
+    ok = ok && (sizes == nullptr || parseSizes(sizes, cfg));
+    if (!ok || cfg.connections <= 0 || cfg.threads <= 0 || cfg.depth <= 0 || cfg.minSize < STAMP_SIZE
+        || cfg.maxSize < cfg.minSize || cfg.rate < 0 || cfg.warmup < 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+    if (cfg.threads > cfg.connections)
+    {
+        cfg.threads = cfg.connections;
+    }
+
+    printf("%s:%hu, %d connections on %d threads, depth %d, body %d-%d bytes %s, ", cfg.host, cfg.port,
+        cfg.connections, cfg.threads, cfg.depth, cfg.minSize, cfg.maxSize, distributionNames[cfg.distribution]);
+    if (cfg.rate > 0)
+    {
+        printf("%.0f requests/s, ", cfg.rate);
+    }
+    else
+    {
+        printf("closed loop, ");
+    }
+    printf("%d+%d seconds\n", cfg.warmup, cfg.seconds);
+
+    LoadBench bench(cfg);
+    if (!bench.run())
+    {
+        printf("no connection\n");
+        return 1;
+    }
+    bench.report();
+    if (cfg.output != nullptr && !bench.writeJson(cfg.output))
+    {
+        printf("cannot write %s\n", cfg.output);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,295 @@
+// Fragmented message parsing benchmark.
+//
+// Encodes N framed protobuf messages of about S bytes into one stream and parses it as the completions hand it out,
+// in pieces of K bytes, in three ways:
+//   copy  - every piece lands in its own receive buffer and is appended to a cache, a whole frame is parsed by
+//           ParseFromArray and erased from the front of the cache, as the receive cache of a connection used to
+//   ring  - the pieces are received straight into one contiguous buffer, which doubles when the frame outgrows it,
+//           and the partial frame left after the whole ones moves to the front, as the receive ring does
+//   chain - the pieces are received straight into a RecvChain, and rpc::parseMessage parses a frame across its
+//           segments by RecvChainInputStream
+// Every way runs with two messages: a google::protobuf::FileDescriptorProto of many small fields and nested
+// messages, copies of the message types of descriptor.proto, and a google::protobuf::UninterpretedOption holding
+// one string of S bytes. It reports the messages/s, the MB/s and the bytes moved to join the frames per message,
+// the receive itself excluded, and checks the size of every message parsed.
+//
+// usage: parse-bench [-n messages] [-s message bytes] [-k piece bytes] [-r rounds]
+
+#include "rpc/RpcProtocol.h"
+#include "google/protobuf/descriptor.pb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::UninterpretedOption;
+
+struct BenchConfig
+{
+    int messages = 2000;
+    size_t size = 65536;
+    size_t piece = 4096;
+    int rounds = 5;
+};
+
+struct BenchResult
+{
+    uint64_t messages;
+    uint64_t errors;  // Messages which didn't parse or came out of the wrong size.
+    uint64_t moved;  // Bytes copied or moved to join the frames.
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A FileDescriptorProto of at least size bytes, of copies of the message types of descriptor.proto.
+static void makeMessage(size_t size, FileDescriptorProto *message)
+{
+    FileDescriptorProto source;
+    FileDescriptorProto::descriptor()->file()->CopyTo(&source);
+    message->set_name("parse-bench.proto");
+    message->set_package("bench");
+    while ((size_t)message->ByteSize() < size)
+    {
+        for (int i = 0; i < source.message_type_size() && (size_t)message->ByteSize() < size; ++i)
+        {
+            message->add_message_type()->CopyFrom(source.message_type(i));
+        }
+    }
+}
+
+// An UninterpretedOption of about size bytes, most of them one string.
+static void makeMessage(size_t size, UninterpretedOption *message)
+{
+    message->set_identifier_value("parse-bench");
+    message->set_positive_int_value(size);
+    message->set_string_value(std::string(size > 32 ? size - 32 : 0, 'x'));
+}
+
+// The frames of messages copies of message, each one behind a 4-byte big-endian size.
+static std::vector<char> encodeStream(const google::protobuf::MessageLite &message, int messages)
+{
+    std::string body = message.SerializeAsString();
+    char header[iocp::rpc::HEADER_SIZE] = {
+        (char)(body.size() >> 24), (char)(body.size() >> 16), (char)(body.size() >> 8), (char)body.size()
+    };
+    std::vector<char> stream;
+    stream.reserve((sizeof(header) + body.size()) * (size_t)messages);
+    for (int i = 0; i < messages; ++i)
+    {
+        stream.insert(stream.end(), header, header + sizeof(header));
+        stream.insert(stream.end(), body.begin(), body.end());
+    }
+    return stream;
+}
+
+static size_t readBodySize(const char *p)
+{
+    return ((size_t)(uint8_t)p[0] << 24) | ((size_t)(uint8_t)p[1] << 16) | ((size_t)(uint8_t)p[2] << 8) | (uint8_t)p[3];
+}
+
+template <class Message>
+static void parseFrames(const char *buf, size_t len, size_t *processed, Message *message, int expected,
+    BenchResult *result)
+{
+    while (len - *processed >= iocp::rpc::HEADER_SIZE)
+    {
+        size_t bodySize = readBodySize(buf + *processed);
+        if (len - *processed - iocp::rpc::HEADER_SIZE < bodySize)
+        {
+            return;
+        }
+        bool parsed = message->ParseFromArray(buf + *processed + iocp::rpc::HEADER_SIZE, (int)bodySize);
+        result->errors += parsed && message->ByteSize() == expected ? 0 : 1;
+        ++result->messages;
+        *processed += iocp::rpc::HEADER_SIZE + bodySize;
+    }
+}
+
+template <class Message>
+static BenchResult parseByCopy(const std::vector<char> &stream, size_t piece, int expected)
+{
+    BenchResult result = { 0, 0, 0 };
+    Message message;
+    std::vector<char> recvBuf(piece);
+    std::string cache;
+    for (size_t offset = 0; offset < stream.size(); offset += piece)
+    {
+        size_t n = stream.size() - offset < piece ? stream.size() - offset : piece;
+        memcpy(recvBuf.data(), stream.data() + offset, n);  // The receive.
+        cache.append(recvBuf.data(), n);
+        result.moved += n;
+
+        size_t processed = 0;
+        parseFrames(cache.data(), cache.size(), &processed, &message, expected, &result);
+        cache.erase(0, processed);
+        result.moved += processed > 0 ? cache.size() : 0;
+    }
+    return result;
+}
+
+template <class Message>
+static BenchResult parseByRing(const std::vector<char> &stream, size_t piece, int expected)
+{
+    BenchResult result = { 0, 0, 0 };
+    Message message;
+    std::vector<char> buf(piece);
+    size_t len = 0;
+    for (size_t offset = 0; offset < stream.size(); offset += piece)
+    {
+        size_t n = stream.size() - offset < piece ? stream.size() - offset : piece;
+        if (buf.size() - len < n)
+        {
+            std::vector<char> grown(buf.size() * 2 >= len + n ? buf.size() * 2 : len + n);
+            memcpy(grown.data(), buf.data(), len);
+            buf.swap(grown);
+            result.moved += len;
+        }
+        memcpy(buf.data() + len, stream.data() + offset, n);  // The receive.
+        len += n;
+
+        size_t processed = 0;
+        parseFrames(buf.data(), len, &processed, &message, expected, &result);
+        if (processed > 0)
+        {
+            memmove(buf.data(), buf.data() + processed, len - processed);
+            len -= processed;
+            result.moved += len;
+        }
+    }
+    return result;
+}
+
+template <class Message>
+static BenchResult parseByChain(const std::vector<char> &stream, size_t piece, int expected)
+{
+    BenchResult result = { 0, 0, 0 };
+    Message message;
+    iocp::rpc::RecvChain chain;
+    iocp::FrameFormat format = iocp::rpc::getFrameFormat(stream.size());
+    for (size_t offset = 0; offset < stream.size(); )
+    {
+        // A piece may span the end of a segment, as a receive into 2 parts.
+        size_t n = stream.size() - offset < piece ? stream.size() - offset : piece;
+        while (n > 0)
+        {
+            size_t room = 0;
+            char *p = chain.prepare(&room);
+            if (p == nullptr)
+            {
+                ++result.errors;
+                return result;
+            }
+            size_t part = n < room ? n : room;
+            memcpy(p, stream.data() + offset, part);  // The receive.
+            chain.commit(part);
+            offset += part;
+            n -= part;
+        }
+
+        iocp::FrameDecoder::Result ret;
+        while ((ret = iocp::rpc::parseMessage(&chain, &message, format)) == iocp::FrameDecoder::FRAME)
+        {
+            result.errors += message.ByteSize() == expected ? 0 : 1;
+            ++result.messages;
+        }
+        if (ret != iocp::FrameDecoder::INCOMPLETE)
+        {
+            ++result.errors;
+            ++result.messages;
+        }
+    }
+    return result;
+}
+
+template <class Run>
+static bool runCase(const char *name, const BenchConfig &cfg, size_t streamSize, Run run)
+{
+    double best = 0.0;
+    BenchResult result = { 0, 0, 0 };
+    for (int round = 0; round < cfg.rounds; ++round)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        result = run();
+        double seconds = elapsedSince(start);
+        if (result.messages != (uint64_t)cfg.messages || result.errors != 0)
+        {
+            printf("%-18s wrong messages: %llu of %d, %llu errors\n", name, (unsigned long long)result.messages,
+                cfg.messages, (unsigned long long)result.errors);
+            return false;
+        }
+        if (round == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    printf("%-18s %12.0f %10.1f %14.0f\n", name, cfg.messages / best, streamSize / best / (1024.0 * 1024.0),
+        (double)result.moved / cfg.messages);
+    return true;
+}
+
+template <class Message>
+static bool runMessage(const char *name, const BenchConfig &cfg)
+{
+    Message prototype;
+    makeMessage(cfg.size, &prototype);
+    int expected = prototype.ByteSize();
+    std::vector<char> stream = encodeStream(prototype, cfg.messages);
+    printf("%s of %d bytes\n", name, expected);
+
+    bool ok = runCase("  copy", cfg, stream.size(), [&]() {
+        return parseByCopy<Message>(stream, cfg.piece, expected);
+    });
+    ok = runCase("  ring", cfg, stream.size(), [&]() {
+        return parseByRing<Message>(stream, cfg.piece, expected);
+    }) && ok;
+    ok = runCase("  chain", cfg, stream.size(), [&]() {
+        return parseByChain<Message>(stream, cfg.piece, expected);
+    }) && ok;
+    return ok;
+}
+
+static void usage()
+{
+    printf("usage: parse-bench [-n messages] [-s message bytes] [-k piece bytes] [-r rounds]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) cfg.messages = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.size = (size_t)atoi(val);
+        else if (strcmp(opt, "-k") == 0) cfg.piece = (size_t)atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.rounds = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.messages <= 0 || cfg.size == 0 || cfg.size > 64 * 1024 * 1024 || cfg.piece == 0
+        || cfg.rounds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    printf("%d messages of %lu bytes, in pieces of %lu bytes, best of %d rounds\n", cfg.messages,
+        (unsigned long)cfg.size, (unsigned long)cfg.piece, cfg.rounds);
+    printf("%-18s %12s %10s %14s\n", "", "messages/s", "MB/s", "moved/message");
+    bool ok = runMessage<FileDescriptorProto>("FileDescriptorProto", cfg);
+    ok = runMessage<UninterpretedOption>("UninterpretedOption", cfg) && ok;
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+}
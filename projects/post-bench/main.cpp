@@ -0,0 +1,289 @@
+// Post benchmark.
+//
+// Runs a server in process, and P producer threads post tasks to it:
+//   shard      - post(task), every task bumps a counter. It reports the tasks run per second, and how many batches
+//                they ran in, i.e. how many times a worker thread had to be woken up for them
+//   connection - post(id, task) round robin over C connections, every task carries a sequence number of its
+//                producer, and the connection checks they arrive in order on its strand
+//
+// usage: post-bench [-n tasks] [-P producers] [-c connections] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define MAX_PRODUCERS 16
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The state of a connection, touched only on its strand.
+struct Sequence
+{
+    uint64_t last[MAX_PRODUCERS];
+    uint64_t disordered;
+};
+
+class PostBench
+{
+public:
+    PostBench(uint16_t port) : _port(port), _run(0), _disordered(0), _seqBase(0) { }
+
+    bool startup(unsigned shards)
+    {
+        _server.setShardCount(shards);
+        return _server.startup("127.0.0.1", _port,
+            [this](iocp::ClientContext<Sequence> *ctx, const char *, size_t len)->size_t {
+                memset(&**ctx, 0, sizeof(Sequence));
+                _idMutex.lock();
+                _ids.push_back(ctx->getId());
+                _idMutex.unlock();
+                return len;
+            },
+            [this](iocp::ClientContext<Sequence> *ctx) {
+                _disordered += (*ctx)->disordered;
+            });
+    }
+
+    void shutdown()
+    {
+        _server.shutdown();
+    }
+
+    void runShard(int tasks, int producers)
+    {
+        _run = 0;
+        iocp::PostStats before = _server.getPostStats();
+        int perProducer = tasks / producers;
+        uint64_t total = (uint64_t)perProducer * producers;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread *> threads;
+        for (int p = 0; p < producers; ++p)
+        {
+            threads.push_back(new std::thread([this, perProducer]() {
+                for (int i = 0; i < perProducer; ++i)
+                {
+                    _server.post([this]() { _run.fetch_add(1, std::memory_order_relaxed); });
+                }
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+        double posting = elapsedSince(start);
+        waitFor(total);
+        double running = elapsedSince(start);
+
+        iocp::PostStats after = _server.getPostStats();
+        uint64_t batches = after.batches - before.batches;
+        printf("%9d %12.0f %12.0f %12llu %12llu %12.1f\n", producers, total / posting, _run.load() / running,
+            (unsigned long long)_run.load(), (unsigned long long)batches,
+            batches > 0 ? (double)(after.tasks - before.tasks) / batches : 0.0);
+    }
+
+    void runConnection(int tasks, int producers)
+    {
+        std::vector<iocp::ConnectionId> ids;
+        _idMutex.lock();
+        ids = _ids;
+        _idMutex.unlock();
+        if (ids.empty())
+        {
+            printf("no connection\n");
+            return;
+        }
+
+        _run = 0;
+        int perProducer = tasks / producers;
+        uint64_t total = (uint64_t)perProducer * producers;
+        uint64_t seqBase = _seqBase;  // Go on from the last run.
+        _seqBase += perProducer;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread *> threads;
+        for (int p = 0; p < producers; ++p)
+        {
+            threads.push_back(new std::thread([this, p, perProducer, seqBase, &ids]() {
+                for (int i = 0; i < perProducer; ++i)
+                {
+                    // Every connection must see the sequence numbers of a producer in increasing order.
+                    uint64_t seq = seqBase + i + 1;
+                    _server.post(ids[i % ids.size()], [this, p, seq](iocp::ClientContext<Sequence> *ctx) {
+                        Sequence &s = **ctx;
+                        if (seq <= s.last[p])
+                        {
+                            ++s.disordered;
+                        }
+                        s.last[p] = seq;
+                        _run.fetch_add(1, std::memory_order_relaxed);
+                    });
+                }
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+        double posting = elapsedSince(start);
+        waitFor(total);
+        double running = elapsedSince(start);
+
+        printf("%9d %12.0f %12.0f %12llu\n", producers, total / posting, _run.load() / running,
+            (unsigned long long)_run.load());
+    }
+
+    int connect(int connections, std::vector<SOCKET> &sockets)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        for (int i = 0; i < connections; ++i)
+        {
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+            {
+                printf("connect failed after %d connections\n", i);
+                if (s != INVALID_SOCKET)
+                {
+                    close_socket(s);
+                }
+                break;
+            }
+            ::send(s, "x", 1, 0);  // Registers the ID.
+            sockets.push_back(s);
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (registered() < sockets.size() && elapsedSince(start) < 5)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return (int)registered();
+    }
+
+    // Counted when the connections are closed.
+    uint64_t disordered()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (_server.getClientCount() > 0 && elapsedSince(start) < 5)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return _disordered.load();
+    }
+
+private:
+    size_t registered()
+    {
+        _idMutex.lock();
+        size_t count = _ids.size();
+        _idMutex.unlock();
+        return count;
+    }
+
+    void waitFor(uint64_t total)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (_run.load() < total && elapsedSince(start) < 30)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    uint16_t _port;
+    iocp::ServerFramework<Sequence> _server;
+    std::atomic<uint64_t> _run;
+    std::atomic<uint64_t> _disordered;
+    uint64_t _seqBase;
+    std::vector<iocp::ConnectionId> _ids;
+    iocp::mutex _idMutex;
+};
+
+static void usage()
+{
+    printf("usage: post-bench [-n tasks] [-P producers] [-c connections] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int tasks = 1000000;
+    int producers = 4;
+    int connections = 100;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) tasks = atoi(val);
+        else if (strcmp(opt, "-P") == 0) producers = atoi(val);
+        else if (strcmp(opt, "-c") == 0) connections = atoi(val);
+        else if (strcmp(opt, "-p") == 0) port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || tasks <= 0 || producers <= 0 || producers > MAX_PRODUCERS || connections <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    iocp::ServerFramework<>::initialize();
+    PostBench bench(port);
+    if (!bench.startup(shards))
+    {
+        printf("startup failed\n");
+        iocp::ServerFramework<>::uninitialize();
+        return 1;
+    }
+
+    printf("post(task), %d tasks\n", tasks);
+    printf("%9s %12s %12s %12s %12s %12s\n", "producers", "posts/s", "tasks/s", "run", "wakeups", "per wakeup");
+    for (int p = 1; p <= producers; p *= 2)
+    {
+        bench.runShard(tasks, p);
+    }
+
+    std::vector<SOCKET> sockets;
+    int connected = bench.connect(connections, sockets);
+    printf("post(id, task), %d tasks over %d connections\n", tasks, connected);
+    printf("%9s %12s %12s %12s\n", "producers", "posts/s", "tasks/s", "run");
+    for (int p = 1; p <= producers; p *= 2)
+    {
+        bench.runConnection(tasks, p);
+    }
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        close_socket(sockets[i]);
+    }
+    printf("out of order: %llu\n", (unsigned long long)bench.disordered());
+
+    bench.shutdown();
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
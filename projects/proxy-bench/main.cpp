@@ -0,0 +1,386 @@
+// Proxy benchmark.
+//
+// Runs an echo backend and a proxy in process. The proxy keeps U connections to the backend by addUpstream, and
+// forwards the frames of every client through the upstream of its affinity, tagged with the ID of the client,
+// and the replies back by the tag. C clients keep D requests of S bytes in flight, straight to the backend and
+// then through the proxy, and it reports the requests/s and the round trip latency of both, and how long the
+// upstreams took to connect.
+//
+// usage: proxy-bench [-c clients] [-u upstreams] [-s bytes] [-d depth] [-t seconds] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   define close_socket ::closesocket
+#else
+#   include <unistd.h>
+#   include <netinet/tcp.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+// Every frame is a 4-byte length followed by the bytes. A request carries its sequence number and the time it
+// was sent, the proxy puts the ID of the client before it.
+#define HEADER_SIZE 4
+#define TAG_SIZE 8
+#define MIN_PAYLOAD_SIZE 16
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t nowMicros()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool sendAll(SOCKET s, const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::send(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool recvAll(SOCKET s, char *buf, int len)
+{
+    while (len > 0)
+    {
+        int ret = ::recv(s, buf, len, 0);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// The bytes of the whole frames at the front of buf.
+static size_t frameBytes(const char *buf, size_t len)
+{
+    size_t processed = 0;
+    while (len - processed >= HEADER_SIZE)
+    {
+        uint32_t frameLen = 0;
+        memcpy(&frameLen, buf + processed, HEADER_SIZE);
+        if (len - processed - HEADER_SIZE < frameLen)
+        {
+            break;
+        }
+        processed += HEADER_SIZE + frameLen;
+    }
+    return processed;
+}
+
+struct BenchConfig
+{
+    int clients = 64;
+    int upstreams = 8;
+    int payloadSize = 64;
+    int depth = 4;
+    int seconds = 3;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+};
+
+struct BenchResult
+{
+    double rate = 0.0;
+    std::vector<double> rtts;  // Microseconds.
+    uint64_t disorders = 0;
+};
+
+class ProxyBench
+{
+public:
+    explicit ProxyBench(const BenchConfig &cfg) : _cfg(cfg), _stop(false), _done(0), _disorders(0) { }
+
+    bool startBackend()
+    {
+        // Echoes the whole frames.
+        _backend.setShardCount(_cfg.shards);
+        return _backend.startup("127.0.0.1", (uint16_t)(_cfg.port + 1),
+            [](iocp::ClientContext<> *ctx, const char *buf, size_t len)->size_t {
+                size_t processed = frameBytes(buf, len);
+                ctx->postSend(buf, processed);
+                return processed;
+            },
+            [](iocp::ClientContext<> *) { });
+    }
+
+    // Returns the seconds the upstreams took to connect, or a negative value on failure.
+    double startProxy()
+    {
+        _proxy.setShardCount(_cfg.shards);
+        _proxy.setConnectTimeout(3000);
+        if (!_proxy.startup("127.0.0.1", _cfg.port,
+            [this](iocp::ClientContext<> *ctx, const char *buf, size_t len)->size_t { return forwardRequests(ctx, buf, len); },
+            [](iocp::ClientContext<> *) { }))
+        {
+            return -1.0;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!_proxy.addUpstream("backend", "127.0.0.1", (uint16_t)(_cfg.port + 1), (size_t)_cfg.upstreams,
+            nullptr,
+            [this](iocp::ClientContext<> *, const char *buf, size_t len)->size_t { return forwardReplies(buf, len); },
+            nullptr))
+        {
+            return -1.0;
+        }
+        while (_proxy.getUpstreamSize("backend") < (size_t)_cfg.upstreams)
+        {
+            if (elapsedSince(start) > 5)
+            {
+                return -1.0;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return elapsedSince(start);
+    }
+
+    void stop()
+    {
+        _proxy.shutdown();
+        _backend.shutdown();
+    }
+
+    bool run(uint16_t port, BenchResult &result)
+    {
+        _stop = false;
+        _done = 0;
+        _disorders = 0;
+        std::vector<std::thread *> threads;
+        std::vector<std::vector<double> > rtts(_cfg.clients);
+        for (int i = 0; i < _cfg.clients; ++i)
+        {
+            threads.push_back(new std::thread([this, port, &rtts, i]() { runClient(port, rtts[i]); }));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));  // Connected and warmed up.
+
+        uint64_t doneBefore = _done.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(_cfg.seconds));
+        result.rate = (_done.load() - doneBefore) / elapsedSince(start);
+
+        _stop = true;
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+        result.rtts.clear();
+        for (size_t i = 0; i < rtts.size(); ++i)
+        {
+            result.rtts.insert(result.rtts.end(), rtts[i].begin(), rtts[i].end());
+        }
+        std::sort(result.rtts.begin(), result.rtts.end());
+        result.disorders = _disorders.load();
+        return true;
+    }
+
+private:
+    // The requests of a client, tagged with its ID, in one send to the upstream of its affinity, so they stay
+    // in order.
+    size_t forwardRequests(iocp::ClientContext<> *ctx, const char *buf, size_t len)
+    {
+        size_t processed = frameBytes(buf, len);
+        if (processed == 0)
+        {
+            return 0;
+        }
+        iocp::ConnectionId upstream = _proxy.getUpstream("backend", ctx->getId());
+        if (upstream == 0)
+        {
+            _proxy.disconnect(ctx->getId());
+            return len;
+        }
+
+        std::vector<char> out;
+        out.reserve(processed + processed / (HEADER_SIZE + MIN_PAYLOAD_SIZE) * (HEADER_SIZE + TAG_SIZE));
+        iocp::ConnectionId id = ctx->getId();
+        for (size_t pos = 0; pos < processed; )
+        {
+            uint32_t frameLen = 0;
+            memcpy(&frameLen, buf + pos, HEADER_SIZE);
+            uint32_t outLen = TAG_SIZE + HEADER_SIZE + frameLen;
+            out.insert(out.end(), (const char *)&outLen, (const char *)&outLen + HEADER_SIZE);
+            out.insert(out.end(), (const char *)&id, (const char *)&id + TAG_SIZE);
+            out.insert(out.end(), buf + pos, buf + pos + HEADER_SIZE + frameLen);
+            pos += HEADER_SIZE + frameLen;
+        }
+        _proxy.postSend(upstream, &out[0], out.size());
+        return processed;
+    }
+
+    // Every reply goes back to the client of its tag.
+    size_t forwardReplies(const char *buf, size_t len)
+    {
+        size_t processed = frameBytes(buf, len);
+        for (size_t pos = 0; pos < processed; )
+        {
+            uint32_t frameLen = 0;
+            memcpy(&frameLen, buf + pos, HEADER_SIZE);
+            iocp::ConnectionId id = 0;
+            memcpy(&id, buf + pos + HEADER_SIZE, TAG_SIZE);
+            _proxy.postSend(id, buf + pos + HEADER_SIZE + TAG_SIZE, frameLen - TAG_SIZE);
+            pos += HEADER_SIZE + frameLen;
+        }
+        return processed;
+    }
+
+    void runClient(uint16_t port, std::vector<double> &rtts)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+        {
+            if (s != INVALID_SOCKET)
+            {
+                close_socket(s);
+            }
+            return;
+        }
+        int one = 1;
+        ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+
+        int frameSize = HEADER_SIZE + _cfg.payloadSize;
+        std::vector<char> request(frameSize, 'x');
+        std::vector<char> reply(frameSize);
+        uint32_t payloadLen = (uint32_t)_cfg.payloadSize;
+        memcpy(&request[0], &payloadLen, HEADER_SIZE);
+
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        bool ok = true;
+        while (ok && !_stop)
+        {
+            for (; ok && sent < received + _cfg.depth; ++sent)
+            {
+                uint64_t stamp = nowMicros();
+                memcpy(&request[HEADER_SIZE], &sent, 8);
+                memcpy(&request[HEADER_SIZE + 8], &stamp, 8);
+                ok = sendAll(s, &request[0], frameSize);
+            }
+            ok = ok && recvAll(s, &reply[0], frameSize);
+            if (ok)
+            {
+                uint64_t seq = 0;
+                uint64_t stamp = 0;
+                memcpy(&seq, &reply[HEADER_SIZE], 8);
+                memcpy(&stamp, &reply[HEADER_SIZE + 8], 8);
+                if (seq != received)
+                {
+                    ++_disorders;
+                }
+                rtts.push_back((double)(nowMicros() - stamp));
+                ++received;
+                ++_done;
+            }
+        }
+        close_socket(s);
+    }
+
+    BenchConfig _cfg;
+    iocp::ServerFramework<> _backend;
+    iocp::ServerFramework<> _proxy;
+    volatile bool _stop;
+    std::atomic<uint64_t> _done;
+    std::atomic<uint64_t> _disorders;
+};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    return sorted[(size_t)(p * (double)(sorted.size() - 1))];
+}
+
+static void printResult(const char *mode, const BenchResult &r)
+{
+    printf("%-8s %12.0f %10.0f %10.0f %10.0f %10llu\n", mode, r.rate, percentile(r.rtts, 0.5), percentile(r.rtts, 0.99),
+        percentile(r.rtts, 1.0), (unsigned long long)r.disorders);
+}
+
+static void usage()
+{
+    printf("usage: proxy-bench [-c clients] [-u upstreams] [-s bytes] [-d depth] [-t seconds] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-c") == 0) cfg.clients = atoi(val);
+        else if (strcmp(opt, "-u") == 0) cfg.upstreams = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.payloadSize = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) cfg.shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.clients <= 0 || cfg.upstreams <= 0 || cfg.payloadSize < MIN_PAYLOAD_SIZE
+        || cfg.depth <= 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    iocp::ServerFramework<>::initialize();
+    ProxyBench bench(cfg);
+    double connectSeconds = -1.0;
+    if (!bench.startBackend() || (connectSeconds = bench.startProxy()) < 0)
+    {
+        printf("startup failed\n");
+        bench.stop();
+        iocp::ServerFramework<>::uninitialize();
+        return 1;
+    }
+    printf("%d clients %d deep, %d bytes per request, %d upstreams connected in %.1f ms\n", cfg.clients, cfg.depth,
+        cfg.payloadSize, cfg.upstreams, connectSeconds * 1000);
+    printf("%-8s %12s %10s %10s %10s %10s\n", "mode", "requests/s", "p50 us", "p99 us", "max us", "disorder");
+
+    BenchResult direct;
+    BenchResult proxied;
+    bench.run((uint16_t)(cfg.port + 1), direct);
+    bench.run(cfg.port, proxied);
+    printResult("direct", direct);
+    printResult("proxied", proxied);
+
+    bench.stop();
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
@@ -0,0 +1,345 @@
+// Receive buffer sizing benchmark.
+//
+// Runs a server in process, with the receive buffers of a fixed size (setRecvBufferSize(4096, 4096, 4096), as
+// every connection had before) or adaptive (the defaults, or the high-water mark given), in two profiles:
+//   idle - N connections send one small message each and then stay silent, the resident memory of the process
+//          grown per connection shows what an idle connection holds
+//   bulk - K connections stream as fast as they can, the MB/s and the onRecv calls per MB show how large the
+//          receives got
+// The pool never gives its slabs back, so run every mode in its own process to compare the memory.
+//
+// usage: recv-bench [-m fixed|adaptive] [-p port] [-i idle connections] [-b bulk connections] [-t seconds]
+//                   [-H high water]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   include <psapi.h>
+#   pragma comment(lib, "psapi.lib")
+#   define close_socket ::closesocket
+#else
+#   include <sys/resource.h>
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define FIXED_RECV_SIZE 4096
+#define IDLE_MESSAGE_SIZE 64
+#define BULK_CHUNK_SIZE 65536
+#define CONNECTIONS_PER_ADDRESS 25000  // Stay clear of the ephemeral ports of one source address.
+
+struct BenchConfig
+{
+    bool adaptive = true;
+    uint16_t port = 8899;
+    int idleConnections = 10000;
+    int bulkConnections = 4;
+    int seconds = 3;
+    size_t highWater = 0;  // 0 for the default.
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static size_t getResidentBytes()
+{
+#if PLATFORM_IS_WINDOWS
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
+    {
+        return 0;
+    }
+    return (size_t)pmc.WorkingSetSize;
+#else
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+    {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    int ret = fscanf(fp, "%lu %lu", &pages, &resident);
+    fclose(fp);
+    return ret == 2 ? (size_t)resident * (size_t)::sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+// Every connection takes 2 descriptors, the client one and the server one. Returns how many fit.
+static int fitIdleConnections(int wanted)
+{
+#if PLATFORM_IS_WINDOWS
+    return wanted;
+#else
+    struct rlimit rl;
+    if (::getrlimit(RLIMIT_NOFILE, &rl) != 0)
+    {
+        return wanted;
+    }
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+        ::getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    int limit = rl.rlim_cur == RLIM_INFINITY ? wanted : (int)((rl.rlim_cur - 64) / 2);
+    if (limit < wanted)
+    {
+        printf("open files limited to %lu, %d idle connections instead of %d (raise ulimit -n)\n",
+            (unsigned long)rl.rlim_cur, limit, wanted);
+        return limit;
+    }
+    return wanted;
+#endif
+}
+
+// Connects from 127.0.0.1, and from 127.0.0.x past CONNECTIONS_PER_ADDRESS connections.
+static SOCKET connectTo(uint16_t port, int index)
+{
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (index >= CONNECTIONS_PER_ADDRESS)
+    {
+        int reuse = 1;
+        ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index / CONNECTIONS_PER_ADDRESS);
+        if (::bind(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+        {
+            close_socket(s);
+            return INVALID_SOCKET;
+        }
+    }
+
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        close_socket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static void closeAll(std::vector<SOCKET> &sockets)
+{
+    for (size_t i = 0; i < sockets.size(); ++i)
+    {
+        close_socket(sockets[i]);
+    }
+    sockets.clear();
+}
+
+class RecvBench
+{
+public:
+    explicit RecvBench(const BenchConfig &cfg) : _cfg(cfg), _calls(0), _bytes(0) { }
+
+    bool startup()
+    {
+        if (_cfg.adaptive)
+        {
+            if (_cfg.highWater != 0)
+            {
+                _server.setRecvBufferSize(RECV_RING_MIN_SIZE, OVERLAPPED_BUF_SIZE, _cfg.highWater);
+            }
+        }
+        else
+        {
+            _server.setRecvBufferSize(FIXED_RECV_SIZE, FIXED_RECV_SIZE, FIXED_RECV_SIZE);
+        }
+        return _server.startup("127.0.0.1", _cfg.port,
+            [this](iocp::ClientContext<> *, const char *, size_t len)->size_t {
+                ++_calls;
+                _bytes += len;
+                return len;  // Streamed bytes, no frames.
+            },
+            [](iocp::ClientContext<> *) { });
+    }
+
+    void shutdown()
+    {
+        _server.shutdown();
+    }
+
+    void runIdle(int connections)
+    {
+        size_t baseline = getResidentBytes();
+        _calls = 0;
+        _bytes = 0;
+
+        std::vector<SOCKET> sockets;
+        sockets.reserve(connections);
+        static const char message[IDLE_MESSAGE_SIZE] = { 0 };
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < connections; ++i)
+        {
+            SOCKET s = connectTo(_cfg.port, i);
+            if (s == INVALID_SOCKET)
+            {
+                printf("connect failed after %d connections\n", i);
+                break;
+            }
+            ::send(s, message, sizeof(message), 0);
+            sockets.push_back(s);
+        }
+
+        // Wait for every message to be processed, and the receives to settle.
+        uint64_t expected = (uint64_t)sockets.size() * IDLE_MESSAGE_SIZE;
+        while (_bytes < expected && elapsedSince(start) < 60)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        size_t resident = getResidentBytes();
+        size_t count = sockets.size() > 0 ? sockets.size() : 1;
+        printf("idle: %lu connections, %llu/%llu bytes received, resident +%lu KB, %lu bytes per connection\n",
+            (unsigned long)sockets.size(), (unsigned long long)_bytes.load(), (unsigned long long)expected,
+            (unsigned long)((resident - baseline) / 1024), (unsigned long)((resident - baseline) / count));
+
+        closeAll(sockets);
+        waitForDisconnection();
+    }
+
+    void runBulk(int connections, int seconds)
+    {
+        volatile bool shouldQuit = false;
+        std::vector<std::thread> clients;
+        for (int i = 0; i < connections; ++i)
+        {
+            clients.push_back(std::thread([&, i]() {
+                SOCKET s = connectTo(_cfg.port, i);
+                if (s == INVALID_SOCKET)
+                {
+                    printf("connect failed\n");
+                    return;
+                }
+                std::vector<char> chunk(BULK_CHUNK_SIZE, 'x');
+                while (!shouldQuit)
+                {
+                    if (::send(s, &chunk[0], (int)chunk.size(), 0) <= 0)
+                    {
+                        break;
+                    }
+                }
+                close_socket(s);
+            }));
+        }
+
+        // Skip the connecting, and the growth of the buffers.
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        uint64_t calls0 = _calls;
+        uint64_t bytes0 = _bytes;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        uint64_t calls = _calls - calls0;
+        uint64_t bytes = _bytes - bytes0;
+        double elapsed = elapsedSince(start);
+
+        shouldQuit = true;
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            clients[i].join();
+        }
+        waitForDisconnection();
+
+        double mb = (double)bytes / (1024 * 1024);
+        printf("bulk: %d connections, %.1f MB/s, %.1f onRecv calls per MB, %.0f bytes per call\n",
+            connections, mb / elapsed, mb > 0 ? (double)calls / mb : 0.0, calls > 0 ? (double)bytes / calls : 0.0);
+    }
+
+private:
+    void waitForDisconnection()
+    {
+        for (int i = 0; i < 500 && _server.getClientCount() > 0; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+private:
+    BenchConfig _cfg;
+    iocp::ServerFramework<> _server;
+    std::atomic<uint64_t> _calls;
+    std::atomic<uint64_t> _bytes;
+};
+
+static void usage()
+{
+    printf("usage: recv-bench [-m fixed|adaptive] [-p port] [-i idle connections] [-b bulk connections] [-t seconds]"
+        " [-H high water]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-m") == 0 && strcmp(val, "fixed") == 0) cfg.adaptive = false;
+        else if (strcmp(opt, "-m") == 0 && strcmp(val, "adaptive") == 0) cfg.adaptive = true;
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-i") == 0) cfg.idleConnections = atoi(val);
+        else if (strcmp(opt, "-b") == 0) cfg.bulkConnections = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-H") == 0) cfg.highWater = (size_t)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.idleConnections < 0 || cfg.bulkConnections < 0 || cfg.seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+    cfg.idleConnections = fitIdleConnections(cfg.idleConnections);
+
+    iocp::ServerFramework<>::initialize();
+    RecvBench bench(cfg);
+    if (!bench.startup())
+    {
+        printf("startup failed\n");
+        iocp::ServerFramework<>::uninitialize();
+        return 1;
+    }
+
+    if (cfg.adaptive)
+    {
+        printf("adaptive receive buffers, high water %lu\n",
+            (unsigned long)(cfg.highWater != 0 ? cfg.highWater : RECV_RING_MAX_SIZE));
+    }
+    else
+    {
+        printf("fixed receive buffers of %d bytes\n", FIXED_RECV_SIZE);
+    }
+    if (cfg.idleConnections > 0)
+    {
+        bench.runIdle(cfg.idleConnections);
+    }
+    if (cfg.bulkConnections > 0)
+    {
+        bench.runBulk(cfg.bulkConnections, cfg.seconds);
+    }
+
+    bench.shutdown();
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
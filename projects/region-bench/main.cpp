@@ -0,0 +1,299 @@
+// Region allocation benchmark.
+//
+// Parses N messages of about S bytes, as a server parses its requests, in three ways:
+//   heap   - a new message per request, parsed and deleted, every part of it allocated and freed on its own
+//   reuse  - one message cleared and parsed again, which keeps the parts it allocated (the protobuf 2 idiom, for
+//            reference, which holds on to the largest request seen)
+//   region - a message created in a google::protobuf::Region per request, parsed in its scope, and freed in bulk
+//            by Region::Reset
+// Every way runs with a generated google::protobuf::FileDescriptorProto and with a DynamicMessage of the same type,
+// as an RpcServer parses the requests of a service built at run time. The message holds copies of the message
+// types of descriptor.proto, i.e. many sub-messages, repeated fields and strings. It reports the messages/s, the
+// MB/s, and the heap allocations and frees per message, counted by the operator new and delete of this program,
+// and checks the size of every message parsed. It also changes a message of a region outside of its scope, as a
+// handler does after the parse, and checks it against the same changes of a heap message.
+//
+// usage: region-bench [-n messages] [-s sizes, e.g. 512,4096,65536] [-r rounds]
+
+#include "google/protobuf/descriptor.pb.h"
+#include "google/protobuf/dynamic_message.h"
+#include "google/protobuf/region.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <new>
+#include <chrono>
+
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::Message;
+using google::protobuf::Region;
+
+static uint64_t s_allocations = 0;
+static uint64_t s_frees = 0;
+
+void *operator new(size_t size)
+{
+    ++s_allocations;
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p)
+{
+    if (p != nullptr)
+    {
+        ++s_frees;
+        free(p);
+    }
+}
+
+struct BenchConfig
+{
+    int messages = 5000;
+    std::vector<int> sizes;
+    int rounds = 5;
+};
+
+struct BenchResult
+{
+    uint64_t messages;
+    uint64_t errors;  // Messages which didn't parse or came out of the wrong size.
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A FileDescriptorProto of at least size bytes, of copies of the message types of descriptor.proto.
+static void makeMessage(size_t size, FileDescriptorProto *message)
+{
+    FileDescriptorProto source;
+    FileDescriptorProto::descriptor()->file()->CopyTo(&source);
+    message->set_name("region-bench.proto");
+    message->set_package("bench");
+    message->add_dependency("google/protobuf/descriptor.proto");
+    while ((size_t)message->ByteSize() < size)
+    {
+        for (int i = 0; i < source.message_type_size() && (size_t)message->ByteSize() < size; ++i)
+        {
+            message->add_message_type()->CopyFrom(source.message_type(i));
+        }
+    }
+}
+
+static BenchResult parseOnHeap(const Message &prototype, const std::string &body, int messages, int expected)
+{
+    BenchResult result = { 0, 0 };
+    for (int i = 0; i < messages; ++i)
+    {
+        Message *message = prototype.New();
+        bool parsed = message->ParseFromArray(body.data(), (int)body.size());
+        result.errors += parsed && message->ByteSize() == expected ? 0 : 1;
+        ++result.messages;
+        delete message;
+    }
+    return result;
+}
+
+static BenchResult parseByReuse(const Message &prototype, const std::string &body, int messages, int expected)
+{
+    BenchResult result = { 0, 0 };
+    Message *message = prototype.New();
+    for (int i = 0; i < messages; ++i)
+    {
+        bool parsed = message->ParseFromArray(body.data(), (int)body.size());
+        result.errors += parsed && message->ByteSize() == expected ? 0 : 1;
+        ++result.messages;
+    }
+    delete message;
+    return result;
+}
+
+static BenchResult parseInRegion(const Message &prototype, const std::string &body, int messages, int expected)
+{
+    BenchResult result = { 0, 0 };
+    Region region;
+    for (int i = 0; i < messages; ++i)
+    {
+        Message *message = region.New(prototype);
+        bool parsed = false;
+        {
+            Region::Scope scope(&region);
+            parsed = message->ParseFromArray(body.data(), (int)body.size());
+        }
+        result.errors += parsed && message->ByteSize() == expected ? 0 : 1;
+        ++result.messages;
+        region.Reset();
+    }
+    return result;
+}
+
+// Grows the repeated fields of message by reflection, past the arrays allocated by the parse.
+static void changeMessage(Message *message)
+{
+    const google::protobuf::Descriptor *type = message->GetDescriptor();
+    const google::protobuf::Reflection *reflection = message->GetReflection();
+    const google::protobuf::FieldDescriptor *dependency = type->FindFieldByName("dependency");
+    const google::protobuf::FieldDescriptor *messageType = type->FindFieldByName("message_type");
+    for (int i = 0; i < 64; ++i)
+    {
+        reflection->AddString(message, dependency, "changed.proto");
+        Message *added = reflection->AddMessage(message, messageType);
+        added->GetReflection()->SetString(added, added->GetDescriptor()->FindFieldByName("name"), "Changed");
+    }
+    reflection->RemoveLast(message, messageType);
+}
+
+// A message parsed in the scope of a region and changed outside of it takes the new arrays from the heap, and
+// leaves the ones of the region to Reset.
+static bool changeOutsideScope(const Message &prototype, const std::string &body)
+{
+    Region region;
+    Message *message = region.New(prototype);
+    bool parsed = false;
+    {
+        Region::Scope scope(&region);
+        parsed = message->ParseFromArray(body.data(), (int)body.size());
+    }
+    changeMessage(message);
+
+    Message *expected = prototype.New();
+    parsed = expected->ParseFromArray(body.data(), (int)body.size()) && parsed;
+    changeMessage(expected);
+    bool ok = parsed && message->SerializeAsString() == expected->SerializeAsString();
+    delete expected;
+    region.Reset();
+    return ok;
+}
+
+template <class Run>
+static bool runCase(const char *name, const BenchConfig &cfg, size_t bodySize, Run run)
+{
+    double best = 0.0;
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    for (int round = 0; round < cfg.rounds; ++round)
+    {
+        uint64_t allocationsBefore = s_allocations;
+        uint64_t freesBefore = s_frees;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        BenchResult result = run();
+        double seconds = elapsedSince(start);
+        allocations = s_allocations - allocationsBefore;
+        frees = s_frees - freesBefore;
+        if (result.messages != (uint64_t)cfg.messages || result.errors != 0)
+        {
+            printf("%-16s wrong messages: %llu of %d, %llu errors\n", name, (unsigned long long)result.messages,
+                cfg.messages, (unsigned long long)result.errors);
+            return false;
+        }
+        if (round == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    printf("%-16s %12.0f %10.1f %14.1f %10.1f\n", name, cfg.messages / best,
+        bodySize * (double)cfg.messages / best / (1024.0 * 1024.0),
+        (double)allocations / cfg.messages, (double)frees / cfg.messages);
+    return true;
+}
+
+static bool runMessage(const char *kind, const Message &prototype, const std::string &body, const BenchConfig &cfg)
+{
+    int expected = (int)body.size();
+    char name[64];
+    bool ok = changeOutsideScope(prototype, body);
+    if (!ok)
+    {
+        printf("%s changed outside the scope: wrong message\n", kind);
+    }
+
+    snprintf(name, sizeof(name), "%s heap", kind);
+    ok = runCase(name, cfg, body.size(), [&]() {
+        return parseOnHeap(prototype, body, cfg.messages, expected);
+    }) && ok;
+    snprintf(name, sizeof(name), "%s reuse", kind);
+    ok = runCase(name, cfg, body.size(), [&]() {
+        return parseByReuse(prototype, body, cfg.messages, expected);
+    }) && ok;
+    snprintf(name, sizeof(name), "%s region", kind);
+    ok = runCase(name, cfg, body.size(), [&]() {
+        return parseInRegion(prototype, body, cfg.messages, expected);
+    }) && ok;
+    return ok;
+}
+
+static void usage()
+{
+    printf("usage: region-bench [-n messages] [-s sizes, e.g. 512,4096,65536] [-r rounds]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) cfg.messages = atoi(val);
+        else if (strcmp(opt, "-s") == 0)
+        {
+            for (const char *p = val; *p != '\0'; )
+            {
+                cfg.sizes.push_back(atoi(p));
+                p = strchr(p, ',');
+                p = p != nullptr ? p + 1 : "";
+            }
+        }
+        else if (strcmp(opt, "-r") == 0) cfg.rounds = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (cfg.sizes.empty())
+    {
+        cfg.sizes.push_back(512);
+        cfg.sizes.push_back(4096);
+        cfg.sizes.push_back(65536);
+    }
+    bool valid = (argc & 1) != 0 && cfg.messages > 0 && cfg.rounds > 0;
+    for (size_t i = 0; i < cfg.sizes.size(); ++i)
+    {
+        valid = valid && cfg.sizes[i] > 0 && cfg.sizes[i] <= 64 * 1024 * 1024;
+    }
+    if (!valid)
+    {
+        usage();
+        return 1;
+    }
+
+    printf("%d messages, best of %d rounds\n", cfg.messages, cfg.rounds);
+    bool ok = true;
+    {
+        google::protobuf::DynamicMessageFactory factory;
+        const Message *dynamicPrototype = factory.GetPrototype(FileDescriptorProto::descriptor());
+        for (size_t i = 0; i < cfg.sizes.size(); ++i)
+        {
+            FileDescriptorProto message;
+            makeMessage((size_t)cfg.sizes[i], &message);
+            std::string body = message.SerializeAsString();
+            printf("\n%lu bytes, %d message types\n", (unsigned long)body.size(), message.message_type_size());
+            printf("%-16s %12s %10s %14s %10s\n", "", "messages/s", "MB/s", "allocs/message", "frees");
+            ok = runMessage("generated", FileDescriptorProto::default_instance(), body, cfg) && ok;
+            ok = runMessage("dynamic", *dynamicPrototype, body, cfg) && ok;
+        }
+    }
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,392 @@
+// RPC benchmark.
+//
+// Runs an RpcServer with an echo service and C RpcChannels of one connection each in process, over loopback. Every
+// channel keeps D calls in flight with a payload of S bytes, each one made again from its done, and every response
+// is checked against its request. It reports the calls/s and the latency percentiles. With -n, every request also
+// carries N items of a sub-message with a string, and with -r 1 the server parses them in its Regions, see
+// RpcServer::useRegion, on as many worker threads as -S gives shards.
+// There is no protoc of this protobuf version in the tree, so the messages and the service are built at run time
+// from ECHO_PROTO, and the calls go to RpcChannel::CallMethod as the generated stubs would make them.
+//
+// usage: rpc-bench [-c channels] [-d depth] [-s payload bytes] [-n items] [-r region 0/1] [-t seconds] [-p port]
+//                  [-S shards]
+
+#include "rpc/RpcServer.h"
+#include "rpc/RpcChannel.h"
+#include "google/protobuf/compiler/parser.h"
+#include "google/protobuf/io/tokenizer.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "google/protobuf/descriptor.pb.h"
+#include "google/protobuf/dynamic_message.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+using google::protobuf::Closure;
+using google::protobuf::Message;
+using google::protobuf::MethodDescriptor;
+using google::protobuf::ServiceDescriptor;
+
+static const char ECHO_PROTO[] =
+    "package bench;\n"
+    "message EchoItem {\n"
+    "  optional uint64 id = 1;\n"
+    "  optional string name = 2;\n"
+    "}\n"
+    "message EchoMessage {\n"
+    "  optional uint64 seq = 1;\n"
+    "  optional bytes payload = 2;\n"
+    "  repeated EchoItem items = 3;\n"
+    "}\n"
+    "service EchoService {\n"
+    "  rpc Echo(EchoMessage) returns (EchoMessage);\n"
+    "}\n";
+
+struct BenchConfig
+{
+    int channels = 16;
+    int depth = 8;
+    int payloadSize = 64;
+    int items = 0;
+    bool region = false;
+    int seconds = 5;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+};
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+class ProtoErrors final : public google::protobuf::io::ErrorCollector
+{
+public:
+    virtual void AddError(int line, int column, const std::string &message) override
+    {
+        printf("echo.proto:%d:%d: %s\n", line + 1, column + 1, message.c_str());
+    }
+};
+
+// The descriptors of ECHO_PROTO, and the prototype of its message.
+class EchoProto final
+{
+public:
+    bool load()
+    {
+        google::protobuf::io::ArrayInputStream input(ECHO_PROTO, (int)strlen(ECHO_PROTO));
+        ProtoErrors errors;
+        google::protobuf::io::Tokenizer tokenizer(&input, &errors);
+        google::protobuf::compiler::Parser parser;
+        parser.RecordErrorsTo(&errors);
+        google::protobuf::FileDescriptorProto file;
+        file.set_name("echo.proto");
+        if (!parser.Parse(&tokenizer, &file))
+        {
+            return false;
+        }
+        _file = _pool.BuildFile(file);
+        if (_file == nullptr)
+        {
+            return false;
+        }
+        _message = _file->FindMessageTypeByName("EchoMessage");
+        _prototype = _factory.GetPrototype(_message);
+        return true;
+    }
+
+    const ServiceDescriptor *getService() const { return _file->service(0); }
+    const Message &getPrototype() const { return *_prototype; }
+    const google::protobuf::FieldDescriptor *getSeqField() const { return _message->FindFieldByName("seq"); }
+    const google::protobuf::FieldDescriptor *getPayloadField() const { return _message->FindFieldByName("payload"); }
+    const google::protobuf::FieldDescriptor *getItemsField() const { return _message->FindFieldByName("items"); }
+
+private:
+    google::protobuf::DescriptorPool _pool;
+    google::protobuf::DynamicMessageFactory _factory;
+    const google::protobuf::FileDescriptor *_file = nullptr;
+    const google::protobuf::Descriptor *_message = nullptr;
+    const Message *_prototype = nullptr;
+};
+
+class EchoService final : public google::protobuf::Service
+{
+public:
+    explicit EchoService(const EchoProto &proto) : _proto(proto) { }
+
+    virtual const ServiceDescriptor *GetDescriptor() override { return _proto.getService(); }
+
+    virtual void CallMethod(const MethodDescriptor *, google::protobuf::RpcController *,
+        const Message *request, Message *response, Closure *done) override
+    {
+        response->CopyFrom(*request);
+        done->Run();
+    }
+
+    virtual const Message &GetRequestPrototype(const MethodDescriptor *) const override
+    {
+        return _proto.getPrototype();
+    }
+
+    virtual const Message &GetResponsePrototype(const MethodDescriptor *) const override
+    {
+        return _proto.getPrototype();
+    }
+
+private:
+    const EchoProto &_proto;
+};
+
+// A channel and its calls in flight, every one made again from its done until the bench stops.
+class Driver final
+{
+public:
+    Driver(iocp::ServerFramework<> &framework, const BenchConfig &cfg, const EchoProto &proto)
+        : _channel(framework, "127.0.0.1", cfg.port, 1)
+        , _proto(proto)
+        , _method(proto.getService()->method(0))
+        , _slots((size_t)cfg.depth)
+    {
+        std::string payload((size_t)cfg.payloadSize, 'x');
+        for (size_t i = 0; i < _slots.size(); ++i)
+        {
+            Slot &slot = _slots[i];
+            slot.driver = this;
+            slot.seq = (uint64_t)i << 40;
+            slot.request.reset(proto.getPrototype().New());
+            slot.response.reset(proto.getPrototype().New());
+            slot.request->GetReflection()->SetString(slot.request.get(), proto.getPayloadField(), payload);
+            for (int j = 0; j < cfg.items; ++j)
+            {
+                Message *item = slot.request->GetReflection()->AddMessage(slot.request.get(), proto.getItemsField());
+                const google::protobuf::Reflection *reflection = item->GetReflection();
+                reflection->SetUInt64(item, item->GetDescriptor()->FindFieldByName("id"), (uint64_t)j);
+                reflection->SetString(item, item->GetDescriptor()->FindFieldByName("name"), "item");
+            }
+            slot.done.reset(google::protobuf::NewPermanentCallback(&Driver::onDone, &slot));
+        }
+    }
+
+    bool waitConnected() { return _channel.waitConnected(3000); }
+
+    void start(std::atomic<int> *inFlight, const std::atomic<bool> *measuring, const std::atomic<bool> *stopping)
+    {
+        _inFlight = inFlight;
+        _measuring = measuring;
+        _stopping = stopping;
+        for (size_t i = 0; i < _slots.size(); ++i)
+        {
+            _inFlight->fetch_add(1);
+            call(&_slots[i]);
+        }
+    }
+
+    // Moves the latencies out.
+    void collect(std::vector<uint32_t> *latencies, uint64_t *errors)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        latencies->insert(latencies->end(), _latencies.begin(), _latencies.end());
+        _latencies.clear();
+        *errors += _errors;
+    }
+
+private:
+    struct Slot
+    {
+        Driver *driver;
+        uint64_t seq;
+        iocp::rpc::RpcController controller;
+        std::unique_ptr<Message> request;
+        std::unique_ptr<Message> response;
+        std::unique_ptr<Closure> done;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    void call(Slot *slot)
+    {
+        slot->controller.Reset();
+        slot->request->GetReflection()->SetUInt64(slot->request.get(), _proto.getSeqField(), ++slot->seq);
+        slot->start = std::chrono::steady_clock::now();
+        _channel.CallMethod(_method, &slot->controller, slot->request.get(), slot->response.get(), slot->done.get());
+    }
+
+    static void onDone(Slot *slot)
+    {
+        Driver *driver = slot->driver;
+        uint32_t latency = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - slot->start).count();
+        const google::protobuf::Reflection *reflection = slot->response->GetReflection();
+        bool ok = !slot->controller.Failed()
+            && reflection->GetUInt64(*slot->response, driver->_proto.getSeqField()) == slot->seq
+            && reflection->FieldSize(*slot->response, driver->_proto.getItemsField())
+                == slot->request->GetReflection()->FieldSize(*slot->request, driver->_proto.getItemsField());
+        {
+            std::lock_guard<std::mutex> lock(driver->_mutex);
+            if (!ok)
+            {
+                ++driver->_errors;
+            }
+            else if (driver->_measuring->load(std::memory_order_relaxed))
+            {
+                driver->_latencies.push_back(latency);
+            }
+        }
+
+        // A failed call isn't made again, it would fail at once as long as the connection is down.
+        if (!ok || driver->_stopping->load())
+        {
+            driver->_inFlight->fetch_sub(1);
+            return;
+        }
+        driver->call(slot);
+    }
+
+    iocp::rpc::RpcChannel _channel;
+    const EchoProto &_proto;
+    const MethodDescriptor *_method;
+    std::vector<Slot> _slots;
+    std::mutex _mutex;
+    std::vector<uint32_t> _latencies;
+    uint64_t _errors = 0;
+    std::atomic<int> *_inFlight = nullptr;
+    const std::atomic<bool> *_measuring = nullptr;
+    const std::atomic<bool> *_stopping = nullptr;
+};
+
+static void usage()
+{
+    printf("usage: rpc-bench [-c channels] [-d depth] [-s payload bytes] [-n items] [-r region 0/1] [-t seconds] "
+        "[-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-c") == 0) cfg.channels = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.payloadSize = atoi(val);
+        else if (strcmp(opt, "-n") == 0) cfg.items = atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.region = atoi(val) != 0;
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) cfg.shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || cfg.channels <= 0 || cfg.depth <= 0 || cfg.payloadSize < 0 || cfg.items < 0
+        || cfg.seconds <= 0
+        || (size_t)cfg.payloadSize + (size_t)cfg.items * 16 + 32 > iocp::rpc::DEFAULT_MAX_MESSAGE_SIZE)
+    {
+        usage();
+        return 1;
+    }
+
+    EchoProto proto;
+    if (!proto.load())
+    {
+        printf("echo.proto failed to load\n");
+        return 1;
+    }
+    EchoService service(proto);
+
+    iocp::ServerFramework<>::initialize();
+    int ret = 0;
+    {
+        iocp::ServerFramework<> serverFramework;
+        iocp::ServerFramework<> clientFramework;  // Its connector makes the connections of the channels.
+        if (cfg.shards > 0)
+        {
+            serverFramework.setShardCount(cfg.shards);
+            clientFramework.setShardCount(cfg.shards);
+        }
+        iocp::rpc::RpcServer server(serverFramework);
+        server.addService(&service);
+        if (cfg.region)
+        {
+            server.useRegion(proto.getPrototype().GetDescriptor());
+        }
+        if (!server.startup(nullptr, cfg.port)
+            || !clientFramework.startup(nullptr, (uint16_t)(cfg.port + 1),
+                [](iocp::ClientContext<> *, const char *, size_t len) { return len; },
+                [](iocp::ClientContext<> *) { }))
+        {
+            printf("startup failed\n");
+            iocp::ServerFramework<>::uninitialize();
+            return 1;
+        }
+
+        std::vector<std::unique_ptr<Driver> > drivers;
+        for (int i = 0; i < cfg.channels; ++i)
+        {
+            drivers.push_back(std::unique_ptr<Driver>(new Driver(clientFramework, cfg, proto)));
+        }
+        int connected = 0;
+        for (size_t i = 0; i < drivers.size(); ++i)
+        {
+            connected += drivers[i]->waitConnected() ? 1 : 0;
+        }
+        printf("%d channels of 1 connection, depth %d, payload %d bytes, %d items, %s, %d seconds\n",
+            cfg.channels, cfg.depth, cfg.payloadSize, cfg.items, cfg.region ? "region" : "heap", cfg.seconds);
+
+        std::atomic<int> inFlight(0);
+        std::atomic<bool> measuring(false);
+        std::atomic<bool> stopping(false);
+        for (size_t i = 0; i < drivers.size(); ++i)
+        {
+            drivers[i]->start(&inFlight, &measuring, &stopping);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));  // Warm up.
+        measuring = true;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(cfg.seconds));
+        measuring = false;
+        double seconds = elapsedSince(start);
+        stopping = true;
+        for (int i = 0; i < 500 && inFlight.load() > 0; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        std::vector<uint32_t> latencies;
+        uint64_t errors = 0;
+        for (size_t i = 0; i < drivers.size(); ++i)
+        {
+            drivers[i]->collect(&latencies, &errors);
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%d of %d connected, %.0f calls/s, %llu errors, %d calls still in flight\n", connected, cfg.channels,
+            latencies.size() / seconds, (unsigned long long)errors, inFlight.load());
+        if (!latencies.empty())
+        {
+            size_t n = latencies.size();
+            printf("latency us: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", latencies[n / 2],
+                latencies[n * 9 / 10], latencies[n * 99 / 100], latencies[n * 999 / 1000], latencies[n - 1]);
+        }
+        if (errors > 0 || connected < cfg.channels || inFlight.load() > 0)
+        {
+            ret = 1;
+        }
+
+        drivers.clear();  // Before the frameworks stop, the channels remove their upstreams.
+        server.shutdown();
+        clientFramework.shutdown();
+    }
+    iocp::ServerFramework<>::uninitialize();
+    google::protobuf::ShutdownProtobufLibrary();
+    return ret;
+}
@@ -0,0 +1,260 @@
+// Message send benchmark.
+//
+// Runs a sink server in process, and C connections to it which send framed protobuf messages with a payload of S
+// bytes as fast as their send queues take them, pausing at the high-water mark and resuming at the low-water one.
+// Every size runs with both ways to send a message:
+//   string - AppendToString behind a header in a new std::string, then postSend, which copies it to the chain
+//   stream - rpc::sendMessage, which serializes it in place in the send chain, see rpc::sendFrame
+// and reports the messages/s and MB/s the sink decoded, and the ones of a wrong size.
+// The message is a google::protobuf::UninterpretedOption, a generated message of the library, with a string of
+// the payload.
+//
+// usage: serialize-bench [-c connections] [-s sizes, e.g. 64,1024,16384] [-t seconds] [-k batch] [-p port]
+
+#include "rpc/RpcProtocol.h"
+#include "google/protobuf/descriptor.pb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+using google::protobuf::UninterpretedOption;
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct BenchConfig
+{
+    int connections = 8;
+    std::vector<int> sizes;
+    int seconds = 3;
+    int batch = 64;  // The messages sent by a connection before the others get their turn.
+    uint16_t port = 8960;
+};
+
+// The state of a sending connection.
+struct Sender
+{
+    std::shared_ptr<UninterpretedOption> message;  // Its own, ByteSize caches the sizes in it.
+    bool paused = false;  // Over the high-water mark.
+    bool scheduled = false;  // A pump is posted.
+};
+
+class Bench final
+{
+public:
+    enum Mode { STRING, STREAM };
+
+    explicit Bench(const BenchConfig &cfg)
+        : _cfg(cfg)
+        , _decoder(iocp::FrameFormat::fixed(4, true, RECV_CACHE_LIMIT_SIZE - 4))
+        , _format(iocp::FrameFormat::fixed(4, true, RECV_CACHE_LIMIT_SIZE - 4))
+    {
+    }
+
+    // Runs a mode and prints a line of results.
+    bool run(Mode mode, int payloadSize, uint16_t port)
+    {
+        _mode = mode;
+        _prototype.Clear();
+        _prototype.set_identifier_value("serialize-bench");
+        _prototype.set_positive_int_value(payloadSize);
+        _prototype.set_string_value(std::string((size_t)payloadSize, 'x'));
+        _bodySize = (size_t)_prototype.ByteSize();
+        _frames = 0;
+        _bytes = 0;
+        _errors = 0;
+        _stopping = false;
+
+        iocp::ServerFramework<> sink;
+        iocp::ServerFramework<Sender> sender;
+        sender.setSendQueueLimits(64 * 1024, 256 * 1024, 0, iocp::SendOverflowPolicy::DROP_NEWEST);
+        sender.setSendQueueCallbacks([](iocp::ClientContext<Sender> *ctx) {
+            (*ctx)->paused = true;
+        }, [this](iocp::ClientContext<Sender> *ctx) {
+            (*ctx)->paused = false;
+            schedule(ctx);
+        });
+
+        bool ok = sink.startup("127.0.0.1", port,
+            [this](iocp::ClientContext<> *, const char *buf, size_t len)->size_t {
+                uint64_t frames = 0;
+                uint64_t errors = 0;
+                iocp::FrameDecoder::Result result;
+                size_t processed = _decoder.decodeAll(buf, len, [this, &frames, &errors](const iocp::Frame &frame)->bool {
+                    ++frames;
+                    errors += frame.body.size() != _bodySize ? 1 : 0;
+                    return true;
+                }, &result);
+                _frames.fetch_add(frames, std::memory_order_relaxed);
+                _bytes.fetch_add(processed, std::memory_order_relaxed);
+                _errors.fetch_add(errors, std::memory_order_relaxed);
+                return processed;
+            }, [](iocp::ClientContext<> *) { });
+        ok = ok && sender.startup("127.0.0.1", (uint16_t)(port + 1),
+            [](iocp::ClientContext<Sender> *, const char *, size_t len) { return len; },
+            [](iocp::ClientContext<Sender> *) { });
+        if (!ok)
+        {
+            printf("startup failed\n");
+            return false;
+        }
+
+        for (int i = 0; i < _cfg.connections; ++i)
+        {
+            sender.connect("127.0.0.1", port, [this](iocp::ClientContext<Sender> *ctx, bool connected) {
+                if (connected)
+                {
+                    (*ctx)->message = std::make_shared<UninterpretedOption>(_prototype);
+                    schedule(ctx);
+                }
+            }, [](iocp::ClientContext<Sender> *, const char *, size_t len) { return len; },
+                [](iocp::ClientContext<Sender> *) { });
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));  // Warm up.
+        uint64_t frames = _frames.load();
+        uint64_t bytes = _bytes.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(_cfg.seconds));
+        double seconds = elapsedSince(start);
+        frames = _frames.load() - frames;
+        bytes = _bytes.load() - bytes;
+        _stopping = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        sender.shutdown();
+        sink.shutdown();
+        printf("%-6s %8d %12.0f %10.1f %8llu\n", mode == STRING ? "string" : "stream", payloadSize,
+            frames / seconds, bytes / seconds / (1024 * 1024), (unsigned long long)_errors.load());
+        return frames > 0 && _errors.load() == 0;
+    }
+
+private:
+    void schedule(iocp::ClientContext<Sender> *ctx)
+    {
+        if ((*ctx)->scheduled || (*ctx)->paused || _stopping.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        (*ctx)->scheduled = true;
+        ctx->post([this](iocp::ClientContext<Sender> *ctx) { pump(ctx); });
+    }
+
+    void pump(iocp::ClientContext<Sender> *ctx)
+    {
+        (*ctx)->scheduled = false;
+        for (int i = 0; i < _cfg.batch && !(*ctx)->paused; ++i)
+        {
+            if (!send(ctx))
+            {
+                return;  // Closed.
+            }
+        }
+        schedule(ctx);
+    }
+
+    bool send(iocp::ClientContext<Sender> *ctx)
+    {
+        const UninterpretedOption &message = *(*ctx)->message;
+        if (_mode == STREAM)
+        {
+            return iocp::rpc::sendMessage(ctx, message, _format) != iocp::ClientContext<Sender>::POST_RESULT::FAIL;
+        }
+
+        std::string frame(4, '\0');
+        message.AppendToString(&frame);
+        size_t size = frame.size() - 4;
+        frame[0] = (char)(size >> 24);
+        frame[1] = (char)(size >> 16);
+        frame[2] = (char)(size >> 8);
+        frame[3] = (char)size;
+        return ctx->postSend(frame.data(), frame.size()) != iocp::ClientContext<Sender>::POST_RESULT::FAIL;
+    }
+
+    const BenchConfig &_cfg;
+    const iocp::FrameDecoder _decoder;
+    const iocp::FrameFormat _format;
+    Mode _mode = STRING;
+    UninterpretedOption _prototype;
+    size_t _bodySize = 0;
+    std::atomic<uint64_t> _frames;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _errors;
+    std::atomic<bool> _stopping;
+};
+
+static void usage()
+{
+    printf("usage: serialize-bench [-c connections] [-s sizes, e.g. 64,1024,16384] [-t seconds] [-k batch] [-p port]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-s") == 0)
+        {
+            for (const char *p = val; *p != '\0'; )
+            {
+                cfg.sizes.push_back(atoi(p));
+                p = strchr(p, ',');
+                p = p != nullptr ? p + 1 : "";
+            }
+        }
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-k") == 0) cfg.batch = atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (cfg.sizes.empty())
+    {
+        cfg.sizes.push_back(64);
+        cfg.sizes.push_back(1024);
+        cfg.sizes.push_back(16384);
+    }
+    bool valid = (argc & 1) != 0 && cfg.connections > 0 && cfg.seconds > 0 && cfg.batch > 0;
+    for (size_t i = 0; i < cfg.sizes.size(); ++i)
+    {
+        // The frames must fit the receive ring of the sink.
+        valid = valid && cfg.sizes[i] >= 0 && cfg.sizes[i] + 64 <= RECV_CACHE_LIMIT_SIZE;
+    }
+    if (!valid)
+    {
+        usage();
+        return 1;
+    }
+
+    iocp::ServerFramework<>::initialize();
+    printf("%d connections, batches of %d, %d seconds\n", cfg.connections, cfg.batch, cfg.seconds);
+    printf("%-6s %8s %12s %10s %8s\n", "mode", "payload", "messages/s", "MB/s", "errors");
+    bool ok = true;
+    {
+        Bench bench(cfg);
+        uint16_t port = cfg.port;
+        for (size_t i = 0; i < cfg.sizes.size(); ++i)
+        {
+            ok = bench.run(Bench::STRING, cfg.sizes[i], port) && ok;
+            ok = bench.run(Bench::STREAM, cfg.sizes[i], (uint16_t)(port + 2)) && ok;
+            port = (uint16_t)(port + 4);
+        }
+    }
+    iocp::ServerFramework<>::uninitialize();
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+// Sharding scaling benchmark: runs an echo server in process, first in the shared mode, then with 1 to N shards,
+// and drives every run with the same echo load (see echo-bench/EchoLoad.h).
+// The load runs on the same machine, so leave some cores to the client threads, or the numbers flatten early.
+//
+// usage: shard-bench [-n max shards] [-p base port] [-c connections] [-s body size] [-d depth] [-t seconds] [-T client threads]
+
+#include "iocp/ServerFramework.h"
+#include "../echo-bench/EchoLoad.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAKE_BODY_SIZE(a0, a1, a2, a3) ((((uint32_t)(uint8_t)(a0)) << 24) | ((uint32_t)(uint8_t)(a1) << 16) | ((uint32_t)(uint8_t)(a2) << 8) | ((uint32_t)(uint8_t)(a3)))
+
+// Echoes every whole packet in the buffer, the remainder bytes are left to the framework's cache.
+static size_t echoPackets(iocp::ClientContext<> *ctx, const char *buf, size_t len)
+{
+    size_t processed = 0;
+    while (len - processed >= 4)
+    {
+        const char *p = buf + processed;
+        size_t packetLen = MAKE_BODY_SIZE(p[0], p[1], p[2], p[3]) + 4;
+        if (packetLen > len - processed)
+        {
+            break;
+        }
+        processed += packetLen;
+    }
+
+    if (processed > 0)
+    {
+        ctx->postSend(buf, processed);
+    }
+    return processed;
+}
+
+// Returns packets/s, or a negative value if the server failed to start.
+static double runOnce(unsigned shards, const EchoLoadConfig &cfg)
+{
+    iocp::ServerFramework<> server;
+    server.setShardCount(shards);
+    if (!server.startup("127.0.0.1", cfg.port, &echoPackets, [](iocp::ClientContext<> *) { }))
+    {
+        return -1.0;
+    }
+
+    EchoLoadResult result = runEchoLoad(cfg, EchoLoadReporter());
+    server.shutdown();
+
+    if (result.failedConnections > 0)
+    {
+        printf("  %d connections failed\n", result.failedConnections);
+    }
+    return (double)result.packets / result.seconds;
+}
+
+static void usage()
+{
+    printf("usage: shard-bench [-n max shards] [-p base port] [-c connections] [-s body size] [-d depth] [-t seconds] [-T client threads]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned maxShards = std::thread::hardware_concurrency();
+    EchoLoadConfig cfg;
+    cfg.connections = 256;
+    cfg.depth = 4;
+    cfg.seconds = 5;
+    cfg.threads = 2;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) maxShards = (unsigned)atoi(val);
+        else if (strcmp(opt, "-p") == 0) cfg.port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-c") == 0) cfg.connections = atoi(val);
+        else if (strcmp(opt, "-s") == 0) cfg.bodySize = atoi(val);
+        else if (strcmp(opt, "-d") == 0) cfg.depth = atoi(val);
+        else if (strcmp(opt, "-t") == 0) cfg.seconds = atoi(val);
+        else if (strcmp(opt, "-T") == 0) cfg.threads = atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || maxShards == 0 || cfg.connections <= 0 || cfg.bodySize < 0 || cfg.depth <= 0 || cfg.seconds <= 0 || cfg.threads <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    iocp::ServerFramework<>::initialize();
+
+    printf("%d connections, %d client threads, body %d bytes, depth %d, %d seconds per run\n",
+        cfg.connections, cfg.threads, cfg.bodySize, cfg.depth, cfg.seconds);
+    printf("%8s %14s %10s\n", "shards", "packets/s", "speedup");
+
+    // Every run listens on its own port, so the connections lingering from the last run don't matter.
+    uint16_t basePort = cfg.port;
+    double shared = runOnce(0, cfg);
+    printf("%8s %14.0f %10s\n", "shared", shared, "-");
+
+    double single = 0.0;
+    for (unsigned shards = 1; shards <= maxShards; ++shards)
+    {
+        cfg.port = (uint16_t)(basePort + shards);
+        double rate = runOnce(shards, cfg);
+        if (rate < 0.0)
+        {
+            printf("%8u %14s\n", shards, "startup failed");
+            continue;
+        }
+        if (shards == 1)
+        {
+            single = rate;
+        }
+        printf("%8u %14.0f %9.2fx\n", shards, rate, single > 0.0 ? rate / single : 0.0);
+    }
+
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}
@@ -0,0 +1,427 @@
+// Timer benchmark.
+//
+// The wheel part arms N timers of random delays up to an hour in a TimerWheel driven by a synthetic clock, cancels
+// half of them and runs the clock until the rest fired, against a std::multimap ordered by expiry (the usual timer
+// queue, whose iterators are the handles). It reports the cost per schedule, cancel and fire, and the resident
+// memory per armed timer.
+// The server part runs a server in process:
+//   idle   - C connections send one byte and then stay silent, the idle timeout closes them, and the lateness of
+//            the closes over the timeout is reported
+//   timers - N timers are armed by setTimer with delays spread over a second, the lateness of their callbacks is
+//            reported, then N more are armed a minute ahead and cancelled, none of which may fire
+//
+// usage: timer-bench [-n timers] [-c idle connections] [-i idle timeout ms] [-p port] [-S shards]
+
+#include "iocp/ServerFramework.h"
+
+#if PLATFORM_IS_WINDOWS
+#   include <psapi.h>
+#   pragma comment(lib, "psapi.lib")
+#   define close_socket ::closesocket
+#else
+#   include <sys/resource.h>
+#   include <unistd.h>
+#   define close_socket ::close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#define MAX_DELAY 3600000  // The delays of the wheel part, up to an hour.
+#define WHEEL_STEP 10  // The synthetic clock advances by a tick.
+#define SPREAD 1000  // The delays of the server part, up to a second.
+#define LATENESS_BINS 1000  // Milliseconds, the last bin takes the later ones.
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static size_t getResidentBytes()
+{
+#if PLATFORM_IS_WINDOWS
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
+    {
+        return 0;
+    }
+    return (size_t)pmc.WorkingSetSize;
+#else
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+    {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    int ret = fscanf(fp, "%lu %lu", &pages, &resident);
+    fclose(fp);
+    return ret == 2 ? (size_t)resident * (size_t)::sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+// Every connection takes 2 descriptors, the client one and the server one. Returns how many fit.
+static int fitConnections(int wanted)
+{
+#if PLATFORM_IS_WINDOWS
+    return wanted;
+#else
+    struct rlimit rl;
+    if (::getrlimit(RLIMIT_NOFILE, &rl) != 0)
+    {
+        return wanted;
+    }
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+        ::getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    int limit = rl.rlim_cur == RLIM_INFINITY ? wanted : (int)((rl.rlim_cur - 64) / 2);
+    if (limit < wanted)
+    {
+        printf("open files limited to %lu, %d connections instead of %d (raise ulimit -n)\n",
+            (unsigned long)rl.rlim_cur, limit, wanted);
+        return limit;
+    }
+    return wanted;
+#endif
+}
+
+// Milliseconds late, binned.
+class Lateness
+{
+public:
+    Lateness() : _bins(LATENESS_BINS + 1), _count(0), _sum(0) { }
+
+    void add(int64_t late)
+    {
+        size_t bin = late < 0 ? 0 : (late > LATENESS_BINS ? LATENESS_BINS : (size_t)late);
+        ++_bins[bin];
+        ++_count;
+        _sum += late < 0 ? 0 : (uint64_t)late;
+    }
+
+    uint64_t count() const { return _count; }
+
+    void print(const char *what) const
+    {
+        uint64_t count = _count;
+        if (count == 0)
+        {
+            printf("%s: none\n", what);
+            return;
+        }
+        printf("%s: %llu, late by mean %.1f ms, p50 %d ms, p99 %d ms, max %d ms\n", what, (unsigned long long)count,
+            (double)_sum / count, percentile(count, 0.5), percentile(count, 0.99), percentile(count, 1.0));
+    }
+
+private:
+    int percentile(uint64_t count, double p) const
+    {
+        uint64_t rank = (uint64_t)(p * (double)(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < _bins.size(); ++i)
+        {
+            seen += _bins[i];
+            if (seen >= rank)
+            {
+                return (int)i;
+            }
+        }
+        return LATENESS_BINS;
+    }
+
+    std::vector<std::atomic<uint64_t> > _bins;
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+};
+
+//
+// The wheel part.
+//
+
+struct QueueResult
+{
+    double scheduleNs;
+    double cancelNs;
+    double fireNs;
+    size_t bytesPerTimer;
+    uint64_t fired;
+};
+
+static void printResult(const char *name, const QueueResult &r, uint64_t expected)
+{
+    printf("%-9s schedule %6.1f ns, cancel %6.1f ns, fire %6.1f ns, %4lu bytes per timer, %llu/%llu fired\n", name,
+        r.scheduleNs, r.cancelNs, r.fireNs, (unsigned long)r.bytesPerTimer, (unsigned long long)r.fired,
+        (unsigned long long)expected);
+}
+
+static QueueResult runWheel(const std::vector<uint64_t> &delays)
+{
+    QueueResult r;
+    uint64_t fired = 0;
+    iocp::TimerWheel wheel(WHEEL_STEP);
+    std::vector<iocp::TimerId> ids(delays.size());
+
+    size_t resident = getResidentBytes();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        ids[i] = wheel.schedule(0, delays[i], 0, [&fired](iocp::TimerId) { ++fired; });
+    }
+    r.scheduleNs = elapsedSince(start) * 1e9 / delays.size();
+    r.bytesPerTimer = (getResidentBytes() - resident) / delays.size();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i += 2)
+    {
+        wheel.cancel(ids[i]);
+    }
+    r.cancelNs = elapsedSince(start) * 1e9 / ((ids.size() + 1) / 2);
+
+    std::vector<iocp::ExpiredTimer, iocp::mp::Allocator<iocp::ExpiredTimer> > expired;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t now = 0; now <= MAX_DELAY + WHEEL_STEP; now += WHEEL_STEP)
+    {
+        wheel.advance(now, expired);
+        for (size_t i = 0; i < expired.size(); ++i)
+        {
+            expired[i].callback(expired[i].id);
+        }
+        expired.clear();
+    }
+    r.fireNs = elapsedSince(start) * 1e9 / (delays.size() / 2);
+    r.fired = fired;
+    return r;
+}
+
+static QueueResult runMultimap(const std::vector<uint64_t> &delays)
+{
+    typedef std::multimap<uint64_t, std::function<void ()> > Queue;
+    QueueResult r;
+    uint64_t fired = 0;
+    Queue queue;
+    std::vector<Queue::iterator> ids(delays.size());
+
+    size_t resident = getResidentBytes();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        ids[i] = queue.insert(std::make_pair(delays[i], std::function<void ()>([&fired]() { ++fired; })));
+    }
+    r.scheduleNs = elapsedSince(start) * 1e9 / delays.size();
+    r.bytesPerTimer = (getResidentBytes() - resident) / delays.size();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i += 2)
+    {
+        queue.erase(ids[i]);
+    }
+    r.cancelNs = elapsedSince(start) * 1e9 / ((ids.size() + 1) / 2);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t now = 0; now <= MAX_DELAY + WHEEL_STEP; now += WHEEL_STEP)
+    {
+        while (!queue.empty() && queue.begin()->first <= now)
+        {
+            queue.begin()->second();
+            queue.erase(queue.begin());
+        }
+    }
+    r.fireNs = elapsedSince(start) * 1e9 / (delays.size() / 2);
+    r.fired = fired;
+    return r;
+}
+
+//
+// The server part.
+//
+
+class TimerBench
+{
+public:
+    TimerBench(uint16_t port, uint32_t idleTimeout) : _port(port), _idleTimeout(idleTimeout), _fired(0) { }
+
+    bool startup(unsigned shards)
+    {
+        _server.setShardCount(shards);
+        _server.setConnectionTimeouts(_idleTimeout, 0, 0);
+        return _server.startup("127.0.0.1", _port,
+            [](iocp::ClientContext<uint64_t> *ctx, const char *, size_t len)->size_t {
+                ctx->setUserData(iocp::TimerWheel::currentTime());  // The last activity.
+                return len;
+            },
+            [this](iocp::ClientContext<uint64_t> *ctx) {
+                uint64_t last = ctx->getUserData();
+                if (last != 0)
+                {
+                    _closes.add((int64_t)(iocp::TimerWheel::currentTime() - last) - _idleTimeout);
+                }
+            });
+    }
+
+    void shutdown()
+    {
+        _server.shutdown();
+    }
+
+    void runIdle(int connections)
+    {
+        std::vector<SOCKET> sockets;
+        sockets.reserve(connections);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        for (int i = 0; i < connections; ++i)
+        {
+            SOCKET s = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (s == INVALID_SOCKET || ::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+            {
+                printf("connect failed after %d connections\n", i);
+                if (s != INVALID_SOCKET)
+                {
+                    close_socket(s);
+                }
+                break;
+            }
+            ::send(s, "x", 1, 0);
+            sockets.push_back(s);
+        }
+
+        // Every connection is closed by the server, a while after the timeout.
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (_closes.count() < sockets.size() && elapsedSince(start) < _idleTimeout / 1000.0 * 3 + 5)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        printf("idle timeout %u ms, %lu connections\n", _idleTimeout, (unsigned long)sockets.size());
+        _closes.print("  closed");
+
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+            close_socket(sockets[i]);
+        }
+    }
+
+    void runTimers(int count)
+    {
+        std::vector<iocp::TimerId> ids;
+        ids.reserve(count);
+
+        // Fire within a second.
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i)
+        {
+            uint64_t delay = (uint64_t)i % SPREAD;
+            uint64_t due = iocp::TimerWheel::currentTime() + delay;
+            _server.setTimer(delay, 0, [this, due](iocp::TimerId) {
+                _lateness.add((int64_t)(iocp::TimerWheel::currentTime() - due));
+                ++_fired;
+            });
+        }
+        double scheduling = elapsedSince(start);
+        while (_fired < (uint64_t)count && elapsedSince(start) < 10)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        printf("setTimer %d timers in %.0f ms, %.1f ns each\n", count, scheduling * 1000, scheduling * 1e9 / count);
+        _lateness.print("  fired");
+
+        // Armed a minute ahead, and cancelled.
+        _fired = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            ids.push_back(_server.setTimer(60000, 0, [this](iocp::TimerId) { ++_fired; }));
+        }
+        size_t cancelled = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            cancelled += _server.cancelTimer(ids[i]) ? 1 : 0;
+        }
+        double cancelling = elapsedSince(start);
+        printf("cancelTimer %lu/%d timers, %.1f ns each, %llu fired\n", (unsigned long)cancelled, count,
+            cancelling * 1e9 / count, (unsigned long long)_fired.load());
+    }
+
+private:
+    uint16_t _port;
+    uint32_t _idleTimeout;
+    iocp::ServerFramework<uint64_t> _server;
+    Lateness _closes;
+    Lateness _lateness;
+    std::atomic<uint64_t> _fired;
+};
+
+static void usage()
+{
+    printf("usage: timer-bench [-n timers] [-c idle connections] [-i idle timeout ms] [-p port] [-S shards]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int timers = 1000000;
+    int connections = 1000;
+    uint32_t idleTimeout = 500;
+    uint16_t port = 8899;
+    unsigned shards = 0;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "-n") == 0) timers = atoi(val);
+        else if (strcmp(opt, "-c") == 0) connections = atoi(val);
+        else if (strcmp(opt, "-i") == 0) idleTimeout = (uint32_t)atoi(val);
+        else if (strcmp(opt, "-p") == 0) port = (uint16_t)atoi(val);
+        else if (strcmp(opt, "-S") == 0) shards = (unsigned)atoi(val);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if ((argc & 1) == 0 || timers <= 0 || connections < 0 || idleTimeout == 0)
+    {
+        usage();
+        return 1;
+    }
+    connections = fitConnections(connections);
+
+    // The wheel first, the pool never gives its slabs back.
+    std::vector<uint64_t> delays(timers);
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        delays[i] = rng() % MAX_DELAY;
+    }
+    printf("%d timers up to %d s, half of them cancelled\n", timers, MAX_DELAY / 1000);
+    printResult("wheel", runWheel(delays), (uint64_t)timers / 2);
+    printResult("multimap", runMultimap(delays), (uint64_t)timers / 2);
+
+    iocp::ServerFramework<>::initialize();
+    TimerBench bench(port, idleTimeout);
+    if (!bench.startup(shards))
+    {
+        printf("startup failed\n");
+        iocp::ServerFramework<>::uninitialize();
+        return 1;
+    }
+    if (connections > 0)
+    {
+        bench.runIdle(connections);
+    }
+    bench.runTimers(timers);
+
+    bench.shutdown();
+    iocp::ServerFramework<>::uninitialize();
+    return 0;
+}